@@ -0,0 +1,82 @@
+# Third-party libraries (CFITSIO, LibRaw, Exiv2, OpenCV, ArrayFire, GSL),
+# shared by the GUI application and the headless batch runner.
+
+win32 {
+    DEFINES += WIN32
+    INCLUDEPATH += C:/Dev/cfitsio_64/cfitsio
+    INCLUDEPATH += "C:\Dev\temp\LibRaw-0.18.2\libraw"
+    #INCLUDEPATH += C:/Dev/libraw
+    INCLUDEPATH += C:\Dev\opencv\build\include
+    INCLUDEPATH += "C:\Program Files\ArrayFire\v3\include"
+    #INCLUDEPATH += C:/dev/exiv2/include
+    INCLUDEPATH += C:\gnu\exiv2\exiv2-master\include
+
+    #C:\gnu\exiv2\exiv2-master\msvc\bin\x64\DebugDLL
+    LIBS += -LC:\gnu\exiv2\exiv2-master\msvc\bin\x64\DebugDLL -llibexiv2
+    #LIBS += -LC:/Dev/exiv2/x64/Debug -llibexiv2
+    LIBS += -LC:/Dev/cfitsio_64 -lcfitsio
+    LIBS += -L"C:\Dev\temp\LibRaw-0.18.2\dll" -llibraw
+    #LIBS += -LC:/Dev/libraw/lib -llibraw
+    LIBS += -L"C:\Program Files\ArrayFire\v3\lib" -lafopencl
+    LIBS += -LC:\Dev\opencv\build\x64\vc14\lib -lopencv_world320d
+
+}
+
+macx {
+    # Fix for xcode 8
+    QMAKE_MAC_SDK = macosx10.12
+    INCLUDEPATH += /usr/local/include
+# Libraw
+    INCLUDEPATH += /usr/local/include/libraw
+# Exiv2
+    INCLUDEPATH += /Users/rattie/Dev/exiv2-trunk_raphael/install/include
+# opencv
+    INCLUDEPATH += /Users/rattie/Dev/opencv-3.3.0/install/include
+# GNU Scientific library
+    INCLUDEPATH += /usr/local/Cellar/gsl/2.4/include
+
+# cfitsio (install with homebrew)
+    LIBS += -L/usr/local/lib -lcfitsio
+
+# libraw (install with homebrew)
+    LIBS += -L/usr/local/lib -lraw
+# Exiv2 (re-built to include fix for sensor temperature)
+    #LIBS += -L/opt/local/lib -lexiv2
+    LIBS += -L/usr/local/lib -lexiv2
+
+# opencv "world" (it has all modules)
+    LIBS += -L/usr/local/lib -lopencv_world
+
+# GNU Scientific library
+    LIBS += -L/usr/local/Cellar/gsl/2.4/lib -lgsl
+
+
+
+# Caveats regarding linking options:
+# In Projects>run menu
+# Original DYLD_FRAMEWORK_PATH = ~/Qt/5.7/clang_64/lib:/usr/local/lib
+# must change to ~/Qt/5.7/clang_64/lib (remove e.g. /usr/local/lib if it's there)
+# DYLD_LIBRARY_PATH must be removed (click UNSET)
+# see here:
+# http://stackoverflow.com/questions/17643509/conflict-between-dynamic-linking-priority-in-osx
+# Although the answer at this link does not talk about DYLD_FRAMEWORK_PATH, it is necessary to
+# change it here as advised above.
+
+# arrayfire
+    #LIBS += -L/usr/local/lib -lafopencl
+# Arrayfire unified backed
+    LIBS += -L/usr/local/lib -laf
+
+# Setup Qt so Clang works with C++11
+    QMAKE_CXXFLAGS += -stdlib=libc++
+    LIBS += -stdlib=libc++
+    QMAKE_CXXFLAGS += -std=c++11
+
+# Setup Qt for optimization
+#QMAKE_CXXFLAGS_RELEASE -= -O
+#QMAKE_CXXFLAGS_RELEASE -= -O1
+#QMAKE_CXXFLAGS_RELEASE -= -O2
+
+#QMAKE_CXXFLAGS_RELEASE += -O3
+
+}
@@ -0,0 +1,106 @@
+#-------------------------------------------------
+#
+# Headless batch runner: calibration, limb fit, registration, stacking and export
+# from a config file. Same sources as Lightdrops.pro, without the main window.
+# It only runs a QCoreApplication: Qt widgets and OpenGL are linked, never instantiated.
+#
+#-------------------------------------------------
+
+QT       += core gui
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets printsupport
+
+TARGET = LightdropsBatch
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+include(Lightdrops.pri)
+
+SOURCES += batchmain.cpp \
+    rbatchrunner.cpp \
+    ropenglwidget.cpp \
+    MyFitsImage.cpp \
+    RawImage.cpp \
+    rmat.cpp \
+    rlistimagemanager.cpp \
+    imagemanager.cpp \
+    rtreewidget.cpp \
+    rprocessing.cpp \
+    parallelcalibration.cpp \
+    rlineedit.cpp \
+    RFrame.cpp \
+    qcustomplot/qcustomplot.cpp \
+    rsubwindow.cpp \
+    data.cpp \
+    circle.cpp \
+    utilities.cpp \
+    rgraphicsscene.cpp \
+    rscrollarea.cpp \
+    RawImage2.cpp \
+    memoryusage.cpp \
+    calibrationkernel.cpp \
+    rmetadatascanner.cpp \
+    rhistogram.cpp \
+    rstacker.cpp \
+    rfilestacksource.cpp \
+    rstackaccumulator.cpp \
+    rmasterlibrary.cpp \
+    rcfa.cpp \
+    rdefectmap.cpp \
+    rinstrumentprofile.cpp \
+    rafbackend.cpp \
+    rdrizzle.cpp \
+    parallelregistration.cpp \
+    rpyramidcache.cpp \
+    rmaskedxcorr.cpp \
+    rphasecorrelator.cpp \
+    rroiregistration.cpp
+
+HEADERS  += winsockwrapper.h \
+    rbatchrunner.h \
+    ropenglwidget.h \
+    MyFitsImage.h \
+    RawImage.h \
+    rmat.h \
+    rlistimagemanager.h \
+    imagemanager.h \
+    rtreewidget.h \
+    rprocessing.h \
+    parallelcalibration.h \
+    rlineedit.h \
+    RFrame.h \
+    qcustomplot/qcustomplot.h \
+    rsubwindow.h \
+    utilities.h \
+    data.h \
+    typedefs.h \
+    circle.h \
+    rgraphicsscene.h \
+    werner/circle.h \
+    werner/mystuff.h \
+    rscrollarea.h \
+    RawImage2.h \
+    memoryusage.h \
+    calibrationkernel.h \
+    rmetadatascanner.h \
+    rhistogram.h \
+    rstacker.h \
+    rfilestacksource.h \
+    rstackaccumulator.h \
+    rmasterlibrary.h \
+    rcfa.h \
+    rdefectmap.h \
+    rinstrumentprofile.h \
+    rafbackend.h \
+    rdrizzle.h \
+    parallelregistration.h \
+    rpyramidcache.h \
+    rmaskedxcorr.h \
+    rphasecorrelator.h \
+    rroiregistration.h
+
+FORMS    += rscrollarea.ui
+
+DISTFILES += \
+    batch_example.ini
@@ -5,6 +5,7 @@
 #include <algorithm>
 
 #include <QtDebug>
+#include <QtEndian>
 
 // opencv
 #include <opencv2/world.hpp>
@@ -12,6 +13,63 @@
 
 using namespace cv;
 
+/// Converts big-endian FITS data to native CV_16U or CV_32F, in row stripes.
+class ParallelFitsSwap : public cv::ParallelLoopBody
+{
+public:
+    ParallelFitsSwap(const uchar *src, cv::Mat &dst, int bitpix, int bzero) :
+        src(src), dst(dst), bitpix(bitpix), bzero(bzero)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        int cols = dst.cols;
+        for (int y = range.start; y < range.end; y++)
+        {
+            if (bitpix == SHORT_IMG)
+            {
+                const uchar *srcRow = src + (size_t) y * cols * 2;
+                ushort *dstRow = dst.ptr<ushort>(y);
+                if (bzero == 32768)
+                {
+                    /// Adding 32768 to a signed 16-bit value is flipping its sign bit.
+                    for (int j = 0; j < cols; j++)
+                    {
+                        dstRow[j] = qFromBigEndian<quint16>(srcRow + 2*j) ^ 0x8000;
+                    }
+                }
+                else
+                {
+                    /// Same as reading CV_16S and converting to CV_16U: negative values saturate to 0.
+                    for (int j = 0; j < cols; j++)
+                    {
+                        qint16 value = (qint16) qFromBigEndian<quint16>(srcRow + 2*j);
+                        dstRow[j] = (ushort) std::max<int>(value, 0);
+                    }
+                }
+            }
+            else
+            {
+                const uchar *srcRow = src + (size_t) y * cols * 4;
+                float *dstRow = dst.ptr<float>(y);
+                for (int j = 0; j < cols; j++)
+                {
+                    quint32 value = qFromBigEndian<quint32>(srcRow + 4*j);
+                    std::memcpy(dstRow + j, &value, 4);
+                }
+            }
+        }
+    }
+
+private:
+    const uchar *src;
+    cv::Mat &dst;
+    int bitpix;
+    int bzero;
+};
+
 MyFitsImage::MyFitsImage(QString filePath) :
 hduType(0), naxis1(0), naxis2(0), nPixels(0), nKeys(0), bscale(1), bzero(0), expTime(0), bayer(false), bitpix(0)
 ,image1D_ushort(NULL), image1D_float(NULL), image1D_shortint(NULL)
@@ -28,6 +86,7 @@ hduType(0), naxis1(0), naxis2(0), nPixels(0), nKeys(0), bscale(1), bzero(0), exp
 	std::string filePathStr(filePath.toStdString());
 
     //qDebug() << "fits_is_reentrant =" << fits_is_reentrant();
+    QMutexLocker cfitsioLocker(cfitsioMutex());
 
 //	if (fits_open_data(&fptr, filePathStr.c_str(), READONLY, status))
 //	{
@@ -140,6 +199,45 @@ hduType(0), naxis1(0), naxis2(0), nPixels(0), nKeys(0), bscale(1), bzero(0), exp
      }
 
 
+    /// Uncompressed 16-bit integer and 32-bit float data are read from a memory map of the data unit,
+    /// byte-swapped straight into the final buffer. This skips CFITSIO's internal buffering and
+    /// the extra copies, which dominate the loading time of long series.
+    /// Scaled data and integer data with BLANK values still go through CFITSIO.
+    long blank = 0;
+    bool hasBlank = (fits_read_key(fptr, TLONG, "BLANK", &blank, NULL, &status) == 0);
+    status = 0;
+    bool canMap = !isCompressed && bscale == 1 && naxis1 > 0 && naxis2 > 0
+            && ((bitpix == SHORT_IMG && !hasBlank && (bzero == 0 || bzero == 32768)) || (bitpix == FLOAT_IMG && bzero == 0));
+
+    LONGLONG headStart = 0, dataStart = 0, dataEnd = 0;
+    if (canMap && fits_get_hduaddrll(fptr, &headStart, &dataStart, &dataEnd, &status) == 0)
+    {
+        QFile dataFile(filePath);
+        qint64 nBytes = (qint64) nPixels * (std::abs(bitpix) / 8);
+        uchar *mappedData = NULL;
+        if (dataFile.open(QIODevice::ReadOnly) && dataFile.size() >= dataStart + nBytes)
+        {
+            mappedData = dataFile.map(dataStart, nBytes);
+        }
+
+        if (mappedData != NULL)
+        {
+            if (fits_close_file(fptr, &status))
+                printerror(status);
+            cfitsioLocker.unlock();
+
+            /// Own, reference-counted buffer: ImageManager adopts it in its RMat instead of copying it.
+            matFits = cv::Mat(naxis2, naxis1, bitpix == SHORT_IMG ? CV_16U : CV_32F);
+            cv::parallel_for_(cv::Range(0, naxis2), ParallelFitsSwap(mappedData, matFits, bitpix, bzero));
+
+            dataFile.unmap(mappedData);
+            qDebug("MyFitsImage:: memory-mapped read, BITPIX = %d", bitpix);
+            return;
+        }
+        qDebug("MyFitsImage:: memory map failed, reading through CFITSIO");
+    }
+    status = 0;
+
     // anynul is set to 1 if there any undefined pixel value.
     anynul = 0;
     // undefined (e.g., blank) pixels are set to NaN.
@@ -272,6 +370,13 @@ cv::Mat MyFitsImage::getMatFits() const
     return matFits;
 }
 
+QMutex* MyFitsImage::cfitsioMutex()
+{
+    static QMutex mutex;
+    static bool reentrant = (fits_is_reentrant() != 0);
+    return reentrant ? NULL : &mutex;
+}
+
 void MyFitsImage::printHDUType(int hduType)
 {
 	switch (hduType)
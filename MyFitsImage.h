@@ -45,6 +45,9 @@ public:
 
     // static
 	static void printerror(int status);
+    /// Serializes CFITSIO calls across threads when the library is not built reentrant.
+    /// Returns NULL when it is, so that QMutexLocker does nothing.
+    static QMutex* cfitsioMutex();
 	static void printHDUType(int hduType);
 
     /// Interpolation
@@ -0,0 +1,40 @@
+#include "winsockwrapper.h"
+#include <QCoreApplication>
+
+#include <iostream>
+
+// Arrayfire
+#include <arrayfire.h>
+
+#include "rbatchrunner.h"
+#include "rafbackend.h"
+
+/// Headless entry point: no QApplication, no QWidget, no OpenGL context.
+/// Usage: LightdropsBatch config.ini
+///        LightdropsBatch --benchmark [naxis1 naxis2 nFrames]
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QStringList args = a.arguments();
+    if (args.size() < 2)
+    {
+        std::cout << "Usage: LightdropsBatch config.ini" << std::endl;
+        std::cout << "       LightdropsBatch --benchmark [naxis1 naxis2 nFrames]" << std::endl;
+        return 1;
+    }
+
+    qDebug() << af::infoString();
+
+    if (args.at(1) == QString("--benchmark"))
+    {
+        int naxis1 = (args.size() > 2) ? args.at(2).toInt() : 2048;
+        int naxis2 = (args.size() > 3) ? args.at(3).toInt() : naxis1;
+        int nFrames = (args.size() > 4) ? args.at(4).toInt() : 32;
+        RAfBackend::benchmark(naxis1, naxis2, nFrames);
+        return 0;
+    }
+
+    RBatchRunner batchRunner(args.at(1));
+    return batchRunner.run();
+}
@@ -0,0 +1,193 @@
+#include "calibrationkernel.h"
+
+#include <opencv2/core/hal/intrin.hpp>
+
+#include "rcfa.h"
+
+#include <algorithm>
+
+using namespace cv;
+
+/// One row of the fused calibration. dark and invFlat can be NULL.
+template <typename T>
+static void calibrateRow(const T *src, const float *dark, const float *invFlat, float *dst, int n);
+
+template <>
+void calibrateRow<ushort>(const ushort *src, const float *dark, const float *invFlat, float *dst, int n)
+{
+    int j = 0;
+#if CV_SIMD128
+    const v_float32x4 vZero = v_setzero_f32();
+    const v_float32x4 vOne = v_setall_f32(1.0f);
+    for (; j <= n - 4; j += 4)
+    {
+        v_float32x4 v = v_cvt_f32(v_reinterpret_as_s32(v_load_expand(src + j)));
+        v = v - (dark != NULL ? v_load(dark + j) : vZero);
+        v = v * (invFlat != NULL ? v_load(invFlat + j) : vOne);
+        v_store(dst + j, v_max(v, vZero));
+    }
+#endif
+    for (; j < n; j++)
+    {
+        float v = (float) src[j];
+        if (dark != NULL) { v -= dark[j]; }
+        if (invFlat != NULL) { v *= invFlat[j]; }
+        dst[j] = std::max(v, 0.0f);
+    }
+}
+
+template <>
+void calibrateRow<float>(const float *src, const float *dark, const float *invFlat, float *dst, int n)
+{
+    int j = 0;
+#if CV_SIMD128
+    const v_float32x4 vZero = v_setzero_f32();
+    const v_float32x4 vOne = v_setall_f32(1.0f);
+    for (; j <= n - 4; j += 4)
+    {
+        v_float32x4 v = v_load(src + j);
+        v = v - (dark != NULL ? v_load(dark + j) : vZero);
+        v = v * (invFlat != NULL ? v_load(invFlat + j) : vOne);
+        v_store(dst + j, v_max(v, vZero));
+    }
+#endif
+    for (; j < n; j++)
+    {
+        float v = src[j];
+        if (dark != NULL) { v -= dark[j]; }
+        if (invFlat != NULL) { v *= invFlat[j]; }
+        dst[j] = std::max(v, 0.0f);
+    }
+}
+
+/// Splits the rows over threads. When called from a calibration worker that already
+/// runs inside cv::parallel_for_, OpenCV runs this one serially.
+class ParallelCalibrationKernel : public cv::ParallelLoopBody
+{
+public:
+    ParallelCalibrationKernel(const cv::Mat &src, const cv::Mat &dark, const cv::Mat &invFlat, cv::Mat &dst) :
+        src(src), dark(dark), invFlat(invFlat), dst(dst)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        int n = src.cols * src.channels();
+        for (int y = range.start; y < range.end; y++)
+        {
+            const float *darkRow = dark.empty() ? NULL : dark.ptr<float>(y);
+            const float *invFlatRow = invFlat.empty() ? NULL : invFlat.ptr<float>(y);
+            float *dstRow = dst.ptr<float>(y);
+
+            if (src.depth() == CV_16U)
+            {
+                calibrateRow<ushort>(src.ptr<ushort>(y), darkRow, invFlatRow, dstRow, n);
+            }
+            else
+            {
+                calibrateRow<float>(src.ptr<float>(y), darkRow, invFlatRow, dstRow, n);
+            }
+        }
+    }
+
+private:
+    const cv::Mat &src;
+    const cv::Mat &dark;
+    const cv::Mat &invFlat;
+    cv::Mat &dst;
+};
+
+
+CalibrationKernel::CalibrationKernel()
+{
+
+}
+
+CalibrationKernel::CalibrationKernel(const cv::Mat &dark, const cv::Mat &flat, bool cfaFlat)
+{
+    setMasters(dark, flat, cfaFlat);
+}
+
+void CalibrationKernel::setMasters(const cv::Mat &dark, const cv::Mat &flat, bool cfaFlat)
+{
+    this->dark.release();
+    invFlat.release();
+
+    if (!dark.empty())
+    {
+        dark.convertTo(this->dark, CV_32F);
+    }
+
+    if (!flat.empty())
+    {
+        /// The flat is normalized by its mean, so that flat fielding keeps
+        /// the overall level of the light, and inverted once so that the per-frame pass
+        /// only multiplies. Dead (<= 0) flat pixels give 0, as cv::divide did.
+        cv::Mat flat32;
+        flat.convertTo(flat32, CV_32F);
+        if (cfaFlat && flat32.channels() == 1)
+        {
+            /// Each CFA plane of invFlat gets the mean of its own colour.
+            cv::Vec3d means = RCfa::colourMeans(flat32);
+            cv::Mat meanFlat(flat32.size(), CV_32F);
+            for (int py = 0; py < 2; py++)
+            {
+                for (int px = 0; px < 2; px++)
+                {
+                    /// 0: top-left, 1: greens, 2: bottom-right
+                    double colourMean = means[py + px];
+                    cv::Size planeSize((flat32.cols - px + 1) / 2, (flat32.rows - py + 1) / 2);
+                    RCfa::insertPlane(cv::Mat(planeSize, CV_32F, cv::Scalar(colourMean)), meanFlat, py, px);
+                }
+            }
+            cv::divide(meanFlat, flat32, invFlat);
+        }
+        else
+        {
+            cv::Mat validMask = flat32.reshape(1) > 0;
+            double meanFlat = cv::mean(flat32.reshape(1), validMask)[0];
+            cv::divide(meanFlat, flat32, invFlat);
+        }
+        invFlat.setTo(0, flat32 <= 0);
+    }
+}
+
+cv::Mat CalibrationKernel::apply(const cv::Mat &lightMat) const
+{
+    cv::Mat src = lightMat;
+    if (src.depth() != CV_16U && src.depth() != CV_32F)
+    {
+        src.convertTo(src, CV_32F);
+    }
+
+    CV_Assert(dark.empty() || (dark.size() == src.size() && dark.channels() == src.channels()));
+    CV_Assert(invFlat.empty() || (invFlat.size() == src.size() && invFlat.channels() == src.channels()));
+
+    cv::Mat dst(src.size(), CV_MAKETYPE(CV_32F, src.channels()));
+    cv::parallel_for_(cv::Range(0, src.rows), ParallelCalibrationKernel(src, dark, invFlat, dst));
+    /// Sparse: a few thousand pixels, while dst is still in cache for the smaller frames.
+    defectMap.apply(dst);
+
+    return dst;
+}
+
+const cv::Mat& CalibrationKernel::getDark() const
+{
+    return dark;
+}
+
+const cv::Mat& CalibrationKernel::getInvFlat() const
+{
+    return invFlat;
+}
+
+void CalibrationKernel::setDefectMap(const RDefectMap &defectMap)
+{
+    this->defectMap = defectMap;
+}
+
+const RDefectMap& CalibrationKernel::getDefectMap() const
+{
+    return defectMap;
+}
@@ -0,0 +1,47 @@
+#ifndef CALIBRATIONKERNEL_H
+#define CALIBRATIONKERNEL_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include "rdefectmap.h"
+
+/// Fused calibration of a light frame: out = max((light - dark) * invFlat, 0)
+/// where invFlat = mean(flat) / flat is precomputed once per master set.
+/// The whole calibration is then a single vectorized pass reading the raw
+/// (uint16 or float) light, instead of a chain of full-frame OpenCV operations.
+/// The kernel only holds shallow copies of the masters and is const after setup,
+/// so the same instance can be shared by concurrent calibration workers.
+class CalibrationKernel
+{
+public:
+    CalibrationKernel();
+    /// dark is the master dark (or bias), flat is the bias-subtracted master flat.
+    /// Either can be empty.
+    /// With cfaFlat, the flat is a Bayer mosaic and is normalized by the mean of each colour
+    /// instead of the overall mean, so that flat fielding keeps the colour balance of the lights.
+    CalibrationKernel(const cv::Mat &dark, const cv::Mat &flat, bool cfaFlat = false);
+
+    void setMasters(const cv::Mat &dark, const cv::Mat &flat, bool cfaFlat = false);
+    /// Hot and cold pixels corrected at the end of apply(). Empty map: no correction.
+    void setDefectMap(const RDefectMap &defectMap);
+
+    /// Returns a new CV_32F mat with the same number of channels as lightMat.
+    /// CV_16U and CV_32F lights are read directly, other depths are converted first.
+    cv::Mat apply(const cv::Mat &lightMat) const;
+
+    const cv::Mat& getDark() const;
+    const cv::Mat& getInvFlat() const;
+    const RDefectMap& getDefectMap() const;
+
+private:
+
+    cv::Mat dark;
+    cv::Mat invFlat;
+    RDefectMap defectMap;
+};
+
+#endif // CALIBRATIONKERNEL_H
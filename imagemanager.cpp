@@ -3,9 +3,12 @@
 #include <QUrl>
 #include <QFileInfo>
 #include <QHeaderView>
+#include <QApplication>
 
-ImageManager::ImageManager(QUrl url) :
-    error(0), url(url), newFitsImage(NULL), fitsSeries(NULL), newRawImage(NULL), rMatImage(NULL), nKeys(1)
+#include "rinstrumentprofile.h"
+
+ImageManager::ImageManager(QUrl url, bool withTableWidget) :
+    error(0), url(url), tableWidget(NULL), newFitsImage(NULL), fitsSeries(NULL), newRawImage(NULL), rMatImage(NULL), nKeys(1)
 {
 
 
@@ -56,9 +59,31 @@ ImageManager::ImageManager(QUrl url) :
     }
     rMatImage->setFileInfo(fileInfo);
     rMatImage->setUrl(url);
-    createTableWidget();
 
-    rMatImage->calcStats();
+    /// Detector defects of the instrument (bad edges, bias drift) are corrected here, once,
+    /// so that everything downstream (calibration, limb fit, registration) sees clean frames.
+    if (RInstrumentProfile::forInstrument(rMatImage->getInstrument()).apply(rMatImage->matImage))
+    {
+        rMatImage->prepImages();
+    }
+    /// The header table is a QWidget. Batch processing (e.g. streaming calibration)
+    /// does not need it and may run outside the GUI thread.
+    /// There is none either without a QApplication (headless batch runner).
+    if (qobject_cast<QApplication*>(QCoreApplication::instance()) == NULL)
+    {
+        withTableWidget = false;
+    }
+
+    if (withTableWidget)
+    {
+        createTableWidget();
+    }
+
+    /// Statistics are for display. In batch mode they are left to be computed if ever needed.
+    if (withTableWidget)
+    {
+        rMatImage->calcStats();
+    }
     rMatImage->setImageTitle(fileName);
 
     std::cout << "ImageManager:: Loaded image: " << fileName.toStdString()  << std::endl;
@@ -70,8 +95,10 @@ ImageManager::~ImageManager()
     qDebug("ImageManager::~ImageManager() calling ImageManager destructor");
 //    delete tableWidget;
     delete rMatImage;
-//    delete newFitsImage;
-//    delete newRawImage;
+    /// The RMat holds its own copy of the pixels, so the decoded file buffers
+    /// can go. Otherwise every ImageManager leaks one full frame.
+    delete newFitsImage;
+    delete newRawImage;
 
 }
 
@@ -90,7 +117,17 @@ void ImageManager::loadFits()
 {
     newFitsImage = new MyFitsImage(filePathQStr);
 
-    rMatImage = new RMat(newFitsImage->getMatFits(), newFitsImage->isBayer());
+    /// The memory-mapped reader and conversions give a buffer of their own, which the RMat takes over.
+    /// Data read by CFITSIO are still in arrays owned by newFitsImage, and must be copied.
+    cv::Mat matFits = newFitsImage->getMatFits();
+    if (matFits.u != NULL)
+    {
+        rMatImage = RMat::adopt(matFits, newFitsImage->isBayer());
+    }
+    else
+    {
+        rMatImage = new RMat(matFits, newFitsImage->isBayer());
+    }
     rMatImage->setBscale(newFitsImage->getBscale());
     rMatImage->setBzero(newFitsImage->getBzero());
     rMatImage->setExpTime(newFitsImage->getExpTime());
@@ -100,18 +137,20 @@ void ImageManager::loadFits()
     rMatImage->setWbBlue(1.0);
 
     instruments instrument;
+    /// Only the minimum is needed here, not the full statistics of the RMat.
+    double dataMin = 0;
+    cv::minMaxLoc(rMatImage->matImage.reshape(1), &dataMin, NULL);
     // USET data?
     if (newFitsImage->getKeyValues().contains(QString("USET")))
     {
         instrument = instruments::USET;
-        //fixUset();
     }
     else if (newFitsImage->getKeyValues().contains(QString("DSLR")))
     {
         instrument = instruments::DSLR;
         rMatImage->flipUD = true;
     }
-    else if (rMatImage->getDataMin() < -100.0)
+    else if (dataMin < -100.0)
     {
         instrument = instruments::MAG;
     }
@@ -302,21 +341,6 @@ void ImageManager::setupTiffTableWidget()
 
 }
 
-void ImageManager::fixUset()
-{
-
-    for (int x = 0; x < 2048; x++)
-    {
-        rMatImage->matImage.at<short>(0, x) = 4095;
-//        rMatImage->matImage.at<short>(1, x) = 4095;
-//        rMatImage->matImage.at<short>(2, x) = 4095;
-//        rMatImage->matImage.at<short>(3, x) = 4095;
-//        rMatImage->matImage.at<short>(4, x) = 4095;
-//        rMatImage->matImage.at<short>(5, x) = 4095;
-    }
-
-}
-
 void ImageManager::exposureParser()
 {
     QString baseName = fileInfo.baseName();
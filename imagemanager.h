@@ -19,7 +19,7 @@
 class ImageManager
 {
 public:
-    ImageManager(QUrl url);
+    ImageManager(QUrl url, bool withTableWidget = true);
     ~ImageManager();
 
 
@@ -47,7 +47,6 @@ private:
     void setupFitsTableWidget();
     void setupRawTableWidget();
     void setupTiffTableWidget();
-    void fixUset();
     void exposureParser();
 
     RMat* rMatImage;
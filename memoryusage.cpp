@@ -0,0 +1,63 @@
+#include "memoryusage.h"
+
+#if defined(WIN32)
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/resource.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#include <cstdio>
+#endif
+
+size_t getCurrentRSS()
+{
+#if defined(WIN32)
+    PROCESS_MEMORY_COUNTERS info;
+    GetProcessMemoryInfo(GetCurrentProcess(), &info, sizeof(info));
+    return (size_t) info.WorkingSetSize;
+#elif defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t infoCount = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &infoCount) != KERN_SUCCESS)
+    {
+        return 0;
+    }
+    return (size_t) info.resident_size;
+#else
+    /// 2nd field of /proc/self/statm is the resident set, in pages.
+    long rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+    if (fscanf(fp, "%*s%ld", &rss) != 1)
+    {
+        rss = 0;
+    }
+    fclose(fp);
+    return (size_t) rss * (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
+
+size_t getPeakRSS()
+{
+#if defined(WIN32)
+    PROCESS_MEMORY_COUNTERS info;
+    GetProcessMemoryInfo(GetCurrentProcess(), &info, sizeof(info));
+    return (size_t) info.PeakWorkingSetSize;
+#else
+    struct rusage rusage;
+    getrusage(RUSAGE_SELF, &rusage);
+#if defined(__APPLE__)
+    // bytes on macOS
+    return (size_t) rusage.ru_maxrss;
+#else
+    // kilobytes on Linux
+    return (size_t) rusage.ru_maxrss * 1024L;
+#endif
+#endif
+}
@@ -0,0 +1,12 @@
+#ifndef MEMORYUSAGE_H
+#define MEMORYUSAGE_H
+
+#include "winsockwrapper.h"
+#include <cstddef>
+
+/// Resident set size of the current process, in bytes.
+/// Used to check that batch processing of long series runs in bounded memory.
+size_t getCurrentRSS();
+size_t getPeakRSS();
+
+#endif // MEMORYUSAGE_H
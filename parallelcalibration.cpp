@@ -1,54 +1,117 @@
 #include "parallelcalibration.h"
 
-ParallelCalibration::ParallelCalibration(QList<QUrl> lightFiles, RMat* masterDark, RMat* masterFlat, QList<RMat*> rMatList)
+#include <iostream>
+
+CalibrationSlots::CalibrationSlots(int nFrames, int window) :
+    frames(nFrames, (RMat*) NULL), ready(nFrames, 0), nextFrame(0), nextToWrite(0), window(std::max(1, window))
+{
+
+}
+
+void CalibrationSlots::publish(int i, RMat *rMat)
 {
-    files = lightFiles;
-    // Use the RMat copy constructor for dark and flat. This is cheap.
-    dark = RMat(*masterDark);
-    if (masterFlat == NULL)
     {
-        flat = RMat();
+        std::lock_guard<std::mutex> lock(mutex);
+        frames[i] = rMat;
+        ready[i] = 1;
     }
-    else
+    frameReady.notify_all();
+}
+
+RMat* CalibrationSlots::waitFrame(int i)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    frameReady.wait(lock, [this, i]{ return ready[i] != 0; });
+    return frames[i];
+}
+
+void CalibrationSlots::publishRemaining()
+{
     {
-        flat = RMat(*masterFlat);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < ready.size(); i++)
+        {
+            ready[i] = 1;
+        }
     }
+    frameReady.notify_all();
+}
+
+void CalibrationSlots::release(int i)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        nextToWrite = i + 1;
+    }
+    slotFree.notify_all();
+}
+
+
+
+ParallelCalibration::ParallelCalibration(QList<QUrl> lightFiles, const CalibrationKernel &kernel, CalibrationSlots *calibrationSlots) :
+    files(lightFiles), kernel(kernel), calibrationSlots(calibrationSlots)
+{
 
-    resultList = rMatList;
 }
 
 
 void ParallelCalibration::operator ()(const cv::Range& range) const
 {
-    for(int i = range.start; i < range.end; i++)
-    {
-        QString filePathQStr = files.at(i).toLocalFile();
-        ImageManager *lightManager = new ImageManager(filePathQStr);
-        cv::Mat matResult;
-        cv::Mat lightMat = lightManager->getRMatImage()->matImage;
+    (void) range;
+    int nFrames = files.size();
 
-        if (lightMat.type() != CV_32F)
+    while (true)
+    {
+        int i = calibrationSlots->nextFrame++;
+        if (i >= nFrames)
         {
-            lightMat.convertTo(lightMat, CV_32F);
+            break;
         }
-        if (dark.matImage.type() != CV_32F)
+
         {
-            dark.matImage.convertTo(dark.matImage, CV_32F);
+            /// Do not run ahead of the writer by more than the window.
+            /// The worker with the lowest index never waits, so this cannot deadlock.
+            std::unique_lock<std::mutex> lock(calibrationSlots->mutex);
+            calibrationSlots->slotFree.wait(lock, [this, i]{ return i < calibrationSlots->nextToWrite + calibrationSlots->window; });
         }
 
-        cv::subtract(lightMat, dark.matImage, matResult);
-
-        if (!flat.matImage.empty())
+        RMat *rMat = NULL;
+        try
+        {
+            rMat = calibrateFrame(i);
+        }
+        catch (cv::Exception& e)
+        {
+            std::cout << "ParallelCalibration:: failed on frame " << i << ": " << e.what() << std::endl;
+            rMat = NULL;
+        }
+        catch (std::exception& e)
         {
-            if (flat.matImage.type() != CV_32F)
-            {
-                flat.matImage.convertTo(flat.matImage, CV_32F);
-            }
-            cv::divide(matResult, flat.matImage, matResult);
+            std::cout << "ParallelCalibration:: failed on frame " << i << ": " << e.what() << std::endl;
+            rMat = NULL;
         }
-        /// Copy the result into the list.
-        /// This may be an overkill. We could output directly into the elements of the list
-        matResult.copyTo(resultList.at(i)->matImage);
-        //delete lightManager;
+        catch (...)
+        {
+            /// Every frame must be published, or the writer and the other workers would wait on it forever.
+            std::cout << "ParallelCalibration:: failed on frame " << i << std::endl;
+            rMat = NULL;
+        }
+
+        calibrationSlots->publish(i, rMat);
+    }
+}
+
+RMat* ParallelCalibration::calibrateFrame(int i) const
+{
+    /// No header table: QWidgets cannot be created outside of the GUI thread.
+    ImageManager lightManager(files.at(i), false);
+    if (lightManager.getError())
+    {
+        return NULL;
     }
+    RMat *rMatRaw = lightManager.getRMatImage();
+
+    cv::Mat matResult = kernel.apply(rMatRaw->matImage);
+
+    return rMatRaw->cloneMetadata(matResult);
 }
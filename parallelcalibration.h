@@ -4,6 +4,11 @@
 #include "winsockwrapper.h"
 #include <QtCore>
 
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
 //opencv
 #include <opencv2/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -13,22 +18,49 @@
 
 #include "imagemanager.h"
 #include "rmat.h"
+#include "calibrationkernel.h"
+
+/// Output of the parallel calibration. Each light has its own slot, filled by whichever
+/// worker calibrated it, and consumed in order by a single writer.
+/// Workers do not start a frame more than "window" frames ahead of the writer.
+struct CalibrationSlots
+{
+    CalibrationSlots(int nFrames, int window);
+
+    std::vector<RMat*> frames;
+    std::vector<char> ready;
+    std::atomic<int> nextFrame;
+    int nextToWrite;
+    int window;
 
+    std::mutex mutex;
+    std::condition_variable frameReady;
+    std::condition_variable slotFree;
+
+    void publish(int i, RMat *rMat);
+    /// Mark the frames that were never published as failed (NULL), so that the writer can finish.
+    void publishRemaining();
+    RMat* waitFrame(int i);
+    void release(int i);
+};
 
 class ParallelCalibration : public cv::ParallelLoopBody
 {
 
 public:
-    ParallelCalibration(QList<QUrl> lightFiles, RMat* masterDark, RMat* masterFlat, QList<RMat*> rMatList);
+    ParallelCalibration(QList<QUrl> lightFiles, const CalibrationKernel &kernel, CalibrationSlots *calibrationSlots);
 
+    /// The range runs over workers, not frames. Each worker pulls the next frame index
+    /// from calibrationSlots, so frames are started in order whatever the threading backend.
     virtual void operator()(const cv::Range& range) const;
 
 private:
 
+    RMat* calibrateFrame(int i) const;
+
     QList<QUrl> files;
-    RMat dark;
-    RMat flat;
-    QList<RMat*> resultList;
+    CalibrationKernel kernel;
+    CalibrationSlots *calibrationSlots;
 };
 
 #endif // PARALLELCALIBRATION_H
@@ -0,0 +1,79 @@
+#include "parallelregistration.h"
+
+#include <iostream>
+
+ParallelRegistration::ParallelRegistration(const QList<RMat *> &rMatList, const ECCReference &reference, RPyramidCache &cache,
+                                           std::vector<cv::Mat> &warps, std::vector<double> &eccs, std::atomic<int> &nextFrame) :
+    rMatList(rMatList), reference(reference), cache(cache), warps(warps), eccs(eccs), nextFrame(nextFrame)
+{
+
+}
+
+void ParallelRegistration::operator()(const cv::Range& range) const
+{
+    for (int w = range.start; w < range.end; w++)
+    {
+        int i;
+        while ((i = nextFrame++) < rMatList.size())
+        {
+            warps[i] = registerFrame(rMatList.at(i), reference, cache, eccs[i]);
+        }
+    }
+}
+
+cv::Mat ParallelRegistration::registerFrame(RMat *rMat, const ECCReference &reference, RPyramidCache &cache, double &ecc)
+{
+    // Normalized frame and its resampled version, 1/4 on each axis.
+    std::vector<cv::Mat> levels = cache.get(rMat, reference.planes, 2);
+    if (levels.size() < 2)
+    {
+        ecc = -1;
+        return cv::Mat::eye(2, 3, CV_32F);
+    }
+    const cv::Mat &frameN = levels.at(0);
+    const cv::Mat &frameR = levels.at(1);
+
+    cv::TermCriteria criteria1(cv::TermCriteria::COUNT, 50, 1e-1);
+    cv::TermCriteria criteria2(cv::TermCriteria::EPS, 50, 1e-2);
+    cv::Mat warpMatrix = cv::Mat::eye(2, 3, CV_32F);
+
+    try
+    {
+        // 1st pass of the ECC algorithm on the decimated image.
+        ecc = cv::findTransformECC(reference.refMatR, frameR, warpMatrix, cv::MOTION_TRANSLATION, criteria1);
+        warpMatrix.at<float>(0, 2) /= RPyramidCache::levelScale(1);
+        warpMatrix.at<float>(1, 2) /= RPyramidCache::levelScale(1);
+
+        // 2nd pass on the full resolution images.
+        ecc = cv::findTransformECC(reference.refMatN, frameN, warpMatrix, cv::MOTION_TRANSLATION, criteria2);
+    }
+    catch (const cv::Exception &e)
+    {
+        std::cout << "ParallelRegistration::registerFrame() ECC failed: " << e.what() << std::endl;
+        ecc = -1;
+        warpMatrix = cv::Mat::eye(2, 3, CV_32F);
+    }
+
+    return warpMatrix;
+}
+
+ParallelPhaseCorrelation::ParallelPhaseCorrelation(const QList<RMat *> &rMatList, const RPhaseCorrelator &correlator, RPyramidCache &cache,
+                                                   const PlaneParams &planes, std::vector<cv::Point2d> &shifts, std::atomic<int> &nextFrame) :
+    rMatList(rMatList), correlator(correlator), cache(cache), planes(planes), shifts(shifts), nextFrame(nextFrame)
+{
+
+}
+
+void ParallelPhaseCorrelation::operator()(const cv::Range& range) const
+{
+    for (int w = range.start; w < range.end; w++)
+    {
+        /// DFT buffers of this worker
+        RPhaseCorrelator::Workspace workspace;
+        int i;
+        while ((i = nextFrame++) < rMatList.size())
+        {
+            shifts[i] = correlator.shift(cache.plane(rMatList.at(i), planes), workspace);
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef PARALLELREGISTRATION_H
+#define PARALLELREGISTRATION_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+#include <atomic>
+#include <vector>
+
+//opencv
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video.hpp>
+
+#include "rmat.h"
+#include "rpyramidcache.h"
+#include "rphasecorrelator.h"
+
+/// Reference of the two-pass ECC registration of registerSeries(), built once from frame 0
+/// and shared read-only by all the workers.
+struct ECCReference
+{
+    /// Exposure-normalized reference, in the ROI, and its 1/4 decimation
+    cv::Mat refMatN;
+    cv::Mat refMatR;
+    /// Preprocessing of the reference, applied to all the frames: scaled by 1 / XPOSURE of the reference,
+    /// masked, in the ROI.
+    PlaneParams planes;
+};
+
+/// Warps of registerSeries(), for many frames at once.
+/// Each worker pulls the next frame index and registers it against the shared reference.
+/// The normalized and decimated frames come from the plane cache of RProcessing, built by the workers on a miss.
+/// Each frame writes only its own warp, so the results do not depend on the scheduling.
+class ParallelRegistration : public cv::ParallelLoopBody
+{
+
+public:
+    ParallelRegistration(const QList<RMat*> &rMatList, const ECCReference &reference, RPyramidCache &cache,
+                         std::vector<cv::Mat> &warps, std::vector<double> &eccs, std::atomic<int> &nextFrame);
+
+    /// The range runs over workers, not frames.
+    virtual void operator()(const cv::Range& range) const;
+
+    /// Decimated then full-resolution ECC, translation only. Returns the warp in inverse map form
+    /// (reference -> frame), or identity if ECC did not converge, with ecc = -1.
+    static cv::Mat registerFrame(RMat *rMat, const ECCReference &reference, RPyramidCache &cache, double &ecc);
+
+private:
+
+    QList<RMat*> rMatList;
+    const ECCReference &reference;
+    RPyramidCache &cache;
+    std::vector<cv::Mat> &warps;
+    std::vector<double> &eccs;
+    std::atomic<int> &nextFrame;
+};
+
+/// Shifts of registerSeriesByPhaseCorrelation(), for many frames at once, against the reference
+/// spectrum of a shared correlator. Each worker pulls the next frame index, takes its plane from the
+/// plane cache and correlates it in its own DFT workspace.
+class ParallelPhaseCorrelation : public cv::ParallelLoopBody
+{
+
+public:
+    ParallelPhaseCorrelation(const QList<RMat*> &rMatList, const RPhaseCorrelator &correlator, RPyramidCache &cache,
+                             const PlaneParams &planes, std::vector<cv::Point2d> &shifts, std::atomic<int> &nextFrame);
+
+    /// The range runs over workers, not frames.
+    virtual void operator()(const cv::Range& range) const;
+
+private:
+
+    QList<RMat*> rMatList;
+    const RPhaseCorrelator &correlator;
+    RPyramidCache &cache;
+    PlaneParams planes;
+    std::vector<cv::Point2d> &shifts;
+    std::atomic<int> &nextFrame;
+};
+
+#endif // PARALLELREGISTRATION_H
@@ -0,0 +1,334 @@
+#include "rafbackend.h"
+
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "rmat.h"
+#include "rstacker.h"
+
+/// Strip size of the automatic tiling on the CPU backend: a share of the L2/L3 cache.
+static const long long autoTileBytes = 2 * 1024 * 1024;
+
+static af::Backend toAfBackend(afBackends backend)
+{
+    switch (backend)
+    {
+    case afBackends::cpu:
+        return AF_BACKEND_CPU;
+    case afBackends::opencl:
+        return AF_BACKEND_OPENCL;
+    case afBackends::cuda:
+        return AF_BACKEND_CUDA;
+    default:
+        return AF_BACKEND_DEFAULT;
+    }
+}
+
+/// Sets the backend and checks that it has a device: the OpenCL library loads fine without any driver.
+static bool trySetBackend(afBackends backend)
+{
+    if (!(af::getAvailableBackends() & toAfBackend(backend)))
+    {
+        return false;
+    }
+
+    try
+    {
+        af::setBackend(toAfBackend(backend));
+        return af::getDeviceCount() > 0;
+    }
+    catch (const af::exception &e)
+    {
+        std::cout << "RAfBackend:: " << RAfBackend::toString(backend).toStdString() << " unusable: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+bool RAfBackend::select(afBackends backend)
+{
+    if (backend != afBackends::automatic)
+    {
+        if (trySetBackend(backend))
+        {
+            return true;
+        }
+        std::cout << "RAfBackend::select() " << toString(backend).toStdString() << " not available" << std::endl;
+    }
+
+    const afBackends order[] = {afBackends::cuda, afBackends::opencl, afBackends::cpu};
+    for (int i = 0; i < 3; i++)
+    {
+        if (trySetBackend(order[i]))
+        {
+            return backend == afBackends::automatic;
+        }
+    }
+
+    return false;
+}
+
+bool RAfBackend::isAvailable(afBackends backend)
+{
+    if (backend == afBackends::automatic)
+    {
+        return af::getAvailableBackends() != 0;
+    }
+    return (af::getAvailableBackends() & toAfBackend(backend)) != 0;
+}
+
+afBackends RAfBackend::active()
+{
+    switch (af::getActiveBackend())
+    {
+    case AF_BACKEND_CPU:
+        return afBackends::cpu;
+    case AF_BACKEND_OPENCL:
+        return afBackends::opencl;
+    case AF_BACKEND_CUDA:
+        return afBackends::cuda;
+    default:
+        return afBackends::automatic;
+    }
+}
+
+afBackends RAfBackend::fromString(QString name)
+{
+    name = name.trimmed().toLower();
+    if (name == QString("cpu"))
+    {
+        return afBackends::cpu;
+    }
+    if (name == QString("opencl"))
+    {
+        return afBackends::opencl;
+    }
+    if (name == QString("cuda"))
+    {
+        return afBackends::cuda;
+    }
+    return afBackends::automatic;
+}
+
+QString RAfBackend::toString(afBackends backend)
+{
+    switch (backend)
+    {
+    case afBackends::cpu:
+        return QString("cpu");
+    case afBackends::opencl:
+        return QString("opencl");
+    case afBackends::cuda:
+        return QString("cuda");
+    default:
+        return QString("auto");
+    }
+}
+
+int RAfBackend::tileRows(int rows, size_t rowBytes, long long tileBytes, int step)
+{
+    if (tileBytes < 0)
+    {
+        tileBytes = (active() == afBackends::cpu) ? autoTileBytes : 0;
+    }
+    if (tileBytes == 0 || rowBytes == 0)
+    {
+        return rows;
+    }
+
+    int nRows = (int) std::min((long long) rows, tileBytes / (long long) rowBytes);
+    nRows = std::max(step, nRows - nRows % step);
+    return nRows;
+}
+
+/// Kappa-sigma clipping of one strip: all frames of a few rows, in cache on the CPU backend.
+static af::array sigmaClipStrip(const af::array &cube, float kappa, int maxIterations)
+{
+    int nFrames = (int) cube.dims(2);
+    af::array keep = af::constant(1, cube.dims(), f32);
+    af::array n = af::constant((float) nFrames, cube.dims(0), cube.dims(1), f32);
+    af::array mean = af::mean(cube, 2);
+
+    for (int it = 0; it < maxIterations; it++)
+    {
+        af::array deviation = cube - af::tile(mean, 1, 1, nFrames);
+        af::array keptDeviation = deviation * keep;
+        af::array sigma = af::sqrt(af::sum(keptDeviation * keptDeviation, 2) / af::max(n, 1.0));
+        af::array newKeep = (af::abs(deviation) <= kappa * af::tile(sigma, 1, 1, nFrames)).as(f32) * keep;
+        bool changed = af::anyTrue<bool>(newKeep != keep);
+        keep = newKeep;
+        n = af::sum(keep, 2);
+        /// Pixels that lost all their samples keep the previous mean
+        mean = af::select(n > 0, af::sum(cube * keep, 2) / af::max(n, 1.0), mean);
+        if (!changed)
+        {
+            break;
+        }
+    }
+
+    return mean;
+}
+
+af::array RAfBackend::sigmaClipStack(const af::array &cube, float kappa, int maxIterations, int tileRows)
+{
+    int naxis2 = (int) cube.dims(1);
+    if (tileRows <= 0 || tileRows >= naxis2)
+    {
+        return sigmaClipStrip(cube, kappa, maxIterations);
+    }
+
+    af::array stacked = af::constant(0, cube.dims(0), cube.dims(1), f32);
+    for (int row0 = 0; row0 < naxis2; row0 += tileRows)
+    {
+        int row1 = std::min(row0 + tileRows, naxis2) - 1;
+        stacked(af::span, af::seq(row0, row1)) = sigmaClipStrip(cube(af::span, af::seq(row0, row1), af::span), kappa, maxIterations);
+    }
+    return stacked;
+}
+
+af::array RAfBackend::filterTiled(const af::array &frame, const std::function<af::array(const af::array&)> &filter,
+                                  int tileRows, int halo, int binning)
+{
+    int naxis2 = (int) frame.dims(1);
+    if (tileRows <= 0 || tileRows >= naxis2)
+    {
+        return filter(frame);
+    }
+
+    af::array filtered;
+    int outRows = 0;
+    for (int row0 = 0; row0 < naxis2; row0 += tileRows)
+    {
+        int row1 = std::min(row0 + tileRows, naxis2);
+        int haloTop = std::min(halo, row0);
+        int haloBottom = std::min(halo, naxis2 - row1);
+
+        af::array tileOut = filter(frame(af::span, af::seq(row0 - haloTop, row1 + haloBottom - 1)));
+
+        /// Rows of the strip itself in the decimated output
+        int skip = haloTop / binning;
+        int nOut = std::min((row1 - row0 + binning - 1) / binning, (int) tileOut.dims(1) - skip);
+        if (nOut <= 0)
+        {
+            continue;
+        }
+        if (filtered.isempty())
+        {
+            filtered = af::constant(0, tileOut.dims(0), (naxis2 + binning - 1) / binning, tileOut.type());
+        }
+        filtered(af::span, af::seq(outRows, outRows + nOut - 1)) = tileOut(af::span, af::seq(skip, skip + nOut - 1));
+        outRows += nOut;
+    }
+
+    return filtered(af::span, af::seq(0, outRows - 1));
+}
+
+af::array RAfBackend::gradientQuality(const af::array &frame, int binning, bool sobel)
+{
+    af::array kernel = af::constant(0, 7, 7);
+    kernel(af::seq(3,6), af::seq(3,6)) = 1;
+
+    /// Rebin the data
+    af::array smoothed = af::convolve2(frame, kernel);
+    af::array binnedFrame = smoothed(af::seq(0, af::end, binning), af::seq(0, af::end, binning));
+    af::array dx, dy;
+    if (sobel)
+    {
+        af::sobel(dx, dy, binnedFrame);
+    }
+    else
+    {
+        af::grad(dx, dy, binnedFrame);
+    }
+    /// Sum of absolute of the X- and Y- gradient
+    return af::abs(dx) + af::abs(dy);
+}
+
+int RAfBackend::gradientHalo(int binning)
+{
+    /// 3 rows for the smoothing kernel, then one decimated row for the gradient.
+    return binning * (1 + (3 + binning - 1) / binning);
+}
+
+/// Best of a few runs, after a warm-up run (JIT compilation of the kernels, memory pools).
+static double timeKernel(const std::function<void()> &kernel, int nRuns = 3)
+{
+    kernel();
+    af::sync();
+    double best = -1;
+    for (int i = 0; i < nRuns; i++)
+    {
+        af::timer timer = af::timer::start();
+        kernel();
+        af::sync();
+        double elapsed = af::timer::stop(timer);
+        best = (best < 0) ? elapsed : std::min(best, elapsed);
+    }
+    return best;
+}
+
+void RAfBackend::benchmark(int naxis1, int naxis2, int nFrames, int binning)
+{
+    /// Same frames for all backends: noise around a constant level, with 0.1% of cosmic rays.
+    size_t frameSize = (size_t) naxis1 * naxis2;
+    std::vector<float> host(frameSize * nFrames);
+    QList<RMat*> rMatList;
+    for (int k = 0; k < nFrames; k++)
+    {
+        cv::Mat frame(naxis2, naxis1, CV_32F, &host[k * frameSize]);
+        cv::randn(frame, 1000, 30);
+        for (size_t i = 0; i < frameSize / 1000; i++)
+        {
+            frame.at<float>((int) (cv::theRNG().uniform(0, naxis2)), (int) (cv::theRNG().uniform(0, naxis1))) = 60000;
+        }
+        rMatList << new RMat(frame, false, instruments::generic);
+    }
+
+    std::cout << "RAfBackend::benchmark() " << nFrames << " frames of " << naxis1 << " x " << naxis2
+              << ", binning " << binning << std::endl;
+
+    /// Reference: the OpenCV stacker used by RProcessing::sigmaClipAverage
+    RStacker stacker(stackMethods::kappaSigma, 3.0f, 3.0f, 5);
+    QElapsedTimer timer;
+    timer.start();
+    stacker.stack(rMatList);
+    std::cout << "  opencv  sigma-clip stack: " << timer.elapsed() / 1000.0 << " s (strips of " << stacker.getStripRows() << " rows)" << std::endl;
+    qDeleteAll(rMatList);
+
+    const afBackends backends[] = {afBackends::cpu, afBackends::opencl, afBackends::cuda};
+    for (int b = 0; b < 3; b++)
+    {
+        if (!trySetBackend(backends[b]))
+        {
+            std::cout << "  " << toString(backends[b]).toStdString() << ": not available" << std::endl;
+            continue;
+        }
+
+        try
+        {
+            af::array cube(naxis1, naxis2, nFrames, host.data());
+            af::array frame = cube(af::span, af::span, 0);
+            std::string name = toString(backends[b]).toStdString();
+
+            /// Tiled: the automatic strip size of the CPU backend, whatever the backend, for comparison.
+            int stackTileRows = tileRows(naxis2, (size_t) naxis1 * nFrames * sizeof(float) * 4, autoTileBytes);
+            int filterTileRows = tileRows(naxis2, (size_t) naxis1 * sizeof(float) * 4, autoTileBytes, binning);
+            int halo = gradientHalo(binning);
+            std::function<af::array(const af::array&)> quality = [binning](const af::array &a) { return gradientQuality(a, binning); };
+
+            double stackTime = timeKernel([&]() { sigmaClipStack(cube, 3.0f, 5).eval(); });
+            double stackTiledTime = timeKernel([&]() { sigmaClipStack(cube, 3.0f, 5, stackTileRows).eval(); });
+            double qualityTime = timeKernel([&]() { quality(frame).eval(); });
+            double qualityTiledTime = timeKernel([&]() { filterTiled(frame, quality, filterTileRows, halo, binning).eval(); });
+
+            std::cout << "  " << name << " sigma-clip stack: " << stackTime << " s, tiled (" << stackTileRows << " rows): " << stackTiledTime << " s" << std::endl;
+            std::cout << "  " << name << " gradient quality, per frame: " << qualityTime << " s, tiled (" << filterTileRows << " rows): " << qualityTiledTime << " s" << std::endl;
+        }
+        catch (const af::exception &e)
+        {
+            std::cout << "  " << toString(backends[b]).toStdString() << ": failed: " << e.what() << std::endl;
+        }
+    }
+}
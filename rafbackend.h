@@ -0,0 +1,54 @@
+#ifndef RAFBACKEND_H
+#define RAFBACKEND_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+#include <functional>
+
+#include <arrayfire.h>
+
+enum class afBackends {automatic, cpu, opencl, cuda};
+
+/// ArrayFire backend selection and the tiled kernels that run on it.
+/// The backend is a run-time choice (settings, batch configuration) instead of a hard-coded OpenCL:
+/// automatic takes CUDA, then OpenCL, then the CPU, skipping the backends without a usable device.
+/// On the CPU backend, a whole frame (or a whole cube) goes through each operation before the next one,
+/// out of cache. The tiled kernels split the frames in strips of rows that are taken through all
+/// the operations at once. Strips are along the second ArrayFire dimension (the image rows), which is contiguous.
+class RAfBackend
+{
+public:
+    /// Returns false if the requested backend is not available, in which case the automatic choice is made.
+    static bool select(afBackends backend);
+    static bool isAvailable(afBackends backend);
+    static afBackends active();
+
+    /// "auto", "cpu", "opencl", "cuda"
+    static afBackends fromString(QString name);
+    static QString toString(afBackends backend);
+
+    /// Rows per strip so that a strip of rowBytes per row fits in tileBytes, a multiple of step.
+    /// tileBytes 0: no tiling (all rows). tileBytes < 0: automatic, only tiles on the CPU backend.
+    static int tileRows(int rows, size_t rowBytes, long long tileBytes, int step = 1);
+
+    /// Kappa-sigma clipped mean along the 3rd dimension of cube, strip by strip.
+    static af::array sigmaClipStack(const af::array &cube, float kappa, int maxIterations, int tileRows = 0);
+
+    /// Applies filter to frame strip by strip. Strips are read with halo extra rows on each side
+    /// (halo covers the reach of the filter) and the filter output is decimated by binning along the rows.
+    /// tileRows and halo are multiples of binning.
+    static af::array filterTiled(const af::array &frame, const std::function<af::array(const af::array&)> &filter,
+                                 int tileRows, int halo, int binning = 1);
+
+    /// Gradient (or Sobel) magnitude of the smoothed and decimated frame: the lucky imaging quality map.
+    static af::array gradientQuality(const af::array &frame, int binning, bool sobel = false);
+    /// Rows of halo needed by gradientQuality
+    static int gradientHalo(int binning);
+
+    /// Times the stacking and block processing kernels on each available backend, tiled and not,
+    /// with the OpenCV stacker as reference. Synthetic frames of naxis1 x naxis2.
+    static void benchmark(int naxis1 = 2048, int naxis2 = 2048, int nFrames = 32, int binning = 2);
+};
+
+#endif // RAFBACKEND_H
@@ -0,0 +1,418 @@
+#include "rbatchrunner.h"
+
+#include <iostream>
+#include <iomanip>
+
+#include "memoryusage.h"
+#include "rmetadatascanner.h"
+#include "rinstrumentprofile.h"
+
+RBatchRunner::RBatchRunner(QString configPath, QObject *parent) : QObject(parent),
+    configPath(configPath), processing(NULL), stackedRMat(NULL),
+    doCalibrate(false), doLimbFit(false), doRegister(false), doStack(false), doExport(false),
+    exportFrames(false), parallelCalibration(true), calibrationThreads(0),
+    limbSmooth(true), limbSmoothSize(5), frameWeighting(frameWeights::none)
+{
+    processing = new RProcessing(this);
+    connect(processing, SIGNAL(messageSignal(QString)), this, SLOT(printMessage(QString)));
+    connect(processing, SIGNAL(tempMessageSignal(QString,int)), this, SLOT(printMessage(QString)));
+}
+
+RBatchRunner::~RBatchRunner()
+{
+
+}
+
+int RBatchRunner::run()
+{
+    if (!loadConfig())
+    {
+        return 1;
+    }
+
+    QElapsedTimer totalTimer;
+    totalTimer.start();
+
+    bool success = true;
+
+    if (success && doCalibrate)
+    {
+        startStage(QString("calibrate"));
+        success = calibrateStage();
+        stopStage();
+    }
+    else if (success)
+    {
+        /// Lights are used as they are.
+        startStage(QString("load"));
+        processing->loadRMatLightList(lightUrls);
+        rMatFrames = processing->rMatLightList;
+        success = !rMatFrames.isEmpty();
+        stopStage();
+    }
+
+    if (success && doLimbFit)
+    {
+        startStage(QString("limbfit"));
+        success = limbFitStage();
+        stopStage();
+    }
+
+    if (success && doRegister)
+    {
+        startStage(QString("register"));
+        success = registerStage();
+        stopStage();
+    }
+
+    if (success && doStack)
+    {
+        startStage(QString("stack"));
+        success = stackStage();
+        stopStage();
+    }
+
+    if (success && doExport)
+    {
+        startStage(QString("export"));
+        success = exportStage();
+        stopStage();
+    }
+
+    printTimings();
+    std::cout << "RBatchRunner:: total: " << totalTimer.elapsed() << " ms" << std::endl;
+
+    if (!success)
+    {
+        std::cout << "RBatchRunner:: stopped at stage \"" << stageName.toStdString() << "\"" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+void RBatchRunner::printMessage(QString message)
+{
+    std::cout << "RBatchRunner:: " << message.toStdString() << std::endl;
+}
+
+bool RBatchRunner::loadConfig()
+{
+    if (!QFileInfo(configPath).exists())
+    {
+        std::cout << "RBatchRunner:: config file not found: " << configPath.toStdString() << std::endl;
+        return false;
+    }
+
+    QSettings settings(configPath, QSettings::IniFormat);
+
+    doCalibrate = settings.value("stages/calibrate", false).toBool();
+    doLimbFit = settings.value("stages/limbfit", false).toBool();
+    doRegister = settings.value("stages/register", false).toBool();
+    doStack = settings.value("stages/stack", false).toBool();
+    doExport = settings.value("stages/export", false).toBool();
+
+    lightUrls = listUrls(settings.value("lights/dir").toString(),
+                         settings.value("lights/files").toStringList(),
+                         settings.value("lights/recursive", false).toBool());
+
+    if (lightUrls.isEmpty())
+    {
+        std::cout << "RBatchRunner:: no lights in [lights]" << std::endl;
+        return false;
+    }
+
+    QString biasPath = settings.value("masters/bias").toString();
+    QString darkPath = settings.value("masters/dark").toString();
+    QString flatPath = settings.value("masters/flat").toString();
+    if (!biasPath.isEmpty())
+    {
+        masterBiasUrl = QUrl::fromLocalFile(biasPath);
+    }
+    if (!darkPath.isEmpty())
+    {
+        masterDarkUrl = QUrl::fromLocalFile(darkPath);
+    }
+    if (!flatPath.isEmpty())
+    {
+        masterFlatUrl = QUrl::fromLocalFile(flatPath);
+    }
+
+    /// Masters not given above are picked from the library, by instrument, exposure and temperature.
+    processing->setMasterLibraryDir(settings.value("masters/library").toString());
+    processing->setUseLibraryFlat(settings.value("masters/libraryFlat", false).toBool());
+
+    /// Per-instrument detector corrections applied when loading, e.g. [profile_USET]
+    RInstrumentProfile::readSettings(settings);
+
+    parallelCalibration = settings.value("calibration/parallel", true).toBool();
+    calibrationThreads = settings.value("calibration/threads", 0).toInt();
+    processing->setFlatPerCFAColour(settings.value("calibration/flatPerCFAColour", true).toBool());
+    processing->setCosmeticCorrection(settings.value("calibration/cosmetic", true).toBool());
+    processing->setDefectHotSigma(settings.value("calibration/hotSigma", 5.0).toFloat());
+    processing->setDefectColdFraction(settings.value("calibration/coldFraction", 0.5).toFloat());
+
+    limbSmooth = settings.value("limbfit/smooth", true).toBool();
+    limbSmoothSize = settings.value("limbfit/smoothSize", 5).toInt();
+    processing->setUseHPF(settings.value("limbfit/hpf", false).toBool());
+    processing->setHPFSigma(settings.value("limbfit/hpfSigma", 0).toDouble());
+
+    registrationMethod = settings.value("registration/method", QString("xcorr")).toString().toLower();
+    processing->setParallelRegistration(settings.value("registration/parallel", true).toBool());
+    processing->setRegistrationThreads(settings.value("registration/threads", 0).toInt());
+    processing->setPlaneCacheBytes((size_t) settings.value("registration/cacheMB", 1024).toLongLong() * 1024 * 1024);
+    QStringList roiList = settings.value("registration/roi").toStringList();
+    if (roiList.size() == 4)
+    {
+        roi = cv::Rect(roiList.at(0).toInt(), roiList.at(1).toInt(), roiList.at(2).toInt(), roiList.at(3).toInt());
+    }
+
+    stackMethod = settings.value("stack/method", QString("mean")).toString().toLower();
+    processing->setClipKappa(settings.value("stack/kappa", 3.0).toFloat());
+    processing->setClipIterations(settings.value("stack/iterations", 5).toInt());
+    /// Frame weights: none, noise or sharpness. Frames below rejectFraction of the median weight are dropped before registration.
+    QString weights = settings.value("stack/weights", QString("none")).toString().toLower();
+    frameWeighting = frameWeights::none;
+    if (weights == QString("noise"))
+    {
+        frameWeighting = frameWeights::noise;
+    }
+    else if (weights == QString("sharpness"))
+    {
+        frameWeighting = frameWeights::sharpness;
+    }
+    processing->setFrameWeighting(frameWeighting);
+    processing->setFrameRejectFraction(settings.value("stack/rejectFraction", 0.0).toFloat());
+    processing->setDrizzleScale(settings.value("stack/drizzleScale", 2.0).toDouble());
+    processing->setDrizzlePixFrac(settings.value("stack/drizzlePixFrac", 0.7).toDouble());
+
+    /// Lucky imaging and other ArrayFire processing: auto, cpu, opencl or cuda
+    processing->setAfBackend(RAfBackend::fromString(settings.value("arrayfire/backend", QString("auto")).toString()));
+    processing->setAfTileBytes(settings.value("arrayfire/tileBytes", -1).toLongLong());
+
+    exportDir = settings.value("export/dir").toString();
+    exportFrames = settings.value("export/frames", false).toBool();
+
+    if (doExport && exportDir.isEmpty())
+    {
+        std::cout << "RBatchRunner:: export enabled without [export] dir" << std::endl;
+        return false;
+    }
+
+    if (doRegister && registrationMethod == QString("limb") && !doLimbFit)
+    {
+        std::cout << "RBatchRunner:: registration method \"limb\" needs the limbfit stage" << std::endl;
+        return false;
+    }
+
+    std::cout << "RBatchRunner:: " << lightUrls.size() << " lights from " << configPath.toStdString() << std::endl;
+    return true;
+}
+
+QList<QUrl> RBatchRunner::listUrls(QString dirPath, QStringList files, bool recursive)
+{
+    QList<QUrl> urls;
+
+    for (int i = 0 ; i < files.size() ; i++)
+    {
+        urls << QUrl::fromLocalFile(files.at(i).trimmed());
+    }
+
+    if (!dirPath.isEmpty())
+    {
+        /// Only the headers are read here: the scanner keeps the supported files, in name order.
+        QVector<RFrameMetadata> metadataList = RMetadataScanner::scanDirectory(dirPath, recursive);
+        for (int i = 0 ; i < metadataList.size() ; i++)
+        {
+            if (metadataList.at(i).valid)
+            {
+                urls << metadataList.at(i).url;
+            }
+        }
+    }
+
+    return urls;
+}
+
+bool RBatchRunner::calibrateStage()
+{
+    QList<QUrl> biasUrls, darkUrls, flatUrls;
+    if (!masterBiasUrl.isEmpty())
+    {
+        biasUrls << masterBiasUrl;
+    }
+    if (!masterDarkUrl.isEmpty())
+    {
+        darkUrls << masterDarkUrl;
+    }
+    if (!masterFlatUrl.isEmpty())
+    {
+        flatUrls << masterFlatUrl;
+    }
+
+    processing->setLightUrls(lightUrls);
+    processing->setBiasUrls(biasUrls);
+    processing->setDarkUrls(darkUrls);
+    processing->setFlatUrls(flatUrls);
+    /// Later stages need the calibrated frames in memory.
+    processing->setStreamCalibration(false);
+    processing->setParallelCalibration(parallelCalibration);
+    processing->setCalibrationThreads(calibrationThreads);
+
+    processing->calibrateOffScreen();
+
+    rMatFrames = processing->rMatLightList;
+    return !rMatFrames.isEmpty();
+}
+
+bool RBatchRunner::limbFitStage()
+{
+    processing->setShowContours(false);
+    processing->setShowLimb(false);
+    processing->rMatLightList = rMatFrames;
+
+    if (!processing->wernerLimbFit(rMatFrames, limbSmooth, limbSmoothSize))
+    {
+        return false;
+    }
+
+    std::cout << "RBatchRunner:: mean radius = " << processing->getMeanRadius() << " px" << std::endl;
+
+    if (!processing->solarLimbRegisterSeries(rMatFrames))
+    {
+        return false;
+    }
+
+    rMatFrames = processing->getLimbFitResultList1();
+    return !rMatFrames.isEmpty();
+}
+
+bool RBatchRunner::registerStage()
+{
+    if (rMatFrames.isEmpty())
+    {
+        return false;
+    }
+
+    if (roi.empty())
+    {
+        /// Default ROI: the central half of the frame.
+        int naxis1 = rMatFrames.at(0)->matImage.cols;
+        int naxis2 = rMatFrames.at(0)->matImage.rows;
+        roi = cv::Rect(naxis1/4, naxis2/4, naxis1/2, naxis2/2);
+    }
+
+    /// A plain mean stack is accumulated while registering: no need to go over the frames again.
+    /// So is a drizzle, which also skips the resampling of the registered frames.
+    processing->setLiveStacking(doStack && stackMethod == QString("mean") && frameWeighting == frameWeights::none);
+    processing->setDrizzle(doStack && stackMethod == QString("drizzle"));
+
+    processing->rMatLightList = rMatFrames;
+    processing->setUseROI(true);
+    processing->setCvRectROI(roi);
+    processing->setApplyMask(false);
+
+    if (registrationMethod == QString("limb"))
+    {
+        processing->registerSeriesOnLimbFit();
+        rMatFrames = processing->getLimbFitResultList2();
+    }
+    else if (registrationMethod == QString("template"))
+    {
+        processing->registerSeriesByTemplateMatching();
+        rMatFrames = processing->getResultList();
+    }
+    else
+    {
+        processing->registerSeries();
+        rMatFrames = processing->getResultList();
+    }
+
+    return !rMatFrames.isEmpty();
+}
+
+bool RBatchRunner::stackStage()
+{
+    bool withClipping = (stackMethod == QString("sigmaclip") || stackMethod == QString("winsorized"));
+    processing->setStackWithMean(!withClipping);
+    processing->setStackWithSigmaClip(withClipping);
+    processing->setClipWinsorized(stackMethod == QString("winsorized"));
+
+    if (stackMethod == QString("drizzle"))
+    {
+        if (processing->getDrizzle()->getNFrames() == rMatFrames.size())
+        {
+            stackedRMat = processing->getDrizzle()->getResultRMat();
+            processing->setDrizzle(false);
+            return stackedRMat != NULL;
+        }
+        /// Without the register stage there are no warps to drizzle with.
+        std::cout << "RBatchRunner:: drizzle needs the register stage, stacking with the mean" << std::endl;
+    }
+
+    if (!withClipping && processing->getLiveStack()->getNFrames() == rMatFrames.size())
+    {
+        stackedRMat = processing->getLiveStack()->getMeanRMat();
+        stackedRMat->setImageTitle(QString("mean_stack"));
+        processing->setLiveStacking(false);
+        return true;
+    }
+
+    processing->stack(rMatFrames);
+    stackedRMat = processing->getStackedRMat();
+
+    return stackedRMat != NULL;
+}
+
+bool RBatchRunner::exportStage()
+{
+    QDir dir(exportDir);
+    if (!dir.exists())
+    {
+        dir.mkpath(QString("."));
+    }
+
+    if (exportFrames || !doStack)
+    {
+        processing->exportFramesToFits(rMatFrames, dir, false);
+    }
+
+    if (stackedRMat != NULL)
+    {
+        QFileInfo fileInfo(dir.filePath(stackedRMat->getImageTitle() + QString(".fits")));
+        QString stackPath = processing->setupFileName(fileInfo);
+        if (!processing->exportToFits(stackedRMat, stackPath))
+        {
+            std::cout << "RBatchRunner:: could not export the stack to " << stackPath.toStdString() << std::endl;
+            return false;
+        }
+        std::cout << "RBatchRunner:: stack exported at: " << stackPath.toStdString() << std::endl;
+    }
+
+    return true;
+}
+
+void RBatchRunner::startStage(QString name)
+{
+    stageName = name;
+    std::cout << "RBatchRunner:: --- " << name.toStdString() << " ---" << std::endl;
+    stageTimer.start();
+}
+
+void RBatchRunner::stopStage()
+{
+    stageNames << stageName;
+    stageTimes << stageTimer.elapsed();
+    stagePeakRSS << getPeakRSS();
+}
+
+void RBatchRunner::printTimings()
+{
+    std::cout << "RBatchRunner:: stage timings" << std::endl;
+    for (int i = 0 ; i < stageNames.size() ; i++)
+    {
+        std::cout << "    " << std::left << std::setw(10) << stageNames.at(i).toStdString()
+                  << std::right << std::setw(10) << stageTimes.at(i) << " ms"
+                  << std::setw(10) << stagePeakRSS.at(i) / (1024*1024) << " MB peak" << std::endl;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef RBATCHRUNNER_H
+#define RBATCHRUNNER_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+#include "rprocessing.h"
+
+/// Runs the calibration, limb fitting, registration, stacking and export off-screen,
+/// as described in a config file (INI format, see batch_example.ini).
+/// Nothing here creates a QWidget or an OpenGL context: it runs with a QCoreApplication.
+class RBatchRunner : public QObject
+{
+    Q_OBJECT
+
+public:
+    RBatchRunner(QString configPath, QObject *parent = NULL);
+    ~RBatchRunner();
+
+    /// Runs the enabled stages in order. Returns 0 on success, like a main().
+    int run();
+
+public slots:
+    void printMessage(QString message);
+
+private:
+
+    bool loadConfig();
+    QList<QUrl> listUrls(QString dirPath, QStringList files, bool recursive);
+
+    bool calibrateStage();
+    bool limbFitStage();
+    bool registerStage();
+    bool stackStage();
+    bool exportStage();
+
+    void startStage(QString name);
+    void stopStage();
+    void printTimings();
+
+    QString configPath;
+    RProcessing *processing;
+
+    // Frames handed over from one stage to the next
+    QList<RMat*> rMatFrames;
+    RMat *stackedRMat;
+
+    // Stages
+    bool doCalibrate, doLimbFit, doRegister, doStack, doExport;
+
+    // Inputs
+    QList<QUrl> lightUrls;
+    QUrl masterBiasUrl, masterDarkUrl, masterFlatUrl;
+    QString exportDir;
+    bool exportFrames;
+
+    // Options
+    bool parallelCalibration;
+    int calibrationThreads;
+    bool limbSmooth;
+    int limbSmoothSize;
+    QString registrationMethod;
+    cv::Rect roi;
+    QString stackMethod;
+    frameWeights frameWeighting;
+
+    // Per-stage wall time (ms) and peak memory (bytes) so far
+    QElapsedTimer stageTimer;
+    QString stageName;
+    QList<QString> stageNames;
+    QList<qint64> stageTimes;
+    QList<size_t> stagePeakRSS;
+};
+
+#endif // RBATCHRUNNER_H
@@ -0,0 +1,141 @@
+#include "rcfa.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+template <typename T>
+static void extractPlaneT(const cv::Mat &cfa, cv::Mat &plane, int py, int px)
+{
+    for (int y = 0; y < plane.rows; y++)
+    {
+        const T *src = cfa.ptr<T>(2 * y + py) + px;
+        T *dst = plane.ptr<T>(y);
+        for (int x = 0; x < plane.cols; x++)
+        {
+            dst[x] = src[2 * x];
+        }
+    }
+}
+
+template <typename T>
+static void insertPlaneT(const cv::Mat &plane, cv::Mat &cfa, int py, int px)
+{
+    for (int y = 0; y < plane.rows; y++)
+    {
+        const T *src = plane.ptr<T>(y);
+        T *dst = cfa.ptr<T>(2 * y + py) + px;
+        for (int x = 0; x < plane.cols; x++)
+        {
+            dst[2 * x] = src[x];
+        }
+    }
+}
+
+cv::Mat RCfa::extractPlane(const cv::Mat &cfa, int py, int px)
+{
+    CV_Assert(cfa.channels() == 1);
+    /// Odd sizes: the planes of the first row or column have one more pixel.
+    cv::Mat plane((cfa.rows - py + 1) / 2, (cfa.cols - px + 1) / 2, cfa.type());
+    switch (cfa.depth())
+    {
+    case CV_8U:
+        extractPlaneT<uchar>(cfa, plane, py, px);
+        break;
+    case CV_16U:
+        extractPlaneT<ushort>(cfa, plane, py, px);
+        break;
+    case CV_32F:
+        extractPlaneT<float>(cfa, plane, py, px);
+        break;
+    default:
+        extractPlaneT<double>(cfa, plane, py, px);
+    }
+    return plane;
+}
+
+void RCfa::insertPlane(const cv::Mat &plane, cv::Mat &cfa, int py, int px)
+{
+    CV_Assert(plane.type() == cfa.type());
+    switch (cfa.depth())
+    {
+    case CV_8U:
+        insertPlaneT<uchar>(plane, cfa, py, px);
+        break;
+    case CV_16U:
+        insertPlaneT<ushort>(plane, cfa, py, px);
+        break;
+    case CV_32F:
+        insertPlaneT<float>(plane, cfa, py, px);
+        break;
+    default:
+        insertPlaneT<double>(plane, cfa, py, px);
+    }
+}
+
+cv::Mat RCfa::luminance(const cv::Mat &cfa)
+{
+    cv::Mat cfa16;
+    cfa.convertTo(cfa16, CV_16U);
+
+    /// Separable [1 2 1]/4 x [1 2 1]/4. BORDER_REFLECT_101 keeps the parity of the mirrored pixels,
+    /// hence the colour weights, along the edges.
+    cv::Mat kernel = (cv::Mat_<float>(3, 1) << 0.25f, 0.5f, 0.25f);
+    cv::Mat luminanceMat;
+    cv::sepFilter2D(cfa16, luminanceMat, CV_16U, kernel, kernel, cv::Point(-1, -1), 0, cv::BORDER_REFLECT_101);
+    return luminanceMat;
+}
+
+cv::Mat RCfa::warpAffine(const cv::Mat &cfa, const cv::Mat &warpMat, int flags)
+{
+    CV_Assert(cfa.channels() == 1);
+
+    /// In inverse map form: src = A * dst + t.
+    cv::Mat inverseWarp;
+    warpMat.convertTo(inverseWarp, CV_64F);
+    if (!(flags & cv::WARP_INVERSE_MAP))
+    {
+        cv::invertAffineTransform(inverseWarp, inverseWarp);
+    }
+    flags |= cv::WARP_INVERSE_MAP;
+
+    cv::Mat warpedCFA(cfa.size(), cfa.type());
+    for (int py = 0; py < 2; py++)
+    {
+        for (int px = 0; px < 2; px++)
+        {
+            /// Plane pixel u is the full pixel 2u + p, of the same phase p in src and dst:
+            /// u_src = A * u + (A * p + t - p) / 2
+            cv::Mat planeWarp = inverseWarp.clone();
+            double a00 = inverseWarp.at<double>(0, 0), a01 = inverseWarp.at<double>(0, 1);
+            double a10 = inverseWarp.at<double>(1, 0), a11 = inverseWarp.at<double>(1, 1);
+            planeWarp.at<double>(0, 2) = (a00 * px + a01 * py + inverseWarp.at<double>(0, 2) - px) / 2.0;
+            planeWarp.at<double>(1, 2) = (a10 * px + a11 * py + inverseWarp.at<double>(1, 2) - py) / 2.0;
+
+            cv::Mat plane = extractPlane(cfa, py, px);
+            cv::Mat warpedPlane;
+            cv::warpAffine(plane, warpedPlane, planeWarp, plane.size(), flags);
+            insertPlane(warpedPlane, warpedCFA, py, px);
+        }
+    }
+
+    return warpedCFA;
+}
+
+cv::Vec3d RCfa::colourMeans(const cv::Mat &cfa)
+{
+    double means[2][2];
+    double counts[2][2];
+    for (int py = 0; py < 2; py++)
+    {
+        for (int px = 0; px < 2; px++)
+        {
+            cv::Mat plane = extractPlane(cfa, py, px);
+            cv::Mat validMask = plane > 0;
+            counts[py][px] = (double) cv::countNonZero(validMask);
+            means[py][px] = cv::mean(plane, validMask)[0];
+        }
+    }
+
+    double greenCount = counts[0][1] + counts[1][0];
+    double greenMean = (greenCount > 0) ? (means[0][1] * counts[0][1] + means[1][0] * counts[1][0]) / greenCount : 0;
+    return cv::Vec3d(means[0][0], greenMean, means[1][1]);
+}
@@ -0,0 +1,36 @@
+#ifndef RCFA_H
+#define RCFA_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+/// Operations done directly on the Bayer mosaic (CFA, single channel), so that calibration,
+/// registration and stacking never demosaic: only the final image is, on display or export.
+/// The two greens are on the anti-diagonal of each 2x2 cell (rows, cols) = (0, 1) and (1, 0),
+/// as for the CV_BayerBG pattern of the DSLR files.
+class RCfa
+{
+public:
+
+    /// Full resolution luminance (R + 2G + B) / 4 of a mosaic, with one 3x3 binomial filter:
+    /// at every pixel, whatever its colour, it weighs R, G and B as above. CV_16U output.
+    static cv::Mat luminance(const cv::Mat &cfa);
+
+    /// Warps a mosaic and keeps it a mosaic: each of the 4 CFA planes (half size) is warped
+    /// with the same transform expressed in its own coordinates, and the planes are put back.
+    /// That is as many pixels as a single full-frame warp, instead of 3 after a demosaic.
+    /// Same flags as cv::warpAffine. Output has the type of the input.
+    static cv::Mat warpAffine(const cv::Mat &cfa, const cv::Mat &warpMat, int flags);
+
+    /// Mean of each CFA colour over pixels > 0: [0] top-left, [1] greens, [2] bottom-right.
+    static cv::Vec3d colourMeans(const cv::Mat &cfa);
+
+    /// Plane of the pixels (2 * row + py, 2 * col + px), and the reverse.
+    static cv::Mat extractPlane(const cv::Mat &cfa, int py, int px);
+    static void insertPlane(const cv::Mat &plane, cv::Mat &cfa, int py, int px);
+};
+
+#endif // RCFA_H
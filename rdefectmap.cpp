@@ -0,0 +1,275 @@
+#include "rdefectmap.h"
+
+#include <opencv2/core/hal/intrin.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "rhistogram.h"
+#include "rcfa.h"
+
+using namespace cv;
+
+/// Optimal sorting network for 8 values (19 comparators).
+static const int sortNetwork8[19][2] = {
+    {0, 2}, {1, 3}, {4, 6}, {5, 7},
+    {0, 4}, {1, 5}, {2, 6}, {3, 7},
+    {0, 1}, {2, 3}, {4, 5}, {6, 7},
+    {2, 4}, {3, 5},
+    {1, 4}, {3, 6},
+    {1, 2}, {3, 4}, {5, 6}
+};
+
+/// Median of 8 neighbours, for 4 defects at a time: the sorting network runs on 4 lanes.
+static void median8x4(float nb[8][4], float *median)
+{
+    int k = 0;
+#if CV_SIMD128
+    v_float32x4 v[8];
+    for (int i = 0; i < 8; i++)
+    {
+        v[i] = v_load(nb[i]);
+    }
+    for (int c = 0; c < 19; c++)
+    {
+        v_float32x4 a = v[sortNetwork8[c][0]];
+        v_float32x4 b = v[sortNetwork8[c][1]];
+        v[sortNetwork8[c][0]] = v_min(a, b);
+        v[sortNetwork8[c][1]] = v_max(a, b);
+    }
+    v_store(median, (v[3] + v[4]) * v_setall_f32(0.5f));
+    k = 4;
+#endif
+    for (; k < 4; k++)
+    {
+        float lane[8];
+        for (int i = 0; i < 8; i++)
+        {
+            lane[i] = nb[i][k];
+        }
+        for (int c = 0; c < 19; c++)
+        {
+            float a = lane[sortNetwork8[c][0]];
+            float b = lane[sortNetwork8[c][1]];
+            lane[sortNetwork8[c][0]] = std::min(a, b);
+            lane[sortNetwork8[c][1]] = std::max(a, b);
+        }
+        median[k] = 0.5f * (lane[3] + lane[4]);
+    }
+}
+
+/// Mirrors a neighbour coordinate that falls outside [0, size[, keeping its parity.
+static inline int mirror(int i, int size, int step)
+{
+    if (i < 0)
+    {
+        return i + 2 * step;
+    }
+    if (i >= size)
+    {
+        return i - 2 * step;
+    }
+    return i;
+}
+
+RDefectMap::RDefectMap(float hotSigma, float coldFraction) :
+    hotSigma(hotSigma), coldFraction(coldFraction), rows(0), cols(0), step(1), nHot(0), nCold(0)
+{
+
+}
+
+void RDefectMap::robustStats(const cv::Mat &mat, double &median, double &sigma)
+{
+    RHistogram histogram;
+    std::vector<double> cutOffs(1, 50.0);
+    median = histogram.percentiles(mat, cutOffs)[0];
+
+    cv::Mat absDev = cv::abs(mat - median);
+    double mad = histogram.percentiles(absDev, cutOffs)[0];
+    sigma = 1.4826 * mad;
+}
+
+void RDefectMap::build(const cv::Mat &dark, const cv::Mat &flat, bool bayer)
+{
+    clear();
+
+    if (dark.empty() && flat.empty())
+    {
+        return;
+    }
+
+    cv::Size size = dark.empty() ? flat.size() : dark.size();
+    rows = size.height;
+    cols = size.width;
+    step = bayer ? 2 : 1;
+
+    /// One flag per pixel while building, whatever the channels of the masters.
+    cv::Mat hotMask = cv::Mat::zeros(size, CV_8U);
+    cv::Mat coldMask = cv::Mat::zeros(size, CV_8U);
+
+    if (!dark.empty())
+    {
+        cv::Mat dark32;
+        dark.convertTo(dark32, CV_32F);
+        double median, sigma;
+        robustStats(dark32.reshape(1), median, sigma);
+        if (sigma > 0)
+        {
+            std::vector<cv::Mat> channels;
+            cv::split(dark32, channels);
+            for (size_t c = 0; c < channels.size(); c++)
+            {
+                hotMask |= (channels[c] > median + hotSigma * sigma);
+                coldMask |= (channels[c] < median - hotSigma * sigma);
+            }
+        }
+    }
+
+    if (!flat.empty() && flat.size() == size)
+    {
+        cv::Mat flat32;
+        flat.convertTo(flat32, CV_32F);
+        std::vector<cv::Mat> channels;
+        cv::split(flat32, channels);
+        for (size_t c = 0; c < channels.size(); c++)
+        {
+            if (bayer && channels.size() == 1)
+            {
+                /// Each CFA colour against its own mean
+                cv::Vec3d means = RCfa::colourMeans(channels[c]);
+                for (int py = 0; py < 2; py++)
+                {
+                    for (int px = 0; px < 2; px++)
+                    {
+                        cv::Mat plane = RCfa::extractPlane(channels[c], py, px);
+                        cv::Mat planeMask = RCfa::extractPlane(coldMask, py, px);
+                        planeMask |= (plane < coldFraction * means[py + px]);
+                        RCfa::insertPlane(planeMask, coldMask, py, px);
+                    }
+                }
+            }
+            else
+            {
+                cv::Mat validMask = channels[c] > 0;
+                double meanFlat = cv::mean(channels[c], validMask)[0];
+                coldMask |= (channels[c] < coldFraction * meanFlat);
+            }
+        }
+    }
+
+    /// Hot wins over cold for the counts. Indices come out sorted, row by row.
+    coldMask.setTo(0, hotMask);
+    nHot = cv::countNonZero(hotMask);
+    nCold = cv::countNonZero(coldMask);
+
+    indices.create(1, nHot + nCold, CV_32S);
+    int *index = indices.ptr<int>(0);
+    int n = 0;
+    for (int y = 0; y < rows; y++)
+    {
+        const uchar *hotRow = hotMask.ptr<uchar>(y);
+        const uchar *coldRow = coldMask.ptr<uchar>(y);
+        for (int x = 0; x < cols; x++)
+        {
+            if (hotRow[x] || coldRow[x])
+            {
+                index[n++] = y * cols + x;
+            }
+        }
+    }
+
+    std::cout << "RDefectMap::build() " << nHot << " hot pixels, " << nCold << " cold pixels" << std::endl;
+}
+
+void RDefectMap::clear()
+{
+    indices.release();
+    rows = 0;
+    cols = 0;
+    nHot = 0;
+    nCold = 0;
+}
+
+void RDefectMap::apply(cv::Mat &mat) const
+{
+    if (empty())
+    {
+        return;
+    }
+
+    CV_Assert(mat.depth() == CV_32F && mat.rows == rows && mat.cols == cols);
+
+    const int dy[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
+    const int dx[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
+    const int cn = mat.channels();
+    const int *index = indices.ptr<int>(0);
+    const int nDefects = (int) indices.total();
+
+    float nb[8][4];
+    float median[4];
+    int batch[4];
+
+    for (int c = 0; c < cn; c++)
+    {
+        /// Gather the neighbours of 4 defects, take the 4 medians at once, write them back.
+        /// Defects of the earlier batches are already filled when they are someone's neighbours.
+        for (int d0 = 0; d0 < nDefects; d0 += 4)
+        {
+            int nBatch = std::min(4, nDefects - d0);
+            for (int k = 0; k < 4; k++)
+            {
+                /// Short batches repeat their last defect.
+                int i = index[d0 + std::min(k, nBatch - 1)];
+                int y = i / cols;
+                int x = i - y * cols;
+                batch[k] = i;
+                for (int j = 0; j < 8; j++)
+                {
+                    int ny = mirror(y + dy[j] * step, rows, step);
+                    int nx = mirror(x + dx[j] * step, cols, step);
+                    nb[j][k] = mat.ptr<float>(ny)[nx * cn + c];
+                }
+            }
+
+            median8x4(nb, median);
+
+            for (int k = 0; k < nBatch; k++)
+            {
+                int y = batch[k] / cols;
+                int x = batch[k] - y * cols;
+                mat.ptr<float>(y)[x * cn + c] = median[k];
+            }
+        }
+    }
+}
+
+bool RDefectMap::empty() const
+{
+    return indices.empty();
+}
+
+int RDefectMap::getNHot() const
+{
+    return nHot;
+}
+
+int RDefectMap::getNCold() const
+{
+    return nCold;
+}
+
+cv::Mat RDefectMap::getIndices() const
+{
+    return indices;
+}
+
+void RDefectMap::setHotSigma(float hotSigma)
+{
+    this->hotSigma = hotSigma;
+}
+
+void RDefectMap::setColdFraction(float coldFraction)
+{
+    this->coldFraction = coldFraction;
+}
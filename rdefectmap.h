@@ -0,0 +1,55 @@
+#ifndef RDEFECTMAP_H
+#define RDEFECTMAP_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+/// Hot and cold (dead) pixels of a sensor, found once from the masters and corrected in every
+/// calibrated light, so that they do not bias the registration nor end up in the stacks.
+/// Hot pixels: master dark above median + hotSigma * sigma, with sigma from the median absolute deviation.
+/// Cold pixels: master dark below median - hotSigma * sigma, or master flat below coldFraction of the
+/// mean flat (of its CFA colour for a Bayer flat).
+/// The defects are kept as a sorted list of pixel indices (CV_32S, 1 x n): a few KB instead of a mask,
+/// and shallow-copied with the CalibrationKernel that holds it.
+class RDefectMap
+{
+public:
+    RDefectMap(float hotSigma = 5.0f, float coldFraction = 0.5f);
+
+    /// dark or flat can be empty. For a Bayer sensor, the neighbours are those of the same colour.
+    void build(const cv::Mat &dark, const cv::Mat &flat, bool bayer);
+    void clear();
+
+    /// Replaces each defect by the median of its 8 neighbours (of the same colour), in place.
+    /// mat is CV_32F, of the size of the masters, with any number of channels.
+    void apply(cv::Mat &mat) const;
+
+    bool empty() const;
+    int getNHot() const;
+    int getNCold() const;
+    cv::Mat getIndices() const;
+
+    void setHotSigma(float hotSigma);
+    void setColdFraction(float coldFraction);
+
+private:
+
+    /// Median and robust standard deviation (1.4826 MAD) of the finite values.
+    static void robustStats(const cv::Mat &mat, double &median, double &sigma);
+
+    float hotSigma;
+    float coldFraction;
+
+    cv::Mat indices;
+    int rows;
+    int cols;
+    // Distance to the neighbours: 2 in a Bayer mosaic
+    int step;
+    int nHot;
+    int nCold;
+};
+
+#endif // RDEFECTMAP_H
@@ -0,0 +1,256 @@
+#include "rdrizzle.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+/// Output rows per parallel band
+static const int bandRows = 32;
+
+/// RGB channel of each CFA position of an RGGB mosaic (CV_BayerBG2RGB in RMat)
+static const int cfaChannel[2][2] = {{0, 1}, {1, 2}};
+
+template <typename T>
+class ParallelDrizzle : public cv::ParallelLoopBody
+{
+public:
+    ParallelDrizzle(const cv::Mat &frame, const cv::Matx23d &toOutput, const cv::Matx23d &fromOutput, bool bayer,
+                    double halfDrop, float weight, cv::Mat &data, cv::Mat &weights) :
+        frame(frame), toOutput(toOutput), fromOutput(fromOutput), bayer(bayer),
+        halfDrop(halfDrop), dropArea(4.0 * halfDrop * halfDrop), weight(weight), data(data), weights(weights)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        const int cn = frame.channels();
+        const int outCn = data.channels();
+
+        for (int band = range.start; band < range.end; band++)
+        {
+            int oy0 = band * bandRows;
+            int oy1 = std::min(oy0 + bandRows, data.rows);
+
+            /// Input rows whose drops can reach the band: corners of the band, widened by a drop, mapped back to the frame.
+            double yMin = frame.rows, yMax = -1;
+            const double cornerX[2] = {0, (double) data.cols};
+            const double cornerY[2] = {oy0 - halfDrop, oy1 + halfDrop};
+            for (int i = 0; i < 2; i++)
+            {
+                for (int j = 0; j < 2; j++)
+                {
+                    double y = fromOutput(1, 0) * cornerX[i] + fromOutput(1, 1) * cornerY[j] + fromOutput(1, 2);
+                    yMin = std::min(yMin, y);
+                    yMax = std::max(yMax, y);
+                }
+            }
+            int y0 = std::max(0, (int) std::floor(yMin) - 1);
+            int y1 = std::min(frame.rows - 1, (int) std::ceil(yMax) + 1);
+
+            for (int y = y0; y <= y1; y++)
+            {
+                const T *src = frame.ptr<T>(y);
+                /// Drop centre in output coordinates, moving along the row
+                double u = toOutput(0, 1) * y + toOutput(0, 2);
+                double v = toOutput(1, 1) * y + toOutput(1, 2);
+
+                for (int x = 0; x < frame.cols; x++, u += toOutput(0, 0), v += toOutput(1, 0))
+                {
+                    int jy0 = std::max(oy0, (int) std::floor(v - halfDrop));
+                    int jy1 = std::min(oy1 - 1, (int) std::floor(v + halfDrop));
+                    int jx0 = std::max(0, (int) std::floor(u - halfDrop));
+                    int jx1 = std::min(data.cols - 1, (int) std::floor(u + halfDrop));
+                    if (jy0 > jy1 || jx0 > jx1)
+                    {
+                        continue;
+                    }
+
+                    for (int jy = jy0; jy <= jy1; jy++)
+                    {
+                        double overlapY = std::min(jy + 1.0, v + halfDrop) - std::max((double) jy, v - halfDrop);
+                        if (overlapY <= 0)
+                        {
+                            continue;
+                        }
+                        float *dataRow = data.ptr<float>(jy);
+                        float *weightRow = weights.ptr<float>(jy);
+
+                        for (int jx = jx0; jx <= jx1; jx++)
+                        {
+                            double overlapX = std::min(jx + 1.0, u + halfDrop) - std::max((double) jx, u - halfDrop);
+                            if (overlapX <= 0)
+                            {
+                                continue;
+                            }
+                            float w = (float) (overlapX * overlapY / dropArea) * weight;
+
+                            if (bayer)
+                            {
+                                float value = (float) src[x];
+                                int c = jx * outCn + cfaChannel[y & 1][x & 1];
+                                if (value == value)
+                                {
+                                    dataRow[c] += w * value;
+                                    weightRow[c] += w;
+                                }
+                            }
+                            else
+                            {
+                                for (int c = 0; c < cn; c++)
+                                {
+                                    float value = (float) src[x * cn + c];
+                                    if (value == value)
+                                    {
+                                        dataRow[jx * outCn + c] += w * value;
+                                        weightRow[jx * outCn + c] += w;
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    const cv::Mat &frame;
+    cv::Matx23d toOutput;
+    cv::Matx23d fromOutput;
+    bool bayer;
+    double halfDrop;
+    double dropArea;
+    float weight;
+    cv::Mat &data;
+    cv::Mat &weights;
+};
+
+RDrizzle::RDrizzle(double scale, double pixFrac) :
+    scale(scale), pixFrac(pixFrac), nFrames(0), bayer(false), instrument(instruments::generic), XPOSURE(0), TEMP(-100)
+{
+
+}
+
+bool RDrizzle::push(const cv::Mat &frame, const cv::Mat &warpMat, bool bayer, float weight)
+{
+    if (frame.empty() || weight <= 0)
+    {
+        return false;
+    }
+
+    bayer = bayer && frame.channels() == 1;
+    int outChannels = bayer ? 3 : frame.channels();
+
+    if (nFrames == 0)
+    {
+        inputSize = frame.size();
+        this->bayer = bayer;
+        cv::Size outputSize(cvRound(frame.cols * scale), cvRound(frame.rows * scale));
+        data = cv::Mat::zeros(outputSize, CV_32FC(outChannels));
+        weights = cv::Mat::zeros(outputSize, CV_32FC(outChannels));
+    }
+    else if (frame.size() != inputSize || bayer != this->bayer || outChannels != data.channels())
+    {
+        std::cout << "RDrizzle::push() frame does not match the first one" << std::endl;
+        return false;
+    }
+
+    /// Frame pixel centre -> reference (inverse of the registration warp) -> output, with pixel edges at integers.
+    cv::Mat frameToReference;
+    warpMat.convertTo(frameToReference, CV_64F);
+    cv::invertAffineTransform(frameToReference, frameToReference);
+    cv::Matx23d toOutput = cv::Matx23d(frameToReference) * scale;
+    toOutput(0, 2) += 0.5 * scale;
+    toOutput(1, 2) += 0.5 * scale;
+    cv::Matx23d fromOutput;
+    cv::invertAffineTransform(toOutput, fromOutput);
+
+    double halfDrop = 0.5 * pixFrac * scale;
+    int nBands = (data.rows + bandRows - 1) / bandRows;
+
+    switch (frame.depth())
+    {
+    case CV_8U:
+        cv::parallel_for_(cv::Range(0, nBands), ParallelDrizzle<uchar>(frame, toOutput, fromOutput, bayer, halfDrop, weight, data, weights));
+        break;
+    case CV_16U:
+        cv::parallel_for_(cv::Range(0, nBands), ParallelDrizzle<ushort>(frame, toOutput, fromOutput, bayer, halfDrop, weight, data, weights));
+        break;
+    case CV_32F:
+        cv::parallel_for_(cv::Range(0, nBands), ParallelDrizzle<float>(frame, toOutput, fromOutput, bayer, halfDrop, weight, data, weights));
+        break;
+    default:
+        cv::Mat frame64;
+        frame.convertTo(frame64, CV_64F);
+        cv::parallel_for_(cv::Range(0, nBands), ParallelDrizzle<double>(frame64, toOutput, fromOutput, bayer, halfDrop, weight, data, weights));
+    }
+
+    nFrames++;
+    return true;
+}
+
+bool RDrizzle::push(RMat *rMat, const cv::Mat &warpMat, float weight)
+{
+    if (nFrames == 0)
+    {
+        instrument = rMat->getInstrument();
+        XPOSURE = rMat->getXPOSURE();
+        TEMP = rMat->getTEMP();
+    }
+    return push(rMat->matImage, warpMat, rMat->isBayer(), weight);
+}
+
+void RDrizzle::reset()
+{
+    data.release();
+    weights.release();
+    inputSize = cv::Size();
+    nFrames = 0;
+}
+
+cv::Mat RDrizzle::getResult() const
+{
+    if (nFrames == 0)
+    {
+        return cv::Mat();
+    }
+    cv::Mat result;
+    cv::divide(data, weights, result);
+    /// Output pixels that no drop reached: 0 rather than NaN
+    result.setTo(0, weights == 0);
+    return result;
+}
+
+cv::Mat RDrizzle::getWeights() const
+{
+    return weights;
+}
+
+RMat* RDrizzle::getResultRMat() const
+{
+    cv::Mat result = getResult();
+    if (result.empty())
+    {
+        return NULL;
+    }
+    /// Already RGB for a Bayer series
+    RMat *rMat = RMat::adopt(result, false, instrument, XPOSURE, TEMP);
+    rMat->setImageTitle(QString("drizzle_stack"));
+    return rMat;
+}
+
+int RDrizzle::getNFrames() const
+{
+    return nFrames;
+}
+
+void RDrizzle::setScale(double scale)
+{
+    this->scale = scale;
+}
+
+void RDrizzle::setPixFrac(double pixFrac)
+{
+    this->pixFrac = pixFrac;
+}
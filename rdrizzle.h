@@ -0,0 +1,59 @@
+#ifndef RDRIZZLE_H
+#define RDRIZZLE_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include "rmat.h"
+
+/// Drizzle integration (variable-pixel linear reconstruction) of registered frames.
+/// Each input pixel is shrunk to a square drop of pixFrac of its size, moved to its registered position
+/// on an output grid scale times finer, and added to the output pixels it overlaps, weighted by the overlap area.
+/// The output is the weighted mean. The frames are not resampled beforehand: the registration only provides
+/// the warp matrices, in the inverse map form given to warpAffine (reference -> frame).
+/// Drops stay axis-aligned squares: exact for translations, a close approximation for the small rotations
+/// of a registration.
+/// Bayer mosaics are drizzled colour by colour (RGGB) onto an RGB output, which is then never demosaiced.
+/// The output grid is split in bands of rows drizzled in parallel, each band reading only the input rows
+/// that can reach it.
+class RDrizzle
+{
+public:
+    RDrizzle(double scale = 2.0, double pixFrac = 0.7);
+
+    /// Returns false if the frame does not match the size of the first one.
+    bool push(const cv::Mat &frame, const cv::Mat &warpMat, bool bayer, float weight = 1.0f);
+    bool push(RMat *rMat, const cv::Mat &warpMat, float weight = 1.0f);
+    void reset();
+
+    /// CV_32F, RGB for Bayer frames, else the channels of the frames. 0 where no drop fell.
+    cv::Mat getResult() const;
+    /// Sum of the weights of the drops in each output pixel
+    cv::Mat getWeights() const;
+    /// Result with the metadata of the first frame
+    RMat* getResultRMat() const;
+    int getNFrames() const;
+
+    void setScale(double scale);
+    void setPixFrac(double pixFrac);
+
+private:
+
+    double scale;
+    double pixFrac;
+
+    cv::Mat data;
+    cv::Mat weights;
+    cv::Size inputSize;
+    int nFrames;
+
+    bool bayer;
+    instruments instrument;
+    float XPOSURE;
+    float TEMP;
+};
+
+#endif // RDRIZZLE_H
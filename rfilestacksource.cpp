@@ -0,0 +1,309 @@
+#include "rfilestacksource.h"
+
+#include <fitsio.h>
+
+#include <atomic>
+#include <iostream>
+
+#include "MyFitsImage.h"
+#include "imagemanager.h"
+#include "rinstrumentprofile.h"
+
+/// Decodes and spools the non-FITS frames, one frame per thread at a time.
+class ParallelSpool : public cv::ParallelLoopBody
+{
+public:
+    ParallelSpool(RFileStackSource &source, const std::vector<int> &frames, std::atomic<int> &failures) :
+        source(source), frames(frames), failures(failures)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        for (int i = range.start; i < range.end; i++)
+        {
+            if (!source.spoolFrame(frames[i]))
+            {
+                failures++;
+            }
+        }
+    }
+
+private:
+    RFileStackSource &source;
+    const std::vector<int> &frames;
+    std::atomic<int> &failures;
+};
+
+static bool isFits(const QUrl &url)
+{
+    QString fileExt = QFileInfo(url.toLocalFile()).suffix().toLower();
+    return (fileExt == QString("fits") || fileExt == QString("fts") || fileExt == QString("fit"));
+}
+
+RFileStackSource::RFileStackSource(const QList<QUrl> &urls) :
+    urls(urls), fitsFiles(urls.size(), (void*) NULL), fitsSaturate(urls.size(), 0), rows(0), cols(0), channels(0), valid(false)
+{
+    if (urls.isEmpty() || !spoolDir.isValid())
+    {
+        return;
+    }
+
+    QVector<RFrameMetadata> scannedList = RMetadataScanner::scanUrls(urls);
+    metadataList.assign(scannedList.begin(), scannedList.end());
+    spoolPaths.resize(urls.size());
+    spoolTypes.resize(urls.size(), CV_32F);
+
+    /// The row drift of an instrument profile is measured over the whole frame:
+    /// FITS frames that need it are loaded whole and spooled, like the other formats.
+    std::vector<int> spoolList;
+    for (int i = 0; i < urls.size(); i++)
+    {
+        if (!isFits(urls.at(i)) || RInstrumentProfile::forInstrument(metadataList[i].instrument).driftCols > 0)
+        {
+            spoolList.push_back(i);
+        }
+    }
+
+    if (!spoolList.empty())
+    {
+        std::cout << "RFileStackSource:: spooling " << spoolList.size() << " frames to " << spoolDir.path().toStdString() << std::endl;
+        std::atomic<int> failures(0);
+        cv::parallel_for_(cv::Range(0, (int) spoolList.size()), ParallelSpool(*this, spoolList, failures));
+        if (failures > 0)
+        {
+            std::cout << "RFileStackSource:: " << failures << " frames could not be decoded" << std::endl;
+            return;
+        }
+    }
+
+    /// All frames must have the size of the first one.
+    rows = metadataList[0].naxis2;
+    cols = metadataList[0].naxis1;
+    channels = CV_MAT_CN(spoolTypes[0]);
+    for (int i = 0; i < urls.size(); i++)
+    {
+        if (!metadataList[i].valid || metadataList[i].naxis1 != cols || metadataList[i].naxis2 != rows
+                || CV_MAT_CN(spoolTypes[i]) != channels)
+        {
+            std::cout << "RFileStackSource:: unreadable frame or size mismatch: " << urls.at(i).toLocalFile().toStdString() << std::endl;
+            return;
+        }
+    }
+
+    valid = (rows > 0 && cols > 0);
+}
+
+RFileStackSource::~RFileStackSource()
+{
+    QMutexLocker cfitsioLocker(MyFitsImage::cfitsioMutex());
+    for (size_t i = 0; i < fitsFiles.size(); i++)
+    {
+        if (fitsFiles[i] != NULL)
+        {
+            int status = 0;
+            fits_close_file((fitsfile*) fitsFiles[i], &status);
+        }
+    }
+}
+
+bool RFileStackSource::isValid() const
+{
+    return valid;
+}
+
+int RFileStackSource::getNFrames() const
+{
+    return valid ? urls.size() : 0;
+}
+
+int RFileStackSource::getRows() const
+{
+    return rows;
+}
+
+int RFileStackSource::getCols() const
+{
+    return cols;
+}
+
+int RFileStackSource::getChannels() const
+{
+    return channels;
+}
+
+bool RFileStackSource::readRows(int frame, int row0, int nRows, float *dst)
+{
+    if (!valid || row0 + nRows > rows)
+    {
+        return false;
+    }
+
+    if (spoolPaths[frame].isEmpty())
+    {
+        if (!readFitsRows(frame, row0, nRows, dst))
+        {
+            return false;
+        }
+        /// Same correction as when ImageManager loads the frame (no row drift here, see the constructor).
+        /// Spooled frames already had it.
+        cv::Mat strip(nRows, cols, CV_32FC(channels), dst);
+        RInstrumentProfile::forInstrument(metadataList[frame].instrument).apply(strip, row0, rows);
+        return true;
+    }
+
+    return readSpooledRows(frame, row0, nRows, dst);
+}
+
+RFrameMetadata RFileStackSource::getMetadata(int frame) const
+{
+    return metadataList[frame];
+}
+
+bool RFileStackSource::openFits(int frame)
+{
+    /// Called with the CFITSIO mutex held
+    std::string filePathStr = urls.at(frame).toLocalFile().toStdString();
+    fitsfile *fptr;
+    int status = 0;
+
+    if (fits_open_file(&fptr, filePathStr.c_str(), READONLY, &status))
+    {
+        MyFitsImage::printerror(status);
+        return false;
+    }
+
+    /// Same HDU selection as MyFitsImage and RMetadataScanner: compressed images live in the 2nd HDU.
+    int nhdus = 0;
+    int hduType = 0;
+    fits_get_num_hdus(fptr, &nhdus, &status);
+    if (nhdus > 1)
+    {
+        fits_movabs_hdu(fptr, 2, &hduType, &status);
+    }
+
+    /// MyFitsImage loads 16-bit integers (unsigned, or signed without BZERO) as CV_16U: negative values saturate to 0.
+    /// fits_get_img_type() gives ZBITPIX for compressed images.
+    int bitpix = 0;
+    fits_get_img_type(fptr, &bitpix, &status);
+    int bzero = 0;
+    int keyStatus = 0;
+    fits_read_key(fptr, TINT, "BZERO", &bzero, NULL, &keyStatus);
+
+    if (status)
+    {
+        MyFitsImage::printerror(status);
+        int closeStatus = 0;
+        fits_close_file(fptr, &closeStatus);
+        return false;
+    }
+
+    fitsFiles[frame] = fptr;
+    fitsSaturate[frame] = (bitpix == USHORT_IMG || (bitpix == SHORT_IMG && (bzero == 0 || bzero == 32768)));
+    return true;
+}
+
+bool RFileStackSource::readFitsRows(int frame, int row0, int nRows, float *dst)
+{
+    LONGLONG nPixels = (LONGLONG) nRows * cols;
+    {
+        QMutexLocker cfitsioLocker(MyFitsImage::cfitsioMutex());
+        if (fitsFiles[frame] == NULL && !openFits(frame))
+        {
+            return false;
+        }
+
+        /// First pixel of the strip (1-based), then nRows full rows.
+        long fpixel[2] = {1, (long) row0 + 1};
+        int anynul = 0;
+        int status = 0;
+        if (fits_read_pix((fitsfile*) fitsFiles[frame], TFLOAT, fpixel, nPixels, NULL, dst, &anynul, &status))
+        {
+            MyFitsImage::printerror(status);
+            return false;
+        }
+    }
+
+    if (fitsSaturate[frame])
+    {
+        cv::Mat strip(1, (int) nPixels, CV_32F, dst);
+        cv::Mat saturated;
+        strip.convertTo(saturated, CV_16U);
+        saturated.convertTo(strip, CV_32F);
+    }
+    return true;
+}
+
+bool RFileStackSource::readSpooledRows(int frame, int row0, int nRows, float *dst)
+{
+    int type = spoolTypes[frame];
+    qint64 rowBytes = (qint64) cols * CV_ELEM_SIZE(type);
+
+    QFile file(spoolPaths[frame]);
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(row0 * rowBytes))
+    {
+        return false;
+    }
+
+    cv::Mat dstMat(nRows, cols, CV_32FC(channels), dst);
+    if (CV_MAT_DEPTH(type) == CV_32F)
+    {
+        return file.read((char*) dst, nRows * rowBytes) == nRows * rowBytes;
+    }
+
+    cv::Mat srcMat(nRows, cols, type);
+    if (file.read((char*) srcMat.data, nRows * rowBytes) != nRows * rowBytes)
+    {
+        return false;
+    }
+    srcMat.convertTo(dstMat, CV_32F);
+    return true;
+}
+
+bool RFileStackSource::spoolFrame(int frame)
+{
+    ImageManager imageManager(urls.at(frame), false);
+    if (imageManager.getError() || imageManager.getRMatImage() == NULL)
+    {
+        return false;
+    }
+
+    RMat *rMatImage = imageManager.getRMatImage();
+    cv::Mat mat = rMatImage->matImage;
+    if (mat.depth() != CV_16U && mat.depth() != CV_32F)
+    {
+        mat.convertTo(mat, CV_32F);
+    }
+    if (!mat.isContinuous())
+    {
+        mat = mat.clone();
+    }
+
+    QString spoolPath = spoolDir.filePath(QString("frame_%1.raw").arg(frame, 5, 10, QChar('0')));
+    QFile file(spoolPath);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        return false;
+    }
+
+    qint64 nBytes = (qint64) mat.total() * mat.elemSize();
+    if (file.write((const char*) mat.data, nBytes) != nBytes)
+    {
+        return false;
+    }
+
+    /// The decoded frame is authoritative for the size and the metadata.
+    RFrameMetadata &metadata = metadataList[frame];
+    metadata.naxis1 = mat.cols;
+    metadata.naxis2 = mat.rows;
+    metadata.bayer = rMatImage->isBayer();
+    metadata.instrument = rMatImage->getInstrument();
+    metadata.XPOSURE = rMatImage->getXPOSURE();
+    metadata.TEMP = rMatImage->getTEMP();
+    metadata.valid = true;
+
+    spoolPaths[frame] = spoolPath;
+    spoolTypes[frame] = mat.type();
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef RFILESTACKSOURCE_H
+#define RFILESTACKSOURCE_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+#include <QTemporaryDir>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+#include "rstacker.h"
+#include "rmetadatascanner.h"
+
+/// Frames read from their files, a strip of rows at a time, for stacking series
+/// that do not fit in memory (e.g. hundreds of darks).
+/// FITS strips are read with CFITSIO, which seeks to the rows and applies BZERO/BSCALE. Each FITS file
+/// is opened on its first strip and stays open until the source is destroyed, so its header is parsed once.
+/// Integer data are saturated to [0, 65535] as when MyFitsImage loads them.
+/// Other formats (CR2, TIFF) cannot be read by rows, nor can frames whose instrument profile corrects
+/// the row drift, which is measured over the full frame: each such frame is decoded once, in parallel,
+/// and spooled to a raw file in a temporary directory, from which the strips are then read.
+/// Memory use is then one decoded frame per thread, plus the stacker's strips.
+class RFileStackSource : public RStackSource
+{
+public:
+    RFileStackSource(const QList<QUrl> &urls);
+    ~RFileStackSource();
+
+    /// False if a file could not be read or its size differs from the first one.
+    bool isValid() const;
+
+    int getNFrames() const;
+    int getRows() const;
+    int getCols() const;
+    int getChannels() const;
+    bool readRows(int frame, int row0, int nRows, float *dst);
+
+    /// Header information of a frame (instrument, bayer, exposure, temperature, ...)
+    RFrameMetadata getMetadata(int frame) const;
+
+private:
+
+    bool openFits(int frame);
+    bool readFitsRows(int frame, int row0, int nRows, float *dst);
+    bool readSpooledRows(int frame, int row0, int nRows, float *dst);
+    bool spoolFrame(int frame);
+
+    friend class ParallelSpool;
+
+    QList<QUrl> urls;
+    // Written by the spooling threads, one element each: std::vector rather than implicitly shared QVector.
+    std::vector<RFrameMetadata> metadataList;
+    // For spooled frames: raw file path and OpenCV type. Empty path for FITS frames.
+    std::vector<QString> spoolPaths;
+    std::vector<int> spoolTypes;
+    QTemporaryDir spoolDir;
+    // For FITS frames: CFITSIO handle (fitsfile*, kept opaque so that fitsio.h stays out of this header),
+    // moved to the image HDU, and whether the data are integers to saturate.
+    std::vector<void*> fitsFiles;
+    std::vector<char> fitsSaturate;
+
+    int rows;
+    int cols;
+    int channels;
+    bool valid;
+};
+
+#endif // RFILESTACKSOURCE_H
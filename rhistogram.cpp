@@ -0,0 +1,361 @@
+#include "rhistogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+/// A bin selection: values whose bin over [lo, lo + nBins/scale] is "bin".
+/// Out-of-range values are clamped into the first or last bin, so that the top level takes every value
+/// and floating point noise at the bin edges does not lose any pixel between the levels.
+struct BinLevel
+{
+    double lo;
+    double scale;
+    int nBins;
+    int bin;
+};
+
+static inline int binIndex(float value, double lo, double scale, int nBins)
+{
+    int bin = (int) ((value - lo) * scale);
+    return std::min(std::max(bin, 0), nBins - 1);
+}
+
+static inline bool isSelected(float value, const std::vector<BinLevel> &levels)
+{
+    for (size_t l = 0; l < levels.size(); l++)
+    {
+        if (binIndex(value, levels[l].lo, levels[l].scale, levels[l].nBins) != levels[l].bin)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Number of stripes: one per thread, so there are only a few partial histograms to merge.
+static int histogramStripes()
+{
+    return std::max(1, cv::getNumThreads());
+}
+
+
+class ParallelMoments : public cv::ParallelLoopBody
+{
+public:
+    ParallelMoments(const cv::Mat &mat, std::mutex &mutex, double &minValue, double &maxValue, double &sum, double &sumSq, double &count) :
+        mat(mat), mutex(mutex), minValue(minValue), maxValue(maxValue), sum(sum), sumSq(sumSq), count(count)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        double localMin = std::numeric_limits<double>::max();
+        double localMax = -std::numeric_limits<double>::max();
+        double localSum = 0, localSumSq = 0, localCount = 0;
+        int n = mat.cols;
+        for (int y = range.start; y < range.end; y++)
+        {
+            const float *row = mat.ptr<float>(y);
+            /// Row sums in double keep the accumulated error small on large frames.
+            double rowSum = 0, rowSumSq = 0;
+            int rowCount = 0;
+            for (int x = 0; x < n; x++)
+            {
+                float v = row[x];
+                if (!std::isfinite(v))
+                {
+                    continue;
+                }
+                localMin = std::min(localMin, (double) v);
+                localMax = std::max(localMax, (double) v);
+                rowSum += v;
+                rowSumSq += (double) v * v;
+                rowCount++;
+            }
+            localSum += rowSum;
+            localSumSq += rowSumSq;
+            localCount += rowCount;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        minValue = std::min(minValue, localMin);
+        maxValue = std::max(maxValue, localMax);
+        sum += localSum;
+        sumSq += localSumSq;
+        count += localCount;
+    }
+
+private:
+    const cv::Mat &mat;
+    std::mutex &mutex;
+    double &minValue;
+    double &maxValue;
+    double &sum;
+    double &sumSq;
+    double &count;
+};
+
+
+/// Histogram of the values selected by "levels", binned over [lo, lo + nBins/scale].
+/// With calcHistRange, values outside [lo, hi[ are dropped instead of clamped, as cv::calcHist does.
+class ParallelHistogram : public cv::ParallelLoopBody
+{
+public:
+    ParallelHistogram(const cv::Mat &mat, const std::vector<BinLevel> &levels, double lo, double scale, int nBins,
+                      bool calcHistRange, std::mutex &mutex, std::vector<double> &hist) :
+        mat(mat), levels(levels), lo(lo), scale(scale), nBins(nBins), calcHistRange(calcHistRange), mutex(mutex), hist(hist)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        std::vector<unsigned int> localHist(nBins, 0);
+        int n = mat.cols;
+        for (int y = range.start; y < range.end; y++)
+        {
+            const float *row = mat.ptr<float>(y);
+            for (int x = 0; x < n; x++)
+            {
+                float v = row[x];
+                if (!std::isfinite(v) || !isSelected(v, levels))
+                {
+                    continue;
+                }
+                if (calcHistRange)
+                {
+                    int bin = (int) std::floor((v - lo) * scale);
+                    if (bin >= 0 && bin < nBins)
+                    {
+                        localHist[bin]++;
+                    }
+                }
+                else
+                {
+                    localHist[binIndex(v, lo, scale, nBins)]++;
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int b = 0; b < nBins; b++)
+        {
+            hist[b] += localHist[b];
+        }
+    }
+
+private:
+    const cv::Mat &mat;
+    const std::vector<BinLevel> &levels;
+    double lo;
+    double scale;
+    int nBins;
+    bool calcHistRange;
+    std::mutex &mutex;
+    std::vector<double> &hist;
+};
+
+
+class ParallelGather : public cv::ParallelLoopBody
+{
+public:
+    ParallelGather(const cv::Mat &mat, const std::vector<BinLevel> &levels, std::mutex &mutex, std::vector<float> &values) :
+        mat(mat), levels(levels), mutex(mutex), values(values)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        std::vector<float> localValues;
+        int n = mat.cols;
+        for (int y = range.start; y < range.end; y++)
+        {
+            const float *row = mat.ptr<float>(y);
+            for (int x = 0; x < n; x++)
+            {
+                float v = row[x];
+                if (std::isfinite(v) && isSelected(v, levels))
+                {
+                    localValues.push_back(v);
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        values.insert(values.end(), localValues.begin(), localValues.end());
+    }
+
+private:
+    const cv::Mat &mat;
+    const std::vector<BinLevel> &levels;
+    std::mutex &mutex;
+    std::vector<float> &values;
+};
+
+
+static cv::Mat toFloat(const cv::Mat &mat)
+{
+    CV_Assert(mat.channels() == 1);
+    if (mat.depth() == CV_32F)
+    {
+        return mat;
+    }
+    cv::Mat matFloat;
+    mat.convertTo(matFloat, CV_32F);
+    return matFloat;
+}
+
+static std::vector<double> selectedHistogram(const cv::Mat &mat, const std::vector<BinLevel> &levels, double lo, double scale, int nBins, bool calcHistRange)
+{
+    std::vector<double> hist(nBins, 0.0);
+    std::mutex mutex;
+    cv::parallel_for_(cv::Range(0, mat.rows), ParallelHistogram(mat, levels, lo, scale, nBins, calcHistRange, mutex, hist), histogramStripes());
+    return hist;
+}
+
+
+RHistogram::RHistogram(int nBins) : nBins(std::max(1, nBins))
+{
+
+}
+
+double RHistogram::moments(const cv::Mat &mat, double &minValue, double &maxValue, double &mean, double &stdDev)
+{
+    cv::Mat matFloat = toFloat(mat);
+    std::mutex mutex;
+    double sum = 0, sumSq = 0, count = 0;
+    minValue = std::numeric_limits<double>::max();
+    maxValue = -std::numeric_limits<double>::max();
+    cv::parallel_for_(cv::Range(0, matFloat.rows), ParallelMoments(matFloat, mutex, minValue, maxValue, sum, sumSq, count), histogramStripes());
+
+    if (count == 0)
+    {
+        minValue = maxValue = mean = stdDev = 0;
+        return 0;
+    }
+    mean = sum / count;
+    stdDev = std::sqrt(std::max(0.0, sumSq / count - mean * mean));
+    return count;
+}
+
+cv::Mat RHistogram::compute(const cv::Mat &mat, double minRange, double maxRange) const
+{
+    cv::Mat matHist = cv::Mat::zeros(nBins, 1, CV_32F);
+    if (maxRange <= minRange)
+    {
+        return matHist;
+    }
+
+    cv::Mat matFloat = toFloat(mat);
+    std::vector<BinLevel> noLevels;
+    std::vector<double> hist = selectedHistogram(matFloat, noLevels, minRange, nBins / (maxRange - minRange), nBins, true);
+    for (int b = 0; b < nBins; b++)
+    {
+        matHist.at<float>(b) = (float) hist[b];
+    }
+    return matHist;
+}
+
+std::vector<double> RHistogram::percentiles(const cv::Mat &mat, const std::vector<double> &cutOffs) const
+{
+    double minValue, maxValue, mean, stdDev;
+    double count = moments(mat, minValue, maxValue, mean, stdDev);
+    return percentiles(mat, cutOffs, minValue, maxValue, count);
+}
+
+std::vector<double> RHistogram::percentiles(const cv::Mat &mat, const std::vector<double> &cutOffs,
+                                            double minValue, double maxValue, double count) const
+{
+    /// Bins with more values than this are split again rather than sorted.
+    const double gatherLimit = 1 << 18;
+    const int maxLevels = 6;
+
+    std::vector<double> results(cutOffs.size(), 0.0);
+    cv::Mat matFloat = toFloat(mat);
+
+    if (count == 0 || maxValue <= minValue)
+    {
+        std::fill(results.begin(), results.end(), minValue);
+        return results;
+    }
+
+    /// The top-level histogram is shared by all the percentiles.
+    std::vector<BinLevel> noLevels;
+    double topScale = nBins / (maxValue - minValue);
+    std::vector<double> topHist = selectedHistogram(matFloat, noLevels, minValue, topScale, nBins, false);
+
+    for (size_t c = 0; c < cutOffs.size(); c++)
+    {
+        double rank = std::floor(cutOffs[c] / 100.0 * count);
+        rank = std::min(std::max(rank, 0.0), count - 1);
+
+        std::vector<BinLevel> levels;
+        double lo = minValue;
+        double hi = maxValue;
+        std::vector<double> hist = topHist;
+        double result = lo;
+        bool found = false;
+
+        for (int level = 0; level < maxLevels && !found; level++)
+        {
+            double scale = nBins / (hi - lo);
+            if (level > 0)
+            {
+                hist = selectedHistogram(matFloat, levels, lo, scale, nBins, false);
+            }
+
+            double cumulative = 0;
+            int bin = nBins - 1;
+            for (int b = 0; b < nBins; b++)
+            {
+                if (cumulative + hist[b] > rank)
+                {
+                    bin = b;
+                    break;
+                }
+                cumulative += hist[b];
+            }
+            rank -= cumulative;
+
+            BinLevel binLevel = {lo, scale, nBins, bin};
+            levels.push_back(binLevel);
+
+            double binLo = lo + bin / scale;
+            double binHi = lo + (bin + 1) / scale;
+
+            if (hist[bin] <= gatherLimit || level == maxLevels - 1 || binHi <= binLo)
+            {
+                std::vector<float> values;
+                values.reserve((size_t) hist[bin]);
+                std::mutex mutex;
+                cv::parallel_for_(cv::Range(0, matFloat.rows), ParallelGather(matFloat, levels, mutex, values), histogramStripes());
+                if (!values.empty())
+                {
+                    size_t k = std::min((size_t) rank, values.size() - 1);
+                    std::nth_element(values.begin(), values.begin() + k, values.end());
+                    result = values[k];
+                }
+                else
+                {
+                    result = binLo;
+                }
+                found = true;
+            }
+
+            lo = binLo;
+            hi = binHi;
+        }
+        results[c] = result;
+    }
+
+    return results;
+}
+
+int RHistogram::getNBins() const
+{
+    return nBins;
+}
@@ -0,0 +1,43 @@
+#ifndef RHISTOGRAM_H
+#define RHISTOGRAM_H
+
+#include "winsockwrapper.h"
+
+#include <vector>
+
+//opencv
+#include <opencv2/core.hpp>
+
+/// Histogram and percentiles of single-channel float images with a fixed number of bins,
+/// whatever the data range. Each pass builds per-thread partial histograms that are merged at the end,
+/// so memory does not depend on the image size nor on its dynamic range.
+/// Non-finite values (e.g. NaN blank pixels) are ignored.
+class RHistogram
+{
+public:
+    RHistogram(int nBins = 4096);
+
+    /// Min, max, mean and standard deviation of the finite values, in one parallel pass.
+    /// Returns the number of finite values.
+    static double moments(const cv::Mat &mat, double &minValue, double &maxValue, double &mean, double &stdDev);
+
+    /// Same binning as cv::calcHist with uniform bins over [minRange, maxRange[. CV_32F, nBins x 1.
+    cv::Mat compute(const cv::Mat &mat, double minRange, double maxRange) const;
+
+    /// Exact percentiles (in %), with the same definition as RMat::calcThreshold():
+    /// the smallest value for which more than cutOff % of the pixels are lower or equal.
+    /// A coarse histogram locates the bin of each percentile, then only the values of that bin
+    /// are gathered and partially sorted. Crowded bins are refined with another histogram first.
+    std::vector<double> percentiles(const cv::Mat &mat, const std::vector<double> &cutOffs) const;
+    /// Same, reusing the output of moments() to save a pass.
+    std::vector<double> percentiles(const cv::Mat &mat, const std::vector<double> &cutOffs,
+                                    double minValue, double maxValue, double count) const;
+
+    int getNBins() const;
+
+private:
+
+    int nBins;
+};
+
+#endif // RHISTOGRAM_H
@@ -0,0 +1,157 @@
+#include "rinstrumentprofile.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <iostream>
+
+static QMutex profileMutex;
+static QMap<int, RInstrumentProfile> profiles;
+static bool profilesInitialized = false;
+
+static const char* instrumentNames[] = {"generic", "MAG", "DSLR", "USET", "TIFF"};
+static const int nInstruments = 5;
+
+/// Defaults. USET: bad first row and first column in the files written before the Suncap update.
+static void initializeProfiles()
+{
+    if (profilesInitialized)
+    {
+        return;
+    }
+
+    RInstrumentProfile usetProfile;
+    usetProfile.badTopRows = 1;
+    usetProfile.badLeftCols = 1;
+    profiles.insert((int) instruments::USET, usetProfile);
+
+    profilesInitialized = true;
+}
+
+RInstrumentProfile::RInstrumentProfile() :
+    badTopRows(0), badBottomRows(0), badLeftCols(0), badRightCols(0),
+    driftCols(0), driftFromRight(false), driftSmooth(15)
+{
+
+}
+
+bool RInstrumentProfile::isIdentity() const
+{
+    return badTopRows == 0 && badBottomRows == 0 && badLeftCols == 0 && badRightCols == 0 && driftCols == 0;
+}
+
+bool RInstrumentProfile::apply(cv::Mat &mat, int row0, int frameRows) const
+{
+    if (mat.empty() || isIdentity())
+    {
+        return false;
+    }
+
+    if (frameRows < 0)
+    {
+        frameRows = mat.rows;
+    }
+
+    if (badLeftCols + badRightCols + driftCols >= mat.cols || badTopRows + badBottomRows >= frameRows)
+    {
+        std::cout << "RInstrumentProfile::apply() profile larger than the frame" << std::endl;
+        return false;
+    }
+
+    if (driftCols > 0 && (row0 != 0 || mat.rows != frameRows))
+    {
+        std::cout << "RInstrumentProfile::apply() the row drift needs the full frame, not a strip" << std::endl;
+        return false;
+    }
+
+    /// Bad columns: copy of the nearest good column, all rows at once.
+    for (int x = 0; x < badLeftCols; x++)
+    {
+        mat.col(badLeftCols).copyTo(mat.col(x));
+    }
+    for (int x = mat.cols - badRightCols; x < mat.cols; x++)
+    {
+        mat.col(mat.cols - badRightCols - 1).copyTo(mat.col(x));
+    }
+
+    /// Bad rows, in frame coordinates.
+    int goodTop = badTopRows - row0;
+    for (int y = 0; y < std::min(badTopRows - row0, mat.rows); y++)
+    {
+        if (goodTop < mat.rows)
+        {
+            mat.row(goodTop).copyTo(mat.row(y));
+        }
+    }
+    int goodBottom = frameRows - badBottomRows - 1 - row0;
+    for (int y = std::max(frameRows - badBottomRows - row0, 0); y < mat.rows; y++)
+    {
+        if (goodBottom >= 0)
+        {
+            mat.row(goodBottom).copyTo(mat.row(y));
+        }
+    }
+
+    if (driftCols > 0)
+    {
+        /// Level of each row in the reference columns, relative to their overall level.
+        int x0 = driftFromRight ? mat.cols - badRightCols - driftCols : badLeftCols;
+        cv::Mat reference = mat.colRange(x0, x0 + driftCols);
+        cv::Mat rowLevel;
+        cv::reduce(reference.reshape(1, reference.rows), rowLevel, 1, CV_REDUCE_AVG, CV_32F);
+        if (driftSmooth > 1)
+        {
+            cv::blur(rowLevel, rowLevel, cv::Size(1, driftSmooth), cv::Point(-1, -1), cv::BORDER_REPLICATE);
+        }
+        rowLevel -= cv::mean(rowLevel)[0];
+
+        /// Integer frames are saturated to their range, as with any subtraction.
+        for (int y = 0; y < mat.rows; y++)
+        {
+            cv::Mat row = mat.row(y);
+            cv::subtract(row, cv::Scalar::all(rowLevel.at<float>(y)), row);
+        }
+    }
+
+    return true;
+}
+
+RInstrumentProfile RInstrumentProfile::forInstrument(instruments instrument)
+{
+    QMutexLocker locker(&profileMutex);
+    initializeProfiles();
+    return profiles.value((int) instrument, RInstrumentProfile());
+}
+
+void RInstrumentProfile::setProfile(instruments instrument, const RInstrumentProfile &profile)
+{
+    QMutexLocker locker(&profileMutex);
+    initializeProfiles();
+    profiles.insert((int) instrument, profile);
+}
+
+void RInstrumentProfile::readSettings(QSettings &settings)
+{
+    for (int i = 0; i < nInstruments; i++)
+    {
+        QString group = QString("profile_%1").arg(instrumentNames[i]);
+        if (!settings.childGroups().contains(group))
+        {
+            continue;
+        }
+
+        RInstrumentProfile profile = forInstrument((instruments) i);
+        settings.beginGroup(group);
+        profile.badTopRows = settings.value("badTopRows", profile.badTopRows).toInt();
+        profile.badBottomRows = settings.value("badBottomRows", profile.badBottomRows).toInt();
+        profile.badLeftCols = settings.value("badLeftCols", profile.badLeftCols).toInt();
+        profile.badRightCols = settings.value("badRightCols", profile.badRightCols).toInt();
+        profile.driftCols = settings.value("driftCols", profile.driftCols).toInt();
+        profile.driftFromRight = settings.value("driftFromRight", profile.driftFromRight).toBool();
+        profile.driftSmooth = settings.value("driftSmooth", profile.driftSmooth).toInt();
+        settings.endGroup();
+
+        setProfile((instruments) i, profile);
+        std::cout << "RInstrumentProfile:: " << instrumentNames[i] << " profile from settings" << std::endl;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef RINSTRUMENTPROFILE_H
+#define RINSTRUMENTPROFILE_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include "rmat.h"
+
+/// Detector defects of an instrument, corrected once when a frame is loaded:
+/// - bad edge rows and columns, replaced by the nearest good one
+///   (e.g. the first row and column of the older USET Retiga files);
+/// - row-wise bias drift, measured on a strip of reference (overscan or unexposed) columns,
+///   smoothed over a few rows and removed from each row.
+/// Whole rows and columns are handled by OpenCV's vectorized copies, reductions and subtractions.
+/// One profile per instrument, editable at run time (setProfile) or from an INI file (readSettings).
+class RInstrumentProfile
+{
+public:
+    RInstrumentProfile();
+
+    /// Applies to a full frame, or to a strip of rows [row0, row0 + mat.rows[ of a frame of frameRows rows.
+    /// Edge rows can only be replaced by a good row inside the strip. The row drift is relative to the
+    /// whole frame, so it is only corrected on full frames: strips of a profile with driftCols > 0 are refused.
+    /// Returns true if mat was changed.
+    bool apply(cv::Mat &mat, int row0 = 0, int frameRows = -1) const;
+    bool isIdentity() const;
+
+    static RInstrumentProfile forInstrument(instruments instrument);
+    static void setProfile(instruments instrument, const RInstrumentProfile &profile);
+    /// Groups [profile_generic], [profile_MAG], [profile_DSLR], [profile_USET], [profile_TIFF]
+    /// with the keys below. Missing keys keep the current values.
+    static void readSettings(QSettings &settings);
+
+    int badTopRows;
+    int badBottomRows;
+    int badLeftCols;
+    int badRightCols;
+    /// Number of reference columns for the bias drift, on the left or right edge (after the bad columns).
+    /// 0 disables the drift correction.
+    int driftCols;
+    bool driftFromRight;
+    /// Rows over which the drift estimate is averaged
+    int driftSmooth;
+};
+
+#endif // RINSTRUMENTPROFILE_H
@@ -1,6 +1,8 @@
 #include <QMdiSubWindow>
 #include <QDropEvent>
 #include <QFileDialog>
+#include <QStandardPaths>
+#include <QSettings>
 
 #include "rmainwindow.h"
 #include "ui_rmainwindow.h"
@@ -30,6 +32,15 @@ RMainWindow::RMainWindow(QWidget *parent) :
     this->showMaximized();
     setCentralWidget(ui->mdiArea);
     processing = new RProcessing(this);
+    /// The master library is opt-in, with [masters] useLibrary=true in lightdrops.ini of the application data directory.
+    /// Masters made here are then kept, and picked again for the lights of later sessions.
+    QDir appDataDir(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation));
+    QSettings appSettings(appDataDir.filePath(QString("lightdrops.ini")), QSettings::IniFormat);
+    if (appSettings.value("masters/useLibrary", false).toBool())
+    {
+        processing->setMasterLibraryDir(appSettings.value("masters/library", appDataDir.filePath(QString("masters"))).toString());
+        processing->setUseLibraryFlat(appSettings.value("masters/libraryFlat", false).toBool());
+    }
 
     vertLineHigh = NULL;
     defaultWindowSize = QSize(512, 512);
@@ -362,9 +373,9 @@ void RMainWindow::selectROI(bool isSquare, int blkSize)
 //    /// Use copy constructor of the RMat to copy the current RMat image.
 //    RMat tempRMat(*currentROpenGLWidget->getRMatImageList().at(ui->sliderFrame->value()));
 //    // Setup image display with QImage and not openGL to allow easier drawings
-//    //cv::Mat matImage = processing->normalizeByThresh(tempRMat.matImageGray, tempRMat.getIntensityLow(), tempRMat.getIntensityHigh(), tempRMat.getDataRange());
+//    //cv::Mat matImage = processing->normalizeByThresh(tempRMat.getMatImageGray(), tempRMat.getIntensityLow(), tempRMat.getIntensityHigh(), tempRMat.getDataRange());
 //    cv::Mat matImageROI;// = matImage; //(ROI);
-//    tempRMat.matImageGray.convertTo(matImageROI, CV_8U, 255.0f/tempRMat.getDataMax());
+//    tempRMat.getMatImageGray().convertTo(matImageROI, CV_8U, 255.0f/tempRMat.getDataMax());
 //    QImage imageROI((const uchar *) matImageROI.data, matImageROI.cols, matImageROI.rows, matImageROI.step, QImage::Format_Grayscale8);
 //    QImage targetImage = imageROI.mirrored(false, true);
 //    // Instantiate an RGraphicsScene. It allows to draw rectangles with the mouse for ROI selection
@@ -1641,7 +1652,7 @@ void RMainWindow::minMaxScale()
     ui->limbSliderLow->setValue(sliderValueLow);
 
     processing->showMinMax(currentROpenGLWidget->getRMatImageList().at(ui->sliderFrame->value())->matImage);
-    processing->showMinMax(currentROpenGLWidget->getRMatImageList().at(ui->sliderFrame->value())->matImageGray);
+    processing->showMinMax(currentROpenGLWidget->getRMatImageList().at(ui->sliderFrame->value())->getMatImageGray());
     //showMinMax(currentROpenGLWidget->getRMatImageList().at(ui->sliderFrame->value()));
 }
 
@@ -2076,7 +2087,7 @@ cv::Mat RMainWindow::convertTo8Bit(RMat *rMatImage)
     }
     else
     {
-        matImage = rMatImage->matImageRGB.clone();
+        matImage = rMatImage->getMatImageRGB().clone();
     }
     matImage.convertTo(matImage, CV_8U, fac);
 
@@ -2273,6 +2284,8 @@ void RMainWindow::plotData(QVector<double> data, QString xLabel, QString yLabel)
 
 void RMainWindow::calibrateOffScreenSlot()
 {
+    processing->setStreamCalibration(ui->streamCalibrationCheckBox->isChecked());
+    processing->setParallelCalibration(ui->parallelCalibrationCheckBox->isChecked());
     processing->calibrateOffScreen();
     autoScale();
 }
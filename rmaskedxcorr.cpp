@@ -0,0 +1,183 @@
+#include "rmaskedxcorr.h"
+
+#include <algorithm>
+#include <cmath>
+
+/// Smallest overlap of the masks at a shift, as a fraction of the valid pixels of the reference ROI
+static const double minOverlapFraction = 0.5;
+/// Variance of an overlap below this fraction of its sum of squares: flat, or rounding noise of the DFTs
+static const double varianceEps = 1e-10;
+
+/// CV_64F copy of the part of mat inside rect, 0 outside mat
+static cv::Mat extractWindow(const cv::Mat &mat, cv::Rect rect)
+{
+    cv::Mat window = cv::Mat::zeros(rect.size(), CV_64F);
+    cv::Rect inside = rect & cv::Rect(0, 0, mat.cols, mat.rows);
+    if (inside.area() > 0)
+    {
+        cv::Mat windowInside = window(inside - rect.tl());
+        mat(inside).convertTo(windowInside, CV_64F);
+    }
+    return window;
+}
+
+/// Offset of the vertex of the parabola through 3 samples, within half a pixel of the middle one
+static double parabolaVertex(double previous, double middle, double next)
+{
+    double curvature = previous - 2.0 * middle + next;
+    if (curvature >= 0)
+    {
+        return 0;
+    }
+    return std::max(-0.5, std::min(0.5, 0.5 * (previous - next) / curvature));
+}
+
+RMaskedXCorr::RMaskedXCorr(const cv::Mat &refMat, const cv::Mat &mask, cv::Rect fov, int maxLength) :
+    fov(fov & cv::Rect(0, 0, refMat.cols, refMat.rows)), radius(std::max(1, maxLength / 2)), minOverlapPixels(0)
+{
+    if (this->fov.area() == 0)
+    {
+        return;
+    }
+    window = cv::Rect(this->fov.x - radius, this->fov.y - radius, this->fov.width + 2 * radius, this->fov.height + 2 * radius);
+    dftSize = cv::Size(cv::getOptimalDFTSize(window.width), cv::getOptimalDFTSize(window.height));
+
+    cv::Mat validMask;
+    if (mask.empty())
+    {
+        validMask = cv::Mat::ones(refMat.size(), CV_8U);
+    }
+    else
+    {
+        validMask = (mask != 0) / 255;
+    }
+    maskWindow = extractWindow(validMask, window);
+
+    /// Reference ROI, masked, minus its mean for the accuracy of the sums of squares.
+    /// The coefficients use the means of each overlap, so they do not depend on this offset.
+    cv::Mat maskRef = maskWindow(cv::Rect(radius, radius, this->fov.width, this->fov.height)).clone();
+    cv::Mat ref = extractWindow(refMat, this->fov);
+    double nRef = cv::sum(maskRef)[0];
+    double meanRef = nRef > 0 ? cv::sum(ref.mul(maskRef))[0] / nRef : 0;
+    cv::Mat refM = (ref - meanRef).mul(maskRef);
+    minOverlapPixels = std::max(1.0, minOverlapFraction * nRef);
+
+    specMaskRef = spectrum(maskRef);
+    specRef = spectrum(refM);
+    specRef2 = spectrum(refM.mul(refM));
+
+    cv::Mat specMaskWindow = spectrum(maskWindow);
+    overlap = correlate(specMaskRef, specMaskWindow);
+    sumRef = correlate(specRef, specMaskWindow);
+    sumRef2 = correlate(specRef2, specMaskWindow);
+}
+
+cv::Point2f RMaskedXCorr::shift(const cv::Mat &matImage, double *peak, cv::Mat *nccMap) const
+{
+    int n = 2 * radius + 1;
+    cv::Mat ncc(n, n, CV_64F, cv::Scalar::all(-1));
+    if (peak != NULL)
+    {
+        *peak = -1;
+    }
+    if (nccMap != NULL)
+    {
+        *nccMap = ncc;
+    }
+
+    if (fov.area() == 0)
+    {
+        return cv::Point2f(0, 0);
+    }
+    cv::Mat frame = extractWindow(matImage, window);
+    double nFrame = cv::sum(maskWindow)[0];
+    if (nFrame <= 0)
+    {
+        return cv::Point2f(0, 0);
+    }
+    double meanFrame = cv::sum(frame.mul(maskWindow))[0] / nFrame;
+    cv::Mat frameM = (frame - meanFrame).mul(maskWindow);
+
+    cv::Mat specFrame = spectrum(frameM);
+    cv::Mat sumFrame = correlate(specMaskRef, specFrame);
+    cv::Mat sumFrame2 = correlate(specMaskRef, spectrum(frameM.mul(frameM)));
+    cv::Mat sumCross = correlate(specRef, specFrame);
+
+    double best = -1;
+    cv::Point bestLoc(-1, -1);
+    for (int y = 0; y < n; y++)
+    {
+        const double *nRow = overlap.ptr<double>(y);
+        const double *fRow = sumRef.ptr<double>(y);
+        const double *ffRow = sumRef2.ptr<double>(y);
+        const double *gRow = sumFrame.ptr<double>(y);
+        const double *ggRow = sumFrame2.ptr<double>(y);
+        const double *fgRow = sumCross.ptr<double>(y);
+        double *nccRow = ncc.ptr<double>(y);
+
+        for (int x = 0; x < n; x++)
+        {
+            double nOverlap = nRow[x];
+            if (nOverlap < minOverlapPixels)
+            {
+                continue;
+            }
+            double varRef = ffRow[x] - fRow[x] * fRow[x] / nOverlap;
+            double varFrame = ggRow[x] - gRow[x] * gRow[x] / nOverlap;
+            if (!(varRef > varianceEps * ffRow[x]) || !(varFrame > varianceEps * ggRow[x]))
+            {
+                continue;
+            }
+            nccRow[x] = (fgRow[x] - fRow[x] * gRow[x] / nOverlap) / std::sqrt(varRef * varFrame);
+            if (nccRow[x] > best || bestLoc.x < 0)
+            {
+                best = nccRow[x];
+                bestLoc = cv::Point(x, y);
+            }
+        }
+    }
+
+    if (bestLoc.x < 0)
+    {
+        return cv::Point2f(0, 0);
+    }
+
+    /// Sub-pixel peak, on each axis, where both neighbours are valid
+    double dx = 0, dy = 0;
+    if (bestLoc.x > 0 && bestLoc.x < n - 1
+            && ncc.at<double>(bestLoc.y, bestLoc.x - 1) > -1 && ncc.at<double>(bestLoc.y, bestLoc.x + 1) > -1)
+    {
+        dx = parabolaVertex(ncc.at<double>(bestLoc.y, bestLoc.x - 1), best, ncc.at<double>(bestLoc.y, bestLoc.x + 1));
+    }
+    if (bestLoc.y > 0 && bestLoc.y < n - 1
+            && ncc.at<double>(bestLoc.y - 1, bestLoc.x) > -1 && ncc.at<double>(bestLoc.y + 1, bestLoc.x) > -1)
+    {
+        dy = parabolaVertex(ncc.at<double>(bestLoc.y - 1, bestLoc.x), best, ncc.at<double>(bestLoc.y + 1, bestLoc.x));
+    }
+
+    if (peak != NULL)
+    {
+        *peak = best;
+    }
+
+    return cv::Point2f((float) (bestLoc.x - radius + dx), (float) (bestLoc.y - radius + dy));
+}
+
+cv::Mat RMaskedXCorr::correlate(const cv::Mat &specA, const cv::Mat &specB) const
+{
+    /// B * conj(A) is the spectrum of sum_x a(x) b(x + d). With the template at the origin of the window,
+    /// d = 0 to 2 * radius covers the shifts -radius to radius, without wrapping around.
+    cv::Mat product, correlation;
+    cv::mulSpectrums(specB, specA, product, 0, true);
+    cv::dft(product, correlation, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+    return correlation(cv::Rect(0, 0, 2 * radius + 1, 2 * radius + 1));
+}
+
+cv::Mat RMaskedXCorr::spectrum(const cv::Mat &mat) const
+{
+    cv::Mat padded = cv::Mat::zeros(dftSize, CV_64F);
+    mat.copyTo(padded(cv::Rect(0, 0, mat.cols, mat.rows)));
+    cv::Mat spec;
+    cv::dft(padded, spec, 0, mat.rows);
+    return spec;
+}
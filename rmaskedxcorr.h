@@ -0,0 +1,51 @@
+#ifndef RMASKEDXCORR_H
+#define RMASKEDXCORR_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+/// Masked normalized cross-correlation of a reference ROI against frames, for all the integer shifts
+/// within +/- maxLength / 2 at once, in the Fourier domain (Padfield, "Masked object registration in the
+/// Fourier domain", 2012). At each shift, the correlation coefficient is taken only over the pixels valid in
+/// both masks, with the means and variances of that overlap. The peak is refined to sub-pixel by a parabola
+/// through its neighbours on each axis.
+/// The correlations of the reference and of the mask do not depend on the frame: they are computed once
+/// here, and each frame costs 2 forward and 3 inverse DFTs.
+class RMaskedXCorr
+{
+public:
+    /// refMat and mask: full frames. mask is CV_8U, non-zero where pixels are valid (e.g. circleMask());
+    /// empty: all valid. The frames are masked with the same mask.
+    RMaskedXCorr(const cv::Mat &refMat, const cv::Mat &mask, cv::Rect fov, int maxLength);
+
+    /// Shift d for which matImage(x + d) best matches refMat(x) over the fov. This is the shift given
+    /// to shiftToWarp(). (0, 0) with a peak of -1 if no shift has enough valid overlap.
+    /// nccMap: correlation coefficients of all shifts, 2 * (maxLength / 2) + 1 on each side, centred on shift 0,
+    /// -1 where the overlap is too small.
+    cv::Point2f shift(const cv::Mat &matImage, double *peak = NULL, cv::Mat *nccMap = NULL) const;
+
+private:
+
+    /// Correlation of a (template side) with b (window side) over the valid shifts, from their spectra
+    cv::Mat correlate(const cv::Mat &specA, const cv::Mat &specB) const;
+    /// Zero-padded spectrum of a mat of the size of the window or smaller
+    cv::Mat spectrum(const cv::Mat &mat) const;
+
+    cv::Rect fov;
+    int radius;
+    /// fov grown by radius on each side, in frame coordinates. Pixels outside the frame are masked.
+    cv::Rect window;
+    cv::Mat maskWindow;
+    cv::Size dftSize;
+
+    /// Spectra of the reference mask, of the masked reference and its square
+    cv::Mat specMaskRef, specRef, specRef2;
+    /// Overlap, sum and sum of squares of the reference over the overlap, at each shift
+    cv::Mat overlap, sumRef, sumRef2;
+    double minOverlapPixels;
+};
+
+#endif // RMASKEDXCORR_H
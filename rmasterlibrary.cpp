@@ -0,0 +1,375 @@
+#include "rmasterlibrary.h"
+
+#include <QCryptographicHash>
+
+#include <cmath>
+#include <iostream>
+
+/// TEMP of frames without a temperature reading (see RMat).
+static const float unknownTEMP = -100;
+
+static QString typeName(masterTypes type)
+{
+    switch (type)
+    {
+    case masterTypes::bias:
+        return QString("bias");
+    case masterTypes::dark:
+        return QString("dark");
+    default:
+        return QString("flat");
+    }
+}
+
+RMasterEntry::RMasterEntry() :
+    type(masterTypes::bias), instrument(instruments::generic), bayer(false), flipUD(false),
+    rows(0), cols(0), channels(1), XPOSURE(0), TEMP(unknownTEMP), nFrames(0)
+{
+
+}
+
+RMasterLibrary::RMasterLibrary(const QString &dirPath) :
+    dir(dirPath), valid(false), XPOSURETolerance(0.01f), TEMPTolerance(1.0f), darkDoublingTemp(6.0f)
+{
+    if (!dir.exists() && !QDir().mkpath(dirPath))
+    {
+        std::cout << "RMasterLibrary:: could not create " << dirPath.toStdString() << std::endl;
+        return;
+    }
+
+    valid = loadIndex();
+}
+
+RMasterLibrary::~RMasterLibrary()
+{
+    /// Unmapped when the files are closed.
+    qDeleteAll(mappedFiles);
+}
+
+bool RMasterLibrary::isValid() const
+{
+    return valid;
+}
+
+QString RMasterLibrary::getPath() const
+{
+    return dir.absolutePath();
+}
+
+QList<RMasterEntry> RMasterLibrary::getEntries() const
+{
+    QMutexLocker locker(&mutex);
+    return entries;
+}
+
+bool RMasterLibrary::loadIndex()
+{
+    QSettings settings(dir.filePath(QString("library.ini")), QSettings::IniFormat);
+    if (settings.status() != QSettings::NoError)
+    {
+        return false;
+    }
+
+    int size = settings.beginReadArray("masters");
+    for (int i = 0; i < size; i++)
+    {
+        settings.setArrayIndex(i);
+        RMasterEntry entry;
+        entry.type = (masterTypes) settings.value("type").toInt();
+        entry.instrument = (instruments) settings.value("instrument").toInt();
+        entry.bayer = settings.value("bayer").toBool();
+        entry.flipUD = settings.value("flipUD").toBool();
+        entry.rows = settings.value("rows").toInt();
+        entry.cols = settings.value("cols").toInt();
+        entry.channels = settings.value("channels", 1).toInt();
+        entry.XPOSURE = settings.value("XPOSURE").toFloat();
+        entry.TEMP = settings.value("TEMP", unknownTEMP).toFloat();
+        entry.nFrames = settings.value("nFrames").toInt();
+        entry.fileName = settings.value("file").toString();
+        entry.created = settings.value("created").toDateTime();
+        entry.checksum = settings.value("checksum").toString();
+
+        /// Files removed by hand are forgotten.
+        if (QFileInfo(dir.filePath(entry.fileName)).exists())
+        {
+            entries << entry;
+        }
+    }
+    settings.endArray();
+
+    std::cout << "RMasterLibrary:: " << entries.size() << " masters in " << dir.absolutePath().toStdString() << std::endl;
+    return true;
+}
+
+bool RMasterLibrary::saveIndex()
+{
+    QSettings settings(dir.filePath(QString("library.ini")), QSettings::IniFormat);
+    settings.remove("masters");
+    settings.beginWriteArray("masters", entries.size());
+    for (int i = 0; i < entries.size(); i++)
+    {
+        const RMasterEntry &entry = entries.at(i);
+        settings.setArrayIndex(i);
+        settings.setValue("type", (int) entry.type);
+        settings.setValue("instrument", (int) entry.instrument);
+        settings.setValue("bayer", entry.bayer);
+        settings.setValue("flipUD", entry.flipUD);
+        settings.setValue("rows", entry.rows);
+        settings.setValue("cols", entry.cols);
+        settings.setValue("channels", entry.channels);
+        settings.setValue("XPOSURE", entry.XPOSURE);
+        settings.setValue("TEMP", entry.TEMP);
+        settings.setValue("nFrames", entry.nFrames);
+        settings.setValue("file", entry.fileName);
+        settings.setValue("created", entry.created);
+        settings.setValue("checksum", entry.checksum);
+    }
+    settings.endArray();
+    settings.sync();
+
+    return settings.status() == QSettings::NoError;
+}
+
+bool RMasterLibrary::addMaster(masterTypes type, RMat *rMatMaster, int nFrames)
+{
+    if (!valid || rMatMaster == NULL || rMatMaster->matImage.empty())
+    {
+        return false;
+    }
+
+    cv::Mat mat;
+    rMatMaster->matImage.convertTo(mat, CV_32F);
+    if (!mat.isContinuous())
+    {
+        mat = mat.clone();
+    }
+
+    /// The same master made again (e.g. the same bias files in another session) is not stored twice.
+    qint64 nBytes = (qint64) mat.total() * mat.elemSize();
+    QString checksum = QString(QCryptographicHash::hash(QByteArray::fromRawData((const char*) mat.data, nBytes),
+                                                        QCryptographicHash::Md5).toHex());
+    {
+        QMutexLocker locker(&mutex);
+        for (int i = 0; i < entries.size(); i++)
+        {
+            if (entries.at(i).type == type && entries.at(i).checksum == checksum)
+            {
+                std::cout << "RMasterLibrary:: master " << typeName(type).toStdString() << " already in the library: "
+                          << entries.at(i).fileName.toStdString() << std::endl;
+                return true;
+            }
+        }
+    }
+
+    RMasterEntry entry;
+    entry.type = type;
+    entry.instrument = rMatMaster->getInstrument();
+    entry.bayer = rMatMaster->isBayer();
+    entry.flipUD = rMatMaster->flipUD;
+    entry.rows = mat.rows;
+    entry.cols = mat.cols;
+    entry.channels = mat.channels();
+    entry.XPOSURE = rMatMaster->getXPOSURE();
+    entry.TEMP = rMatMaster->getTEMP();
+    entry.nFrames = nFrames;
+    entry.created = QDateTime::currentDateTime();
+    entry.checksum = checksum;
+    entry.fileName = QString("%1_%2.f32").arg(typeName(type)).arg(entry.created.toString("yyyyMMdd_hhmmss_zzz"));
+
+    QFile file(dir.filePath(entry.fileName));
+    if (!file.open(QIODevice::WriteOnly) || file.write((const char*) mat.data, nBytes) != nBytes)
+    {
+        std::cout << "RMasterLibrary::addMaster() could not write " << file.fileName().toStdString() << std::endl;
+        return false;
+    }
+    file.close();
+
+    QMutexLocker locker(&mutex);
+    entries << entry;
+    std::cout << "RMasterLibrary:: added master " << typeName(type).toStdString()
+              << " XPOSURE = " << entry.XPOSURE << " TEMP = " << entry.TEMP << std::endl;
+    return saveIndex();
+}
+
+bool RMasterLibrary::matches(const RMasterEntry &entry, masterTypes type, const RFrameMetadata &lightMetadata) const
+{
+    if (entry.type != type || entry.instrument != lightMetadata.instrument)
+    {
+        return false;
+    }
+    if (lightMetadata.naxis1 > 0 && lightMetadata.naxis2 > 0
+            && (entry.cols != lightMetadata.naxis1 || entry.rows != lightMetadata.naxis2))
+    {
+        return false;
+    }
+    return true;
+}
+
+int RMasterLibrary::findNearest(masterTypes type, const RFrameMetadata &lightMetadata, bool useXPOSURE, bool useTEMP) const
+{
+    int best = -1;
+    double bestCost = 0;
+    for (int i = 0; i < entries.size(); i++)
+    {
+        const RMasterEntry &entry = entries.at(i);
+        if (!matches(entry, type, lightMetadata))
+        {
+            continue;
+        }
+
+        /// In stops of thermal signal: twice the exposure or darkDoublingTemp degrees more cost 1.
+        double cost = 0;
+        if (useXPOSURE && entry.XPOSURE > 0 && lightMetadata.XPOSURE > 0)
+        {
+            cost += std::fabs(std::log2(lightMetadata.XPOSURE / entry.XPOSURE));
+        }
+        if (useTEMP && entry.TEMP > unknownTEMP && lightMetadata.TEMP > unknownTEMP)
+        {
+            cost += std::fabs(lightMetadata.TEMP - entry.TEMP) / darkDoublingTemp;
+        }
+
+        /// The most recent of equally good masters
+        if (best < 0 || cost < bestCost || (cost == bestCost && entry.created > entries.at(best).created))
+        {
+            best = i;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+cv::Mat RMasterLibrary::mapEntry(const RMasterEntry &entry)
+{
+    /// Each file is mapped once, for the lifetime of the library.
+    if (mappedMats.contains(entry.fileName))
+    {
+        return mappedMats.value(entry.fileName);
+    }
+
+    QFile *file = new QFile(dir.filePath(entry.fileName));
+    qint64 nBytes = (qint64) entry.rows * entry.cols * entry.channels * sizeof(float);
+    if (!file->open(QIODevice::ReadOnly) || file->size() != nBytes)
+    {
+        std::cout << "RMasterLibrary:: cannot map " << entry.fileName.toStdString() << std::endl;
+        delete file;
+        return cv::Mat();
+    }
+
+    uchar *data = file->map(0, nBytes, QFileDevice::MapPrivateOption);
+    if (data == NULL)
+    {
+        delete file;
+        return cv::Mat();
+    }
+
+    cv::Mat mat(entry.rows, entry.cols, CV_32FC(entry.channels), data);
+    mappedFiles.insert(entry.fileName, file);
+    mappedMats.insert(entry.fileName, mat);
+    return mat;
+}
+
+RMat* RMasterLibrary::entryToRMat(const RMasterEntry &entry, cv::Mat mat) const
+{
+    RMat *rMatMaster = RMat::adopt(mat, entry.bayer, entry.instrument, entry.XPOSURE, entry.TEMP);
+    rMatMaster->flipUD = entry.flipUD;
+    rMatMaster->setImageTitle(QString("master %1 (library: %2)").arg(typeName(entry.type)).arg(entry.fileName));
+    return rMatMaster;
+}
+
+RMat* RMasterLibrary::findBias(const RFrameMetadata &lightMetadata)
+{
+    QMutexLocker locker(&mutex);
+    int i = findNearest(masterTypes::bias, lightMetadata, false, true);
+    if (i < 0)
+    {
+        return NULL;
+    }
+
+    cv::Mat mat = mapEntry(entries.at(i));
+    return mat.empty() ? NULL : entryToRMat(entries.at(i), mat);
+}
+
+RMat* RMasterLibrary::findDark(const RFrameMetadata &lightMetadata)
+{
+    QMutexLocker locker(&mutex);
+    int i = findNearest(masterTypes::dark, lightMetadata, true, true);
+    if (i < 0)
+    {
+        return NULL;
+    }
+
+    const RMasterEntry &entry = entries.at(i);
+    cv::Mat mat = mapEntry(entry);
+    if (mat.empty())
+    {
+        return NULL;
+    }
+
+    float xposureRatio = 1.0f;
+    if (entry.XPOSURE > 0 && lightMetadata.XPOSURE > 0
+            && std::fabs(lightMetadata.XPOSURE - entry.XPOSURE) > XPOSURETolerance * entry.XPOSURE)
+    {
+        xposureRatio = lightMetadata.XPOSURE / entry.XPOSURE;
+    }
+
+    float tempDelta = 0;
+    if (entry.TEMP > unknownTEMP && lightMetadata.TEMP > unknownTEMP
+            && std::fabs(lightMetadata.TEMP - entry.TEMP) > TEMPTolerance)
+    {
+        tempDelta = lightMetadata.TEMP - entry.TEMP;
+    }
+
+    if (xposureRatio == 1.0f && tempDelta == 0)
+    {
+        return entryToRMat(entry, mat);
+    }
+
+    int j = findNearest(masterTypes::bias, lightMetadata, false, true);
+    cv::Mat biasMat = (j < 0) ? cv::Mat() : mapEntry(entries.at(j));
+    if (biasMat.empty() || biasMat.size() != mat.size() || biasMat.type() != mat.type())
+    {
+        std::cout << "RMasterLibrary:: no bias to scale the dark, using the nearest one as it is" << std::endl;
+        return entryToRMat(entry, mat);
+    }
+
+    /// dark = bias + (dark - bias) * scale, in a new buffer.
+    float scale = xposureRatio * std::pow(2.0f, tempDelta / darkDoublingTemp);
+    cv::Mat scaledMat;
+    cv::addWeighted(mat, scale, biasMat, 1.0 - scale, 0.0, scaledMat);
+    std::cout << "RMasterLibrary:: dark XPOSURE = " << entry.XPOSURE << " TEMP = " << entry.TEMP
+              << " scaled by " << scale << " for XPOSURE = " << lightMetadata.XPOSURE << " TEMP = " << lightMetadata.TEMP << std::endl;
+
+    RMat *rMatDark = entryToRMat(entry, scaledMat);
+    rMatDark->setXPOSURE(lightMetadata.XPOSURE);
+    rMatDark->setTEMP(lightMetadata.TEMP);
+    rMatDark->setImageTitle(QString("master dark (library: %1, scaled)").arg(entry.fileName));
+    return rMatDark;
+}
+
+RMat* RMasterLibrary::findFlat(const RFrameMetadata &lightMetadata)
+{
+    QMutexLocker locker(&mutex);
+    int i = findNearest(masterTypes::flat, lightMetadata, false, false);
+    if (i < 0)
+    {
+        return NULL;
+    }
+
+    cv::Mat mat = mapEntry(entries.at(i));
+    return mat.empty() ? NULL : entryToRMat(entries.at(i), mat);
+}
+
+void RMasterLibrary::setXPOSURETolerance(float relTolerance)
+{
+    this->XPOSURETolerance = relTolerance;
+}
+
+void RMasterLibrary::setTEMPTolerance(float tolerance)
+{
+    this->TEMPTolerance = tolerance;
+}
+
+void RMasterLibrary::setDarkDoublingTemp(float doublingTemp)
+{
+    this->darkDoublingTemp = doublingTemp;
+}
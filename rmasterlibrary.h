@@ -0,0 +1,95 @@
+#ifndef RMASTERLIBRARY_H
+#define RMASTERLIBRARY_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include "rmat.h"
+#include "rmetadatascanner.h"
+
+enum class masterTypes {bias, dark, flat};
+
+/// One master of the library, as recorded in its index.
+struct RMasterEntry
+{
+    RMasterEntry();
+
+    masterTypes type;
+    instruments instrument;
+    bool bayer;
+    bool flipUD;
+    int rows;
+    int cols;
+    int channels;
+    float XPOSURE;
+    float TEMP;
+    int nFrames;
+    QString fileName;
+    QDateTime created;
+    /// MD5 of the stored pixels, to skip a master identical to one already stored
+    QString checksum;
+};
+
+/// Persistent library of master frames, reused from one session to the next.
+/// Masters are stored as raw float files (flats already bias-subtracted), with an index
+/// (library.ini) recording type, instrument, size, exposure and sensor temperature.
+/// They are memory-mapped when used, so the same master costs no reading and no decoding
+/// in later calibrations, and its pages are shared with the file cache.
+/// The mappings are private (copy-on-write): a master changed in memory never alters the file.
+/// RMats returned by the find functions share the mappings: they must not outlive the library,
+/// and are not meant to be changed in place.
+class RMasterLibrary
+{
+public:
+    RMasterLibrary(const QString &dirPath);
+    ~RMasterLibrary();
+
+    /// False if the directory cannot be created or its index cannot be read.
+    bool isValid() const;
+    QString getPath() const;
+    QList<RMasterEntry> getEntries() const;
+
+    /// Stores a CV_32F copy of the master, unless one of the same type has the same pixels.
+    bool addMaster(masterTypes type, RMat *rMatMaster, int nFrames);
+
+    /// Masters for a light frame with this instrument, size, exposure and temperature.
+    /// A size of 0 (unknown from the header) matches any size. NULL if none fits.
+    RMat* findBias(const RFrameMetadata &lightMetadata);
+    /// Nearest dark in exposure and temperature. If it is not within the tolerances and a bias
+    /// is available, its thermal signal (dark - bias) is scaled linearly with the exposure
+    /// and doubles every darkDoublingTemp degrees.
+    RMat* findDark(const RFrameMetadata &lightMetadata);
+    /// Most recent flat.
+    RMat* findFlat(const RFrameMetadata &lightMetadata);
+
+    void setXPOSURETolerance(float relTolerance);
+    void setTEMPTolerance(float tolerance);
+    void setDarkDoublingTemp(float doublingTemp);
+
+private:
+
+    bool loadIndex();
+    bool saveIndex();
+    /// Index of the best entry, or -1. The cost is the log2 of the dark scaling factor.
+    int findNearest(masterTypes type, const RFrameMetadata &lightMetadata, bool useXPOSURE, bool useTEMP) const;
+    bool matches(const RMasterEntry &entry, masterTypes type, const RFrameMetadata &lightMetadata) const;
+    cv::Mat mapEntry(const RMasterEntry &entry);
+    RMat* entryToRMat(const RMasterEntry &entry, cv::Mat mat) const;
+
+    QDir dir;
+    bool valid;
+    QList<RMasterEntry> entries;
+    // Open files of the mapped masters and their mappings, by file name
+    QMap<QString, QFile*> mappedFiles;
+    QMap<QString, cv::Mat> mappedMats;
+    mutable QMutex mutex;
+
+    float XPOSURETolerance;
+    float TEMPTolerance;
+    float darkDoublingTemp;
+};
+
+#endif // RMASTERLIBRARY_H
@@ -1,6 +1,162 @@
 #include "rmat.h"
 #include <qdebug.h>
 #include <iostream>
+#include <limits>
+
+#include "rhistogram.h"
+#include "rcfa.h"
+#include <vector>
+#include <cmath>
+
+static std::atomic<unsigned long long> nPixelCopies(0);
+static std::atomic<unsigned long long> nPixelCopyBytes(0);
+static std::atomic<unsigned long long> nAdoptions(0);
+static std::atomic<unsigned long long> nextRevision(1);
+
+static std::atomic<bool> fastStats(true);
+static std::atomic<int> statsStride(1);
+static std::atomic<int> floatHistBins(4096);
+
+/// Frame quality terms of one row, from its neighbours above and below:
+/// |Laplacian-like mask [1 -2 1; -2 4 -2; 1 -2 1]| for the noise (Immerkaer's estimator, blind to smooth signal),
+/// |central gradient| along x and y for the sharpness, as in the lucky imaging gradient metric.
+template <typename T>
+static inline void qualityRow(const T *above, const T *row, const T *below, int cols, double &noiseSum, double &gradientSum)
+{
+    float rowNoise = 0, rowGradient = 0;
+    for (int x = 1; x < cols - 1; x++)
+    {
+        float a = (float) above[x - 1] - 2.0f * above[x] + above[x + 1];
+        float r = (float) row[x - 1] - 2.0f * row[x] + row[x + 1];
+        float b = (float) below[x - 1] - 2.0f * below[x] + below[x + 1];
+        rowNoise += std::abs(a - 2.0f * r + b);
+        rowGradient += 0.5f * (std::abs((float) row[x + 1] - row[x - 1]) + std::abs((float) below[x] - above[x]));
+    }
+    noiseSum += rowNoise;
+    gradientSum += rowGradient;
+}
+
+/// Noise sigma and mean gradient from the sums of qualityRow() over nRows rows.
+static void qualityFromSums(double noiseSum, double gradientSum, int nRows, int cols, float &noise, float &sharpness)
+{
+    double nSamples = (double) nRows * std::max(cols - 2, 0);
+    if (nSamples <= 0)
+    {
+        noise = 0;
+        sharpness = 0;
+        return;
+    }
+    noise = (float) (std::sqrt(CV_PI / 2.0) * noiseSum / (6.0 * nSamples));
+    sharpness = (float) (gradientSum / nSamples);
+}
+
+/// Quality terms on their own, for the float and other types. Every stride-th row.
+template <typename T>
+static void frameQuality(const cv::Mat &mat, int stride, float &noise, float &sharpness)
+{
+    double noiseSum = 0, gradientSum = 0;
+    int nRows = 0;
+    for (int y = 1; y < mat.rows - 1; y += std::max(stride, 1))
+    {
+        qualityRow<T>(mat.ptr<T>(y - 1), mat.ptr<T>(y), mat.ptr<T>(y + 1), mat.cols, noiseSum, gradientSum);
+        nRows++;
+    }
+    qualityFromSums(noiseSum, gradientSum, nRows, mat.cols, noise, sharpness);
+}
+
+/// Single pass over an 8 or 16-bit gray image. With stride 1, only the full-resolution integer histogram
+/// is built and min, max, mean and variance are all derived from it exactly.
+/// With a larger stride, min, max and the moments still see every pixel,
+/// but only every stride-th row and column enters the histogram (used for the percentiles).
+/// The frame quality terms (noise, sharpness) are taken in the same pass, on the rows of the histogram,
+/// while they are in cache.
+template <typename T>
+static void integerStats(const cv::Mat &mat, int stride, std::vector<unsigned int> &hist,
+                         double &minValue, double &maxValue, double &meanValue, double &stdDevValue, double &nSampled,
+                         float &noise, float &sharpness)
+{
+    hist.assign((size_t) std::numeric_limits<T>::max() + 1, 0);
+    unsigned long long nPixels = (unsigned long long) mat.total();
+    double noiseSum = 0, gradientSum = 0;
+    int nQualityRows = 0;
+
+    if (stride <= 1)
+    {
+        for (int y = 0; y < mat.rows; y++)
+        {
+            const T *row = mat.ptr<T>(y);
+            for (int x = 0; x < mat.cols; x++)
+            {
+                hist[row[x]]++;
+            }
+            if (y > 0 && y < mat.rows - 1)
+            {
+                qualityRow<T>(mat.ptr<T>(y - 1), row, mat.ptr<T>(y + 1), mat.cols, noiseSum, gradientSum);
+                nQualityRows++;
+            }
+        }
+        qualityFromSums(noiseSum, gradientSum, nQualityRows, mat.cols, noise, sharpness);
+
+        unsigned long long sum = 0, sumSq = 0;
+        int first = -1, last = -1;
+        for (size_t v = 0; v < hist.size(); v++)
+        {
+            if (hist[v] == 0)
+            {
+                continue;
+            }
+            if (first < 0) { first = (int) v; }
+            last = (int) v;
+            sum += (unsigned long long) hist[v] * v;
+            sumSq += (unsigned long long) hist[v] * v * v;
+        }
+        minValue = first;
+        maxValue = last;
+        meanValue = (double) sum / (double) nPixels;
+        stdDevValue = std::sqrt(std::max(0.0, (double) sumSq / (double) nPixels - meanValue * meanValue));
+        nSampled = (double) nPixels;
+        return;
+    }
+
+    T minT = std::numeric_limits<T>::max();
+    T maxT = 0;
+    unsigned long long sum = 0, sumSq = 0, sampled = 0;
+    for (int y = 0; y < mat.rows; y++)
+    {
+        const T *row = mat.ptr<T>(y);
+        unsigned long long rowSum = 0, rowSumSq = 0;
+        for (int x = 0; x < mat.cols; x++)
+        {
+            T v = row[x];
+            minT = std::min(minT, v);
+            maxT = std::max(maxT, v);
+            rowSum += v;
+            rowSumSq += (unsigned long long) v * v;
+        }
+        sum += rowSum;
+        sumSq += rowSumSq;
+
+        if (y % stride == 0)
+        {
+            for (int x = 0; x < mat.cols; x += stride)
+            {
+                hist[row[x]]++;
+                sampled++;
+            }
+            if (y > 0 && y < mat.rows - 1)
+            {
+                qualityRow<T>(mat.ptr<T>(y - 1), row, mat.ptr<T>(y + 1), mat.cols, noiseSum, gradientSum);
+                nQualityRows++;
+            }
+        }
+    }
+    qualityFromSums(noiseSum, gradientSum, nQualityRows, mat.cols, noise, sharpness);
+    minValue = minT;
+    maxValue = maxT;
+    meanValue = (double) sum / (double) nPixels;
+    stdDevValue = std::sqrt(std::max(0.0, (double) sumSq / (double) nPixels - meanValue * meanValue));
+    nSampled = (double) sampled;
+}
 
 RMat::RMat()
 {
@@ -12,13 +168,18 @@ RMat::RMat()
     this->imageTitle = QString("");
     this->instrument = instruments::generic;
     this->flipUD = false;
+    this->item = NULL;
+    this->planesValid = false;
+    this->planesData = NULL;
+    this->statsValid = false;
+    this->revision = nextRevision++;
 
 }
 
 RMat::RMat(cv::Mat mat)
 {
     initialize();
-    mat.copyTo(this->matImage);
+    copyPixels(mat);
     prepImages();
 }
 
@@ -27,7 +188,7 @@ RMat::RMat(const RMat &rMat)
        SOLAR_R(rMat.SOLAR_R), wbRed(rMat.wbRed), wbGreen(rMat.wbGreen), wbBlue(rMat.wbBlue), instrument(rMat.instrument), imageTitle(QString("")),
        item(NULL)
 {
-    rMat.matImage.copyTo(this->matImage);
+    copyPixels(rMat.matImage);
     prepImages();
 }
 
@@ -36,7 +197,7 @@ RMat::RMat(cv::Mat mat, RMat *rMat) : flipUD(rMat->flipUD), bayer(rMat->bayer),
     instrument(rMat->instrument), imageTitle(rMat->imageTitle),
     item(NULL)
 {
-    mat.copyTo(this->matImage);
+    copyPixels(mat);
     prepImages();
 }
 
@@ -44,7 +205,7 @@ RMat::RMat(cv::Mat mat, bool bayer) : flipUD(false), bayer(bayer), bscale(1), bz
     SOLAR_R(0), wbRed(1.0), wbGreen(1.0), wbBlue(1.0), instrument(instruments::generic), imageTitle(QString("")),
     item(NULL)
 {
-    mat.copyTo(this->matImage);
+    copyPixels(mat);
     prepImages();
 }
 
@@ -52,7 +213,7 @@ RMat::RMat(cv::Mat mat, bool bayer, instruments instrument) : flipUD(false), bay
     expTime(0), XPOSURE(0), TEMP(-100), SOLAR_R(0), wbRed(1.0), wbGreen(1.0), wbBlue(1.0), instrument(instrument), imageTitle(QString("")),
     item(NULL)
 {
-    mat.copyTo(this->matImage);
+    copyPixels(mat);
     prepImages();
 }
 
@@ -60,7 +221,7 @@ RMat::RMat(cv::Mat mat, bool bayer, instruments instrument, float XPOSURE, float
     XPOSURE(XPOSURE), TEMP(TEMP), SOLAR_R(0), wbRed(1.0), wbGreen(1.0), wbBlue(1.0), instrument(instrument), imageTitle(QString("")),
     item(NULL)
 {
-    mat.copyTo(this->matImage);
+    copyPixels(mat);
     prepImages();
 }
 
@@ -76,6 +237,79 @@ RMat::~RMat()
     //    }
 }
 
+RMat* RMat::adopt(cv::Mat mat, bool bayer, instruments instrument, float XPOSURE, float TEMP)
+{
+    RMat *rMat = new RMat();
+    rMat->initialize();
+    rMat->bayer = bayer;
+    rMat->instrument = instrument;
+    rMat->expTime = 0;
+    rMat->XPOSURE = XPOSURE;
+    rMat->TEMP = TEMP;
+    rMat->matImage = mat;
+    rMat->prepImages();
+    nAdoptions++;
+    return rMat;
+}
+
+RMat* RMat::cloneMetadata(cv::Mat mat) const
+{
+    RMat *rMat = new RMat();
+    rMat->bayer = bayer;
+    rMat->bscale = bscale;
+    rMat->bzero = bzero;
+    rMat->dataMin = dataMin;
+    rMat->dataMax = dataMax;
+    rMat->expTime = expTime;
+    rMat->XPOSURE = XPOSURE;
+    rMat->TEMP = TEMP;
+    rMat->SOLAR_R = SOLAR_R;
+    rMat->wbRed = wbRed;
+    rMat->wbGreen = wbGreen;
+    rMat->wbBlue = wbBlue;
+    rMat->instrument = instrument;
+    rMat->imageTitle = imageTitle;
+    rMat->fileInfo = fileInfo;
+    rMat->url = url;
+    rMat->date_obs = date_obs;
+    rMat->time_obs = time_obs;
+    rMat->date_time = date_time;
+    rMat->flipUD = flipUD;
+    rMat->matImage = mat;
+    rMat->prepImages();
+    nAdoptions++;
+    return rMat;
+}
+
+void RMat::copyPixels(const cv::Mat &mat)
+{
+    mat.copyTo(this->matImage);
+    nPixelCopies++;
+    nPixelCopyBytes += (unsigned long long) mat.total() * mat.elemSize();
+}
+
+unsigned long long RMat::getPixelCopies()
+{
+    return nPixelCopies;
+}
+
+unsigned long long RMat::getPixelCopyBytes()
+{
+    return nPixelCopyBytes;
+}
+
+unsigned long long RMat::getAdoptions()
+{
+    return nAdoptions;
+}
+
+void RMat::resetCounters()
+{
+    nPixelCopies = 0;
+    nPixelCopyBytes = 0;
+    nAdoptions = 0;
+}
+
 void RMat::initialize()
 {
     bayer = false;
@@ -99,50 +333,117 @@ void RMat::initialize()
 
 void RMat::prepImages()
 {
-    std::cout << "RMat::PrepImages()" << std::endl;
+    /// Nothing is derived here anymore: the gray and RGB planes and the statistics
+    /// are built on first use (see buildPlanes() and computeStats()), so an intermediate RMat
+    /// that is never displayed costs only its own buffer.
+    planesValid = false;
+    planesData = NULL;
+    statsValid = false;
+    revision = nextRevision++;
+    matImageGray.release();
+    matImageRGB.release();
 
-    if (matImage.channels() == 1)
-    {
-        if (bayer)
-        {
-            std::cout << "RMat::PrepImages() Image is bayer. Converting..." << std::endl;
+    normalizeFloatRange();
+}
 
-            matImage.convertTo(matImageRGB, CV_16U);
-            cv::cvtColor(matImageRGB, matImageRGB, CV_BayerBG2RGB);
-            cv::cvtColor(matImageRGB, matImageGray, CV_RGB2GRAY);
-        }
-        else
-        {
-            std::cout << "RMat::PrepImages() Image is not bayer. Gray image is assigned to the original array" << std::endl;
+unsigned long long RMat::getRevision() const
+{
+    return revision;
+}
 
-            matImageGray = matImage;
-            cv::cvtColor(matImage, matImageRGB, CV_GRAY2RGB);
-        }
+void RMat::buildPlanes() const
+{
+    if (planesValid && planesData == matImage.data)
+    {
+        return;
+    }
+
+    if (matImage.empty())
+    {
+        matImageGray = cv::Mat();
+        matImageRGB = cv::Mat();
+    }
+    else if (matImage.channels() == 1)
+    {
+        /// Statistics and registration only need a gray plane: for a Bayer mosaic, a luminance taken
+        /// straight from it, otherwise the original array. The RGB plane is left to getMatImageRGB(),
+        /// i.e. to display and export.
+        matImageGray = bayer ? RCfa::luminance(matImage) : matImage;
+        matImageRGB.release();
     }
     else // Assumes 3 channels?
     {
         if (instrument != instruments::TIFF)
         {
-            std::cout << "RMat::PrepImages() Image is not TIFF" << std::endl;
-
             cv::cvtColor(matImage, matImageGray, CV_RGB2GRAY);
             matImageRGB = matImage;
         }
         else
         {
-            std::cout << "RMat::PrepImages() Image is TIFF" << std::endl;
-
             cv::cvtColor(matImage, matImageGray, CV_BGR2GRAY);
             cv::cvtColor(matImage, matImageRGB, CV_BGR2RGB);
         }
+    }
+
+    planesData = matImage.data;
+    planesValid = true;
+}
+
+cv::Mat RMat::getMatImageGray() const
+{
+    buildPlanes();
+    return matImageGray;
+}
+
+cv::Mat RMat::getMatImageRGB() const
+{
+    buildPlanes();
+    if (matImageRGB.empty() && matImage.channels() == 1 && !matImage.empty())
+    {
+        if (bayer)
+        {
+            std::cout << "RMat::getMatImageRGB() Image is bayer. Converting..." << std::endl;
+            matImage.convertTo(matImageRGB, CV_16U);
+            cv::cvtColor(matImageRGB, matImageRGB, CV_BayerBG2RGB);
+        }
+        else
+        {
+            cv::cvtColor(matImage, matImageRGB, CV_GRAY2RGB);
+        }
+    }
+    return matImageRGB;
+}
 
+void RMat::normalizeFloatRange()
+{
+    /// Floating point images normalized within [0, 1] get their positive integral values
+    /// restored over 16 bit. This used to happen in calcStats() on the gray image,
+    /// but it changes matImage, so it must not wait until someone asks for statistics.
+    int matType = matImage.type();
+    if (matImage.empty() || (matType != CV_32F && matType != CV_32FC3))
+    {
+        return;
     }
 
+    double minValue, maxValue;
+    cv::minMaxLoc(matImage.reshape(1), &minValue, &maxValue);
+    if (minValue >= 0 && maxValue <= 1)
+    {
+        matImage = matImage * 65535.0f;
+        planesValid = false;
+        statsValid = false;
+    }
+}
 
-    calcStats();
+void RMat::ensureStats() const
+{
+    if (!statsValid || !planesValid || planesData != matImage.data)
+    {
+        computeStats();
+    }
 }
 
-void RMat::computeHist(int nBins, float minRange, float maxRange)
+void RMat::computeHist(int nBins, float minRange, float maxRange) const
 {
     float range[2];
     range[0] = minRange;
@@ -159,17 +460,67 @@ void RMat::computeHist(int nBins, float minRange, float maxRange)
     }
     else
     {
-        cv::calcHist( &matImageGray, 1, 0, cv::Mat(), matHist, 1, &nBins, &histRange, uniform, accumulate);   
+        cv::Mat matGray = getMatImageGray();
+        cv::calcHist( &matGray, 1, 0, cv::Mat(), matHist, 1, &nBins, &histRange, uniform, accumulate);
     }
 
 }
 
 void RMat::calcStats()
 {
-    qDebug("RMat::calcStats()");
+    normalizeFloatRange();
+    computeStats();
+}
 
-    // Calculate min and max from matImageGray
-    calcMinMax();
+void RMat::computeStats() const
+{
+    qDebug("RMat::computeStats()");
+
+    if (matImage.empty())
+    {
+        return;
+    }
+    /// Set first: the getters used below must not recurse into here.
+    statsValid = true;
+
+    cv::Mat matGray = getMatImageGray();
+    /// 8 and 16-bit data get everything from one pass and an integer histogram.
+    /// Float data get a bounded histogram and exact percentiles from RHistogram.
+    /// Other types go through minMaxLoc, meanStdDev and calcHist.
+    bool useIntegerStats = fastStats && matGray.channels() == 1 && (matGray.depth() == CV_16U || matGray.depth() == CV_8U);
+    bool useFloatStats = fastStats && matGray.channels() == 1 && matGray.depth() == CV_32F;
+    std::vector<unsigned int> intHist;
+    if (useIntegerStats)
+    {
+        double meanValue, stdDevValue;
+        if (matGray.depth() == CV_16U)
+        {
+            integerStats<ushort>(matGray, statsStride, intHist, dataMin, dataMax, meanValue, stdDevValue, histTotal, noise, sharpness);
+        }
+        else
+        {
+            integerStats<uchar>(matGray, statsStride, intHist, dataMin, dataMax, meanValue, stdDevValue, histTotal, noise, sharpness);
+        }
+        mean = (float) meanValue;
+        stdDev = (float) stdDevValue;
+    }
+    else if (useFloatStats)
+    {
+        double meanValue, stdDevValue;
+        histTotal = RHistogram::moments(matGray, dataMin, dataMax, meanValue, stdDevValue);
+        mean = (float) meanValue;
+        stdDev = (float) stdDevValue;
+        frameQuality<float>(matGray, statsStride, noise, sharpness);
+    }
+    else
+    {
+        // Calculate min and max from matImageGray
+        calcMinMax();
+        cv::Mat matGray32;
+        cv::extractChannel(matGray, matGray32, 0);
+        matGray32.convertTo(matGray32, CV_32F);
+        frameQuality<float>(matGray32, statsStride, noise, sharpness);
+    }
     qDebug("RMat::calcStats():: [dataMin , dataMax] = [%f , %f]", (float) dataMin, (float) dataMax);
 
 
@@ -200,12 +551,7 @@ void RMat::calcStats()
     }
     else if (matType == CV_32F || matType == CV_32FC3)
     {
-        if (dataMin >= 0 && dataMax <= 1)
-        {
-            // Image is considered normalized. Restore positive integral values ranging over 16 bit
-            matImage = matImage * 65535.0f;
-            calcMinMax();
-        }
+        /// Normalized images were already restored to 16 bit by normalizeFloatRange().
         dataRange = (float) (dataMax - dataMin);
         /// For normalization / contrast stretching
         /// we assume that no CCD will go beyond 16 bits
@@ -224,11 +570,14 @@ void RMat::calcStats()
         maxHistRange = (float) dataMax;
     }
 
-    cv::Scalar meanScalar;
-    cv::Scalar stdDevScalar;
-    cv::meanStdDev(matImageGray, meanScalar, stdDevScalar);
-    mean = (float) meanScalar.val[0];
-    stdDev = (float) stdDevScalar.val[0];
+    if (!useIntegerStats && !useFloatStats)
+    {
+        cv::Scalar meanScalar;
+        cv::Scalar stdDevScalar;
+        cv::meanStdDev(matGray, meanScalar, stdDevScalar);
+        mean = (float) meanScalar.val[0];
+        stdDev = (float) stdDevScalar.val[0];
+    }
     nPixels = (uint) matImage.cols * matImage.rows;
 
 
@@ -236,15 +585,29 @@ void RMat::calcStats()
     minHistRange = std::min(0.0f, (float) dataMin) ;
     // Get histogram
     int nBins = (int) dataRange;
+    if (useFloatStats)
+    {
+        /// The range of float data can be anything: keep a fixed bin budget.
+        nBins = std::min(std::max(nBins, 1), (int) floatHistBins);
+    }
     histWidth = (maxHistRange - minHistRange)/(double) (nBins);
     std::cout << "Calculating histogram..." << std::endl;
     std::cout << "minHistRange = " << minHistRange << std::endl;
     std::cout << "maxHistRange = " << maxHistRange << std::endl;
-    computeHist(nBins, minHistRange, maxHistRange);
-
-   // Calculate median
-    median = calcMedian(histWidth, minHistRange);
-    std::cout << "Median = " << median << std::endl;
+    if (useIntegerStats)
+    {
+        binIntegerHist(intHist, nBins);
+    }
+    else if (useFloatStats)
+    {
+        RHistogram histogram(nBins);
+        matHist = histogram.compute(matGray, minHistRange, maxHistRange);
+    }
+    else
+    {
+        computeHist(nBins, minHistRange, maxHistRange);
+        histTotal = nPixels;
+    }
 
     /// Define percentiles for the low and high thresholds
     /// i.e, pertcentage of pixels below the lowest intensity
@@ -264,8 +627,26 @@ void RMat::calcStats()
         cutOffHigh = 99.85f;
     }
 
-    intensityLow = calcThreshold(cutOffLow, histWidth, minHistRange);
-    intensityHigh = calcThreshold(cutOffHigh, histWidth, minHistRange);
+    if (useFloatStats)
+    {
+        /// Exact values rather than bin edges: the bins can be wide here.
+        std::vector<double> cutOffs;
+        cutOffs.push_back(50.0);
+        cutOffs.push_back(cutOffLow);
+        cutOffs.push_back(cutOffHigh);
+        std::vector<double> values = RHistogram(floatHistBins).percentiles(matGray, cutOffs, dataMin, dataMax, histTotal);
+        median = (float) values[0];
+        intensityLow = (float) values[1];
+        intensityHigh = (float) values[2];
+    }
+    else
+    {
+        // Calculate median
+        median = calcMedian(histWidth, minHistRange);
+        intensityLow = calcThreshold(cutOffLow, histWidth, minHistRange);
+        intensityHigh = calcThreshold(cutOffHigh, histWidth, minHistRange);
+    }
+    std::cout << "Median = " << median << std::endl;
 
     if (intensityLow == intensityHigh)
     {
@@ -273,20 +654,56 @@ void RMat::calcStats()
     }
 }
 
-void RMat::calcMinMax()
+void RMat::binIntegerHist(const std::vector<unsigned int> &intHist, int nBins) const
 {
-    if (matImageGray.empty())
+    /// Same binning as cv::calcHist over [minHistRange, maxHistRange[ in computeHist().
+    matHist = cv::Mat::zeros(nBins, 1, CV_32F);
+    if (nBins <= 0 || histWidth <= 0)
     {
-        matImageGray = matImage;
+        return;
+    }
+
+    float *histPtr = matHist.ptr<float>(0);
+    int vMin = std::max(0, (int) std::ceil(minHistRange));
+    int vMax = std::min((int) intHist.size(), (int) std::ceil(maxHistRange));
+    for (int v = vMin; v < vMax; v++)
+    {
+        if (intHist[v] == 0)
+        {
+            continue;
+        }
+        int bin = (int) ((v - minHistRange) / histWidth);
+        if (bin >= 0 && bin < nBins)
+        {
+            histPtr[bin] += (float) intHist[v];
+        }
     }
+}
+
+void RMat::setFastStats(bool status)
+{
+    fastStats = status;
+}
+
+void RMat::setStatsStride(int stride)
+{
+    statsStride = std::max(1, stride);
+}
 
-    cv::minMaxLoc(matImageGray, &dataMin, &dataMax);
+void RMat::setFloatHistBins(int nBins)
+{
+    floatHistBins = std::max(1, nBins);
+}
+
+void RMat::calcMinMax() const
+{
+    cv::minMaxLoc(getMatImageGray(), &dataMin, &dataMax);
 }
 
 cv::Mat RMat::extractChannel(unsigned int channel)
 {
     cv::Mat planesRGB[3];
-    cv::split(matImageRGB, planesRGB);
+    cv::split(getMatImageRGB(), planesRGB);
     cv::Mat matPlane = planesRGB[channel];
 
     return matPlane;
@@ -294,7 +711,7 @@ cv::Mat RMat::extractChannel(unsigned int channel)
 
 
 
-float RMat::calcMedian(double histWidth, float minRange)
+float RMat::calcMedian(double histWidth, float minRange) const
 {
 //    std::cout << "Calculating median..." << std::endl;
 //    float cdf = 0;
@@ -319,7 +736,7 @@ float RMat::calcMedian(double histWidth, float minRange)
     return median;
 }
 
-float RMat::calcThreshold(float cutOff, double histWidth, float minRange)
+float RMat::calcThreshold(float cutOff, double histWidth, float minRange) const
 {
     float cdf = 0.0f;
     bool checkThreshold = false;
@@ -329,7 +746,7 @@ float RMat::calcThreshold(float cutOff, double histWidth, float minRange)
     int i = 0;
     while (i < nBins && checkThreshold == false){
         cdf += matHist.at<float>(i);
-        checkThreshold = (100.0f * cdf/nPixels > cutOff);
+        checkThreshold = (100.0f * cdf/histTotal > cutOff);
         if (checkThreshold) { index = i;}
         i++;
     }
@@ -366,11 +783,13 @@ int RMat::getBzero() const
 
 double RMat::getDataMin() const
 {
+    ensureStats();
     return dataMin;
 }
 
 double RMat::getDataMax() const
 {
+    ensureStats();
     return dataMax;
 }
 
@@ -421,61 +840,85 @@ QString RMat::getImageTitle() const
 
 cv::Mat RMat::getMatHist() const
 {
+    ensureStats();
     return matHist;
 }
 
 float RMat::getMean() const
 {
+    ensureStats();
     return mean;
 }
 
 float RMat::getStdDev() const
 {
+    ensureStats();
     return stdDev;
 }
 
+float RMat::getNoise() const
+{
+    ensureStats();
+    return noise;
+}
+
+float RMat::getSharpness() const
+{
+    ensureStats();
+    return sharpness;
+}
+
 float RMat::getMedian() const
 {
+    ensureStats();
     return median;
 }
 
 float RMat::getIntensityLow() const
 {
+    ensureStats();
     return intensityLow;
 }
 
 float RMat::getIntensityHigh() const
 {
+    ensureStats();
     return intensityHigh;
 }
 
 double RMat::getHistWidth() const
 {
+    ensureStats();
     return histWidth;
 }
 
 uint RMat::getNPixels() const
 {
+    ensureStats();
     return nPixels;
 }
 
 float RMat::getMinHistRange() const
 {
+    ensureStats();
     return minHistRange;
 }
 
 float RMat::getMaxHistRange() const
 {
+    ensureStats();
     return maxHistRange;
 }
 
 float RMat::getDataRange() const
 {
+    ensureStats();
     return dataRange;
 }
 
 float RMat::getNormalizeRange() const
 {
+    ensureStats();
     return normalizeRange;
 }
 
@@ -515,6 +958,8 @@ QUrl RMat::getUrl() const
 void RMat::setBayer(bool bayer)
 {
     this->bayer = bayer;
+    planesValid = false;
+    statsValid = false;
 }
 
 void RMat::setBscale(float bscale)
@@ -529,11 +974,13 @@ void RMat::setBzero(int bzero)
 
 void RMat::setDataMin(float dataMin)
 {
+    ensureStats();
     this->dataMin = dataMin;
 }
 
 void RMat::setDataMax(float dataMax)
 {
+    ensureStats();
     this->dataMax = dataMax;
 }
 
@@ -580,6 +1027,9 @@ void RMat::setImageTitle(QString title)
 void RMat::setInstrument(instruments instrument)
 {
     this->instrument = instrument;
+    /// Planes (TIFF is BGR) and histogram ranges depend on the instrument.
+    planesValid = false;
+    statsValid = false;
 }
 
 void RMat::setItem(QTreeWidgetItem *item)
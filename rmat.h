@@ -11,6 +11,9 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <atomic>
+#include <vector>
+
 //using namespace cv;
 
 
@@ -28,19 +31,49 @@ public:
     RMat(cv::Mat mat, bool bayer, instruments instrument, float XPOSURE, float TEMP);
     ~RMat();
 
+    /// Takes mat as the image buffer without copying it. Use it for a mat that was just computed
+    /// and will not be written to by the caller anymore, e.g. the output of a warp or a calibration.
+    static RMat* adopt(cv::Mat mat, bool bayer, instruments instrument = instruments::generic, float XPOSURE = 0, float TEMP = -100);
+    /// New RMat with all the metadata of this one (not the tree item), adopting mat as its image buffer.
+    RMat* cloneMetadata(cv::Mat mat) const;
+
+    /// Counters of image buffer copies made by the constructors, and of adopted buffers.
+    /// Used to check how many full-frame allocations a processing step costs.
+    static unsigned long long getPixelCopies();
+    static unsigned long long getPixelCopyBytes();
+    static unsigned long long getAdoptions();
+    static void resetCounters();
+
+    /// Statistics engine settings, for all RMats.
+    /// Fast stats: one pass and an integer histogram for 8 and 16-bit images (exact with stride 1).
+    /// Stride > 1 subsamples rows and columns for the histogram, hence for median and percentile thresholds only.
+    static void setFastStats(bool status);
+    static void setStatsStride(int stride);
+    /// Histogram size for float images, whatever their range.
+    static void setFloatHistBins(int nBins);
+
     cv::Mat matImage;
-    cv::Mat matImageGray;
-    cv::Mat matImageRGB;
+
+    /// Derived planes, computed from matImage on first use and cached.
+    /// They are rebuilt if matImage is reassigned, or after prepImages().
+    /// For a Bayer image, the gray plane is the luminance of the mosaic (see RCfa). The RGB plane
+    /// of a single-channel image is only built by getMatImageRGB(), which demosaics Bayer images.
+    cv::Mat getMatImageGray() const;
+    cv::Mat getMatImageRGB() const;
 
     void initialize();
+    /// To call after matImage is modified in place: derived planes and statistics are recomputed on next use.
     void prepImages();
+    /// Unique among all RMats and renewed by prepImages(): with matImage.data, identifies the pixels
+    /// for data derived from this RMat and cached elsewhere (see RPyramidCache).
+    unsigned long long getRevision() const;
     // Methods for getting some statistics
-    void computeHist(int nBins, float minRange, float maxRange);
-    float calcMedian(double histWidth, float minRange);
-    float calcThreshold(float cutOff, double histWidth, float minRange);
+    void computeHist(int nBins, float minRange, float maxRange) const;
+    float calcMedian(double histWidth, float minRange) const;
+    float calcThreshold(float cutOff, double histWidth, float minRange) const;
 
     void calcStats();
-    void calcMinMax();
+    void calcMinMax() const;
 
     // Extract channels
     cv::Mat extractChannel(unsigned int channel);
@@ -69,6 +102,10 @@ public:
     float getMean() const;
     float getStdDev() const;
     float getMedian() const;
+    /// Standard deviation of the pixel noise, from the gray image, insensitive to the smooth signal
+    float getNoise() const;
+    /// Mean gradient magnitude of the gray image: larger for sharper frames of a same target
+    float getSharpness() const;
     float getIntensityLow() const;
     float getIntensityHigh() const;
     double getHistWidth() const;
@@ -110,11 +147,26 @@ public:
 
 private:
 
+   void copyPixels(const cv::Mat &mat);
+   void buildPlanes() const;
+   void normalizeFloatRange();
+   void computeStats() const;
+   void binIntegerHist(const std::vector<unsigned int> &intHist, int nBins) const;
+   void ensureStats() const;
+
+   // Lazily derived planes. planesData is matImage.data when they were built.
+   mutable cv::Mat matImageGray;
+   mutable cv::Mat matImageRGB;
+   mutable bool planesValid;
+   mutable const uchar *planesData;
+   mutable bool statsValid;
+   unsigned long long revision;
+
    bool bayer;
    float bscale;
    int bzero;
-   double dataMin;
-   double dataMax;
+   mutable double dataMin;
+   mutable double dataMax;
    float expTime;
    float XPOSURE;
    float TEMP;
@@ -132,19 +184,23 @@ private:
    QString date_time;
 
    // Image statistics
-   cv::Mat matHist;
-   float mean;
-   float stdDev;
-   float median;
-   float intensityLow, intensityHigh;
-   double histWidth;
-   float minHistRange;
-   float maxHistRange;
-   uint nPixels;
-   float dataRange;
+   mutable cv::Mat matHist;
+   mutable float mean;
+   mutable float stdDev;
+   mutable float median;
+   mutable float noise;
+   mutable float sharpness;
+   mutable float intensityLow, intensityHigh;
+   mutable double histWidth;
+   mutable float minHistRange;
+   mutable float maxHistRange;
+   mutable uint nPixels;
+   // Number of pixels that went into matHist, for the percentiles.
+   mutable double histTotal;
+   mutable float dataRange;
 
    // Normalization range
-   float normalizeRange;
+   mutable float normalizeRange;
 
    // for QTreeWidget
    QTreeWidgetItem* item;
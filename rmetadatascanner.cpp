@@ -0,0 +1,297 @@
+#include "rmetadatascanner.h"
+
+#include <fitsio.h>
+#include <exiv2/exiv2.hpp>
+
+#include <iostream>
+#include <algorithm>
+
+#include "MyFitsImage.h"
+
+RFrameMetadata::RFrameMetadata() :
+    instrument(instruments::generic), bayer(false), flipUD(false), naxis1(0), naxis2(0),
+    EXPTIME(0), XPOSURE(0), TEMP(-100), SOLAR_R(0), valid(false)
+{
+
+}
+
+
+class ParallelMetadataScan : public cv::ParallelLoopBody
+{
+public:
+    ParallelMetadataScan(const QList<QUrl> &urls, QVector<RFrameMetadata> &metadataList) :
+        urls(urls), metadataList(metadataList)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        for (int i = range.start; i < range.end; i++)
+        {
+            metadataList[i] = RMetadataScanner::scanFile(urls.at(i));
+        }
+    }
+
+private:
+    const QList<QUrl> &urls;
+    QVector<RFrameMetadata> &metadataList;
+};
+
+
+RFrameMetadata RMetadataScanner::scanFile(const QUrl &url)
+{
+    RFrameMetadata metadata;
+    metadata.url = url;
+
+    QString filePath = url.toLocalFile();
+    QFileInfo fileInfo(filePath);
+    metadata.fileName = fileInfo.fileName();
+    QString fileExt = fileInfo.suffix().toLower();
+
+    if (fileExt == QString("fits") || fileExt == QString("fts") || fileExt == QString("fit"))
+    {
+        scanFits(filePath, metadata);
+    }
+    else if (fileExt == QString("cr2"))
+    {
+        scanRaw(filePath, metadata);
+    }
+    else if (fileExt == QString("tiff"))
+    {
+        scanTiff(filePath, metadata);
+    }
+
+    return metadata;
+}
+
+QVector<RFrameMetadata> RMetadataScanner::scanUrls(const QList<QUrl> &urls)
+{
+    QVector<RFrameMetadata> metadataList(urls.size());
+    /// Headers are small: this is mostly waiting on the file system, so more threads than cores is fine.
+    cv::parallel_for_(cv::Range(0, urls.size()), ParallelMetadataScan(urls, metadataList));
+    return metadataList;
+}
+
+QVector<RFrameMetadata> RMetadataScanner::scanDirectory(const QString &dirPath, bool recursive)
+{
+    QStringList nameFilters;
+    nameFilters << "*.fits" << "*.fts" << "*.fit" << "*.cr2" << "*.CR2" << "*.FITS" << "*.FTS" << "*.FIT"
+                << "*.tiff" << "*.TIFF";
+
+    QList<QUrl> urls;
+    QDirIterator it(dirPath, nameFilters, QDir::Files, recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags);
+    while (it.hasNext())
+    {
+        urls << QUrl::fromLocalFile(it.next());
+    }
+    /// QDirIterator gives no guaranteed order.
+    std::sort(urls.begin(), urls.end(), [](const QUrl &a, const QUrl &b) { return a.toLocalFile() < b.toLocalFile(); });
+
+    return scanUrls(urls);
+}
+
+bool RMetadataScanner::exportTable(const QVector<RFrameMetadata> &metadataList, const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        std::cout << "RMetadataScanner::exportTable() could not open " << filePath.toStdString() << std::endl;
+        return false;
+    }
+
+    QTextStream out(&file);
+    out << "FILE,INSTRUMENT,BAYER,NAXIS1,NAXIS2,EXPTIME,XPOSURE,TEMP,SOLAR_R,DATE-OBS,TIME\n";
+    for (int i = 0; i < metadataList.size(); i++)
+    {
+        const RFrameMetadata &m = metadataList.at(i);
+        if (!m.valid)
+        {
+            continue;
+        }
+        out << m.url.toLocalFile() << "," << (int) m.instrument << "," << (int) m.bayer << ","
+            << m.naxis1 << "," << m.naxis2 << "," << m.EXPTIME << "," << m.XPOSURE << "," << m.TEMP << ","
+            << m.SOLAR_R << "," << m.date_obs << "," << m.time_obs << "\n";
+    }
+
+    return true;
+}
+
+void RMetadataScanner::scanFits(const QString &filePath, RFrameMetadata &metadata)
+{
+    QMutexLocker cfitsioLocker(MyFitsImage::cfitsioMutex());
+
+    fitsfile *fptr;
+    int status = 0;
+    std::string filePathStr(filePath.toStdString());
+
+    if (fits_open_file(&fptr, filePathStr.c_str(), READONLY, &status))
+    {
+        std::cout << "RMetadataScanner:: Error opening FITS file " << filePathStr << std::endl;
+        return;
+    }
+
+    /// Same HDU selection as MyFitsImage: compressed images live in the 2nd HDU.
+    int nhdus = 0;
+    int hduType = 0;
+    fits_get_num_hdus(fptr, &nhdus, &status);
+    if (nhdus > 1)
+    {
+        fits_movabs_hdu(fptr, 2, &hduType, &status);
+    }
+    if (status)
+    {
+        fits_close_file(fptr, &status);
+        return;
+    }
+
+    char keyString[FLEN_VALUE];
+    if (fits_read_key(fptr, TSTRING, "ZCMPTYPE", keyString, NULL, &status))
+    {
+        status = 0;
+        fits_read_key(fptr, TINT, "NAXIS1", &metadata.naxis1, NULL, &status); status = 0;
+        fits_read_key(fptr, TINT, "NAXIS2", &metadata.naxis2, NULL, &status); status = 0;
+    }
+    else
+    {
+        fits_read_key(fptr, TINT, "ZNAXIS1", &metadata.naxis1, NULL, &status); status = 0;
+        fits_read_key(fptr, TINT, "ZNAXIS2", &metadata.naxis2, NULL, &status); status = 0;
+    }
+
+    int bayer = 0;
+    if (fits_read_key(fptr, TLOGICAL, "BAYER", &bayer, NULL, &status) == 0) { metadata.bayer = bayer; }
+    status = 0;
+    if (fits_read_key(fptr, TFLOAT, "EXPTIME", &metadata.EXPTIME, NULL, &status)) { status = 0; }
+    if (fits_read_key(fptr, TFLOAT, "XPOSURE", &metadata.XPOSURE, NULL, &status)) { status = 0; }
+    if (fits_read_key(fptr, TFLOAT, "TEMP", &metadata.TEMP, NULL, &status)) { status = 0; }
+    if (fits_read_key(fptr, TFLOAT, "SOLAR_R", &metadata.SOLAR_R, NULL, &status)) { status = 0; }
+
+    char dateObs[FLEN_VALUE];
+    char timeObs[FLEN_VALUE];
+    if (fits_read_key(fptr, TSTRING, "DATE-OBS", dateObs, NULL, &status) == 0) { metadata.date_obs = QString(dateObs).simplified(); }
+    status = 0;
+    if (fits_read_key(fptr, TSTRING, "TIME", timeObs, NULL, &status) == 0) { metadata.time_obs = QString(timeObs).simplified(); }
+    status = 0;
+
+    /// Instrument detection follows ImageManager::loadFits(), which looks for the values anywhere in the header.
+    /// MAG is detected from the data range there, which we cannot do here.
+    int nKeys = 0, moreKeys = 0;
+    char keyword[FLEN_KEYWORD], keyValue[FLEN_VALUE], comment[FLEN_COMMENT];
+    fits_get_hdrspace(fptr, &nKeys, &moreKeys, &status);
+    bool isUset = false, isDslr = false, hasFlipUD = false, flipUD = false;
+    for (int ii = 1; ii <= nKeys && status == 0; ii++)
+    {
+        fits_read_keyn(fptr, ii, keyword, keyValue, comment, &status);
+        QString value = QString(keyValue).simplified().remove(' ').remove('\'');
+        isUset |= (value == QString("USET"));
+        isDslr |= (value == QString("DSLR"));
+        if (QString(keyword) == QString("FLIPUD"))
+        {
+            hasFlipUD = true;
+            flipUD = (value == QString("T"));
+        }
+    }
+    status = 0;
+
+    if (isUset)
+    {
+        metadata.instrument = instruments::USET;
+    }
+    else if (isDslr)
+    {
+        metadata.instrument = instruments::DSLR;
+        metadata.flipUD = true;
+    }
+    if (hasFlipUD)
+    {
+        metadata.flipUD = flipUD;
+    }
+
+    /// Files written by LightDrops have both. Other instruments have only one of them.
+    if (metadata.XPOSURE == 0)
+    {
+        metadata.XPOSURE = metadata.EXPTIME;
+    }
+
+    fits_close_file(fptr, &status);
+    metadata.valid = true;
+}
+
+void RMetadataScanner::scanRaw(const QString &filePath, RFrameMetadata &metadata)
+{
+    metadata.instrument = instruments::DSLR;
+    metadata.bayer = true;
+    metadata.flipUD = true;
+
+    try
+    {
+        Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(filePath.toStdString());
+        image->readMetadata();
+        Exiv2::ExifData &exifData = image->exifData();
+        if (exifData.empty())
+        {
+            return;
+        }
+
+        Exiv2::ExifData::const_iterator it = exifData.findKey(Exiv2::ExifKey("Exif.Photo.ExposureTime"));
+        if (it != exifData.end())
+        {
+            metadata.XPOSURE = it->toFloat();
+            metadata.EXPTIME = metadata.XPOSURE;
+        }
+
+        /// Same key as RawImage::extractExif().
+        it = exifData.findKey(Exiv2::ExifKey("Exif.CanonSi.CameraTemperature"));
+        if (it != exifData.end())
+        {
+            metadata.TEMP = QString::fromStdString(it->print()).section(' ', 0, 0).toFloat();
+        }
+
+        it = exifData.findKey(Exiv2::ExifKey("Exif.Photo.DateTimeOriginal"));
+        if (it != exifData.end())
+        {
+            /// "YYYY:MM:DD hh:mm:ss"
+            QString dateTime = QString::fromStdString(it->toString());
+            metadata.date_obs = dateTime.section(' ', 0, 0).replace(':', '-');
+            metadata.time_obs = dateTime.section(' ', 1, 1);
+        }
+
+        metadata.naxis1 = image->pixelWidth();
+        metadata.naxis2 = image->pixelHeight();
+        metadata.valid = true;
+    }
+    catch (Exiv2::AnyError& e)
+    {
+        std::cout << "RMetadataScanner:: Exiv2 error on " << filePath.toStdString() << ": " << e.what() << std::endl;
+    }
+}
+
+void RMetadataScanner::scanTiff(const QString &filePath, RFrameMetadata &metadata)
+{
+    /// Same as ImageManager::loadTiff(): TIFF images are loaded as RGB, never as a mosaic.
+    metadata.instrument = instruments::TIFF;
+    metadata.bayer = false;
+
+    try
+    {
+        Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(filePath.toStdString());
+        image->readMetadata();
+
+        Exiv2::ExifData &exifData = image->exifData();
+        Exiv2::ExifData::const_iterator it = exifData.findKey(Exiv2::ExifKey("Exif.Photo.ExposureTime"));
+        if (it != exifData.end())
+        {
+            metadata.XPOSURE = it->toFloat();
+            metadata.EXPTIME = metadata.XPOSURE;
+        }
+
+        /// From the image file directory, which every TIFF has, even without Exif data.
+        metadata.naxis1 = image->pixelWidth();
+        metadata.naxis2 = image->pixelHeight();
+        metadata.valid = (metadata.naxis1 > 0 && metadata.naxis2 > 0);
+    }
+    catch (Exiv2::AnyError& e)
+    {
+        std::cout << "RMetadataScanner:: Exiv2 error on " << filePath.toStdString() << ": " << e.what() << std::endl;
+    }
+}
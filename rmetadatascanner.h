@@ -0,0 +1,56 @@
+#ifndef RMETADATASCANNER_H
+#define RMETADATASCANNER_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include "rmat.h"
+
+/// What we need to sort, filter or match frames, without decoding any pixel.
+struct RFrameMetadata
+{
+    RFrameMetadata();
+
+    QUrl url;
+    QString fileName;
+    instruments instrument;
+    bool bayer;
+    bool flipUD;
+    int naxis1;
+    int naxis2;
+    float EXPTIME;
+    float XPOSURE;
+    float TEMP;
+    float SOLAR_R;
+    QString date_obs;
+    QString time_obs;
+    /// False if the header could not be read.
+    bool valid;
+};
+
+/// Header-only scan of FITS files (CFITSIO), and of CR2 and TIFF files (Exiv2).
+/// Unlike ImageManager, nothing is decoded, demosaiced or histogrammed, and no widget is created,
+/// so a whole archive can be indexed quickly and from any thread.
+class RMetadataScanner
+{
+public:
+
+    static RFrameMetadata scanFile(const QUrl &url);
+    /// Scans in parallel. The output is in the same order as the input.
+    static QVector<RFrameMetadata> scanUrls(const QList<QUrl> &urls);
+    static QVector<RFrameMetadata> scanDirectory(const QString &dirPath, bool recursive = false);
+
+    /// Writes one line per frame as comma-separated values.
+    static bool exportTable(const QVector<RFrameMetadata> &metadataList, const QString &filePath);
+
+private:
+
+    static void scanFits(const QString &filePath, RFrameMetadata &metadata);
+    static void scanRaw(const QString &filePath, RFrameMetadata &metadata);
+    static void scanTiff(const QString &filePath, RFrameMetadata &metadata);
+};
+
+#endif // RMETADATASCANNER_H
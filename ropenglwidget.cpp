@@ -199,11 +199,11 @@ void ROpenGLWidget::prepImage()
 
         if (rMatImageList.at(ii)->isBayer() || rMatImageList.at(ii)->matImage.channels() == 3)
         {
-           tempMat = rMatImageList.at(ii)->matImageRGB.clone();
+           tempMat = rMatImageList.at(ii)->getMatImageRGB().clone();
         }
         else
         {
-           tempMat = rMatImageList.at(ii)->matImageGray.clone();
+           tempMat = rMatImageList.at(ii)->getMatImageGray().clone();
         }
 
         // Some DSLRs uses a coordinate system up-side down with resp. to FITS images.
@@ -0,0 +1,133 @@
+#include "rphasecorrelator.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+
+/// Half size of the weighted centroid around the peak (5x5, as cv::phaseCorrelate)
+static const int centroidRadius = 2;
+
+RPhaseCorrelator::RPhaseCorrelator(const cv::Mat &refMat, bool hanning) :
+    size(refMat.size()), dftSize(cv::getOptimalDFTSize(refMat.cols), cv::getOptimalDFTSize(refMat.rows))
+{
+    if (refMat.empty())
+    {
+        return;
+    }
+    if (hanning)
+    {
+        cv::createHanningWindow(window, size, CV_64F);
+    }
+
+    Workspace refWorkspace;
+    transform(refMat, refWorkspace);
+    refSpectrum = refWorkspace.spectrum;
+}
+
+void RPhaseCorrelator::transform(const cv::Mat &mat, Workspace &workspace) const
+{
+    /// The padding stays 0: only the top-left corner is written, with frames of the size of the reference.
+    if (workspace.padded.size() != dftSize || workspace.padded.type() != CV_64F)
+    {
+        workspace.padded = cv::Mat::zeros(dftSize, CV_64F);
+    }
+    cv::Mat frame = workspace.padded(cv::Rect(0, 0, size.width, size.height));
+    mat.convertTo(frame, CV_64F);
+    if (!window.empty())
+    {
+        cv::multiply(frame, window, frame);
+    }
+
+    cv::dft(workspace.padded, workspace.spectrum, cv::DFT_COMPLEX_OUTPUT, size.height);
+}
+
+cv::Point2d RPhaseCorrelator::shift(const cv::Mat &matImage, Workspace &workspace, double *response) const
+{
+    if (response != NULL)
+    {
+        *response = -1;
+    }
+    if (matImage.size() != size || refSpectrum.empty())
+    {
+        std::cout << "RPhaseCorrelator::shift() frame size differs from the reference" << std::endl;
+        return cv::Point2d(0, 0);
+    }
+
+    transform(matImage, workspace);
+
+    /// Normalized cross-power spectrum R * conj(F) / |R * conj(F)|, in place
+    for (int y = 0; y < dftSize.height; y++)
+    {
+        const cv::Vec2d *ref = refSpectrum.ptr<cv::Vec2d>(y);
+        cv::Vec2d *spec = workspace.spectrum.ptr<cv::Vec2d>(y);
+        for (int x = 0; x < dftSize.width; x++)
+        {
+            double re = ref[x][0] * spec[x][0] + ref[x][1] * spec[x][1];
+            double im = ref[x][1] * spec[x][0] - ref[x][0] * spec[x][1];
+            double magnitude = std::sqrt(re * re + im * im);
+            if (magnitude > DBL_EPSILON)
+            {
+                spec[x] = cv::Vec2d(re / magnitude, im / magnitude);
+            }
+            else
+            {
+                spec[x] = cv::Vec2d(0, 0);
+            }
+        }
+    }
+
+    cv::dft(workspace.spectrum, workspace.correlation, cv::DFT_INVERSE | cv::DFT_REAL_OUTPUT);
+
+    /// Peak, then its weighted centroid. The correlation is not fft-shifted: offsets past half the size wrap around.
+    cv::Point peakLoc;
+    cv::minMaxLoc(workspace.correlation, NULL, NULL, NULL, &peakLoc);
+
+    double sum = 0, sumX = 0, sumY = 0;
+    for (int dy = -centroidRadius; dy <= centroidRadius; dy++)
+    {
+        int y = (peakLoc.y + dy + dftSize.height) % dftSize.height;
+        const double *row = workspace.correlation.ptr<double>(y);
+        for (int dx = -centroidRadius; dx <= centroidRadius; dx++)
+        {
+            double value = row[(peakLoc.x + dx + dftSize.width) % dftSize.width];
+            sum += value;
+            sumX += value * dx;
+            sumY += value * dy;
+        }
+    }
+
+    cv::Point2d peak(peakLoc.x, peakLoc.y);
+    if (sum != 0)
+    {
+        peak.x += sumX / sum;
+        peak.y += sumY / sum;
+    }
+    if (peak.x > dftSize.width / 2.0)
+    {
+        peak.x -= dftSize.width;
+    }
+    if (peak.y > dftSize.height / 2.0)
+    {
+        peak.y -= dftSize.height;
+    }
+
+    /// The unscaled inverse DFT peaks at about the number of pixels
+    if (response != NULL)
+    {
+        *response = sum / dftSize.area();
+    }
+
+    return -peak;
+}
+
+cv::Point2d RPhaseCorrelator::shift(const cv::Mat &matImage, double *response)
+{
+    return shift(matImage, ownWorkspace, response);
+}
+
+cv::Size RPhaseCorrelator::getDftSize() const
+{
+    return dftSize;
+}
@@ -0,0 +1,49 @@
+#ifndef RPHASECORRELATOR_H
+#define RPHASECORRELATOR_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+/// Phase correlation of frames against one reference, as cv::phaseCorrelate(refMat, matImage, window),
+/// with the same sign convention and 5x5 weighted centroid, but with everything that depends only on the
+/// reference computed once: its spectrum, the Hanning window and the optimal DFT size the frames are
+/// zero-padded to. Each frame then costs one forward DFT, one multiplication by the normalized cross-power
+/// spectrum and one inverse DFT, in the buffers of a Workspace that is reused from one frame to the next.
+/// shift() with a Workspace is const: threads share the correlator, each with its own Workspace.
+class RPhaseCorrelator
+{
+public:
+    /// DFT buffers of one thread
+    struct Workspace
+    {
+        cv::Mat padded;
+        cv::Mat spectrum;
+        cv::Mat correlation;
+    };
+
+    RPhaseCorrelator(const cv::Mat &refMat, bool hanning = false);
+
+    /// Shift to give to the warp (inverse map) that registers matImage on the reference.
+    /// response: height of the correlation peak, 1 for identical images. (0, 0) and -1 if the sizes differ.
+    cv::Point2d shift(const cv::Mat &matImage, Workspace &workspace, double *response = NULL) const;
+    /// With the workspace of this correlator
+    cv::Point2d shift(const cv::Mat &matImage, double *response = NULL);
+
+    cv::Size getDftSize() const;
+
+private:
+
+    /// Windowed, zero-padded frame and its spectrum, in workspace
+    void transform(const cv::Mat &mat, Workspace &workspace) const;
+
+    cv::Size size;
+    cv::Size dftSize;
+    cv::Mat window;
+    cv::Mat refSpectrum;
+    Workspace ownWorkspace;
+};
+
+#endif // RPHASECORRELATOR_H
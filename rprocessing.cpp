@@ -11,15 +11,32 @@
 
 // Algorithm from std
 #include <algorithm>
+#include <thread>
 
 #include "imagemanager.h"
 #include "parallelcalibration.h"
+#include "parallelregistration.h"
+#include "rmaskedxcorr.h"
+#include "rroiregistration.h"
 #include "typedefs.h"
+#include "memoryusage.h"
+#include "rstacker.h"
+#include "rfilestacksource.h"
+#include "rstackaccumulator.h"
+#include "rmasterlibrary.h"
+#include "rcfa.h"
 
 RProcessing::RProcessing(QObject *parent): QObject(parent),
-    masterBias(NULL), masterDark(NULL), masterFlat(NULL), masterFlatN(NULL), stackedRMat(NULL), useUrlsFromTreeWidget(false), useXCorr(false),
+    masterBias(NULL), masterDark(NULL), masterFlat(NULL), masterFlatN(NULL), stackedRMat(NULL), cannyQImage(NULL), treeWidget(NULL), useUrlsFromTreeWidget(false), currentROpenGLWidget(NULL), useXCorr(false),
     masterWithMean(true), masterWithSigmaClip(false), stackWithMean(true), stackWithSigmaClip(false), radius(0), radius1(0), radius2(0), radius3(0), meanRadius(0),
-    useROI(false), maskCircleX(0), maskCircleY(0), maskCircleRadius(0), blkSize(32), binning(2)
+    useROI(false), maskCircleX(0), maskCircleY(0), maskCircleRadius(0), limbFitPlot(NULL), blkSize(32), binning(2),
+    afBackend(afBackends::automatic), afTileBytes(-1),
+    clipKappa(3.0f), clipIterations(5), clipWinsorized(false), liveStacking(false), drizzle(false),
+    frameWeighting(frameWeights::none), frameRejectFraction(0),
+    streamCalibration(false), streamWindow(4), streamPeakRSS(0), parallelCalibration(true), calibrationThreads(0),
+    parallelRegistration(true), registrationThreads(0), phaseCorrelationHanning(false),
+    masterLibrary(NULL), useLibraryFlat(false), masterFlatFromLibrary(false), flatPerCFAColour(true),
+    cosmeticCorrection(true), defectHotSigma(5.0f), defectColdFraction(0.5f)
 {
     listImageManager = new RListImageManager();
 }
@@ -49,6 +66,12 @@ RProcessing::~RProcessing()
         delete masterFlatN;
     }
 
+    /// After the masters, which may point into its mappings
+    if (masterLibrary != NULL)
+    {
+        delete masterLibrary;
+    }
+
 //    if (!resultList.empty())
 //    {
 //        qDeleteAll(resultList);
@@ -180,19 +203,24 @@ double *RProcessing::gaussKer2d(double sigma)
 
 void RProcessing::exportMastersToFits()
 {
+    /// Masters are written next to their frames, or in exportMastersDir without treeWidget.
+    QDir biasDir = (treeWidget != NULL) ? treeWidget->getBiasDir() : QDir(exportMastersDir);
+    QDir darkDir = (treeWidget != NULL) ? treeWidget->getDarkDir() : QDir(exportMastersDir);
+    QDir flatDir = (treeWidget != NULL) ? treeWidget->getFlatDir() : QDir(exportMastersDir);
+
     if (masterBias != NULL && !masterBias->matImage.empty())
     {
-        QFileInfo fileInfo(treeWidget->getBiasDir().filePath(QString("masterBias.fits")));
+        QFileInfo fileInfo(biasDir.filePath(QString("masterBias.fits")));
         QString masterBiasPath = setupFileName(fileInfo);
 
         exportToFits(masterBias, masterBiasPath);
-        std::cout << "Bias dir: " << treeWidget->getBiasDir().rootPath().toStdString() << std::endl;
+        std::cout << "Bias dir: " << biasDir.rootPath().toStdString() << std::endl;
         std::cout << "masterBias exported at: " << masterBiasPath.toStdString() << std::endl;
     }
 
     if (masterDark != NULL && !masterDark->matImage.empty())
     {
-        QFileInfo fileInfo(treeWidget->getDarkDir().filePath(QString("masterDark.fits")));
+        QFileInfo fileInfo(darkDir.filePath(QString("masterDark.fits")));
         QString masterDarkPath = setupFileName(fileInfo);
 
         exportToFits(masterDark, masterDarkPath);
@@ -203,7 +231,7 @@ void RProcessing::exportMastersToFits()
     if (masterFlat != NULL && !masterFlat->matImage.empty())
     {
 
-        QFileInfo fileInfo(treeWidget->getFlatDir().filePath(QString("masterFlat.fits")));
+        QFileInfo fileInfo(flatDir.filePath(QString("masterFlat.fits")));
         QString masterFlatPath = setupFileName(fileInfo);
 
         exportToFits(masterFlat, masterFlatPath);
@@ -250,29 +278,36 @@ QString RProcessing::setupFileName(QFileInfo fileInfo)
 }
 
 
-void RProcessing::exportToFits(RMat *rMatImage, QString QStrFilename)
+bool RProcessing::exportToFits(RMat *rMatImage, QString QStrFilename)
 {
-
-    if (rMatImage->matImage.channels() == 3)
+    int nChannels = rMatImage->matImage.channels();
+    if (nChannels != 1 && nChannels != 3)
     {
-        emit tempMessageSignal(QString("Multi-channel image. Select another image type (e.g Tiff)"));
-        return;
+        emit tempMessageSignal(QString("Image type not recognized"));
+        return false;
     }
     // Write fits files
     // To do: need to add FITS keyword about bayer type.
+    QMutexLocker cfitsioLocker(MyFitsImage::cfitsioMutex());
     std::string strFilename(QStrFilename.toStdString());
     fitsfile *fptr; /* pointer to the FITS file; defined in fitsio.h */
     long fpixel = 1, naxis = 2, nPixels;
     int status = 0; /* initialize status before calling fitsio routines */
-    long naxes[2];
+    long naxes[3];
     naxes[0] = (long) rMatImage->matImage.cols;
     naxes[1] = (long) rMatImage->matImage.rows;
+    naxes[2] = 3;
     nPixels = (long) (rMatImage->matImage.cols * rMatImage->matImage.rows);
     int bayer = (int) rMatImage->isBayer();
     char keyname[] = "BAYER";
 
     // Create new file
-    fits_create_file(&fptr, strFilename.c_str(), &status);
+    if (fits_create_file(&fptr, strFilename.c_str(), &status))
+    {
+        MyFitsImage::printerror(status);
+        emit tempMessageSignal(QString("Could not create %1").arg(QStrFilename));
+        return false;
+    }
 
     // If the images is still bayer (CFA), should convert back to original DSLR precision of 16 bits unsigned to save memory.
 
@@ -287,7 +322,26 @@ void RProcessing::exportToFits(RMat *rMatImage, QString QStrFilename)
     /// I need revisit the flat-fielding operation to make things more rigourous.
     /// UPDATE2: The flat fielding makes much more sense now, as it gives me much more natural colors without
     /// touching any of the r,g,b white balance values. And the range is restored.
-    if (rMatImage->isBayer())
+    if (nChannels == 3)
+    {
+        /// FITS data are planar: one plane per channel, in the RGB order of the RMat (see getMatImageRGB()).
+        /// 16-bit stacks stay 16-bit, anything else is written as float.
+        naxis = 3;
+        bool is16U = (rMatImage->matImage.depth() == CV_16U);
+        std::vector<cv::Mat> planes;
+        cv::split(rMatImage->getMatImageRGB(), planes);
+        fits_create_img(fptr, is16U ? USHORT_IMG : FLOAT_IMG, naxis, naxes, &status);
+        for (int c = 0; c < 3; c++)
+        {
+            cv::Mat plane = planes[c];
+            if (!is16U && plane.depth() != CV_32F)
+            {
+                plane.convertTo(plane, CV_32F);
+            }
+            fits_write_img(fptr, is16U ? TUSHORT : TFLOAT, fpixel + c * nPixels, nPixels, plane.data, &status);
+        }
+    }
+    else if (rMatImage->isBayer())
     {
         cv::Mat tempImage16;
         rMatImage->matImage.convertTo(tempImage16, CV_16U);
@@ -311,8 +365,10 @@ void RProcessing::exportToFits(RMat *rMatImage, QString QStrFilename)
     }
     else
     {
+        int closeStatus = 0;
+        fits_delete_file(fptr, &closeStatus);
         emit tempMessageSignal(QString("Image type not recognized"));
-        return;
+        return false;
     }
 
     // Write BAYER keyword
@@ -358,6 +414,13 @@ void RProcessing::exportToFits(RMat *rMatImage, QString QStrFilename)
     // Close the file
     fits_close_file(fptr, &status);
 
+    if (status)
+    {
+        MyFitsImage::printerror(status);
+        emit tempMessageSignal(QString("Could not write %1").arg(QStrFilename));
+        return false;
+    }
+    return true;
 }
 
 void RProcessing::batchExportToFits(QList<QUrl> urls, QString exportDir)
@@ -422,7 +485,7 @@ void RProcessing::exportToTiff(RMat *rMatImage, QString QStrFilename)
     std::string strFilename(tiffFilename.toStdString());
     cv::Mat matImageBGR16;
 
-    cv::cvtColor(rMatImage->matImageRGB, matImageBGR16, CV_RGB2BGR);
+    cv::cvtColor(rMatImage->getMatImageRGB(), matImageBGR16, CV_RGB2BGR);
 
     try {
             cv::imwrite(strFilename, matImageBGR16);
@@ -447,7 +510,7 @@ void RProcessing::exportToJpeg(RMat *rMatImage, QString QStrFilename)
     }
     else
     {
-        rMatImage->matImageRGB.convertTo(matImage16, CV_16U);
+        rMatImage->getMatImageRGB().convertTo(matImage16, CV_16U);
         cv::cvtColor(matImage16, matImage16, CV_RGB2BGR);
         std::cout << "exportToJpeg:: cv::cvtColor(matImage16, matImage16, CV_GRAY2BGR)" << std::endl;
     }
@@ -471,12 +534,12 @@ void RProcessing::loadMasterBias()
 {
     /// Used off-screen because no image is loaded beforehand in the ROpenGLWidget.
     /// So the url must exist in the treeWidget
-    if (treeWidget->getBiasUrls().size() == 1)
+    if (fetchBiasUrls().size() == 1)
     {
-        masterBiasUrl = treeWidget->getBiasUrls().at(0);
+        masterBiasUrl = fetchBiasUrls().at(0);
         std::cout << "RProcessing::loadMasterBias() masterBiasUrl = " << masterBiasUrl.toLocalFile().toStdString() << std::endl;
     }
-    else if (treeWidget->getBiasUrls().empty())
+    else if (fetchBiasUrls().empty())
     {
 
         qDebug("You need at least one Bias image in the calibration tree");
@@ -505,11 +568,11 @@ void RProcessing::loadMasterDark()
 {
     /// Used off-screen because no image is loaded beforehand in the ROpenGLWidget.
     /// So the url must exist in the treeWidget
-    if (treeWidget->getDarkUrls().size() == 1)
+    if (fetchDarkUrls().size() == 1)
     {
-        masterDarkUrl = treeWidget->getDarkUrls().at(0);
+        masterDarkUrl = fetchDarkUrls().at(0);
     }
-    else if (treeWidget->getDarkUrls().empty())
+    else if (fetchDarkUrls().empty())
     {
         return;
     }
@@ -535,11 +598,11 @@ void RProcessing::loadMasterFlat()
 {
     /// Used off-screen because no image is loaded beforehand in the ROpenGLWidget.
     /// So the url must exist in the treeWidget
-    if (treeWidget->getFlatUrls().size() == 1)
+    if (fetchFlatUrls().size() == 1)
     {
-        masterFlatUrl = treeWidget->getFlatUrls().at(0);
+        masterFlatUrl = fetchFlatUrls().at(0);
     }
-    else if (treeWidget->getFlatUrls().empty())
+    else if (fetchFlatUrls().empty())
     {
         return;
     }
@@ -695,32 +758,30 @@ void RProcessing::createMasters()
         tempMessageSignal(QString("No data processed"));
         return;
     }
+
+    if (masterLibrary != NULL)
+    {
+        addMastersToLibrary();
+    }
     tempMessageSignal(QString("Calibration masters ready. You may export. "), 0);
 }
 
 bool RProcessing::makeMasterBias()
 {
-    if (!treeWidget->getBiasUrls().empty())
+    if (!fetchBiasUrls().empty())
     {   /// Images not yet in memory,
-        /// load the bias files from their urls found in the treeWidget
-        loadRMatBiasList(treeWidget->getBiasUrls());
-
-        if (masterWithMean)
-        {
-            masterBias = average(rMatBiasList);
-            masterBias->setImageTitle( QString("master Bias (arithmetic mean)") );
-
-        }
-        else if (masterWithSigmaClip)
+        /// stack the bias files strip by strip from their urls found in the treeWidget
+        masterBias = stackMasterFromUrls(fetchBiasUrls());
+        if (masterBias == NULL)
         {
-            masterBias = sigmaClipAverage(rMatBiasList);
-            masterBias->setImageTitle( QString("master Bias (sigma-clipped average)") );
-
+            emit messageSignal(QString("Could not read the bias images"));
+            return false;
         }
-        return !masterBias->matImage.empty();
+        masterBias->setImageTitle( masterWithSigmaClip ? QString("master Bias (sigma-clipped average)") : QString("master Bias (arithmetic mean)") );
+        return true;
     }
 
-    else if (treeWidget->getBiasUrls().empty() && !treeWidget->rMatBiasList.empty())
+    else if (treeWidget != NULL && fetchBiasUrls().empty() && !treeWidget->rMatBiasList.empty())
     {   /// Images already in memory,
         /// get the pointer to the biases (list of Mat) from the treeWidget
         rMatBiasList = treeWidget->rMatBiasList;
@@ -749,24 +810,19 @@ bool RProcessing::makeMasterBias()
 bool RProcessing::makeMasterDark()
 {
 
-    if (!treeWidget->getDarkUrls().empty())
+    if (!fetchDarkUrls().empty())
     {   /// Images not yet in memory,
-        /// load the dark files from their urls found in the treeWidget
-        loadRMatDarkList(treeWidget->getDarkUrls());
-        if (masterWithMean)
-        {
-            masterDark = average(rMatDarkList);
-            masterDark->setImageTitle( QString("master Dark (arithmetic mean)") );
-        }
-        else if (masterWithSigmaClip)
+        /// stack the dark files strip by strip from their urls found in the treeWidget
+        masterDark = stackMasterFromUrls(fetchDarkUrls());
+        if (masterDark == NULL)
         {
-            masterDark = sigmaClipAverage(rMatDarkList);
-            masterDark->setImageTitle( QString("master Dark (sigma-clipped average)") );
+            emit messageSignal(QString("Could not read the dark images"));
+            return false;
         }
         masterDark->setImageTitle(QString("master Dark"));
-        return !masterDark->matImage.empty();
+        return true;
     }
-    else if (treeWidget->getDarkUrls().empty() && !treeWidget->rMatDarkList.empty())
+    else if (treeWidget != NULL && fetchDarkUrls().empty() && !treeWidget->rMatDarkList.empty())
     {   /// Images already in memory,
         /// get the pointer to the darks (list of Mat) from the treeWidget
         rMatDarkList = treeWidget->rMatDarkList;
@@ -792,24 +848,18 @@ bool RProcessing::makeMasterDark()
 
 bool RProcessing::makeMasterFlat()
 {
-    if (!treeWidget->getFlatUrls().empty())
+    if (!fetchFlatUrls().empty())
     {   /// Images not yet in memory,
-        /// load the flat files from their urls found in the treeWidget
-        loadRMatFlatList(treeWidget->getFlatUrls());
-
-        if (masterWithMean)
-        {
-            masterFlat = average(rMatFlatList);
-            masterFlat->setImageTitle( QString("master Flat (arithmetic mean)") );
-        }
-        else if (masterWithSigmaClip)
+        /// stack the flat files strip by strip from their urls found in the treeWidget
+        masterFlat = stackMasterFromUrls(fetchFlatUrls());
+        if (masterFlat == NULL)
         {
-            masterFlat = sigmaClipAverage(rMatFlatList);
-            masterFlat->setImageTitle( QString("master Flat (sigma-clipped average)") );
+            emit messageSignal(QString("Could not read the flat images"));
+            return false;
         }
-
+        masterFlat->setImageTitle( masterWithSigmaClip ? QString("master Flat (sigma-clipped average)") : QString("master Flat (arithmetic mean)") );
     }
-    else if (treeWidget->getFlatUrls().empty() && !treeWidget->rMatFlatList.empty())
+    else if (treeWidget != NULL && fetchFlatUrls().empty() && !treeWidget->rMatFlatList.empty())
     {   /// Images already in memory,
         /// get the pointer to the flats (list of Mat) from the treeWidget
         rMatFlatList = treeWidget->rMatFlatList;
@@ -845,11 +895,9 @@ bool RProcessing::makeMasterFlat()
 
     cv::Mat tempMatFlat;
     cv::Mat tempMatBias;
-    masterBias->matImage.convertTo(tempMatFlat, CV_32F);
-    masterFlat->matImage.convertTo(tempMatBias, CV_32F);
+    masterFlat->matImage.convertTo(tempMatFlat, CV_32F);
+    masterBias->matImage.convertTo(tempMatBias, CV_32F);
     cv::subtract(tempMatFlat, tempMatBias, masterFlat->matImage);
-    //masterFlat->matImage.convertTo(masterFlat->matImage, rMatFlatList.at(0)->matImage.type());
-    masterFlat->setInstrument(rMatFlatList.at(0)->getInstrument());
     /// Update masterFlat statistics
 
     masterFlat->calcStats();
@@ -857,6 +905,60 @@ bool RProcessing::makeMasterFlat()
     return true;
 }
 
+RMat* RProcessing::stackMasterFromUrls(QList<QUrl> urls)
+{
+    /// Row strips are read from all the files and combined as they come,
+    /// so the frames are never all in memory, not even one of them for FITS files.
+    RFileStackSource source(urls);
+    if (!source.isValid())
+    {
+        return NULL;
+    }
+
+    stackMethods method = stackMethods::mean;
+    if (masterWithSigmaClip)
+    {
+        method = clipWinsorized ? stackMethods::winsorized : stackMethods::kappaSigma;
+    }
+    RStacker stacker(method, clipKappa, clipKappa, clipIterations);
+
+    QElapsedTimer timer;
+    timer.start();
+    cv::Mat matMaster = stacker.stack(source);
+    if (matMaster.empty())
+    {
+        return NULL;
+    }
+    qDebug("RProcessing::stackMasterFromUrls:: %d frames in %lld ms, rejected: %.3f %%",
+           source.getNFrames(), (long long) timer.elapsed(), 100.0 * stacker.getRejectedFraction());
+
+    if (method != stackMethods::mean)
+    {
+        rejectionMap = stacker.getRejectionMap();
+    }
+
+    /// The master stays in floating point. Its temperature is the mean of the frames' (e.g. for the master library).
+    RFrameMetadata metadata = source.getMetadata(0);
+    float sumTEMP = 0;
+    int nTEMP = 0;
+    for (int i = 0; i < source.getNFrames(); i++)
+    {
+        if (source.getMetadata(i).TEMP > -100)
+        {
+            sumTEMP += source.getMetadata(i).TEMP;
+            nTEMP++;
+        }
+    }
+    if (nTEMP > 0)
+    {
+        metadata.TEMP = sumTEMP / nTEMP;
+    }
+    RMat *rMatMaster = RMat::adopt(matMaster, metadata.bayer, metadata.instrument, metadata.XPOSURE, metadata.TEMP);
+    rMatMaster->flipUD = metadata.flipUD;
+    rMatMaster->setSOLAR_R(metadata.SOLAR_R);
+    return rMatMaster;
+}
+
 void RProcessing::stack(QList<RMat *> rMatImageList)
 {
     if (rMatImageList.isEmpty())
@@ -865,7 +967,15 @@ void RProcessing::stack(QList<RMat *> rMatImageList)
         return;
     }
 
-    if (stackWithMean)
+    if (frameWeighting != frameWeights::none)
+    {
+        stackedRMat = weightedAverage(rMatImageList);
+        if (stackedRMat != NULL)
+        {
+            stackedRMat->setImageTitle(QString("weighted_stack"));
+        }
+    }
+    else if (stackWithMean)
     {
         stackedRMat = average(rMatImageList);
         stackedRMat->setImageTitle(QString("mean_stack"));
@@ -897,26 +1007,16 @@ RMat* RProcessing::average(QList<RMat*> rMatList)
         return rMatList.at(0);
     }
     /// Averages a series of cv::Mat images using arithmetic mean.
-    int naxis1 = rMatList.at(0)->matImage.cols;
-    int naxis2 = rMatList.at(0)->matImage.rows;
-
-    /// Need to create a Mat image that will host the result of the average.
-    /// It needs to be the same type, and has the number of channels as the Mat images of the series.
-    cv::Mat avgImg = cv::Mat::zeros(naxis2, naxis1, rMatList.at(0)->matImage.type());
-    avgImg.convertTo(avgImg, CV_32F);
-
+    /// The running accumulator converts the frames a row at a time, with compensated sums.
+    RStackAccumulator accumulator;
     for(int i = 0; i < rMatList.size(); i++)
     {
-        cv::Mat tempImage;
-        rMatList.at(i)->matImage.convertTo(tempImage, CV_32F);
-        /// Sum the images with cv::accumulate
-        /// This function can only work with up to 3 color channels
-        cv::accumulate(tempImage, avgImg);
+        accumulator.push(rMatList.at(i)->matImage);
     }
 
-    avgImg = avgImg / (float) rMatList.size();
+    cv::Mat avgImg = accumulator.getMean();
     avgImg.convertTo(avgImg, rMatList.at(0)->matImage.type());
-    RMat *rMatAvg = new RMat(avgImg, rMatList.at(0)->isBayer(), rMatList.at(0)->getInstrument(), rMatList.at(0)->getXPOSURE(), rMatList.at(0)->getTEMP());
+    RMat *rMatAvg = RMat::adopt(avgImg, rMatList.at(0)->isBayer(), rMatList.at(0)->getInstrument(), rMatList.at(0)->getXPOSURE(), rMatList.at(0)->getTEMP());
     return rMatAvg;
 }
 
@@ -928,62 +1028,32 @@ RMat *RProcessing::sigmaClipAverage(QList<RMat*> rMatImageList)
         return rMatImageList.at(0);
     }
 
-    try {
-        af::setBackend(AF_BACKEND_OPENCL);
-//        af::array tempArray(10, 10, 2);
-//        tempArray(af::span, af::span, 0) = 1;
-//        tempArray(af::span, af::span, 1) = 0;
-
-    /// Get sigma coefficient from sigmaEdit
-//    float sigmaFactor = 1.0f;
-    int naxis2 = rMatImageList.at(0)->matImage.rows;
-    int naxis1 = rMatImageList.at(0)->matImage.cols;
     int nFrames = rMatImageList.size();
     emit messageSignal(QString("Stacking %1 frames with sigma-clipping").arg(nFrames));
 
-    /// Initialize the GPU array series
-    af::array arfSeries(naxis2, naxis1, nFrames);
-    /// Store the matImageList (converted to float) in the GPU array
-    cv::Mat tempMat(naxis2, naxis1, CV_32F);
-    for ( int k=0; k < nFrames; k++)
+    /// Iterative kappa-sigma (or winsorized) clipping, strip by strip on the CPU.
+    RStacker stacker(clipWinsorized ? stackMethods::winsorized : stackMethods::kappaSigma, clipKappa, clipKappa, clipIterations);
+
+    QElapsedTimer timer;
+    timer.start();
+    cv::Mat matImage = stacker.stack(rMatImageList);
+    if (matImage.empty())
     {
-        rMatImageList.at(k)->matImage.convertTo(tempMat, CV_32F);
-        //cv::cvtColor(rMatImageList.at(k).matImage, tempMat, CV_RGB2GRAY);
-        af::array tempArf(naxis2, naxis1, (float*) tempMat.data);
-        //arfSeries(af::span, af::span, k) = transpose(tempArf);
-        arfSeries(af::span, af::span, k) = tempArf;
+        emit messageSignal(QString("Sigma-clipping failed, using the mean: frames of different sizes?"));
+        return average(rMatImageList);
     }
+    qDebug("RProcessing::sigmaClipAverage::  elapsed: %lld ms, rejected: %.3f %%", (long long) timer.elapsed(), 100.0 * stacker.getRejectedFraction());
 
-    af::timer start2 = af::timer::start();
+    rejectionMap = stacker.getRejectionMap();
 
-    af::array meanArf = af::median(arfSeries, 2);
-//    qDebug("RProcessing::sigmaClipAverage::  elapsed seconds: %f us", af::timer::stop(start2));
-//    af::array meanArfTiled = af::tile(meanArf, 1, 1, nFrames);
-//    //af::array stdevArf = af::moddims(af::stdev(arfSeries, 2), naxis2, naxis1);
-//    af::array stdevArf = af::stdev(arfSeries, 2);
-//    af::array stdevArfTiled = af::tile(stdevArf, 1, 1, nFrames);
-//    af::array arfMaskReject = af::abs(arfSeries - meanArfTiled) > stdevArfTiled;
-//    arfSeries(arfMaskReject) = meanArfTiled(arfMaskReject);
-//    meanArf = af::mean(arfSeries, 2);
-//    qDebug("RProcessing::sigmaClipAverage::  elapsed seconds: %f s", af::timer::stop(start2));
-    /// Copy an array from the device to the host:
-    float *hostArf = meanArf.host<float>();
-
-    qDebug("RProcessing::sigmaClipAverage::  elapsed seconds: %f s", af::timer::stop(start2));
     /// Prepare output Mat image
-    cv::Mat matImage(naxis2, naxis1, CV_32F, hostArf);
     matImage.convertTo(matImage, rMatImageList.at(0)->matImage.type());
-    RMat *rMatAvg = new RMat(matImage, rMatImageList.at(0)->isBayer(), rMatImageList.at(0)->getInstrument());
+    RMat *rMatAvg = RMat::adopt(matImage, rMatImageList.at(0)->isBayer(), rMatImageList.at(0)->getInstrument(),
+                                rMatImageList.at(0)->getXPOSURE(), rMatImageList.at(0)->getTEMP());
 
     rMatAvg->setSOLAR_R(rMatImageList.at(0)->getSOLAR_R());
 
-
     return rMatAvg;
-
-    } catch (af::exception& e) {
-        printf("caught exception when trying CPU backend\n");
-        fprintf(stderr, "%s\n", e.what());
-    }
 }
 
 double RProcessing::pixelDistance(double u, double v)
@@ -1136,6 +1206,111 @@ RMat* RProcessing::sharpenCurrentImage(RMat *rMatImage, float weight1)
     return rMatSharp;
 }
 
+RMat *RProcessing::weightedAverage(QList<RMat *> rMatImageList)
+{
+    int nFrames = rMatImageList.size();
+    /// Weights of the lights when these are their registered versions, else from the frames themselves.
+    std::vector<float> weights = ((int) frameWeightList.size() == nFrames) ? frameWeightList : computeFrameWeights(rMatImageList);
+
+    stackMethods method = stackMethods::mean;
+    if (stackWithSigmaClip)
+    {
+        method = clipWinsorized ? stackMethods::winsorized : stackMethods::kappaSigma;
+    }
+    emit messageSignal(QString("Stacking %1 weighted frames").arg(nFrames));
+
+    RStacker stacker(method, clipKappa, clipKappa, clipIterations);
+    stacker.setWeights(weights);
+
+    QElapsedTimer timer;
+    timer.start();
+    cv::Mat matImage = stacker.stack(rMatImageList);
+    if (matImage.empty())
+    {
+        emit messageSignal(QString("Weighted stacking failed: frames of different sizes?"));
+        return NULL;
+    }
+    qDebug("RProcessing::weightedAverage::  elapsed: %lld ms, rejected: %.3f %%", (long long) timer.elapsed(), 100.0 * stacker.getRejectedFraction());
+
+    rejectionMap = stacker.getRejectionMap();
+
+    matImage.convertTo(matImage, rMatImageList.at(0)->matImage.type());
+    RMat *rMatAvg = RMat::adopt(matImage, rMatImageList.at(0)->isBayer(), rMatImageList.at(0)->getInstrument(),
+                                rMatImageList.at(0)->getXPOSURE(), rMatImageList.at(0)->getTEMP());
+    rMatAvg->setSOLAR_R(rMatImageList.at(0)->getSOLAR_R());
+    return rMatAvg;
+}
+
+std::vector<float> RProcessing::computeFrameWeights(QList<RMat *> rMatImageList)
+{
+    std::vector<float> weights(rMatImageList.size(), 1.0f);
+    if (frameWeighting == frameWeights::none)
+    {
+        return weights;
+    }
+
+    /// Noise and sharpness come with the statistics of each frame, computed once.
+    float maxWeight = 0;
+    for (int i = 0; i < rMatImageList.size(); i++)
+    {
+        float noise = std::max(rMatImageList.at(i)->getNoise(), 1e-6f);
+        float sharpness = rMatImageList.at(i)->getSharpness();
+        if (frameWeighting == frameWeights::noise)
+        {
+            weights[i] = 1.0f / (noise * noise);
+        }
+        else
+        {
+            weights[i] = (sharpness * sharpness) / (noise * noise);
+        }
+        maxWeight = std::max(maxWeight, weights[i]);
+    }
+
+    for (size_t i = 0; i < weights.size(); i++)
+    {
+        weights[i] = (maxWeight > 0) ? std::max(weights[i] / maxWeight, 1e-6f) : 1.0f;
+    }
+    return weights;
+}
+
+void RProcessing::selectLights()
+{
+    frameWeightList.clear();
+    if (frameWeighting == frameWeights::none || rMatLightList.isEmpty())
+    {
+        return;
+    }
+
+    std::vector<float> weights = computeFrameWeights(rMatLightList);
+    if (frameRejectFraction > 0)
+    {
+        std::vector<float> sortedWeights(weights);
+        std::nth_element(sortedWeights.begin(), sortedWeights.begin() + sortedWeights.size() / 2, sortedWeights.end());
+        float threshold = frameRejectFraction * sortedWeights[sortedWeights.size() / 2];
+
+        QList<RMat*> keptList;
+        std::vector<float> keptWeights;
+        for (int i = 0; i < rMatLightList.size(); i++)
+        {
+            if (weights[i] >= threshold)
+            {
+                keptList << rMatLightList.at(i);
+                keptWeights.push_back(weights[i]);
+            }
+            else
+            {
+                std::cout << "RProcessing::selectLights() rejecting frame #" << i << " (weight " << weights[i] << ")" << std::endl;
+            }
+        }
+        emit tempMessageSignal(QString("%1 of %2 frames rejected on quality").arg(rMatLightList.size() - keptList.size()).arg(rMatLightList.size()));
+        /// The frames are not deleted: they still belong to their image manager or to the caller.
+        rMatLightList = keptList;
+        weights = keptWeights;
+    }
+
+    frameWeightList = weights;
+}
+
 void RProcessing::blockProcessingLocal(QList<RMat*> rMatImageList)
 {
 
@@ -1145,7 +1320,7 @@ void RProcessing::blockProcessingLocal(QList<RMat*> rMatImageList)
         resultList.clear();
     }
 
-    af::setBackend(AF_BACKEND_OPENCL);
+    RAfBackend::select(afBackend);
 
     int naxis2 = rMatImageList.at(0)->matImage.rows;
     int naxis1 = rMatImageList.at(0)->matImage.cols;
@@ -1516,6 +1691,8 @@ void RProcessing::extractLuckySample(QList<RMat *> rMatImageList, QList<RMat *>
         y -= blkSize/2;
     }
 
+    RAfBackend::select(afBackend);
+
     af::array arDim = af::constant(blkSize, 2, nBest-1);
     af::array coordRange = af::range(af::dim4(blkSize));
     af::array xRange = coordRange + x;
@@ -1550,6 +1727,8 @@ void RProcessing::extractLuckySample2(QList<RMat *> rMatImageList, QList<RMat *>
         y -= blkSize/2;
     }
 
+    RAfBackend::select(afBackend);
+
     af::array arDim = af::constant(blkSize, 2, nBest-1);
     af::array coordRange = af::range(af::dim4(blkSize));
     af::array xRange = coordRange + x;
@@ -1605,8 +1784,10 @@ void RProcessing::blockProcessingGradient(QList<RMat *> rMatImageList, af::array
     arfSeries = af::constant(0, naxis1, naxis2, nFrames);
     qualityBinnedSeries = af::constant(0, nBAxis1, nBAxis2, nFrames);
 
-    af::array kernel = af::constant(0, 7, 7);
-    kernel(af::seq(3,6), af::seq(3,6)) = 1;
+    /// Smoothing, rebinning and gradient strip by strip, in cache on the CPU backend.
+    int binning = this->binning;
+    int tileRows = RAfBackend::tileRows(naxis2, naxis1 * sizeof(float) * 4, afTileBytes, binning);
+    std::function<af::array(const af::array&)> quality = [binning](const af::array &a) { return RAfBackend::gradientQuality(a, binning); };
 
     cv::Mat tempMat(naxis2, naxis1, CV_32F);
     for ( int k=0; k < nFrames; k++)
@@ -1614,14 +1795,7 @@ void RProcessing::blockProcessingGradient(QList<RMat *> rMatImageList, af::array
         rMatImageList.at(k)->matImage.convertTo(tempMat, CV_32F);
         af::array tempArf(naxis1, naxis2, (float*) tempMat.data);
         arfSeries(af::span, af::span, k) = tempArf;
-        /// Rebin the data
-        af::array arfTemp = convolve2(tempArf, kernel);
-        af::array binnedFrame = arfTemp(af::seq(0, af::end, binning), af::seq(0, af::end, binning));
-        af::array dx, dy;
-        af::grad(dx, dy, binnedFrame);
-        /// Sum of absolute of the X- and Y- gradient (look for a norm-L2 function in ArrayFire?)
-        af::array gradientMagnitude = af::abs(dx) + af::abs(dy);
-        qualityBinnedSeries(af::span, af::span, k) = gradientMagnitude;
+        qualityBinnedSeries(af::span, af::span, k) = RAfBackend::filterTiled(tempArf, quality, tileRows, RAfBackend::gradientHalo(binning), binning);
     }
 }
 
@@ -1640,8 +1814,9 @@ void RProcessing::blockProcessingSobel(QList<RMat *> rMatImageList, af::array &a
     arfSeries = af::constant(0, naxis1, naxis2, nFrames);
     qualitySeries = af::constant(0, nBAxis1, nBAxis2, nFrames);
 
-    af::array kernel = af::constant(0, 7, 7);
-    kernel(af::seq(3,6), af::seq(3,6)) = 1;
+    int binning = this->binning;
+    int tileRows = RAfBackend::tileRows(naxis2, naxis1 * sizeof(float) * 4, afTileBytes, binning);
+    std::function<af::array(const af::array&)> quality = [binning](const af::array &a) { return RAfBackend::gradientQuality(a, binning, true); };
 
     cv::Mat tempMat(naxis2, naxis1, CV_32F);
     for ( int k=0; k < nFrames; k++)
@@ -1649,15 +1824,7 @@ void RProcessing::blockProcessingSobel(QList<RMat *> rMatImageList, af::array &a
         rMatImageList.at(k)->matImage.convertTo(tempMat, CV_32F);
         af::array tempArf(naxis1, naxis2, (float*) tempMat.data);
         arfSeries(af::span, af::span, k) = tempArf;
-        /// Rebin the data
-        af::array arfTemp = convolve2(tempArf, kernel);
-        af::array binnedFrame = arfTemp(af::seq(0, af::end, binning), af::seq(0, af::end, binning));
-        af::array dx, dy;
-        //af::grad(dx, dy, binnedFrame);
-        af::sobel(dx, dy, binnedFrame);
-        /// Sum of absolute of the X- and Y- gradient (look for a norm-L2 function in ArrayFire?)
-        af::array gradientMagnitude = af::abs(dx) + af::abs(dy);
-        qualitySeries(af::span, af::span, k) = gradientMagnitude;
+        qualitySeries(af::span, af::span, k) = RAfBackend::filterTiled(tempArf, quality, tileRows, RAfBackend::gradientHalo(binning), binning);
     }
 }
 
@@ -1684,6 +1851,16 @@ void RProcessing::blockProcessingLaplace(QList<RMat *> rMatImageList, af::array
 
     af::array kernel(3, 3, ker);
 
+    // Rebin the image (not rebinned if binning = 1) and convolve it with the Laplacian kernel, strip by strip.
+    // The halo covers one rebinned row of the kernel.
+    int tileRows = RAfBackend::tileRows(naxis2, naxis1 * sizeof(float) * 4, afTileBytes, binning);
+    std::function<af::array(const af::array&)> laplace = [this, &kernel](const af::array &a)
+    {
+        af::array binnedAr;
+        rebin(a, binnedAr, binning);
+        return af::convolve2(binnedAr, kernel);
+    };
+
     cv::Mat tempMat(naxis2, naxis1, CV_32F);
 
     for ( int k=0; k < nFrames; k++)
@@ -1691,20 +1868,14 @@ void RProcessing::blockProcessingLaplace(QList<RMat *> rMatImageList, af::array
         rMatImageList.at(k)->matImage.convertTo(tempMat, CV_32F);
         af::array tempAr(naxis1, naxis2, (float*) tempMat.data);
         arfSeries(af::span, af::span, k) = tempAr;
-        // Rebin the image. The image is in fact not rebinned if binning = 1.
-        af::array binnedAr;
-        rebin(tempAr, binnedAr, binning);
-        // Convolve the rebinned with Laplacian kernel
-        af::array arfTemp = convolve2(binnedAr, kernel);
         // Store it in the 3D array
-        qualitySeries(af::span, af::span, k) = arfTemp;
+        qualitySeries(af::span, af::span, k) = RAfBackend::filterTiled(tempAr, laplace, tileRows, binning, binning);
     }
 }
 
 void RProcessing::blockProcessingGlobalGradients(QList<RMat *> rMatImageList)
 {
-    af::setBackend(AF_BACKEND_OPENCL);
-    //af::setBackend(AF_BACKEND_CPU);
+    RAfBackend::select(afBackend);
 
     af::array arfSeries;
     af::array qualityBinnedSeries;
@@ -1813,8 +1984,7 @@ void RProcessing::blockProcessingGlobalGradients(QList<RMat *> rMatImageList)
 
 void RProcessing::blockProcessingGlobalLaplace(QList<RMat *> rMatImageList)
 {
-    af::setBackend(AF_BACKEND_OPENCL);
-    //af::setBackend(AF_BACKEND_CPU);
+    RAfBackend::select(afBackend);
 
     af::array arfSeries;
     af::array qualityBinnedSeries;
@@ -2150,7 +2320,7 @@ void RProcessing::fetchTMatchShiftsGfor(af::array & ar, af::array &dxAr, af::arr
 
 void RProcessing::calibrateOffScreen()
 {
-    if (treeWidget->getLightUrls().empty())
+    if (fetchLightUrls().empty())
     {
         qDebug("ProcessingWidget::calibrateOffScreen():: No lights");
         tempMessageSignal(QString("No Light image"));
@@ -2163,35 +2333,93 @@ void RProcessing::calibrateOffScreen()
         resultList.clear();
     }
 
-    std::cout << "Loading master Bias..." << std::endl;
-    loadMasterBias();
+    /// Masters given as urls take precedence over those of the library.
+    masterFlatFromLibrary = false;
+    libraryMastersUsed.clear();
+    bool fromLibrary = (masterLibrary != NULL && loadMastersFromLibrary());
+    /// Said in the final message too, as the calibration replaces this one.
+    QString libraryMessage;
+    if (!libraryMastersUsed.isEmpty())
+    {
+        libraryMessage = QString(" Using %1.").arg(libraryMastersUsed.join(QString(", ")));
+        emit tempMessageSignal(libraryMessage.trimmed(), 0);
+    }
 
+    if (!fromLibrary || !fetchBiasUrls().empty())
+    {
+        std::cout << "Loading master Bias..." << std::endl;
+        loadMasterBias();
+    }
 
-    std::cout << "Loading master Dark..." << std::endl;
-    loadMasterDark();
+    if (!fetchDarkUrls().empty())
+    {
+        std::cout << "Loading master Dark..." << std::endl;
+        loadMasterDark();
+    }
 
-    std::cout << "Loading master Flat..." << std::endl;
-    loadMasterFlat();
+    if (!fetchFlatUrls().empty())
+    {
+        std::cout << "Loading master Flat..." << std::endl;
+        loadMasterFlat();
+        masterFlatFromLibrary = false;
+    }
 
     /// Flat fielding needs also to have at least the bias removed.
-    if (masterBias !=NULL)
+    /// Flats of the library already have it removed.
+    if (masterBias !=NULL && masterFlat != NULL && !masterFlatFromLibrary)
     {
         std::cout << "Subtracking Bias to Flat..." << std::endl;
         cv::subtract(masterFlat->matImage, masterBias->matImage, masterFlat->matImage);
     }
 
 
-//    for (int i = 0 ; i < treeWidget->getLightUrls().size() ; i++)
+//    for (int i = 0 ; i < fetchLightUrls().size() ; i++)
 //    {
 //        cv::Mat tempMat;
 //        tempMat.create(masterDark->matImage.rows, masterDark->matImage.cols, masterDark->matImage.type());
 //        resultList << new RMat(tempMat, masterDark->isBayer());
 //    }
 
-    //cv::parallel_for_(cv::Range(0, treeWidget->getLightUrls().size()), ParallelCalibration(treeWidget->getLightUrls(), masterDark, masterFlat, resultList));
-    calibrate();
+    setupCalibrationKernel();
+
+    int nCalibrated = 0;
+    if (parallelCalibration)
+    {
+        nCalibrated = calibrateParallel();
+    }
+    else if (streamCalibration)
+    {
+        nCalibrated = calibrateStream();
+    }
+    else
+    {
+        calibrate();
+        nCalibrated = resultList.size();
+    }
+
+    /// < 0: the calibration could not start, and said why.
+    if (nCalibrated < 0)
+    {
+        return;
+    }
+    int nSkipped = fetchLightUrls().size() - nCalibrated;
+
+    if (streamCalibration)
+    {
+        /// Calibrated frames went straight to disk and are not kept in memory.
+        if (nCalibrated == 0)
+        {
+            emit tempMessageSignal(QString("No light could be calibrated"));
+            return;
+        }
+        emit tempMessageSignal(QString("%1 calibrated lights exported to %2 (%3 skipped). Peak memory: %4 MB.%5")
+                               .arg(nCalibrated).arg(exportCalibrateDir).arg(nSkipped)
+                               .arg((qulonglong) (streamPeakRSS / (1024*1024))).arg(libraryMessage), 0);
+        return;
+    }
+
     qDebug("ProcessingWidget::calibrateOffScreen():: Done.");
-    tempMessageSignal(QString("Calibration completed."), 0);
+    tempMessageSignal(QString("Calibration completed.") + libraryMessage, 0);
 
     rMatLightList = resultList; // Add to tree widget?
     resultList.clear();
@@ -2211,98 +2439,420 @@ void RProcessing::calibrate()
     }
 
     std::cout << "Calibrating Lights..." << std::endl;
-    for(int i = 0; i < treeWidget->getLightUrls().size(); i++)
+    for(int i = 0; i < fetchLightUrls().size(); i++)
     {
-        ImageManager lightManager(treeWidget->getLightUrls().at(i));
-        //cv::Mat matResult;
-        cv::Mat lightMat = lightManager.getRMatImage()->matImage;
-
-        if (lightMat.type() != CV_32F)
-        {
-            lightMat.convertTo(lightMat, CV_32F);
-            std::cout << "Converted light to CV_32F" << std::endl;
-        }
+        ImageManager lightManager(fetchLightUrls().at(i));
+        cv::Mat lightMat = calibrateLight(lightManager.getRMatImage()->matImage);
 
-        if (masterDark!=NULL )
-        {
-            std::cout << "Subtracting Dark..." << std::endl;
-            cv::subtract(lightMat, masterDark->matImage, lightMat);
-        }
-        else if (masterBias != NULL)
-        {
-            cv::subtract(lightMat, masterBias->matImage, lightMat);
-        }
-
-        if (masterFlat != NULL)
-        {
-            std::cout << "Flat fielding..." << std::endl;
-            /// A flat field completely modify the range of the image.
-            /// We could restore that range and continue treating the image with an integral type
-            /// or we could treat it as float as long as we stay consistent.
-            /// In case we treat as float, demosaicing with openCV needs image to range from 0 and 1
-            cv::Scalar oldMean = cv::mean(lightMat);
-            std::cout << "Dividing by flat-field..." << std::endl;
-            cv::divide(lightMat, masterFlat->matImage, lightMat);
-            cv::Scalar newMean = cv::mean(lightMat);
-            cv::Scalar scale = oldMean/newMean;
-            lightMat = lightMat * (float)scale.val[0];
-
-
-        }
-
-        cv::threshold(lightMat, lightMat, 0, 0, cv::THRESH_TOZERO);
-
-        /// Copy the result into the list.
-        /// This may be an overkill. We could output directly into the elements of the list
-        resultList << new RMat(lightMat, lightManager.getRMatImage()->isBayer(), lightManager.getRMatImage()->getInstrument(), lightManager.getRMatImage()->getXPOSURE(), lightManager.getRMatImage()->getTEMP());
-        resultList.at(i)->flipUD = lightManager.getRMatImage()->flipUD;
-        resultList.at(i)->calcMinMax();
-        resultList.at(i)->calcStats();
-        resultList.at(i)->setFileInfo(lightManager.getRMatImage()->getFileInfo());
-        showMinMax(resultList.at(i)->matImageGray);
+        /// The calibrated mat is fresh: the RMat takes it over instead of copying it.
+        resultList << lightManager.getRMatImage()->cloneMetadata(lightMat);
+        /// Statistics and derived planes are computed when the result is displayed.
+        showMinMax(resultList.at(i)->matImage);
     }
 
 }
 
-void RProcessing::meshgrid(const cv::Mat &xgv, const cv::Mat &ygv, cv::Mat1i &X, cv::Mat1i &Y)
+cv::Mat RProcessing::calibrateLight(cv::Mat lightMat)
 {
-      cv::repeat(xgv.reshape(1,1), ygv.total(), 1, X);
-      cv::repeat(ygv.reshape(1,1).t(), 1, xgv.total(), Y);
+    /// Dark (or bias) subtraction, flat fielding and clipping of negative values
+    /// for one light frame. The calibrationKernel must be set up beforehand.
+    return calibrationKernel.apply(lightMat);
 }
 
-
-
-
-void RProcessing::setExportMastersDir(QString dir)
+void RProcessing::setupCalibrationKernel()
 {
-    this->exportMastersDir = dir;
-    qDebug() << "Export masters to: " << exportMastersDir;
-}
+    cv::Mat darkMat;
+    cv::Mat flatMat;
+    bool cfaFlat = false;
+    if (masterDark != NULL)
+    {
+        darkMat = masterDark->matImage;
+    }
+    else if (masterBias != NULL)
+    {
+        darkMat = masterBias->matImage;
+    }
+    if (masterFlat != NULL)
+    {
+        flatMat = masterFlat->matImage;
+        cfaFlat = masterFlat->isBayer() && flatPerCFAColour;
+    }
 
-void RProcessing::setExportCalibrateDir(QString dir)
-{
-    this->exportCalibrateDir = dir;
-    qDebug() << "Export calibrated data to: " << exportCalibrateDir;
+    calibrationKernel.setMasters(darkMat, flatMat, cfaFlat);
+
+    /// Hot pixels need a real dark: a bias has too little thermal signal to show them.
+    RDefectMap defectMap(defectHotSigma, defectColdFraction);
+    if (cosmeticCorrection)
+    {
+        cv::Mat defectDark = (masterDark != NULL) ? masterDark->matImage : cv::Mat();
+        bool bayer = (masterDark != NULL && masterDark->isBayer()) || (masterFlat != NULL && masterFlat->isBayer());
+        defectMap.build(defectDark, flatMat, bayer);
+    }
+    calibrationKernel.setDefectMap(defectMap);
 }
 
-bool RProcessing::prepRegistration()
+int RProcessing::calibrateParallel()
 {
+    /// Multi-threaded calibration of the lights in the treeWidget.
+    /// Workers decode and calibrate frames concurrently, each into its own slot,
+    /// and a single writer thread consumes the slots in frame order.
+    /// With streamCalibration, the writer exports each frame to exportCalibrateDir and releases it,
+    /// otherwise the frames end up in resultList in the original order.
+    /// Returns the number of calibrated frames, or -1 if the calibration could not start.
+    QList<QUrl> lightUrls = fetchLightUrls();
+    int nFrames = lightUrls.size();
 
-    if (!useUrlsFromTreeWidget)
-    {   // If we do not use the urls from the treeWidget, then use the images in the currentROpenGLWidget
-        rMatLightList = currentROpenGLWidget->getRMatImageList();
-        std::cout << "prepRegistration()  Using currentROpenGLWidget" << std::endl;
-    }
-    else if(!treeWidget->getLightUrls().empty())
-    {   // Load the lights from the file urls in the treeWidget,
-        emit tempMessageSignal(QString("Batch processing %1 images").arg(rMatLightList.size()), 10000);
-        loadRMatLightList(treeWidget->getLightUrls());
-        std::cout << "prepRegistration()  Batch processing from treeWidget" << std::endl;
+    if (streamCalibration && exportCalibrateDir.isEmpty())
+    {
+        emit tempMessageSignal(QString("Set an export directory for streamed calibration"));
+        return -1;
     }
-    else
+
+    QDir exportDir(exportCalibrateDir);
+    if (streamCalibration && !exportDir.exists())
     {
-        emit tempMessageSignal(QString("No lights to register"), 10000);
-        return false;
+        exportDir.mkpath(QString("."));
+    }
+
+    if (!resultList.isEmpty())
+    {
+        qDeleteAll(resultList);
+        resultList.clear();
+    }
+
+    int nThreads = calibrationThreads > 0 ? calibrationThreads : cv::getNumThreads();
+    nThreads = std::max(1, std::min(nThreads, nFrames));
+    /// The window must at least cover all the workers, or they would wait on each other.
+    int window = std::max(streamWindow, nThreads);
+
+    QElapsedTimer timer;
+    timer.start();
+    streamPeakRSS = getCurrentRSS();
+    RMat::resetCounters();
+
+    CalibrationSlots calibrationSlots(nFrames, window);
+    int nCalibrated = 0;
+
+    std::thread writer([&]()
+    {
+        for (int i = 0; i < nFrames; i++)
+        {
+            RMat *rMat = calibrationSlots.waitFrame(i);
+            if (rMat != NULL)
+            {
+                nCalibrated++;
+            }
+            if (rMat != NULL && streamCalibration)
+            {
+                QString fileName = rMat->getFileInfo().baseName() + QString("_C.fits");
+                QString filePath = setupFileName(QFileInfo(exportDir.filePath(fileName)));
+                if (!exportToFits(rMat, filePath))
+                {
+                    nCalibrated--;
+                }
+                delete rMat;
+                calibrationSlots.frames[i] = NULL;
+            }
+            calibrationSlots.release(i);
+            streamPeakRSS = std::max(streamPeakRSS, getCurrentRSS());
+        }
+    });
+
+    try
+    {
+        cv::parallel_for_(cv::Range(0, nThreads), ParallelCalibration(lightUrls, calibrationKernel, &calibrationSlots), nThreads);
+    }
+    catch (...)
+    {
+        /// The writer must be joined before unwinding, or its destructor terminates the program.
+        calibrationSlots.publishRemaining();
+        writer.join();
+        for (int i = 0; i < nFrames; i++)
+        {
+            delete calibrationSlots.frames[i];
+        }
+        throw;
+    }
+    writer.join();
+
+    if (!streamCalibration)
+    {
+        for (int i = 0; i < nFrames; i++)
+        {
+            if (calibrationSlots.frames[i] != NULL)
+            {
+                resultList << calibrationSlots.frames[i];
+            }
+        }
+    }
+
+    qDebug("RProcessing::calibrateParallel() %d frames on %d threads in %f s. Peak RSS = %f MB", nFrames, nThreads,
+           timer.elapsed() / 1000.0, streamPeakRSS / (1024.0 * 1024.0));
+    qDebug("RProcessing::calibrateParallel() RMat buffer copies: %llu (%f MB), adopted: %llu", RMat::getPixelCopies(),
+           RMat::getPixelCopyBytes() / (1024.0 * 1024.0), RMat::getAdoptions());
+
+    return nCalibrated;
+}
+
+int RProcessing::calibrateStream()
+{
+    /// Out-of-core calibration of the lights in the treeWidget.
+    /// Each light is read, calibrated, written to exportCalibrateDir and released before the next one,
+    /// so the memory footprint is that of a single frame, whatever the number of lights.
+    /// Returns the number of calibrated frames, or -1 if the calibration could not start.
+    QList<QUrl> lightUrls = fetchLightUrls();
+
+    if (exportCalibrateDir.isEmpty())
+    {
+        emit tempMessageSignal(QString("Set an export directory for streamed calibration"));
+        return -1;
+    }
+
+    QDir exportDir(exportCalibrateDir);
+    if (!exportDir.exists())
+    {
+        exportDir.mkpath(QString("."));
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    streamPeakRSS = getCurrentRSS();
+
+    int nCalibrated = 0;
+    int nSkipped = 0;
+    for (int i = 0; i < lightUrls.size(); i++)
+    {
+        RMat *rMatLight = NULL;
+        {
+            /// Keep the ImageManager in this scope so the raw frame is released right after calibration.
+            ImageManager lightManager(lightUrls.at(i), false);
+            if (lightManager.getError())
+            {
+                std::cout << "RProcessing::calibrateStream() could not load " << lightUrls.at(i).toLocalFile().toStdString() << std::endl;
+                nSkipped++;
+                continue;
+            }
+            RMat *rMatRaw = lightManager.getRMatImage();
+            cv::Mat lightMat = calibrateLight(rMatRaw->matImage);
+
+            rMatLight = rMatRaw->cloneMetadata(lightMat);
+        }
+
+        QString fileName = rMatLight->getFileInfo().baseName() + QString("_C.fits");
+        QString filePath = setupFileName(QFileInfo(exportDir.filePath(fileName)));
+        if (exportToFits(rMatLight, filePath))
+        {
+            nCalibrated++;
+        }
+        else
+        {
+            nSkipped++;
+        }
+        delete rMatLight;
+
+        streamPeakRSS = std::max(streamPeakRSS, getCurrentRSS());
+        std::cout << "RProcessing::calibrateStream() frame " << i+1 << "/" << lightUrls.size()
+                  << " RSS = " << getCurrentRSS() / (1024*1024) << " MB" << std::endl;
+    }
+
+    qDebug("RProcessing::calibrateStream() %d frames in %f s, %d skipped. Peak RSS = %f MB", nCalibrated,
+           timer.elapsed() / 1000.0, nSkipped, streamPeakRSS / (1024.0 * 1024.0));
+    return nCalibrated;
+}
+
+void RProcessing::meshgrid(const cv::Mat &xgv, const cv::Mat &ygv, cv::Mat1i &X, cv::Mat1i &Y)
+{
+      cv::repeat(xgv.reshape(1,1), ygv.total(), 1, X);
+      cv::repeat(ygv.reshape(1,1).t(), 1, xgv.total(), Y);
+}
+
+
+
+
+void RProcessing::setExportMastersDir(QString dir)
+{
+    this->exportMastersDir = dir;
+    qDebug() << "Export masters to: " << exportMastersDir;
+}
+
+void RProcessing::setMasterLibraryDir(QString dir)
+{
+    if (masterLibrary != NULL)
+    {
+        /// The masters may point into its mappings.
+        std::cout << "RProcessing::setMasterLibraryDir() library already set: " << masterLibrary->getPath().toStdString() << std::endl;
+        return;
+    }
+
+    if (dir.isEmpty())
+    {
+        return;
+    }
+
+    masterLibrary = new RMasterLibrary(dir);
+    if (!masterLibrary->isValid())
+    {
+        delete masterLibrary;
+        masterLibrary = NULL;
+        emit tempMessageSignal(QString("Master library unavailable: %1").arg(dir));
+    }
+}
+
+void RProcessing::setParallelRegistration(bool status)
+{
+    this->parallelRegistration = status;
+}
+
+void RProcessing::setRegistrationThreads(int nThreads)
+{
+    this->registrationThreads = nThreads;
+}
+
+void RProcessing::setPlaneCacheBytes(size_t maxBytes)
+{
+    planeCache.setMaxBytes(maxBytes);
+}
+
+void RProcessing::setPhaseCorrelationHanning(bool status)
+{
+    this->phaseCorrelationHanning = status;
+}
+
+void RProcessing::setCosmeticCorrection(bool status)
+{
+    this->cosmeticCorrection = status;
+}
+
+void RProcessing::setDefectHotSigma(float hotSigma)
+{
+    this->defectHotSigma = hotSigma;
+}
+
+void RProcessing::setDefectColdFraction(float coldFraction)
+{
+    this->defectColdFraction = coldFraction;
+}
+
+void RProcessing::setFlatPerCFAColour(bool status)
+{
+    this->flatPerCFAColour = status;
+}
+
+void RProcessing::setUseLibraryFlat(bool status)
+{
+    this->useLibraryFlat = status;
+}
+
+bool RProcessing::loadMastersFromLibrary()
+{
+    /// Header only: instrument, size, exposure and sensor temperature of the lights.
+    RFrameMetadata lightMetadata = RMetadataScanner::scanFile(fetchLightUrls().at(0));
+    if (!lightMetadata.valid)
+    {
+        return false;
+    }
+
+    /// The masters replaced here are deleted, once even if bias and dark were the same.
+    RMat *oldBias = masterBias;
+    RMat *oldDark = masterDark;
+    RMat *oldFlat = masterFlat;
+    QStringList &usedTitles = libraryMastersUsed;
+
+    if (fetchBiasUrls().empty())
+    {
+        masterBias = masterLibrary->findBias(lightMetadata);
+        if (masterBias != NULL)
+        {
+            usedTitles << masterBias->getImageTitle();
+        }
+    }
+    if (fetchDarkUrls().empty())
+    {
+        masterDark = masterLibrary->findDark(lightMetadata);
+        if (masterDark != NULL)
+        {
+            usedTitles << masterDark->getImageTitle();
+        }
+    }
+    if (fetchFlatUrls().empty() && useLibraryFlat)
+    {
+        masterFlat = masterLibrary->findFlat(lightMetadata);
+        masterFlatFromLibrary = (masterFlat != NULL);
+        if (masterFlat != NULL)
+        {
+            usedTitles << masterFlat->getImageTitle();
+        }
+    }
+
+    if (oldBias != NULL && oldBias != masterBias && oldBias != masterDark)
+    {
+        delete oldBias;
+    }
+    if (oldDark != NULL && oldDark != masterDark && oldDark != masterBias && oldDark != oldBias)
+    {
+        delete oldDark;
+    }
+    if (oldFlat != NULL && oldFlat != masterFlat)
+    {
+        delete oldFlat;
+    }
+
+    std::cout << "RProcessing::loadMastersFromLibrary() bias: " << (masterBias != NULL) << " dark: " << (masterDark != NULL)
+              << " flat: " << (masterFlat != NULL) << std::endl;
+    return masterBias != NULL || masterDark != NULL || masterFlat != NULL;
+}
+
+void RProcessing::addMastersToLibrary()
+{
+    if (biasSuccess)
+    {
+        masterLibrary->addMaster(masterTypes::bias, masterBias, fetchBiasUrls().empty() ? rMatBiasList.size() : fetchBiasUrls().size());
+    }
+    if (darkSuccess)
+    {
+        masterLibrary->addMaster(masterTypes::dark, masterDark, fetchDarkUrls().empty() ? rMatDarkList.size() : fetchDarkUrls().size());
+    }
+    /// Only a flat that makeMasterFlat() could subtract the bias from.
+    if (flatSuccess && masterBias != NULL)
+    {
+        masterLibrary->addMaster(masterTypes::flat, masterFlat, fetchFlatUrls().empty() ? rMatFlatList.size() : fetchFlatUrls().size());
+    }
+}
+
+void RProcessing::setExportCalibrateDir(QString dir)
+{
+    this->exportCalibrateDir = dir;
+    qDebug() << "Export calibrated data to: " << exportCalibrateDir;
+}
+
+bool RProcessing::prepRegistration()
+{
+
+    if (!useUrlsFromTreeWidget)
+    {   // If we do not use the urls from the treeWidget, then use the images in the currentROpenGLWidget
+        // Without widget (batch mode), use rMatLightList as it is, e.g. straight out of the calibration.
+        if (currentROpenGLWidget != NULL)
+        {
+            rMatLightList = currentROpenGLWidget->getRMatImageList();
+            std::cout << "prepRegistration()  Using currentROpenGLWidget" << std::endl;
+        }
+    }
+    else if(!fetchLightUrls().empty())
+    {   // Load the lights from the file urls in the treeWidget,
+        emit tempMessageSignal(QString("Batch processing %1 images").arg(rMatLightList.size()), 10000);
+        loadRMatLightList(fetchLightUrls());
+        std::cout << "prepRegistration()  Batch processing from treeWidget" << std::endl;
+    }
+    else
+    {
+        emit tempMessageSignal(QString("No lights to register"), 10000);
+        return false;
+    }
+    selectLights();
+    if (rMatLightList.isEmpty())
+    {
+        emit tempMessageSignal(QString("No lights to register"), 10000);
+        return false;
     }
     if (cvRectROIList.isEmpty())
     {
@@ -2324,18 +2874,10 @@ bool RProcessing::prepRegistration()
 
     cv::Mat refMat;
 
-    if (rMatLightList.at(0)->isBayer())
-    {
-        std::cout << "prepRegistration() Original image is Bayer. Place reference image with debayerized 3-channel image" << std::endl;
-        rMatLightList.at(0)->matImageRGB.copyTo(refMat);
-    }
-    else
-    {
-        std::cout << "prepRegistration() Original image is not Bayer. Place reference image as is" << std::endl;
-        rMatLightList.at(0)->matImage.copyTo(refMat);
-    }
+    /// Bayer images stay mosaics through registration.
+    rMatLightList.at(0)->matImage.copyTo(refMat);
 
-    RMat *newRMat = new RMat(refMat, false, rMatLightList.at(0)->getInstrument(), rMatLightList.at(0)->getXPOSURE(), rMatLightList.at(0)->getTEMP());
+    RMat *newRMat = new RMat(refMat, rMatLightList.at(0)->isBayer(), rMatLightList.at(0)->getInstrument(), rMatLightList.at(0)->getXPOSURE(), rMatLightList.at(0)->getTEMP());
 
     QFileInfo fileInfo = rMatLightList.at(0)->getFileInfo();
     bool flipUD = rMatLightList.at(0)->flipUD;
@@ -2349,7 +2891,7 @@ bool RProcessing::prepRegistration()
     }
 
     std::cout << "prepRegistration() Appending reference image to resultList" << std::endl;
-    resultList << newRMat;
+    resultList << stackRegistered(newRMat, 0);
 
     std::cout << "prepRegistration() Setting fileInfo and flipUD for reference image" << std::endl;
     resultList.at(0)->setFileInfo(fileInfo);
@@ -2367,173 +2909,142 @@ void RProcessing::registerSeries()
     /// 1) By Drag and Drop in the QMdiArea
     /// 2) After a calibration like in calibrate()
     /// We use resultList as the (temporary?) output list.
+    /// The warps of all frames against frame 0 are independent of each other: they are computed first,
+    /// in parallel with parallelRegistration, then the frames are shifted and stacked in order.
+    /// The planes are only shared within one registration: they are freed on leaving, whatever the exit path.
+    RPyramidCache::ClearGuard clearPlanes(planeCache);
 
     bool status = prepRegistration();
     if (!status) {return;}
 
     int nFrames = rMatLightList.size();
 
-    // Define the motion model
-    const int warp_mode_1 = cv::MOTION_TRANSLATION;
-    const int warp_mode_2 = cv::MOTION_TRANSLATION;
-
-    // Specify the number of iterations.
-    int number_of_iterations_1 = 50; // stellar
-    int number_of_iterations_2 = 50; // stellar
-//    int number_of_iterations_1 = 100; // solar
-//    int number_of_iterations_2 = 200; // solar
-
-    // Specify the threshold of the increment
-    // in the correlation coefficient between two iterations
-    double termination_eps_1 = 1e-1; // stellar
-    double termination_eps_2 = 1e-2; // stellar
-//    double termination_eps_1 = 1e-2; // solar
-//    double termination_eps_2 = 1e-3; // solar
-
-    // Define termination criteria
-    //cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, number_of_iterations, termination_eps);
-    //cv::TermCriteria criteria(cv::TermCriteria::EPS, number_of_iterations, termination_eps);
-    cv::TermCriteria criteria1(cv::TermCriteria::COUNT, number_of_iterations_1, termination_eps_1);
-    cv::TermCriteria criteria2(cv::TermCriteria::EPS, number_of_iterations_2, termination_eps_2);
-
-
     // Get the 1st image of the rMatLightList as the reference image (and put as 1st element of resultList)
-    cv::Mat refMat;
-    // Normalized version
-    cv::Mat refMatN;
-
-    rMatLightList.at(0)->matImageGray.convertTo(refMat, CV_32F);
+    // The reference and its decimation are built once and shared by all the frames.
     // Normalize to a multiple of the exposure time * median?
-    //float lowThresh = rMatLightList.at(0)->getIntensityLow();
-    //float highThresh = rMatLightList.at(0)->getIntensityHigh();
-    float normFactor = 1.0f / rMatLightList.at(0)->getXPOSURE();
+    ECCReference reference;
+    reference.planes = PlaneParams(planeNorms::scaled, 1.0f / rMatLightList.at(0)->getXPOSURE());
 
     if(applyMask & (maskCircleRadius !=0))
     {
-        refMat = circleMaskMat(refMat, maskCircleX, maskCircleY, maskCircleRadius);
-        //emit resultSignal(refMat, false, instruments::DSLR);
+        reference.planes.maskX = maskCircleX;
+        reference.planes.maskY = maskCircleY;
+        reference.planes.maskRadius = maskCircleRadius;
     }
 
-    // Normalize to the normFactor (e.g: the mean, high threshold from rMat->calcStats(), ...)
-    refMatN = refMat * normFactor;
-    //cv::threshold(refMatN, registeredMatN, 0.9, 0.9, cv::THRESH_TRUNC);
-
-
     // If ROI is used
     if (useROI)
     {
-        refMatN = refMatN(cvRectROI);
-        emit resultSignal(refMatN, false, rMatLightList.at(0)->getInstrument());
+        reference.planes.roi = cvRectROI;
     }
 
-    // Get a resampled version. 1/4 on each axis.
-    cv::Mat refMatR;
-    cv::resize(refMatN, refMatR, cv::Size(), 0.25, 0.25, CV_INTER_AREA);
-
-
-    for (int i = 1 ; i < nFrames; ++i)
+    // Normalized reference and a resampled version, 1/4 on each axis.
+    std::vector<cv::Mat> refLevels = planeCache.get(rMatLightList.at(0), reference.planes, 2);
+    if (refLevels.size() < 2)
     {
-        qDebug("Registering image #%i/%i", i, nFrames);
-
-        cv::Mat registeredMat;
-        // Normalized mat image
-        cv::Mat registeredMatN;
-        // Rebinned mat Image
-        cv::Mat registeredMatR;
+        emit tempMessageSignal(QString("Registration: could not build the reference plane"));
+        return;
+    }
+    reference.refMatN = refLevels.at(0);
+    reference.refMatR = refLevels.at(1);
+    if (useROI)
+    {
+        emit resultSignal(reference.refMatN, false, rMatLightList.at(0)->getInstrument());
+    }
 
-        // Registration requires floating points
-        rMatLightList.at(i)->matImageGray.convertTo(registeredMat, CV_32F);
+    std::vector<cv::Mat> warps(nFrames);
+    std::vector<double> eccs(nFrames, 1.0);
+    warps[0] = cv::Mat::eye(2, 3, CV_32F);
 
-        if(applyMask & (maskCircleRadius !=0))
+    QElapsedTimer timer;
+    timer.start();
+    int nThreads = 1;
+    if (parallelRegistration && nFrames > 2)
+    {
+        nThreads = registrationThreads > 0 ? registrationThreads : cv::getNumThreads();
+        nThreads = std::max(1, std::min(nThreads, nFrames - 1));
+        std::atomic<int> nextFrame(1);
+        cv::parallel_for_(cv::Range(0, nThreads), ParallelRegistration(rMatLightList, reference, planeCache, warps, eccs, nextFrame), nThreads);
+    }
+    else
+    {
+        for (int i = 1; i < nFrames; ++i)
         {
-            registeredMat = circleMaskMat(registeredMat, maskCircleX, maskCircleY, maskCircleRadius);
-            //emit resultSignal(refMat, false, instruments::DSLR);
+            qDebug("Registering image #%i/%i", i, nFrames);
+            warps[i] = ParallelRegistration::registerFrame(rMatLightList.at(i), reference, planeCache, eccs[i]);
         }
+    }
+    qDebug("RProcessing::registerSeries() %d warps on %d threads in %f s", nFrames - 1, nThreads, timer.elapsed() / 1000.0);
+    qDebug("RProcessing::registerSeries() plane cache: %llu planes built, %llu hits, %f MB", planeCache.getBuilds(), planeCache.getHits(), planeCache.getBytes() / 1048576.0);
 
-        registeredMatN = registeredMat * normFactor;
-        // If ROI is used
-        if (useROI)
+    for (int i = 1 ; i < nFrames; ++i)
+    {
+        if (eccs[i] < 0)
         {
-            registeredMatN = registeredMatN(cvRectROI);
+            std::cout << "image #" << i << ": registration failed, frame dropped" << std::endl;
+            continue;
         }
 
-        //cv::threshold(registeredMatN, registeredMatN, 0.9, 0.9, cv::THRESH_TRUNC);
-
-
-
-        // Get a resampled version. 1/4 on each axis;
-        cv::resize(registeredMatN, registeredMatR, cv::Size(), 0.25, 0.25, CV_INTER_AREA);
-
-        cv::Mat warp_matrix_1 = cv::Mat::eye(2, 3, CV_32F);
-        double eccEps = 0;
-        // 1st pass of the ECC algorithm on the decimated image. The results are stored in warp_matrix.
-        eccEps = cv::findTransformECC(
-                    refMatR,
-                    registeredMatR,
-                    warp_matrix_1,
-                    warp_mode_1,
-                    criteria1
-                    );
-        qDebug() << "eccEps 1 =" << eccEps / 0.25;
-        warp_matrix_1.at<float>(0, 2) /= 0.25;
-        warp_matrix_1.at<float>(1, 2) /= 0.25;
-        std::cout << "result warp_matrix 1 =" << std::endl << warp_matrix_1 << std::endl << std::endl;
-
-        // 2nd pass on the full resolution images.
-        eccEps = cv::findTransformECC(
-                    refMatN,
-                    registeredMatN,
-                    warp_matrix_1,
-                    warp_mode_2,
-                    criteria2
-                    );
-
-        qDebug() << "eccEps 2 =" << eccEps;
-        std::cout << "result warp_matrix 2 =" << std::endl << warp_matrix_1 << std::endl << std::endl;
+        cv::Mat warp_matrix_1 = warps[i];
+        std::cout << "image #" << i << ": eccEps = " << eccs[i] << ", warp_matrix =" << std::endl << warp_matrix_1 << std::endl << std::endl;
 
         // To do the alignment, use warpAffine. Needs to be applied on 3 channels separately and reassemble the channels?
         // That should be ok as the shifts will be applied rigidly on the 3 channels.
 
         if (rMatLightList.at(0)->isBayer())
         {
-            // RGB array for splitting channels
-            cv::Mat tempMatRGB[3];
-            // Split the channels
-            cv::split(rMatLightList.at(i)->matImageRGB, tempMatRGB);
-            cv::warpAffine(tempMatRGB[0], tempMatRGB[0], warp_matrix_1, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-            cv::warpAffine(tempMatRGB[1], tempMatRGB[1], warp_matrix_1, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-            cv::warpAffine(tempMatRGB[2], tempMatRGB[2], warp_matrix_1, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-
-            tempMatRGB[0].convertTo(tempMatRGB[0], CV_16U);
-            tempMatRGB[1].convertTo(tempMatRGB[1], CV_16U);
-            tempMatRGB[2].convertTo(tempMatRGB[2], CV_16U);
-            vector<cv::Mat> channels;
-            // Watch the order. 1st array will be last channel.
-            channels.push_back(tempMatRGB[0]);
-            channels.push_back(tempMatRGB[1]);
-            channels.push_back(tempMatRGB[2]);
-            cv::Mat registeredMatRGB;
-            cv::merge(channels, registeredMatRGB);
-            // registeredMat is necessarily non-bayer.
-            resultList << new RMat(registeredMatRGB, false, rMatLightList.at(i)->getInstrument());
+            cv::Mat registeredCFA = shiftImage(rMatLightList.at(i), warp_matrix_1);
+            resultList << stackRegistered(RMat::adopt(registeredCFA, true, rMatLightList.at(i)->getInstrument()), i);
         }
         else
         {
-            cv::warpAffine(registeredMat, registeredMat, warp_matrix_1, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
+            cv::Mat registeredMat;
+            if (drizzle)
+            {
+                registeredMat = shiftImage(rMatLightList.at(i), warp_matrix_1);
+            }
+            else
+            {
+                rMatLightList.at(i)->getMatImageGray().convertTo(registeredMat, CV_32F);
+                if(applyMask & (maskCircleRadius !=0))
+                {
+                    registeredMat = circleMaskMat(registeredMat, maskCircleX, maskCircleY, maskCircleRadius);
+                }
+                cv::warpAffine(registeredMat, registeredMat, warp_matrix_1, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
+            }
             // registeredMat is necessarily non-bayer.
-            resultList << new RMat(registeredMat, false, rMatLightList.at(i)->getInstrument());
-            resultList.at(i)->setBscale(normFactor);
+            resultList << stackRegistered(RMat::adopt(registeredMat, false, rMatLightList.at(i)->getInstrument()), i);
+            resultList.last()->setBscale(reference.planes.scale);
 
         }
 
     }
 
+    /// Frames on which ECC failed were left out: they are neither stacked nor drizzled. Their weights are only
+    /// removed now, as stackRegistered() looks them up by light index, so that frameWeightList follows resultList.
+    int nDropped = 0;
+    for (int i = nFrames - 1; i > 0; --i)
+    {
+        if (eccs[i] < 0)
+        {
+            if (i < (int) frameWeightList.size())
+            {
+                frameWeightList.erase(frameWeightList.begin() + i);
+            }
+            nDropped++;
+        }
+    }
+    if (nDropped > 0)
+    {
+        emit tempMessageSignal(QString("%1 of %2 frames dropped: registration failed").arg(nDropped).arg(nFrames));
+    }
 }
 
 void RProcessing::registerSeriesXCorrPropagate(bool useROI, bool normalizeByExposure, int sigmaBlur)
 {
     /// Register by pairs of nearest frames (in time) and propagate up to the first so that the series
     /// is coaligned with the first image.
+    RPyramidCache::ClearGuard clearPlanes(planeCache);
 
     // Check that registration is properly setup, including normalization.
     bool status = prepRegistration();
@@ -2543,48 +3054,15 @@ void RProcessing::registerSeriesXCorrPropagate(bool useROI, bool normalizeByExpo
         return;
     }
 
-    cv::Mat refMat;
-    cv::Mat currentMatImage;
+    // Each frame is normalized and blurred once, from the plane cache, though it is used in two pairs.
+    PlaneParams planes(normalizeByExposure ? planeNorms::exposureThresh : planeNorms::channel);
+    planes.sigmaBlur = sigmaBlur;
+
     cv::Mat warpMatrixTotal = cv::Mat::eye( 2, 3, CV_32FC1 );
     for (int i=0; i < rMatLightList.size()-1; i++)
     {
-        std::cout << "RProcessing::registerSeriesXCorrPropagate() converting to CV_32F at frame # " << i << std::endl;
-
-        refMat = rMatLightList.at(i)->extractChannel(0);
-        currentMatImage = rMatLightList.at(i+1)->extractChannel(0);
-
-        cv::Mat refMatN;
-        cv::Mat currentMatImageN;
-        if (normalizeByExposure)
-        {
-            refMatN = normalizeByThresh(refMat, 0, 16183, 65536.0);
-            refMatN = refMatN / rMatLightList.at(i)->getXPOSURE();
-
-            currentMatImageN = normalizeByThresh(currentMatImage, 0, 16183, 65536.0);
-            currentMatImageN = currentMatImageN / rMatLightList.at(i+1)->getXPOSURE();
-
-        }
-        else
-        {
-            refMat.convertTo(refMatN, CV_32F);
-            currentMatImage.convertTo(currentMatImageN, CV_32F);
-        }
-
-
-//        rMatLightList.at(i)->matImageGray.convertTo(refMat, CV_32F);
-//        rMatLightList.at(i+1)->matImageGray.convertTo(currentMatImage, CV_32F);
-
-        std::cout << "RProcessing::registerSeriesXCorrPropagate() divide by XPOSURE at frame # " << i << std::endl;
-
-
-
-
-        if (sigmaBlur > 0)
-        {
-            // Gaussien blur. Kernel size is estimate from sigma.
-            cv::GaussianBlur(refMatN, refMatN, cv::Size(0, 0), sigmaBlur);
-            cv::GaussianBlur(currentMatImageN, currentMatImageN, cv::Size(0, 0), sigmaBlur);
-        }
+        cv::Mat refMatN = planeCache.plane(rMatLightList.at(i), planes);
+        cv::Mat currentMatImageN = planeCache.plane(rMatLightList.at(i+1), planes);
 
         std::cout << "RProcessing::registerSeriesXCorrPropagate() Calculating shift at frame # " << i << std::endl;
 
@@ -2614,16 +3092,16 @@ void RProcessing::registerSeriesXCorrPropagate(bool useROI, bool normalizeByExpo
         std::cout << "RProcessing::registerSeriesXCorrPropagate() ShiftY = " << warpMat.at<float>(1, 2) << std::endl;
 
         cv::Mat shiftedMat = shiftImage(rMatLightList.at(i+1), warpMatrixTotal);
-        resultList << new RMat(shiftedMat, false, rMatLightList.at(i+1)->getInstrument(), rMatLightList.at(i+1)->getXPOSURE(), rMatLightList.at(i+1)->getTEMP());
+        resultList << stackRegistered(RMat::adopt(shiftedMat, rMatLightList.at(i+1)->isBayer(), rMatLightList.at(i+1)->getInstrument(), rMatLightList.at(i+1)->getXPOSURE(), rMatLightList.at(i+1)->getTEMP()), i+1);
         resultList.at(i+1)->setFileInfo(rMatLightList.at(i+1)->getFileInfo());
         resultList.at(i+1)->flipUD = rMatLightList.at(i+1)->flipUD;
     }
-
 }
 
 void RProcessing::registerSeriesOnLimbFit()
 {   /// X-correlate upon the results of the limb-based registration
     /// Uses output variable "limbFitResultList1" from solarLimbRegisterSeries();
+    RPyramidCache::ClearGuard clearPlanes(planeCache);
 
     if (limbFitWarpMat.empty())
     {
@@ -2659,45 +3137,38 @@ void RProcessing::registerSeriesOnLimbFit()
     //cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, number_of_iterations, termination_eps);
     //cv::TermCriteria criteria(cv::TermCriteria::EPS, number_of_iterations, termination_eps);
     cv::TermCriteria criteria1(cv::TermCriteria::COUNT, number_of_iterations_1, termination_eps_1);
-    cv::TermCriteria criteria2(cv::TermCriteria::EPS, number_of_iterations_2, termination_eps_2);
-
-
-    // Get the 1st image of the rMatLightList as the reference image (and put as 1st element of resultList)
-
-    cv::Mat refMat;
-    limbFitResultList1.at(0)->matImage.convertTo(refMat, CV_16U);
-
-
-    RMat *refRMat = new RMat(refMat, false, limbFitResultList1.at(0)->getInstrument());
-    limbFitResultList2 << refRMat;
-    limbFitResultList2.at(0)->setImageTitle(QString("X-corr registered image # 1"));
+    cv::TermCriteria criteria2(cv::TermCriteria::EPS, number_of_iterations_2, termination_eps_2);
 
-    cv::Mat refMat0 = normalizeByThresh(limbFitResultList1.at(0)->matImage, limbFitResultList1.at(0)->getIntensityLow(), limbFitResultList1.at(0)->getIntensityHigh(), limbFitResultList1.at(0)->getNormalizeRange());
-//    emit resultSignal(refMat0, false, rMatList.at(0)->getInstrument(), QString("BLAH 0"));
 
     // Set low and high threshold values to properly saturate the disk.
-    float lowThresh = 100.0f;
-    float highThresh = 2000.0f;
-    // Get and normalize/saturate the new reference image (at i = 0).
-    // Need to take into account the new range within which the image has been normalized, and clip it.
-    cv::Mat refMat1 = normalizeClipByThresh(refMat0, lowThresh, highThresh, limbFitResultList1.at(0)->getDataRange());
-//    emit resultSignal(refMat1, false, instruments::generic, QString("BLAH 1"));
-
-    // Get ROI if any
-    cv::Mat refMat2;
+    // Each image is normalized/saturated (taking into account the new range within which it has been normalized and clipped),
+    // cut to the ROI if any and resampled, 1/4 on each axis, in the plane cache.
+    PlaneParams planes(planeNorms::limb);
+    planes.clipLow = 100.0f;
+    planes.clipHigh = 2000.0f;
     if (useROI)
     {
-        refMat2 = refMat1(cvRectROI);
+        planes.roi = cvRectROI;
     }
-    else
+
+    std::vector<cv::Mat> refLevels = planeCache.get(limbFitResultList1.at(0), planes, 2);
+    // The reference planes come first, so that nothing is stacked when they cannot be built.
+    if (refLevels.size() < 2)
     {
-        refMat2 = refMat1;
+        emit tempMessageSignal(QString("Limb registration: could not build the reference plane"));
+        return;
     }
-    refMat2.convertTo(refMat2, CV_32F);
+    cv::Mat refMat2 = refLevels.at(0);
+    cv::Mat refMat2R = refLevels.at(1);
+
+    // Get the 1st image of the rMatLightList as the reference image (and put as 1st element of resultList)
+    cv::Mat refMat;
+    limbFitResultList1.at(0)->matImage.convertTo(refMat, CV_16U);
 
-    // Get a resampled version of the reference image. 1/4 on each axis.
-    cv::Mat refMat2R;
-    cv::resize(refMat2, refMat2R, cv::Size(), 0.25, 0.25, CV_INTER_AREA);
+
+    RMat *refRMat = new RMat(refMat, false, limbFitResultList1.at(0)->getInstrument());
+    limbFitResultList2 << stackRegistered(refRMat, 0);
+    limbFitResultList2.at(0)->setImageTitle(QString("X-corr registered image # 1"));
 
 
     for (int i = 1 ; i < nFrames; ++i)
@@ -2705,29 +3176,10 @@ void RProcessing::registerSeriesOnLimbFit()
 
         qDebug("Registering image #%i/%i", i, nFrames);
 
-        cv::Mat tempMat = normalizeByThresh(limbFitResultList1.at(i)->matImage, limbFitResultList1.at(i)->getIntensityLow(), limbFitResultList1.at(i)->getIntensityHigh(), limbFitResultList1.at(i)->getNormalizeRange());
-
         // Get the image to co-align with respect to the reference image
-        cv::Mat registeredMat = normalizeClipByThresh(tempMat, lowThresh, highThresh, limbFitResultList1.at(i)->getDataRange());
-
-        cv::Mat registeredMat2;
-        if (useROI)
-        {
-            registeredMat2 = registeredMat(cvRectROI);
-        }
-        else
-        {
-            registeredMat2 = registeredMat;
-        }
-
-
-        registeredMat2.convertTo(registeredMat2, CV_32F);
-
-        //resultSignal(registeredMat2, false, instruments::generic);
-
-        // Get a resampled version. 1/4 on each axis.
-        cv::Mat registeredMat2R;
-        cv::resize(registeredMat2, registeredMat2R, cv::Size(), 0.25, 0.25, CV_INTER_AREA);
+        std::vector<cv::Mat> levels = planeCache.get(limbFitResultList1.at(i), planes, 2);
+        cv::Mat registeredMat2 = levels.at(0);
+        cv::Mat registeredMat2R = levels.at(1);
 
         cv::Mat warp_matrix_1 = cv::Mat::eye(2, 3, CV_32F);
         double eccEps = 0;
@@ -2741,9 +3193,9 @@ void RProcessing::registerSeriesOnLimbFit()
                     criteria1
                     );
 
-        qDebug() << "eccEps 1 =" << eccEps / 0.25;
-        warp_matrix_1.at<float>(0, 2) /= 0.25;
-        warp_matrix_1.at<float>(1, 2) /= 0.25;
+        qDebug() << "eccEps 1 =" << eccEps / RPyramidCache::levelScale(1);
+        warp_matrix_1.at<float>(0, 2) /= RPyramidCache::levelScale(1);
+        warp_matrix_1.at<float>(1, 2) /= RPyramidCache::levelScale(1);
         std::cout << "result warp_matrix 1 =" << std::endl << warp_matrix_1 << std::endl << std::endl;
 
         // 2nd pass on the full resolution images.
@@ -2765,13 +3217,12 @@ void RProcessing::registerSeriesOnLimbFit()
         warp_matrix_total.at<float>(1, 2) = limbFitWarpMat.at<float>(1, 2) + warp_matrix_1.at<float>(1, 2);
         std::cout << "warp_matrix_total = " << std::endl << " " << warp_matrix_total << std::endl << std::endl;
 
-        cv::warpAffine(rMatLightList.at(i)->matImage, registeredMat, warp_matrix_total, registeredMat.size(),cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
+        cv::Mat registeredMat = shiftImage(rMatLightList.at(i), warp_matrix_total);
 
         registeredMat.convertTo(registeredMat, CV_16U);
-        limbFitResultList2 << new RMat(registeredMat, false, rMatLightList.at(i)->getInstrument()); // This RMat is necessarily non-bayer.
+        limbFitResultList2 << stackRegistered(RMat::adopt(registeredMat, rMatLightList.at(i)->isBayer(), rMatLightList.at(i)->getInstrument()), i);
         limbFitResultList2.at(i)->setImageTitle(QString("X-corr registered image # %1").arg(i));
     }
-
 }
 
 void RProcessing::registerSeriesByPhaseCorrelation()
@@ -2780,15 +3231,14 @@ void RProcessing::registerSeriesByPhaseCorrelation()
     /// 1) By Drag and Drop in the QMdiArea
     /// 2) After a calibration like in calibrate()
     /// We use resultList as the (temporary?) output list.
-    if (!treeWidget->rMatLightList.isEmpty())
-    {
-        rMatLightList = treeWidget->rMatLightList;
-    }
-    else
+    RPyramidCache::ClearGuard clearPlanes(planeCache);
+
+    if (!fetchRMatLightList())
     {
         emit tempMessageSignal(QString("No lights to register"));
         return;
     }
+    selectLights();
     // Clear the resultList if not empty
     if (!resultList.isEmpty())
     {
@@ -2797,35 +3247,42 @@ void RProcessing::registerSeriesByPhaseCorrelation()
     }
 
     // Get the 1st image of the rMatLightList as the reference image (and put as 1st element of resultList)
-    cv::Mat refMat;
-    // Normalized version
-    cv::Mat refMatN;
+    resultList << stackRegistered(new RMat(rMatLightList.at(0)->matImage, rMatLightList.at(0)->isBayer(), rMatLightList.at(0)->getInstrument()), 0);
+
+    // Normalize to a multiple of the exposure time * median?
+    float normFactor = 1.0f / rMatLightList.at(0)->getXPOSURE();
+    // Normalized versions, from the plane cache
+    PlaneParams planes(planeNorms::scaled, normFactor);
+    cv::Mat refMatN = planeCache.plane(rMatLightList.at(0), planes);
+
+    // The reference spectrum and window are computed once. Like in registerSeries(), the shifts are
+    // independent of each other and computed first, in parallel with parallelRegistration.
+    RPhaseCorrelator correlator(refMatN, phaseCorrelationHanning);
+    int nFrames = rMatLightList.size();
+    std::vector<cv::Point2d> shifts(nFrames);
 
-    if (rMatLightList.at(0)->isBayer())
+    QElapsedTimer timer;
+    timer.start();
+    int nThreads = 1;
+    if (parallelRegistration && nFrames > 2)
     {
-        resultList << new RMat(rMatLightList.at(0)->matImageRGB, false, rMatLightList.at(0)->getInstrument());
+        nThreads = registrationThreads > 0 ? registrationThreads : cv::getNumThreads();
+        nThreads = std::max(1, std::min(nThreads, nFrames - 1));
+        std::atomic<int> nextFrame(1);
+        cv::parallel_for_(cv::Range(0, nThreads), ParallelPhaseCorrelation(rMatLightList, correlator, planeCache, planes, shifts, nextFrame), nThreads);
     }
     else
     {
-        resultList << new RMat(rMatLightList.at(0)->matImage, false, rMatLightList.at(0)->getInstrument());
+        for (int i = 1; i < nFrames; ++i)
+        {
+            shifts[i] = correlator.shift(planeCache.plane(rMatLightList.at(i), planes));
+        }
     }
+    qDebug("RProcessing::registerSeriesByPhaseCorrelation() %d shifts on %d threads in %f s", nFrames - 1, nThreads, timer.elapsed() / 1000.0);
 
-
-    rMatLightList.at(0)->matImageGray.convertTo(refMat, CV_32F);
-    // Normalize to a multiple of the exposure time * median?
-    float normFactor = 1.0f / rMatLightList.at(0)->getXPOSURE();
-    // Normalize to the normFactor (e.g: the mean, high threshold from rMat->calcStats(), ...)
-    refMatN = refMat * normFactor;
-
-
-    for (int i=1; i < rMatLightList.size(); i++)
+    for (int i=1; i < nFrames; i++)
     {
-        cv::Mat currentMatImage;
-        rMatLightList.at(i)->matImageGray.convertTo(currentMatImage, CV_32F);
-
-        cv::Mat currentMatImageN = currentMatImage * normFactor;
-
-        cv::Point2d shift = cv::phaseCorrelate(refMatN, currentMatImageN);
+        cv::Point2d shift = shifts[i];
         std::cout << "Shifts = " << shift << std::endl;
 
         cv::Mat registeredMat;
@@ -2835,41 +3292,24 @@ void RProcessing::registerSeriesByPhaseCorrelation()
 
         if (rMatLightList.at(0)->isBayer())
         {
-            // RGB array for splitting channels
-            cv::Mat tempMatRGB[3];
-            // Split the channels
-            cv::split(rMatLightList.at(i)->matImageRGB, tempMatRGB);
-            cv::warpAffine(tempMatRGB[0], tempMatRGB[0], warpMat, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-            cv::warpAffine(tempMatRGB[1], tempMatRGB[1], warpMat, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-            cv::warpAffine(tempMatRGB[2], tempMatRGB[2], warpMat, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-
-            tempMatRGB[0].convertTo(tempMatRGB[0], CV_16U);
-            tempMatRGB[1].convertTo(tempMatRGB[1], CV_16U);
-            tempMatRGB[2].convertTo(tempMatRGB[2], CV_16U);
-            vector<cv::Mat> channels;
-            // Watch the order. 1st array will be last channel.
-            channels.push_back(tempMatRGB[0]);
-            channels.push_back(tempMatRGB[1]);
-            channels.push_back(tempMatRGB[2]);
-            cv::Mat registeredMatRGB;
-            cv::merge(channels, registeredMatRGB);
-            // registeredMat is necessarily non-bayer.
-            resultList << new RMat(registeredMatRGB, false, rMatLightList.at(i)->getInstrument());
+            cv::Mat registeredCFA = shiftImage(rMatLightList.at(i), warpMat);
+            resultList << stackRegistered(RMat::adopt(registeredCFA, true, rMatLightList.at(i)->getInstrument()), i);
         }
         else
         {
-            cv::warpAffine(rMatLightList.at(i)->matImage, registeredMat, warpMat, registeredMat.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
+            registeredMat = shiftImage(rMatLightList.at(i), warpMat);
             // registeredMat is necessarily non-bayer.
-            resultList << new RMat(registeredMat, false, rMatLightList.at(i)->getInstrument());
+            resultList << stackRegistered(RMat::adopt(registeredMat, false, rMatLightList.at(i)->getInstrument()), i);
             resultList.at(i)->setBscale(normFactor);
 
         }
     }
-
 }
 
 void RProcessing::registerSeriesCustom()
 {
+    RPyramidCache::ClearGuard clearPlanes(planeCache);
+
     if (cvRectROI.empty())
     {
         emit tempMessageSignal(QString("ROI not defined"));
@@ -2882,15 +3322,12 @@ void RProcessing::registerSeriesCustom()
         return;
     }
 
-    if (!treeWidget->rMatLightList.isEmpty())
-    {
-        rMatLightList = treeWidget->rMatLightList;
-    }
-    else
+    if (!fetchRMatLightList())
     {
         emit tempMessageSignal(QString("No lights to register"));
         return;
     }
+    selectLights();
     // Clear the resultList if not empty
     if (!resultList.isEmpty())
     {
@@ -2899,26 +3336,24 @@ void RProcessing::registerSeriesCustom()
     }
 
     // Get the 1st image of the rMatLightList as the reference image (and put as 1st element of resultList)
-    cv::Mat refMat;
-    // Normalized version
-    cv::Mat refMatN;
-
-    if (rMatLightList.at(0)->isBayer())
-    {
-        resultList << new RMat(rMatLightList.at(0)->matImageRGB, false, rMatLightList.at(0)->getInstrument());
-    }
-    else
-    {
-        resultList << new RMat(rMatLightList.at(0)->matImage, false, rMatLightList.at(0)->getInstrument());
-    }
-
-    rMatLightList.at(0)->matImageGray.convertTo(refMat, CV_32F);
+    resultList << stackRegistered(new RMat(rMatLightList.at(0)->matImage, rMatLightList.at(0)->isBayer(), rMatLightList.at(0)->getInstrument()), 0);
 
+    // Normalized and blurred versions, from the plane cache
     float normFactor = 1.0f / rMatLightList.at(0)->getXPOSURE();
-    refMatN = refMat * normFactor;
+    PlaneParams planes(planeNorms::scaled, normFactor);
+    planes.sigmaBlur = 3;
+    cv::Mat refMatN = planeCache.plane(rMatLightList.at(0), planes);
 
     std::cout << "cvRectROI = " << cvRectROI << std::endl;
 
+    // The correlations of the reference ROI and of the mask are computed once for the whole series.
+    cv::Mat mask;
+    if(applyMask)
+    {
+        mask = circleMask(refMatN, maskCircleX, maskCircleY, maskCircleRadius);
+    }
+    RMaskedXCorr xCorr(refMatN, mask, cvRectROI, 50);
+
     // Originally I chose to use the first image in the timeline as a reference
     // During the total eclipse, statistical properties change rapidly, and normalization by exposure time is not enough
     // (it's also the case with clouds, fire haze passing quickly etc...)
@@ -2926,17 +3361,13 @@ void RProcessing::registerSeriesCustom()
     // This is the purpose of the function registerSeriesCustomPropagate()
     for (int i=1; i < rMatLightList.size(); i++)
     {
-        cv::Mat currentMatImage;
-        rMatLightList.at(i)->matImageGray.convertTo(currentMatImage, CV_32F);
-
-        cv::Mat currentMatImageN = currentMatImage * normFactor;
-        cv::Point shift = calculateSADShift(refMatN, currentMatImageN, cvRectROI, 50);
+        cv::Mat currentMatImageN = planeCache.plane(rMatLightList.at(i), planes);
+        cv::Point2f shift = xCorr.shift(currentMatImageN);
         std::cout << "Shifts = " << shift << std::endl;
 
-        cv::Mat shiftedMat = shiftImage(rMatLightList.at(i), shift);
-        resultList << new RMat(shiftedMat, false, rMatLightList.at(i)->getInstrument());
+        cv::Mat shiftedMat = shiftImage(rMatLightList.at(i), shiftToWarp(shift));
+        resultList << stackRegistered(RMat::adopt(shiftedMat, rMatLightList.at(i)->isBayer(), rMatLightList.at(i)->getInstrument()), i);
     }
-
 }
 
 void RProcessing::registerSeriesCustomPropagate()
@@ -2946,6 +3377,7 @@ void RProcessing::registerSeriesCustomPropagate()
     // During the total eclipse, statistical properties change rapidly, and normalization by exposure time is not enough
     // (it's also the case with clouds, fire haze passing quickly etc...)
     // Thus I should opt for a propagating approach, and make a by-pair coalignment, and propagate the shift with respect to the first image
+    RPyramidCache::ClearGuard clearPlanes(planeCache);
 
     std::cout << "Starting registerSeriesCustomPropagate()... " << std::endl;
 
@@ -2961,15 +3393,12 @@ void RProcessing::registerSeriesCustomPropagate()
         return;
     }
 
-    if (!treeWidget->rMatLightList.isEmpty())
-    {
-        rMatLightList = treeWidget->rMatLightList;
-    }
-    else
+    if (!fetchRMatLightList())
     {
         emit tempMessageSignal(QString("No lights to register"));
         return;
     }
+    selectLights();
     // Clear the resultList if not empty
     if (!resultList.isEmpty())
     {
@@ -2979,118 +3408,59 @@ void RProcessing::registerSeriesCustomPropagate()
 
     std::cout << "registerSeriesCustomPropagate() check passed. " << std::endl;
 
-    cv::Mat refMat;
-    // Normalized version
-    cv::Mat refMatN;
-    cv::Mat currentMatImage;
-    cv::Mat currentMatImageN;
-
-
-    if (rMatLightList.at(0)->isBayer())
-    {
-        resultList << new RMat(rMatLightList.at(0)->matImageRGB, false, rMatLightList.at(0)->getInstrument());
-    }
-    else
-    {
-        resultList << new RMat(rMatLightList.at(0)->matImage, false, rMatLightList.at(0)->getInstrument());
-    }
+    resultList << stackRegistered(new RMat(rMatLightList.at(0)->matImage, rMatLightList.at(0)->isBayer(), rMatLightList.at(0)->getInstrument()), 0);
 
+    // Normalized and blurred versions, from the plane cache: each frame is used in two pairs.
     float normFactor = 1.0f / rMatLightList.at(0)->getXPOSURE();
+    PlaneParams planes(planeNorms::scaled, normFactor);
+    planes.sigmaBlur = 3;
 
     std::cout << "cvRectROI = " << cvRectROI << std::endl;
     std::cout << "cvRectROIList(0) = " << cvRectROIList.at(0) << std::endl;
 
-    cv::Point shift(0, 0);
+    cv::Point2f shift(0, 0);
     for (int i=0; i < rMatLightList.size()-1; i++)
     {
-        rMatLightList.at(i)->matImageGray.convertTo(refMat, CV_32F);
-        refMatN = refMat * normFactor;
-
-        rMatLightList.at(i+1)->matImageGray.convertTo(currentMatImage, CV_32F);
-
-        currentMatImageN = currentMatImage * normFactor;
-        //shift = shift + calculateSADShift(refMatN, currentMatImageN, cvRectROI, 50);
-        shift = shift + calculateSADShift(refMatN, currentMatImageN, cvRectROIList, 50);
+        cv::Mat refMatN = planeCache.plane(rMatLightList.at(i), planes);
+        cv::Mat currentMatImageN = planeCache.plane(rMatLightList.at(i+1), planes);
+        shift = shift + calculateMaskedXCorrShift(refMatN, currentMatImageN, cvRectROIList, 50);
         std::cout << "Shifts = " << shift << std::endl;
 
-        cv::Mat shiftedMat = shiftImage(rMatLightList.at(i+1), shift);
-        resultList << new RMat(shiftedMat, false, rMatLightList.at(i)->getInstrument());
+        cv::Mat shiftedMat = shiftImage(rMatLightList.at(i+1), shiftToWarp(shift));
+        resultList << stackRegistered(RMat::adopt(shiftedMat, rMatLightList.at(i)->isBayer(), rMatLightList.at(i)->getInstrument()), i+1);
     }
 }
 
-cv::Point RProcessing::calculateSADShift(cv::Mat refMat, cv::Mat matImage, cv::Rect fov, int maxLength)
+cv::Point2f RProcessing::calculateMaskedXCorrShift(cv::Mat refMat, cv::Mat matImage, cv::Rect fov, int maxLength)
 {
-
+    /// Masked normalized cross-correlation over all the shifts within +/- maxLength/2 at once, see RMaskedXCorr.
+    /// refMat and matImage come blurred (sigma 3) from the plane cache.
     cv::Mat mask;
     if(applyMask)
     {
         mask = circleMask(refMat, maskCircleX, maskCircleY, maskCircleRadius);
-        //emit resultSignal(refMat, false, instruments::DSLR);
-    }
-    else
-    {
-        mask = cv::Mat::ones(refMat.size(), CV_8U);
-    }
-
-    cv::GaussianBlur(refMat, refMat, cv::Size(0, 0), 3);
-    cv::GaussianBlur(matImage, matImage, cv::Size(0, 0), 3);
-
-    cv::Mat diffMat;
-    cv::Mat absDiffMat;
-    cv::Mat sMask = mask(fov);
-    cv::Mat sMask2;
-    cv::Mat sRefMat = refMat(fov);
-    cv::Mat sMatImage;
-    cv::Mat SAD = cv::Mat::zeros(maxLength, maxLength, CV_32F);
-    cv::Rect fov2 = fov;
-
-    // Loop through all test shifts using sum of absolute difference
-    // Beware, SAD is initially populated with zeros. So I must not "miss a spot".
-    for (int i=0; i < maxLength; ++i)
-    {
-        int dy = -maxLength / 2 + i;
-        fov2.y = fov.y + dy;
-
-        for (int j=0; j < maxLength; ++j)
-        {
-            int dx = -maxLength/2 + j;
-            fov2.x = fov.x + dx;
-            //std::cout << "[dx, dy] " << "[" << dx << "," << dy << "]" << std::endl;
-
-            sMatImage = matImage(fov2);
-            // Combine the shifted mask and the reference mask into one mask, with zeros wherever one of them is zeros
-            cv::bitwise_and(sMask, mask(fov2), sMask2);
-            cv::subtract(sRefMat, sMatImage, diffMat, sMask2);
-            absDiffMat = cv::abs(diffMat);
-            cv::Scalar sad = cv::sum(absDiffMat) / cv::sum(sMask2);
-            SAD.at<float>(i,j) = (float) sad.val[0];
-        }
     }
 
-    cv::Point minLoc;
-    cv::Point maxLoc;
-    double minValue;
-    double maxValue;
-    cv::minMaxLoc(SAD, &minValue, &maxValue, &minLoc, &maxLoc);
-    cv::Point shift;
-    shift.x = minLoc.x - maxLength/2;
-    shift.y = minLoc.y - maxLength/2;
+    RMaskedXCorr xCorr(refMat, mask, fov, maxLength);
+    double peak;
+    cv::Point2f shift = xCorr.shift(matImage, &peak);
+    std::cout << "calculateMaskedXCorrShift:: shift = " << shift << ", correlation = " << peak << std::endl;
 
     return shift;
 }
 
-cv::Point RProcessing::calculateSADShift(cv::Mat refMat, cv::Mat matImage, QList<cv::Rect> fovList, int maxLength)
+cv::Point2f RProcessing::calculateMaskedXCorrShift(cv::Mat refMat, cv::Mat matImage, QList<cv::Rect> fovList, int maxLength)
 {
-    cv::Point shift;
-    for (int i=0; i < fovList.size(); i++)
+    /// All the ROIs at once, combined robustly. See RROIRegistration.
+    cv::Mat mask;
+    if(applyMask)
     {
-        cv::Rect fov = fovList.at(i);
-        shift += calculateSADShift(refMat, matImage, fov, maxLength);
+        mask = circleMask(refMat, maskCircleX, maskCircleY, maskCircleRadius);
     }
 
-    // Average the shifts
-    shift /= fovList.size();
-    std::cout << "calculateSADShift:: shift = "<< std::endl;
+    RROIRegistration registration(refMat, fovList, roiEstimators::maskedXCorr, maxLength / 2, mask);
+    cv::Point2f shift = registration.shift(matImage);
+    std::cout << "calculateMaskedXCorrShift:: shift = "<< std::endl;
     std::cout << shift << std::endl;
 
     return shift;
@@ -3167,63 +3537,28 @@ cv::Mat RProcessing::calculateXCorrShift(cv::Mat refMat, cv::Mat matImage, cv::M
 
 cv::Mat RProcessing::calculateXCorrShift(cv::Mat refMat, cv::Mat matImage, QList<cv::Rect> fovList)
 {
+    /// All the ROIs are extracted once and solved concurrently, on patches of matImage, then combined
+    /// robustly. See RROIRegistration.
+    RROIRegistration registration(refMat, fovList, roiEstimators::ecc);
+    std::vector<cv::Point2f> roiShifts;
+    std::vector<double> roiWeights;
+    std::vector<bool> inliers;
+    cv::Point2f shift = registration.shift(matImage, &roiShifts, &roiWeights, &inliers);
 
-
-
-    cv::Rect roi = fovList.at(0);
-    std::cout << "RProcessing::calculateXCorrShift() 1st roi = " << roi << std::endl;
-
-    cv::Mat sRefMat = refMat(roi);
-    cv::Mat sMatImage = matImage(roi);
-
-    cv::Mat warpMatrix0 = calculateXCorrShift(sRefMat, sMatImage);
-    std::cout << "1st pass. warpMatrix_0 = " << warpMatrix0 << std::endl;
-
-
-    if (fovList.size() == 1)
+    for (int i = 0; i < registration.getNROIs(); i++)
     {
-        return warpMatrix0;
-    }
-
-    std::cout << "Shifting image for 2nd pass..." << std::endl;
-    cv::warpAffine(matImage, matImage, warpMatrix0, matImage.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-
-
-    cv::Mat warpMatrixTotal = cv::Mat::eye( 2, 3, CV_32FC1 );
-    std::cout << "warpMatrixTotal = " << warpMatrixTotal << std::endl;
-    for (int i=1; i < fovList.size(); i++)
-    {
-        std::cout << "Calculating shift for ROI # " << i << std::endl;
-        cv::Rect roi = fovList.at(i);
-        std::cout << "roi = " << roi << std::endl;
-
-        cv::Mat sRefMat = refMat(roi);
-        cv::Mat sMatImage = matImage(roi);
-
-        cv::Mat warpMatrix_i = calculateXCorrShift(sRefMat, sMatImage);
-        std::cout << "warpMatrix_i = " << warpMatrix_i << std::endl;
-
-        // Translation in 1st dimension
-        warpMatrixTotal.at<float>(0,2) += warpMatrix_i.at<float>(0, 2);
-        // Translation in 2nd dimension
-        warpMatrixTotal.at<float>(1,2) += warpMatrix_i.at<float>(1, 2);
+        std::cout << "ROI # " << i << ": shift = " << roiShifts.at(i) << ", weight = " << roiWeights.at(i)
+                  << (inliers.at(i) ? "" : " (rejected)") << std::endl;
     }
 
-    // Average the shifts
-    warpMatrixTotal.at<float>(0,2) /= (fovList.size() - 1);
-    warpMatrixTotal.at<float>(1,2) /= (fovList.size() - 1);
-
-    warpMatrixTotal.at<float>(0,2) += warpMatrix0.at<float>(0,2);
-    warpMatrixTotal.at<float>(1,2) += warpMatrix0.at<float>(1,2);
+    std::cout << "RProcessing::calculateXCorrShift:: shift X = " << shift.x << std::endl;
+    std::cout << "RProcessing::calculateXCorrShift:: shift Y = " << shift.y << std::endl;
 
-    std::cout << "RProcessing::calculateXCorrShift:: shift X = " << warpMatrixTotal.at<float>(0,2) << std::endl;
-    std::cout << "RProcessing::calculateXCorrShift:: shift Y = " << warpMatrixTotal.at<float>(1,2) << std::endl;
-
-    return warpMatrixTotal;
+    return shiftToWarp(shift);
 
 }
 
-cv::Mat RProcessing::shiftToWarp(cv::Point shift)
+cv::Mat RProcessing::shiftToWarp(cv::Point2f shift)
 {
     cv::Mat warpMat = cv::Mat::eye(2, 3, CV_32F);
     warpMat.at<float>(0, 2) = shift.x;
@@ -3238,6 +3573,7 @@ void RProcessing::registerSeriesByTemplateMatching()
     /// The longer the exposure, the farther the off-limb coronal features saturate.
     /// Thus it becomes necessary to exclude a larger saturated part. Experience shows that enhanced X-Correlation fails
     /// when the ROI(s) become(s) small, and the other similarity metrics offered by template matching offer alternatives.
+    RPyramidCache::ClearGuard clearPlanes(planeCache);
 
     /// Work with a single ROI for now. Check if it exists.
     if (cvRectROI.empty())
@@ -3245,65 +3581,54 @@ void RProcessing::registerSeriesByTemplateMatching()
         emit tempMessageSignal(QString("ROI not defined"));
         return;
     }
-    resultList << new RMat(rMatLightList.at(0)->matImageRGB, false, rMatLightList.at(0)->getInstrument());
-    // Reference image
-    cv::Mat refMatN;
-    rMatLightList.at(0)->matImageGray.convertTo(refMatN, CV_32F);
-    refMatN = refMatN / rMatLightList.at(0)->getXPOSURE();
+    selectLights();
+    resultList << stackRegistered(new RMat(rMatLightList.at(0)->matImage, rMatLightList.at(0)->isBayer(), rMatLightList.at(0)->getInstrument()), 0);
+    // Reference image. Each image normalized by its own exposure, from the plane cache.
+    PlaneParams planes(planeNorms::exposure);
+    cv::Mat refMatN = planeCache.plane(rMatLightList.at(0), planes);
 
     for (int i = 1; i < rMatLightList.size(); ++i)
     {
-        cv::Mat currentMatImageN;
-        rMatLightList.at(i)->matImageGray.convertTo(currentMatImageN, CV_32F);
-        currentMatImageN = currentMatImageN / rMatLightList.at(i)->getXPOSURE();
+        cv::Mat currentMatImageN = planeCache.plane(rMatLightList.at(i), planes);
 
         cv::Mat warpMat = calculateTemplateMatchShift(refMatN, currentMatImageN, cvRectROI);
         cv::Mat shiftedMat = shiftImage(rMatLightList.at(i), warpMat);
-        resultList << new RMat(shiftedMat, false, rMatLightList.at(i)->getInstrument());
+        resultList << stackRegistered(RMat::adopt(shiftedMat, rMatLightList.at(i)->isBayer(), rMatLightList.at(i)->getInstrument()), i);
     }
 }
 
 void RProcessing::registerSeriesByTemplateMatchingPropagate()
 {
+    RPyramidCache::ClearGuard clearPlanes(planeCache);
+
     /// Work if a single ROI for now. Check that it exists
     if (cvRectROI.empty())
     {
         emit tempMessageSignal(QString("ROI not defined"));
         return;
     }
+    selectLights();
 
-    if (rMatLightList.at(0)->isBayer())
-    {
-        resultList << new RMat(rMatLightList.at(0)->matImageRGB, false, rMatLightList.at(0)->getInstrument(), rMatLightList.at(0)->getXPOSURE(), rMatLightList.at(0)->getTEMP());
-        resultList.at(0)->setFileInfo(rMatLightList.at(0)->getFileInfo());
-    }
-    else
-    {
-        resultList << new RMat(rMatLightList.at(0)->matImage, false, rMatLightList.at(0)->getInstrument(), rMatLightList.at(0)->getXPOSURE(), rMatLightList.at(0)->getTEMP());
-        resultList.at(0)->setFileInfo(rMatLightList.at(0)->getFileInfo());
-    }
+    resultList << stackRegistered(new RMat(rMatLightList.at(0)->matImage, rMatLightList.at(0)->isBayer(), rMatLightList.at(0)->getInstrument(), rMatLightList.at(0)->getXPOSURE(), rMatLightList.at(0)->getTEMP()), 0);
+    resultList.at(0)->setFileInfo(rMatLightList.at(0)->getFileInfo());
 
-    cv::Mat refMat;
-    cv::Mat currentMatImage;
+    // Each image normalized by its own exposure, once, from the plane cache
+    PlaneParams planes(planeNorms::exposure);
     cv::Mat warpMatrixTotal = cv::Mat::eye( 2, 3, CV_32FC1 );
 
     for (int i=0; i < rMatLightList.size()-1; i++)
     {
-        rMatLightList.at(i)->matImageGray.convertTo(refMat, CV_32F);
-        rMatLightList.at(i+1)->matImageGray.convertTo(currentMatImage, CV_32F);
-
-        cv::Mat refMatN = refMat / rMatLightList.at(i)->getXPOSURE();
-        cv::Mat currentMatImageN = currentMatImage / rMatLightList.at(i+1)->getXPOSURE();
+        cv::Mat refMatN = planeCache.plane(rMatLightList.at(i), planes);
+        cv::Mat currentMatImageN = planeCache.plane(rMatLightList.at(i+1), planes);
 
         cv::Mat warpMat = calculateTemplateMatchShift(refMatN, currentMatImageN, cvRectROI);
         warpMatrixTotal.at<float>(0, 2) += warpMat.at<float>(0, 2);
         warpMatrixTotal.at<float>(1, 2) += warpMat.at<float>(1, 2);
 
         cv::Mat shiftedMat = shiftImage(rMatLightList.at(i+1), warpMatrixTotal);
-        resultList << new RMat(shiftedMat, false, rMatLightList.at(i+1)->getInstrument(), rMatLightList.at(i+1)->getXPOSURE(), rMatLightList.at(i+1)->getTEMP());
+        resultList << stackRegistered(RMat::adopt(shiftedMat, rMatLightList.at(i+1)->isBayer(), rMatLightList.at(i+1)->getInstrument(), rMatLightList.at(i+1)->getXPOSURE(), rMatLightList.at(i+1)->getTEMP()), i+1);
         resultList.at(i+1)->setFileInfo(rMatLightList.at(i+1)->getFileInfo());
     }
-
 }
 
 
@@ -3368,32 +3693,21 @@ cv::Mat RProcessing::calculateTemplateMatchShift(cv::Mat refMat, cv::Mat matImag
 cv::Mat RProcessing::shiftImage(RMat * rMatImage, cv::Mat warpMat)
 {
     cv::Mat registeredMat;
+    if (drizzle)
+    {
+        /// No resampling: the warp is kept for stackRegistered(), which drizzles the frame itself.
+        pendingWarp = warpMat.clone();
+        return rMatImage->matImage;
+    }
     if (rMatImage->isBayer())
     {
-        // RGB array for splitting channels
-        cv::Mat tempMatRGB[3];
-        // Split the channels
-        cv::split(rMatImage->matImageRGB, tempMatRGB);
-        cv::warpAffine(tempMatRGB[0], tempMatRGB[0], warpMat, tempMatRGB[0].size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-        cv::warpAffine(tempMatRGB[1], tempMatRGB[1], warpMat, tempMatRGB[0].size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-        cv::warpAffine(tempMatRGB[2], tempMatRGB[2], warpMat, tempMatRGB[0].size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-
-        tempMatRGB[0].convertTo(tempMatRGB[0], CV_16U);
-        tempMatRGB[1].convertTo(tempMatRGB[1], CV_16U);
-        tempMatRGB[2].convertTo(tempMatRGB[2], CV_16U);
-        vector<cv::Mat> channels;
-        // Watch the order. 1st array will be last channel.
-        channels.push_back(tempMatRGB[0]);
-        channels.push_back(tempMatRGB[1]);
-        channels.push_back(tempMatRGB[2]);
-
-        cv::merge(channels, registeredMat);
-        // registeredMat is necessarily non-bayer.
+        /// The mosaic is warped plane by plane and stays a mosaic, of the type of the input:
+        /// stacks of registered Bayer frames are demosaiced once, at the end.
+        registeredMat = RCfa::warpAffine(rMatImage->matImage, warpMat, cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
     }
     else
     {
         cv::warpAffine(rMatImage->matImage, registeredMat, warpMat, rMatImage->matImage.size(), cv::INTER_LANCZOS4 + CV_WARP_INVERSE_MAP);
-        // registeredMat is necessarily non-bayer.
     }
     return registeredMat;
 }
@@ -3411,7 +3725,7 @@ cv::Mat RProcessing::shiftImage(RMat *rMatImage, cv::Point shift)
 
 void RProcessing::cannyEdgeDetectionOffScreen(int thresh)
 {
-    if (treeWidget->getLightUrls().empty())
+    if (fetchLightUrls().empty())
     {
         qDebug("ProcessingWidget::cannyEdgeDetectionOffScreen():: No lights");
         tempMessageSignal(QString("No Light image(s)"));
@@ -3429,13 +3743,13 @@ void RProcessing::cannyEdgeDetectionOffScreen(int thresh)
         centers.clear();
     }
 
-    centers.reserve(treeWidget->getLightUrls().size());
+    centers.reserve(fetchLightUrls().size());
     radius = 0;
 
-    for(int i = 0; i < treeWidget->getLightUrls().size(); i++)
+    for(int i = 0; i < fetchLightUrls().size(); i++)
     {
         qDebug("RProcessing:: cannyEdgeDetection() on image #%i", i);
-        ImageManager *newImageManager = new ImageManager(treeWidget->getLightUrls().at(i));
+        ImageManager *newImageManager = new ImageManager(fetchLightUrls().at(i));
         imageManagerList << newImageManager;
         rMatLightList << newImageManager->getRMatImage();
         setupCannyDetection(i);
@@ -3481,17 +3795,12 @@ bool RProcessing::cannyEdgeDetection(int thresh)
     }
 
     radius = 0;
-    instruments instrument = rMatLightList.at(0)->getInstrument();
 
     for (int i = 0 ; i < rMatLightList.size() ; ++i)
     {
         qDebug("RProcessing:: cannyEdgeDetection() on image # %i", i+1);
         setupCannyDetection(i);
         cannyDetect(thresh);
-        if (instrument == instruments::USET)
-        {
-            fixUset(contoursMat);
-        }
 
         bool success = limbFit(i);
         qDebug("RProcessing:: success on image # %i", (int) success);
@@ -3972,13 +4281,10 @@ bool RProcessing::wernerLimbFit(QList<RMat*> rMatImageList, bool smooth, int smo
 
     }
 
-    limbFitPlot = new QCustomPlot();
-    limbFitPlot->addGraph();
-
     // Prepare the plot data
     QVector<double> frameNumbers;
     QVector<double> radius;
-    for (int i = 0 ; i < rMatLightList.size() ; ++i)
+    for (int i = 0 ; i < circleOutList.size() ; ++i)
     {
         frameNumbers << i;
         radius << circleOutList.at(i).r;
@@ -3991,9 +4297,15 @@ bool RProcessing::wernerLimbFit(QList<RMat*> rMatImageList, bool smooth, int smo
     qDebug() << "vector radius = " << radius;
     qDebug("meanRadius() = %f", meanRadius);
 
-    limbFitPlot->graph(0)->setData(frameNumbers, radius);
-    limbFitPlot->rescaleAxes();
-    limbFitPlot->xAxis->setRange(0, rMatLightList.size());
+    /// The plot is a QWidget: only with a QApplication, not in batch mode.
+    if (qobject_cast<QApplication*>(QCoreApplication::instance()) != NULL)
+    {
+        limbFitPlot = new QCustomPlot();
+        limbFitPlot->addGraph();
+        limbFitPlot->graph(0)->setData(frameNumbers, radius);
+        limbFitPlot->rescaleAxes();
+        limbFitPlot->xAxis->setRange(0, circleOutList.size());
+    }
 
 
     return true;
@@ -4038,9 +4350,10 @@ bool RProcessing::solarLimbRegisterSeries(QList<RMat*> rMatImageList)
 
         registeredMat.convertTo(registeredMat, CV_16U);
 
-        RMat *resultMat = new RMat(registeredMat, false, rMatImageList.at(i)->getInstrument());
+        RMat *resultMat = RMat::adopt(registeredMat, false, rMatImageList.at(i)->getInstrument());
         resultMat->setImageTitle(QString("Registered image # ") + QString::number(i));
         resultMat->setDate_time(rMatImageList.at(i)->getDate_time());
+        /// Intermediate frames for registerSeriesOnLimbFit(): only its outputs feed the stack.
         limbFitResultList1 << resultMat;
     }
 
@@ -4052,10 +4365,7 @@ bool RProcessing::solarLimbRegisterSeries(QList<RMat*> rMatImageList)
 
 void RProcessing::raphFindLimb(cv::Mat matImage, Data *dat, int numDots, bool smooth, int smoothSize)
 {
-    /// Fix USET images for bad 1st column and 1st row
-    /// This fix won't be needed after using Emil's updated version
-    /// of Suncap, but still needed for the older files in the USET database.
-    fixUset(matImage);
+    /// The bad 1st column and 1st row of the older USET files are fixed when loading (see RInstrumentProfile).
     cv::Mat matImageF;
     matImage.convertTo(matImageF, CV_32F);
     cv::Mat matSlice;
@@ -4381,34 +4691,6 @@ void RProcessing::createHDRMat(QList<RMat *> rMatImageList)
 
 }
 
-void RProcessing::fixUset(cv::Mat matImage)
-{
-
-    if (matImage.type() == CV_16U)
-    {
-        for (int x = 0; x < matImage.cols; x++)
-        {   /// 1st rows
-            matImage.at<ushort>(0, x) = matImage.at<ushort>(1, x);
-        }
-        for (int y = 0; y < matImage.rows; y++)
-        {   /// 1st rows
-            matImage.at<ushort>(y, 0) = matImage.at<ushort>(y, 1);
-        }
-    }
-    else if (matImage.type() == CV_32F)
-    {
-        for (int x = 0; x < matImage.cols; x++)
-        {   /// 1st rows
-            matImage.at<float>(0, x) = matImage.at<float>(1, x);
-        }
-        for (int y = 0; y < matImage.rows; y++)
-        {   /// 1st rows
-            matImage.at<float>(y, 0) = matImage.at<float>(y, 1);
-        }
-    }
-
-}
-
 void RProcessing::setupMaskingCircle(int circleX, int circleY, int radius)
 {
     this->maskCircleX = circleX;
@@ -4487,6 +4769,111 @@ void RProcessing::setCurrentROpenGLWidget(ROpenGLWidget *rOpenGLWidget)
     currentROpenGLWidget = rOpenGLWidget;
 }
 
+void RProcessing::setClipKappa(float kappa)
+{
+    this->clipKappa = kappa;
+}
+
+void RProcessing::setClipIterations(int nIterations)
+{
+    this->clipIterations = nIterations;
+}
+
+void RProcessing::setClipWinsorized(bool status)
+{
+    this->clipWinsorized = status;
+}
+
+void RProcessing::setLiveStacking(bool status)
+{
+    /// Starts a new stack
+    this->liveStacking = status;
+    liveStack.reset();
+}
+
+void RProcessing::setDrizzle(bool status)
+{
+    /// Starts a new drizzle
+    this->drizzle = status;
+    drizzleStack.reset();
+    pendingWarp.release();
+}
+
+void RProcessing::setFrameWeighting(frameWeights weighting)
+{
+    this->frameWeighting = weighting;
+}
+
+void RProcessing::setFrameRejectFraction(float fraction)
+{
+    this->frameRejectFraction = fraction;
+}
+
+void RProcessing::setDrizzleScale(double scale)
+{
+    drizzleStack.setScale(scale);
+}
+
+void RProcessing::setDrizzlePixFrac(double pixFrac)
+{
+    drizzleStack.setPixFrac(pixFrac);
+}
+
+void RProcessing::setLightUrls(QList<QUrl> urls)
+{
+    this->lightUrlList = urls;
+}
+
+void RProcessing::setBiasUrls(QList<QUrl> urls)
+{
+    this->biasUrlList = urls;
+}
+
+void RProcessing::setDarkUrls(QList<QUrl> urls)
+{
+    this->darkUrlList = urls;
+}
+
+void RProcessing::setFlatUrls(QList<QUrl> urls)
+{
+    this->flatUrlList = urls;
+}
+
+QList<QUrl> RProcessing::fetchLightUrls() const
+{
+    return (treeWidget != NULL) ? treeWidget->getLightUrls() : lightUrlList;
+}
+
+QList<QUrl> RProcessing::fetchBiasUrls() const
+{
+    return (treeWidget != NULL) ? treeWidget->getBiasUrls() : biasUrlList;
+}
+
+QList<QUrl> RProcessing::fetchDarkUrls() const
+{
+    return (treeWidget != NULL) ? treeWidget->getDarkUrls() : darkUrlList;
+}
+
+QList<QUrl> RProcessing::fetchFlatUrls() const
+{
+    return (treeWidget != NULL) ? treeWidget->getFlatUrls() : flatUrlList;
+}
+
+bool RProcessing::fetchRMatLightList()
+{
+    /// In the GUI, the lights are those loaded in the treeWidget.
+    /// Without treeWidget, rMatLightList is used as set by the caller or by the calibration.
+    if (treeWidget != NULL)
+    {
+        if (treeWidget->rMatLightList.isEmpty())
+        {
+            return false;
+        }
+        rMatLightList = treeWidget->rMatLightList;
+    }
+    return !rMatLightList.isEmpty();
+}
+
 void RProcessing::setShowContours(bool status)
 {
     showContours = status;
@@ -4562,6 +4949,16 @@ void RProcessing::setQualityMetric(QString qualityMetric)
     this->qualityMetric = qualityMetric;
 }
 
+void RProcessing::setAfBackend(afBackends backend)
+{
+    this->afBackend = backend;
+}
+
+void RProcessing::setAfTileBytes(long long tileBytes)
+{
+    this->afTileBytes = tileBytes;
+}
+
 void RProcessing::setApplyMask(bool status)
 {
     this->applyMask = status;
@@ -4587,6 +4984,26 @@ void RProcessing::setMaskCircleRadius(int circleRadius)
     this->maskCircleRadius = circleRadius;
 }
 
+void RProcessing::setStreamCalibration(bool status)
+{
+    this->streamCalibration = status;
+}
+
+void RProcessing::setStreamWindow(int nFrames)
+{
+    this->streamWindow = std::max(1, nFrames);
+}
+
+void RProcessing::setParallelCalibration(bool status)
+{
+    this->parallelCalibration = status;
+}
+
+void RProcessing::setCalibrationThreads(int nThreads)
+{
+    this->calibrationThreads = nThreads;
+}
+
 void RProcessing::setUseUrlsFromTreeWidget(bool status)
 {
     this->useUrlsFromTreeWidget = status;
@@ -4635,6 +5052,62 @@ RMat* RProcessing::getMasterFlat()
     return masterFlat;
 }
 
+RMat* RProcessing::getStackedRMat()
+{
+    return stackedRMat;
+}
+
+cv::Mat RProcessing::getRejectionMap()
+{
+    return rejectionMap;
+}
+
+std::vector<float> RProcessing::getFrameWeights()
+{
+    return frameWeightList;
+}
+
+RStackAccumulator* RProcessing::getLiveStack()
+{
+    return &liveStack;
+}
+
+RDrizzle* RProcessing::getDrizzle()
+{
+    return &drizzleStack;
+}
+
+RMasterLibrary* RProcessing::getMasterLibrary()
+{
+    return masterLibrary;
+}
+
+const RDefectMap& RProcessing::getDefectMap() const
+{
+    return calibrationKernel.getDefectMap();
+}
+
+RMat* RProcessing::stackRegistered(RMat *rMat, int frame)
+{
+    /// Registration outputs go through here, to be stacked as they come when live stacking is on.
+    /// When drizzling, rMat is the unresampled frame and pendingWarp its registration (none for the reference).
+    /// frame is the index of the light in rMatLightList, which frameWeightList follows.
+    if (drizzle)
+    {
+        float weight = (frame >= 0 && frame < (int) frameWeightList.size()) ? frameWeightList[frame] : 1.0f;
+        if (!drizzleStack.push(rMat, pendingWarp.empty() ? cv::Mat::eye(2, 3, CV_32F) : pendingWarp, weight))
+        {
+            std::cout << "RProcessing::stackRegistered() frame #" << frame << " not drizzled: size or channels differ" << std::endl;
+        }
+        pendingWarp.release();
+    }
+    else if (liveStacking)
+    {
+        liveStack.push(rMat);
+    }
+    return rMat;
+}
+
 RMat *RProcessing::getEllipseRMat()
 {
     return ellipseRMat;
@@ -4680,6 +5153,11 @@ QVector<Circle> RProcessing::getCircleOutList()
     return circleOutList;
 }
 
+size_t RProcessing::getStreamPeakRSS()
+{
+    return streamPeakRSS;
+}
+
 float RProcessing::getMeanRadius()
 {
     return meanRadius;
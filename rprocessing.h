@@ -10,6 +10,13 @@
 
 
 #include "rmat.h"
+#include "calibrationkernel.h"
+#include "rstackaccumulator.h"
+#include "rstacker.h"
+#include "rmasterlibrary.h"
+#include "rafbackend.h"
+#include "rdrizzle.h"
+#include "rpyramidcache.h"
 #include "rlistimagemanager.h"
 #include "rtreewidget.h"
 #include "rlineedit.h"
@@ -53,6 +60,9 @@ public:
 
     RMat *average(QList<RMat*> rMatList);
     RMat *sigmaClipAverage(QList<RMat *> rMatImageList);
+    RMat *weightedAverage(QList<RMat *> rMatImageList);
+    /// One weight per frame from its statistics (RMat::getNoise(), RMat::getSharpness()), the largest being 1.
+    std::vector<float> computeFrameWeights(QList<RMat *> rMatImageList);
 
     /// Fourier filtering
     double pixelDistance(double u, double v);
@@ -123,7 +133,8 @@ public:
     /// export methods
     void exportMastersToFits();
     void exportFramesToFits(QList<RMat*> rMatImageList, QDir exportDir, bool useBasename);
-    void exportToFits(RMat *rMatImage, QString QStrFilename);
+    /// 3-channel images are written as an NAXIS3 = 3 cube of R, G, B planes. False if nothing could be written.
+    bool exportToFits(RMat *rMatImage, QString QStrFilename);
     void batchExportToFits(QList<QUrl> urls, QString exportDir);
     cv::Mat rescaleForExport8Bits(cv::Mat matImage, float alpha, float beta);
     void exportToTiff(RMat *rMatImage, QString QStrFilename);
@@ -165,10 +176,23 @@ public:
     void setSharpenLiveStatus(bool status);
     void setStackWithMean(bool status);
     void setStackWithSigmaClip(bool status);
+    // Sigma-clipping: kappa (in sigma units), number of iterations, winsorized or plain kappa-sigma
+    void setClipKappa(float kappa);
+    void setClipIterations(int nIterations);
+    void setClipWinsorized(bool status);
+    // Live stacking: registered frames are also pushed into a running mean as they are produced
+    void setLiveStacking(bool status);
+    void setDrizzle(bool status);
+    void setFrameWeighting(frameWeights weighting);
+    void setFrameRejectFraction(float fraction);
+    void setDrizzleScale(double scale);
+    void setDrizzlePixFrac(double pixFrac);
     void setBinning(int binning);
     void setBlkSize(int blkSize);
     void setNBest(int nBest);
     void setQualityMetric(QString qualityMetric);
+    void setAfBackend(afBackends backend);
+    void setAfTileBytes(long long tileBytes);
     void setApplyMask(bool status);
     // ROI
     void setCvRectROIList(QList<cv::Rect> cvRectList);
@@ -177,6 +201,32 @@ public:
     void setMaskCircleRadius(int circleRadius);
     // TreeWidget
     void setUseUrlsFromTreeWidget(bool status);
+    // Urls used instead of those of the treeWidget when there is none (headless batch processing)
+    void setLightUrls(QList<QUrl> urls);
+    void setBiasUrls(QList<QUrl> urls);
+    void setDarkUrls(QList<QUrl> urls);
+    void setFlatUrls(QList<QUrl> urls);
+    // Streaming (out-of-core) calibration
+    void setStreamCalibration(bool status);
+    void setStreamWindow(int nFrames);
+    void setParallelCalibration(bool status);
+    void setCalibrationThreads(int nThreads);
+    void setParallelRegistration(bool status);
+    void setRegistrationThreads(int nThreads);
+    /// Memory of the normalized planes kept across the registration methods and runs. 0: none kept.
+    void setPlaneCacheBytes(size_t maxBytes);
+    /// Hanning window on the frames before phase correlation
+    void setPhaseCorrelationHanning(bool status);
+    // Bayer flats normalized per CFA colour (keeps the colour balance) or by their overall mean
+    void setFlatPerCFAColour(bool status);
+    // Hot and cold pixels from the master dark and flat, corrected in every calibrated light
+    void setCosmeticCorrection(bool status);
+    void setDefectHotSigma(float hotSigma);
+    void setDefectColdFraction(float coldFraction);
+    // Library of masters reused across sessions. An empty dir disables it.
+    void setMasterLibraryDir(QString dir);
+    // Flats change with the optics (dust, focus): those of the library are only used on demand.
+    void setUseLibraryFlat(bool status);
 
     /// getters
     QString getExportMastersDir();
@@ -185,6 +235,16 @@ public:
     RMat* getMasterBias();
     RMat* getMasterDark();
     RMat* getMasterFlat();
+    RMat* getStackedRMat();
+    /// Number of rejected frames per pixel in the last sigma-clipped stack (CV_16U)
+    cv::Mat getRejectionMap();
+    std::vector<float> getFrameWeights();
+    /// Running stack of the registered frames, while live stacking is on
+    RStackAccumulator* getLiveStack();
+    RDrizzle* getDrizzle();
+    RMasterLibrary* getMasterLibrary();
+    /// Defects found with the current masters, at the last calibration
+    const RDefectMap& getDefectMap() const;
     RMat* getCannyRMat();
     RMat* getContoursRMat();
     RMat* getEllipseRMat();
@@ -197,6 +257,7 @@ public:
     QList<RMat*> getLuckyBlkList();
     QVector<Circle> getCircleOutList();
     float getMeanRadius();
+    size_t getStreamPeakRSS();
     float fetchRMatSeriesMin(QList<RMat*> rMatImageList);
     float fetchRMatSeriesMax(QList<RMat*> rMatImageList);
 
@@ -255,11 +316,12 @@ public slots:
    void registerSeriesByPhaseCorrelation();
    void registerSeriesCustom();
    void registerSeriesCustomPropagate();
-   cv::Point calculateSADShift(cv::Mat refMat, cv::Mat matImage, cv::Rect fov, int maxLength);
-   cv::Point calculateSADShift(cv::Mat refMat, cv::Mat matImage, QList<cv::Rect> fovList, int maxLength);
+   /// Sub-pixel shift of matImage with respect to refMat in the fov, within +/- maxLength/2, honouring the circle mask
+   cv::Point2f calculateMaskedXCorrShift(cv::Mat refMat, cv::Mat matImage, cv::Rect fov, int maxLength);
+   cv::Point2f calculateMaskedXCorrShift(cv::Mat refMat, cv::Mat matImage, QList<cv::Rect> fovList, int maxLength);
    cv::Mat calculateXCorrShift(cv::Mat refMat, cv::Mat matImage, cv::Mat warpMatrix = cv::Mat::eye(2, 3, CV_32F));
    cv::Mat calculateXCorrShift(cv::Mat refMat, cv::Mat matImage, QList<cv::Rect> fovList);
-   cv::Mat shiftToWarp(cv::Point shift);
+   cv::Mat shiftToWarp(cv::Point2f shift);
 
    // Template Matching
    void registerSeriesByTemplateMatching();
@@ -284,8 +346,8 @@ public slots:
    RMat* normalizeToXposure(RMat* rMat);
    QList<RMat*> normalizeSeriesToXposure(QList<RMat*> rMatImageList);
    void normalizeByStatsInPlace(RMat* rMat);
-   cv::Mat normalizeByThresh(cv::Mat matImage, float oldMin, float oldMax, float newRange);
-   cv::Mat normalizeClipByThresh(cv::Mat matImage, float newMin, float newMax, float dataRange);
+   static cv::Mat normalizeByThresh(cv::Mat matImage, float oldMin, float oldMax, float newRange);
+   static cv::Mat normalizeClipByThresh(cv::Mat matImage, float newMin, float newMax, float dataRange);
    cv::Mat stretch14to16bit(cv::Mat matImage);
    QList<RMat*> stretchSeries14to16bit(QList<RMat*> rMatImageList);
 
@@ -299,7 +361,6 @@ public slots:
    // HDR
    void createHDRMat(QList<RMat*> rMatImageList);
 
-   void fixUset(cv::Mat matImage);
     // ROI
    void setupMaskingCircle(int circleX, int circleY, int radius);
    void appendROIList(QRect qRect);
@@ -310,6 +371,26 @@ private:
 
     void normalizeFlat();
     void calibrate();
+    cv::Mat calibrateLight(cv::Mat lightMat);
+    void setupCalibrationKernel();
+    int calibrateStream();
+    int calibrateParallel();
+    /// Master frame stacked from the files, strip by strip, with the master settings.
+    RMat* stackMasterFromUrls(QList<QUrl> urls);
+    /// Registered frame to the live stack or drizzle, weighted by frameWeightList[frame].
+    RMat* stackRegistered(RMat *rMat, int frame);
+    /// Masters of the library for the first light, for the masters without urls.
+    bool loadMastersFromLibrary();
+    void addMastersToLibrary();
+
+    // Urls and lights from the treeWidget, or from the setters above without treeWidget.
+    QList<QUrl> fetchLightUrls() const;
+    QList<QUrl> fetchBiasUrls() const;
+    QList<QUrl> fetchDarkUrls() const;
+    QList<QUrl> fetchFlatUrls() const;
+    bool fetchRMatLightList();
+    /// Weighs the lights and drops those below frameRejectFraction of the median weight, before any warp.
+    void selectLights();
 
     void meshgrid(const cv::Mat &xgv, const cv::Mat &ygv, cv::Mat1i &X, cv::Mat1i &Y);
 
@@ -320,6 +401,8 @@ private:
     RMat *masterDark;
     RMat *masterFlat;
     RMat *masterFlatN;
+    /// Dark and inverse normalized flat, set up once per master set.
+    CalibrationKernel calibrationKernel;
     RMat *stackedRMat;
     QList<RMat*> resultList;
     QList<RMat*> resultList2;
@@ -343,6 +426,7 @@ private:
 
     RTreeWidget *treeWidget;
     bool useUrlsFromTreeWidget;
+    QList<QUrl> lightUrlList, biasUrlList, darkUrlList, flatUrlList;
     ROpenGLWidget *currentROpenGLWidget;
 
     QString exportMastersDir;
@@ -389,10 +473,57 @@ private:
     int nBest;
     QList<RMat*> luckyBlkList;
     QString qualityMetric;
+    // ArrayFire backend, selected before each ArrayFire processing.
+    afBackends afBackend;
+    // Strip size of the tiled ArrayFire kernels. 0: whole frames, -1: automatic (tiled on the CPU backend only)
+    long long afTileBytes;
 
     // Normalization of the images
     double normFactor;
 
+    // Sigma-clipped stacking
+    float clipKappa;
+    int clipIterations;
+    bool clipWinsorized;
+    cv::Mat rejectionMap;
+    bool liveStacking;
+    RStackAccumulator liveStack;
+    // Drizzle: registration only gives the warps, the frames are splatted on the drizzle grid, not resampled.
+    bool drizzle;
+    RDrizzle drizzleStack;
+    // Warp of the frame on its way from shiftImage() to stackRegistered()
+    cv::Mat pendingWarp;
+    // Weighted stacking. frameWeightList follows rMatLightList after selectLights(), hence the registered frames.
+    frameWeights frameWeighting;
+    float frameRejectFraction;
+    std::vector<float> frameWeightList;
+
+    // Streaming calibration. streamWindow: number of calibrated frames in flight before writing to disk,
+    // with parallelCalibration (the sequential stream writes each frame as soon as it is calibrated).
+    bool streamCalibration;
+    int streamWindow;
+    size_t streamPeakRSS;
+    // Multi-threaded calibration. 0 threads means OpenCV's default.
+    bool parallelCalibration;
+    int calibrationThreads;
+    // Parallel warps in registerSeries(). 0 threads means OpenCV's default.
+    bool parallelRegistration;
+    int registrationThreads;
+    bool phaseCorrelationHanning;
+    // Normalized and decimated frames of all the registration methods, cleared at the end of each registerSeries*()
+    RPyramidCache planeCache;
+    // Masters reused across sessions, memory-mapped
+    RMasterLibrary *masterLibrary;
+    // Titles of the masters the last calibration took from the library, for the user
+    QStringList libraryMastersUsed;
+    bool useLibraryFlat;
+    // The library stores flats with the bias already subtracted.
+    bool masterFlatFromLibrary;
+    bool flatPerCFAColour;
+    bool cosmeticCorrection;
+    float defectHotSigma;
+    float defectColdFraction;
+
 
 };
 
@@ -0,0 +1,246 @@
+#include "rpyramidcache.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+
+#include "rprocessing.h"
+
+/// Decimation from one level to the next
+static const double decimation = 0.25;
+
+PlaneParams::PlaneParams(planeNorms norm, float scale) :
+    norm(norm), scale(scale), clipLow(0), clipHigh(0), sigmaBlur(0), maskX(0), maskY(0), maskRadius(0)
+{
+
+}
+
+bool PlaneParams::operator<(const PlaneParams &other) const
+{
+    return std::make_tuple((int) norm, scale, clipLow, clipHigh, sigmaBlur, roi.x, roi.y, roi.width, roi.height, maskX, maskY, maskRadius)
+            < std::make_tuple((int) other.norm, other.scale, other.clipLow, other.clipHigh, other.sigmaBlur,
+                              other.roi.x, other.roi.y, other.roi.width, other.roi.height, other.maskX, other.maskY, other.maskRadius);
+}
+
+bool RPyramidCache::Key::operator<(const Key &other) const
+{
+    if (revision != other.revision)
+    {
+        return revision < other.revision;
+    }
+    if (data != other.data)
+    {
+        return data < other.data;
+    }
+    return params < other.params;
+}
+
+RPyramidCache::RPyramidCache(size_t maxBytes) :
+    maxBytes(maxBytes), bytes(0), useCounter(0), nBuilds(0), nHits(0)
+{
+
+}
+
+std::vector<cv::Mat> RPyramidCache::get(RMat *rMat, const PlaneParams &params, int nLevels)
+{
+    nLevels = std::max(1, nLevels);
+
+    Key key;
+    key.revision = rMat->getRevision();
+    key.data = rMat->matImage.data;
+    key.params = params;
+
+    std::vector<cv::Mat> levels;
+    {
+        QMutexLocker locker(&mutex);
+        std::map<Key, Entry>::iterator it = entries.find(key);
+        if (it != entries.end())
+        {
+            levels = it->second.levels;
+            it->second.lastUse = ++useCounter;
+            nHits++;
+        }
+    }
+
+    if ((int) levels.size() >= nLevels)
+    {
+        levels.resize(nLevels);
+        return levels;
+    }
+
+    /// Missing levels are built outside the lock, from the coarsest one available.
+    if (levels.empty())
+    {
+        cv::Mat plane = buildPlane(rMat, params);
+        if (plane.empty())
+        {
+            return levels;
+        }
+        levels.push_back(plane);
+    }
+    while ((int) levels.size() < nLevels)
+    {
+        cv::Mat decimated;
+        cv::resize(levels.back(), decimated, cv::Size(), decimation, decimation, CV_INTER_AREA);
+        levels.push_back(decimated);
+    }
+
+    store(key, levels);
+    return levels;
+}
+
+cv::Mat RPyramidCache::plane(RMat *rMat, const PlaneParams &params)
+{
+    std::vector<cv::Mat> levels = get(rMat, params, 1);
+    return levels.empty() ? cv::Mat() : levels.at(0);
+}
+
+void RPyramidCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    entries.clear();
+    bytes = 0;
+}
+
+double RPyramidCache::levelScale(int level)
+{
+    return std::pow(decimation, level);
+}
+
+/// First channel of the frame. Mosaics give their CFA luminance, so that registration never demosaics.
+static cv::Mat firstChannel(RMat *rMat)
+{
+    if (rMat->matImage.channels() == 1)
+    {
+        return rMat->getMatImageGray();
+    }
+    return rMat->extractChannel(0);
+}
+
+cv::Mat RPyramidCache::buildPlane(RMat *rMat, const PlaneParams &params)
+{
+    if (rMat->matImage.empty())
+    {
+        return cv::Mat();
+    }
+
+    cv::Mat plane;
+    switch (params.norm)
+    {
+    case planeNorms::exposure:
+        rMat->getMatImageGray().convertTo(plane, CV_32F);
+        plane = plane / rMat->getXPOSURE();
+        break;
+    case planeNorms::exposureThresh:
+        plane = RProcessing::normalizeByThresh(firstChannel(rMat), 0, 16183, 65536.0);
+        plane = plane / rMat->getXPOSURE();
+        break;
+    case planeNorms::channel:
+        firstChannel(rMat).convertTo(plane, CV_32F, params.scale);
+        break;
+    case planeNorms::limb:
+    {
+        cv::Mat stretched = RProcessing::normalizeByThresh(rMat->matImage, rMat->getIntensityLow(), rMat->getIntensityHigh(), rMat->getNormalizeRange());
+        plane = RProcessing::normalizeClipByThresh(stretched, params.clipLow, params.clipHigh, rMat->getDataRange());
+        plane.convertTo(plane, CV_32F);
+        break;
+    }
+    default:
+        rMat->getMatImageGray().convertTo(plane, CV_32F, params.scale);
+    }
+
+    if (params.maskRadius != 0)
+    {
+        cv::circle(plane, cv::Point(params.maskX, params.maskY), params.maskRadius, cv::Scalar::all(0), -1);
+    }
+
+    if (params.sigmaBlur > 0)
+    {
+        // Gaussien blur. Kernel size is estimate from sigma.
+        cv::GaussianBlur(plane, plane, cv::Size(0, 0), params.sigmaBlur);
+    }
+
+    /// Own buffer for the ROI, so that the full plane is not kept
+    if (!params.roi.empty())
+    {
+        plane = plane(params.roi & cv::Rect(0, 0, plane.cols, plane.rows)).clone();
+    }
+
+    return plane;
+}
+
+void RPyramidCache::store(const Key &key, const std::vector<cv::Mat> &levels)
+{
+    size_t levelBytes = 0;
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        levelBytes += levels.at(i).total() * levels.at(i).elemSize();
+    }
+
+    QMutexLocker locker(&mutex);
+    std::map<Key, Entry>::iterator it = entries.find(key);
+    if (it == entries.end())
+    {
+        nBuilds++;
+        Entry entry;
+        entry.levels = levels;
+        entry.bytes = levelBytes;
+        entry.lastUse = ++useCounter;
+        entries[key] = entry;
+        bytes += levelBytes;
+    }
+    /// Another thread may have stored the same plane meanwhile: keep the deeper pyramid.
+    else if (it->second.levels.size() < levels.size())
+    {
+        bytes += levelBytes - it->second.bytes;
+        it->second.levels = levels;
+        it->second.bytes = levelBytes;
+        it->second.lastUse = ++useCounter;
+    }
+
+    evict();
+}
+
+void RPyramidCache::evict()
+{
+    while (bytes > maxBytes && !entries.empty())
+    {
+        std::map<Key, Entry>::iterator oldest = entries.begin();
+        for (std::map<Key, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            if (it->second.lastUse < oldest->second.lastUse)
+            {
+                oldest = it;
+            }
+        }
+        bytes -= oldest->second.bytes;
+        entries.erase(oldest);
+    }
+}
+
+unsigned long long RPyramidCache::getBuilds() const
+{
+    QMutexLocker locker(&mutex);
+    return nBuilds;
+}
+
+unsigned long long RPyramidCache::getHits() const
+{
+    QMutexLocker locker(&mutex);
+    return nHits;
+}
+
+size_t RPyramidCache::getBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return bytes;
+}
+
+void RPyramidCache::setMaxBytes(size_t maxBytes)
+{
+    QMutexLocker locker(&mutex);
+    this->maxBytes = maxBytes;
+    evict();
+}
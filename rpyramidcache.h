@@ -0,0 +1,117 @@
+#ifndef RPYRAMIDCACHE_H
+#define RPYRAMIDCACHE_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+#include <map>
+#include <vector>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include "rmat.h"
+
+/// How a frame is turned into the float plane given to the registration
+enum class planeNorms {
+    scaled,         // gray plane times scale (e.g. 1 / XPOSURE of the reference frame)
+    exposure,       // gray plane divided by its own XPOSURE
+    exposureThresh, // channel 0 stretched from [0, 16183] to [0, 65536], divided by its own XPOSURE
+    channel,        // channel 0 times scale
+                    // (both channel norms take the gray plane of single-channel frames: the CFA luminance of a mosaic)
+    limb            // stretched between its own intensity thresholds, then clipped to [clipLow, clipHigh]
+};
+
+/// Preprocessing of a registration plane, in this order: normalization, circular mask (zeroed),
+/// gaussian blur, ROI. Part of the key of RPyramidCache.
+struct PlaneParams
+{
+    PlaneParams(planeNorms norm = planeNorms::scaled, float scale = 1.0f);
+
+    planeNorms norm;
+    float scale;
+    float clipLow, clipHigh;
+    /// 0: no blur
+    double sigmaBlur;
+    /// Empty: whole frame
+    cv::Rect roi;
+    /// Radius 0: no mask
+    int maskX, maskY, maskRadius;
+
+    bool operator<(const PlaneParams &other) const;
+};
+
+/// Normalized registration planes of the frames and their coarse-to-fine pyramids, shared by all the
+/// registration methods of RProcessing. Level 0 is the full resolution plane, each next level is decimated
+/// by levelScale (CV_INTER_AREA), the 1/4 of the two-pass ECC.
+/// Entries are keyed by the pixels of the frame (RMat revision and buffer) and by the preprocessing,
+/// so a frame is normalized and decimated once per session, e.g. once instead of twice by the methods
+/// that register pairs of consecutive frames, and not again when the series is registered anew.
+/// The planes are shared with the cache and must not be written to.
+/// Thread-safe: planes are built outside the lock, so workers of ParallelRegistration build theirs at once.
+/// Least recently used entries are dropped beyond maxBytes; with maxBytes 0 nothing is kept.
+class RPyramidCache
+{
+public:
+    RPyramidCache(size_t maxBytes = (size_t) 1024 * 1024 * 1024);
+
+    /// Levels 0 to nLevels - 1 of the plane of rMat. Levels missing from a cached entry are added to it.
+    std::vector<cv::Mat> get(RMat *rMat, const PlaneParams &params, int nLevels = 1);
+    /// Level 0 only
+    cv::Mat plane(RMat *rMat, const PlaneParams &params);
+    void clear();
+
+    /// Scale of the level with respect to level 0
+    static double levelScale(int level);
+    static cv::Mat buildPlane(RMat *rMat, const PlaneParams &params);
+
+    /// Planes built, and requests served from a cached plane
+    unsigned long long getBuilds() const;
+    unsigned long long getHits() const;
+    size_t getBytes() const;
+
+    void setMaxBytes(size_t maxBytes);
+
+    /// Clears the cache when leaving the scope, so that the planes of a registration are freed on every exit path.
+    class ClearGuard
+    {
+    public:
+        explicit ClearGuard(RPyramidCache &cache) : cache(cache) {}
+        ~ClearGuard() { cache.clear(); }
+
+    private:
+        Q_DISABLE_COPY(ClearGuard)
+        RPyramidCache &cache;
+    };
+
+private:
+
+    struct Key
+    {
+        unsigned long long revision;
+        const uchar *data;
+        PlaneParams params;
+
+        bool operator<(const Key &other) const;
+    };
+
+    struct Entry
+    {
+        std::vector<cv::Mat> levels;
+        size_t bytes;
+        unsigned long long lastUse;
+    };
+
+    void store(const Key &key, const std::vector<cv::Mat> &levels);
+    void evict();
+
+    mutable QMutex mutex;
+    std::map<Key, Entry> entries;
+    size_t maxBytes;
+    size_t bytes;
+    unsigned long long useCounter;
+    unsigned long long nBuilds;
+    unsigned long long nHits;
+};
+
+#endif // RPYRAMIDCACHE_H
@@ -0,0 +1,236 @@
+#include "rroiregistration.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "rpyramidcache.h"
+
+/// Smallest decimated ECC template side
+static const int minDecimatedSide = 16;
+/// Floor of the scale of the residuals, in pixels: sub-pixel disagreements are not outliers.
+static const double minScale = 0.25;
+/// Residuals beyond this many scales are outliers
+static const double outlierScales = 3.0;
+
+/// Shifts of the ROIs of one frame. The range runs over ROIs.
+class ParallelROIShifts : public cv::ParallelLoopBody
+{
+public:
+    ParallelROIShifts(const RROIRegistration &registration, const cv::Mat &matImage,
+                      std::vector<cv::Point2f> &shifts, std::vector<double> &weights) :
+        registration(registration), matImage(matImage), shifts(shifts), weights(weights)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        for (int i = range.start; i < range.end; i++)
+        {
+            shifts[i] = registration.roiShift(i, matImage, weights[i]);
+        }
+    }
+
+private:
+    const RROIRegistration &registration;
+    const cv::Mat &matImage;
+    std::vector<cv::Point2f> &shifts;
+    std::vector<double> &weights;
+};
+
+static double median(std::vector<double> values)
+{
+    size_t n = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + n, values.end());
+    double upper = values[n];
+    if (values.size() % 2 == 1)
+    {
+        return upper;
+    }
+    return 0.5 * (upper + *std::max_element(values.begin(), values.begin() + n));
+}
+
+RROIRegistration::RROIRegistration(const cv::Mat &refMat, const QList<cv::Rect> &roiList, roiEstimators estimator,
+                                   int searchRadius, const cv::Mat &mask) :
+    estimator(estimator), searchRadius(searchRadius), frameSize(refMat.size())
+{
+    cv::Rect frameRect(0, 0, refMat.cols, refMat.rows);
+    int minSide = -1;
+    for (int i = 0; i < roiList.size(); i++)
+    {
+        cv::Rect roi = roiList.at(i) & frameRect;
+        if (roi.area() == 0)
+        {
+            std::cout << "RROIRegistration:: ROI " << roiList.at(i) << " outside the frame" << std::endl;
+            continue;
+        }
+        this->roiList << roi;
+        minSide = (minSide < 0) ? std::min(roi.width, roi.height) : std::min(minSide, std::min(roi.width, roi.height));
+    }
+    if (this->searchRadius < 0)
+    {
+        this->searchRadius = std::max(1, minSide / 4);
+    }
+
+    for (int i = 0; i < this->roiList.size(); i++)
+    {
+        cv::Rect roi = this->roiList.at(i);
+        if (estimator == roiEstimators::maskedXCorr)
+        {
+            xCorrs.push_back(RMaskedXCorr(refMat, mask, roi, 2 * this->searchRadius));
+            continue;
+        }
+
+        cv::Mat templ;
+        refMat(roi).convertTo(templ, CV_32F);
+        cv::Mat templR;
+        double scale = RPyramidCache::levelScale(1);
+        if (std::min(roi.width, roi.height) * scale >= minDecimatedSide)
+        {
+            cv::resize(templ, templR, cv::Size(), scale, scale, CV_INTER_AREA);
+        }
+        templates.push_back(templ);
+        templatesR.push_back(templR);
+    }
+}
+
+cv::Point2f RROIRegistration::shift(const cv::Mat &matImage, std::vector<cv::Point2f> *roiShifts,
+                                    std::vector<double> *roiWeights, std::vector<bool> *inliers) const
+{
+    int nROIs = roiList.size();
+    std::vector<cv::Point2f> shifts(nROIs);
+    std::vector<double> weights(nROIs, 0);
+    cv::parallel_for_(cv::Range(0, nROIs), ParallelROIShifts(*this, matImage, shifts, weights));
+
+    cv::Point2f result = combine(shifts, weights, inliers);
+    if (roiShifts != NULL)
+    {
+        *roiShifts = shifts;
+    }
+    if (roiWeights != NULL)
+    {
+        *roiWeights = weights;
+    }
+    return result;
+}
+
+cv::Point2f RROIRegistration::roiShift(int i, const cv::Mat &matImage, double &weight) const
+{
+    weight = 0;
+    if (matImage.size() != frameSize)
+    {
+        return cv::Point2f(0, 0);
+    }
+
+    if (estimator == roiEstimators::maskedXCorr)
+    {
+        double peak;
+        cv::Point2f roiShift = xCorrs.at(i).shift(matImage, &peak);
+        weight = peak > 0 ? peak * peak : 0;
+        return roiShift;
+    }
+
+    /// Patch of the frame around the ROI. ECC starts from the offset of the ROI in the patch.
+    cv::Rect roi = roiList.at(i);
+    cv::Rect patchRect = cv::Rect(roi.x - searchRadius, roi.y - searchRadius, roi.width + 2 * searchRadius, roi.height + 2 * searchRadius)
+            & cv::Rect(0, 0, matImage.cols, matImage.rows);
+    cv::Point2f offset(roi.x - patchRect.x, roi.y - patchRect.y);
+    cv::Mat patch;
+    matImage(patchRect).convertTo(patch, CV_32F);
+
+    const int warpMode = cv::MOTION_TRANSLATION;
+    cv::TermCriteria criteria(cv::TermCriteria::MAX_ITER, 100, 1e-1);
+    cv::Mat warpMatrix = cv::Mat::eye(2, 3, CV_32F);
+    warpMatrix.at<float>(0, 2) = offset.x;
+    warpMatrix.at<float>(1, 2) = offset.y;
+
+    try
+    {
+        const cv::Mat &templR = templatesR.at(i);
+        if (!templR.empty())
+        {
+            double scale = RPyramidCache::levelScale(1);
+            cv::Mat patchR;
+            cv::resize(patch, patchR, cv::Size(), scale, scale, CV_INTER_AREA);
+            cv::Mat warpMatrixR = warpMatrix.clone();
+            warpMatrixR.at<float>(0, 2) *= scale;
+            warpMatrixR.at<float>(1, 2) *= scale;
+            cv::findTransformECC(templR, patchR, warpMatrixR, warpMode, criteria);
+            warpMatrix.at<float>(0, 2) = warpMatrixR.at<float>(0, 2) / scale;
+            warpMatrix.at<float>(1, 2) = warpMatrixR.at<float>(1, 2) / scale;
+        }
+        double ecc = cv::findTransformECC(templates.at(i), patch, warpMatrix, warpMode, criteria);
+        weight = ecc > 0 ? ecc * ecc : 0;
+    }
+    catch (const cv::Exception &e)
+    {
+        std::cout << "RROIRegistration::roiShift() ECC failed on ROI " << roi << ": " << e.what() << std::endl;
+        return cv::Point2f(0, 0);
+    }
+
+    return cv::Point2f(warpMatrix.at<float>(0, 2) - offset.x, warpMatrix.at<float>(1, 2) - offset.y);
+}
+
+cv::Point2f RROIRegistration::combine(const std::vector<cv::Point2f> &shifts, const std::vector<double> &weights,
+                                      std::vector<bool> *inliers)
+{
+    std::vector<bool> kept(shifts.size(), false);
+    std::vector<double> xs, ys;
+    for (size_t i = 0; i < shifts.size(); i++)
+    {
+        if (weights.at(i) > 0)
+        {
+            xs.push_back(shifts.at(i).x);
+            ys.push_back(shifts.at(i).y);
+        }
+    }
+    if (xs.empty())
+    {
+        if (inliers != NULL)
+        {
+            *inliers = kept;
+        }
+        return cv::Point2f(0, 0);
+    }
+
+    /// Distances to the median shift, and their scaled MAD
+    cv::Point2d center(median(xs), median(ys));
+    std::vector<double> residuals;
+    for (size_t i = 0; i < shifts.size(); i++)
+    {
+        if (weights.at(i) > 0)
+        {
+            residuals.push_back(std::hypot(shifts.at(i).x - center.x, shifts.at(i).y - center.y));
+        }
+    }
+    double scale = std::max(minScale, 1.4826 * median(residuals));
+
+    double sumW = 0;
+    cv::Point2d sum(0, 0);
+    for (size_t i = 0; i < shifts.size(); i++)
+    {
+        double residual = std::hypot(shifts.at(i).x - center.x, shifts.at(i).y - center.y);
+        if (weights.at(i) > 0 && residual <= outlierScales * scale)
+        {
+            kept[i] = true;
+            sum.x += weights.at(i) * shifts.at(i).x;
+            sum.y += weights.at(i) * shifts.at(i).y;
+            sumW += weights.at(i);
+        }
+    }
+
+    if (inliers != NULL)
+    {
+        *inliers = kept;
+    }
+    return cv::Point2f((float) (sum.x / sumW), (float) (sum.y / sumW));
+}
+
+int RROIRegistration::getNROIs() const
+{
+    return roiList.size();
+}
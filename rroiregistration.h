@@ -0,0 +1,60 @@
+#ifndef RROIREGISTRATION_H
+#define RROIREGISTRATION_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+#include <vector>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include "rmaskedxcorr.h"
+
+/// Estimator of the shift of each ROI
+enum class roiEstimators {ecc, maskedXCorr};
+
+/// Translation of frames with respect to a reference from several ROIs at once.
+/// Everything that depends only on the reference is extracted once per ROI: the ECC templates and their
+/// 1/4 decimation, or the reference spectra of RMaskedXCorr. For each frame, the ROIs are solved concurrently
+/// on patches of the frame, each grown by the search radius so that no intermediate full-frame warp is needed:
+/// ECC starts from the patch offset, on the decimated patches then at full resolution.
+/// The shifts of the ROIs are combined robustly: ROIs whose shift is beyond 3 scaled MADs (a scale of at least
+/// a quarter pixel) from the median shift are rejected, and the others are averaged with the square of their
+/// correlation coefficient as weight. Failed ROIs weigh 0.
+class RROIRegistration
+{
+public:
+    /// refMat: full frame, CV_32F. searchRadius < 0: a quarter of the smallest ROI side.
+    /// mask: circle mask of RMaskedXCorr, unused by ECC.
+    RROIRegistration(const cv::Mat &refMat, const QList<cv::Rect> &roiList, roiEstimators estimator = roiEstimators::ecc,
+                     int searchRadius = -1, const cv::Mat &mask = cv::Mat());
+
+    /// Shift d for which matImage(x + d) best matches refMat(x), as given to shiftToWarp().
+    /// roiShifts, roiWeights and inliers: per ROI, for diagnostics.
+    cv::Point2f shift(const cv::Mat &matImage, std::vector<cv::Point2f> *roiShifts = NULL,
+                      std::vector<double> *roiWeights = NULL, std::vector<bool> *inliers = NULL) const;
+
+    /// Shift of one ROI, with its weight (0 if it failed). Thread-safe.
+    cv::Point2f roiShift(int i, const cv::Mat &matImage, double &weight) const;
+
+    /// Robust weighted mean of the shifts, see above. (0, 0) if all weights are 0.
+    static cv::Point2f combine(const std::vector<cv::Point2f> &shifts, const std::vector<double> &weights,
+                               std::vector<bool> *inliers = NULL);
+
+    int getNROIs() const;
+
+private:
+
+    roiEstimators estimator;
+    QList<cv::Rect> roiList;
+    int searchRadius;
+    cv::Size frameSize;
+
+    /// ECC templates and their decimation (empty if the ROI is too small to decimate)
+    std::vector<cv::Mat> templates;
+    std::vector<cv::Mat> templatesR;
+    std::vector<RMaskedXCorr> xCorrs;
+};
+
+#endif // RROIREGISTRATION_H
@@ -0,0 +1,221 @@
+#include "rstackaccumulator.h"
+
+#include <opencv2/core/hal/intrin.hpp>
+
+#include <vector>
+
+using namespace cv;
+
+/// Welford update of one row, Kahan-compensated. NaN samples leave the pixel unchanged.
+/// Note: -ffast-math would optimize the compensation away.
+static void welfordRow(const float *x, float *mean, float *meanComp, float *m2, float *m2Comp, float *count, int n)
+{
+    int j = 0;
+#if CV_SIMD128
+    const v_float32x4 vOne = v_setall_f32(1.0f);
+    for (; j <= n - 4; j += 4)
+    {
+        v_float32x4 vx = v_load(x + j);
+        v_float32x4 keep = (vx == vx);
+        v_float32x4 vCount = v_load(count + j);
+        v_float32x4 vMean = v_load(mean + j);
+        v_float32x4 vMeanComp = v_load(meanComp + j);
+        v_float32x4 vM2 = v_load(m2 + j);
+        v_float32x4 vM2Comp = v_load(m2Comp + j);
+
+        v_float32x4 newCount = vCount + vOne;
+        v_float32x4 delta = vx - vMean;
+        v_float32x4 y = delta / newCount - vMeanComp;
+        v_float32x4 t = vMean + y;
+        v_float32x4 newMeanComp = (t - vMean) - y;
+        v_float32x4 newMean = t;
+
+        v_float32x4 y2 = delta * (vx - newMean) - vM2Comp;
+        v_float32x4 t2 = vM2 + y2;
+        v_float32x4 newM2Comp = (t2 - vM2) - y2;
+
+        v_store(count + j, (newCount & keep) | (vCount & ~keep));
+        v_store(mean + j, (newMean & keep) | (vMean & ~keep));
+        v_store(meanComp + j, (newMeanComp & keep) | (vMeanComp & ~keep));
+        v_store(m2 + j, (t2 & keep) | (vM2 & ~keep));
+        v_store(m2Comp + j, (newM2Comp & keep) | (vM2Comp & ~keep));
+    }
+#endif
+    for (; j < n; j++)
+    {
+        if (x[j] != x[j])
+        {
+            continue;
+        }
+        count[j] += 1.0f;
+        float delta = x[j] - mean[j];
+        float y = delta / count[j] - meanComp[j];
+        float t = mean[j] + y;
+        meanComp[j] = (t - mean[j]) - y;
+        mean[j] = t;
+
+        float y2 = delta * (x[j] - mean[j]) - m2Comp[j];
+        float t2 = m2[j] + y2;
+        m2Comp[j] = (t2 - m2[j]) - y2;
+        m2[j] = t2;
+    }
+}
+
+class ParallelWelford : public cv::ParallelLoopBody
+{
+public:
+    ParallelWelford(const cv::Mat &frame, cv::Mat &mean, cv::Mat &meanComp, cv::Mat &m2, cv::Mat &m2Comp, cv::Mat &count) :
+        frame(frame), mean(mean), meanComp(meanComp), m2(m2), m2Comp(m2Comp), count(count)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        int n = frame.cols * frame.channels();
+        std::vector<float> rowBuffer;
+        for (int y = range.start; y < range.end; y++)
+        {
+            const float *x;
+            if (frame.depth() == CV_32F)
+            {
+                x = frame.ptr<float>(y);
+            }
+            else
+            {
+                /// Other depths are converted a row at a time, not as a full-frame temporary.
+                rowBuffer.resize(n);
+                cv::Mat rowMat(1, frame.cols, CV_32FC(frame.channels()), rowBuffer.data());
+                frame.row(y).convertTo(rowMat, CV_32F);
+                x = rowBuffer.data();
+            }
+            welfordRow(x, mean.ptr<float>(y), meanComp.ptr<float>(y), m2.ptr<float>(y), m2Comp.ptr<float>(y), count.ptr<float>(y), n);
+        }
+    }
+
+private:
+    const cv::Mat &frame;
+    cv::Mat &mean;
+    cv::Mat &meanComp;
+    cv::Mat &m2;
+    cv::Mat &m2Comp;
+    cv::Mat &count;
+};
+
+
+RStackAccumulator::RStackAccumulator() :
+    nFrames(0), bayer(false), instrument(instruments::generic), XPOSURE(0), TEMP(-100), SOLAR_R(0), flipUD(false)
+{
+
+}
+
+bool RStackAccumulator::push(const cv::Mat &frame)
+{
+    QMutexLocker locker(&mutex);
+
+    if (frame.empty())
+    {
+        return false;
+    }
+
+    int type = CV_32FC(frame.channels());
+    if (nFrames == 0)
+    {
+        mean = cv::Mat::zeros(frame.rows, frame.cols, type);
+        meanComp = cv::Mat::zeros(frame.rows, frame.cols, type);
+        m2 = cv::Mat::zeros(frame.rows, frame.cols, type);
+        m2Comp = cv::Mat::zeros(frame.rows, frame.cols, type);
+        count = cv::Mat::zeros(frame.rows, frame.cols, type);
+    }
+    else if (frame.rows != mean.rows || frame.cols != mean.cols || type != mean.type())
+    {
+        qDebug("RStackAccumulator::push() frame of a different size or number of channels");
+        return false;
+    }
+
+    cv::parallel_for_(cv::Range(0, frame.rows), ParallelWelford(frame, mean, meanComp, m2, m2Comp, count));
+    nFrames++;
+    return true;
+}
+
+bool RStackAccumulator::push(RMat *rMat)
+{
+    if (rMat == NULL)
+    {
+        return false;
+    }
+
+    if (getNFrames() == 0)
+    {
+        QMutexLocker locker(&mutex);
+        bayer = rMat->isBayer();
+        instrument = rMat->getInstrument();
+        XPOSURE = rMat->getXPOSURE();
+        TEMP = rMat->getTEMP();
+        SOLAR_R = rMat->getSOLAR_R();
+        flipUD = rMat->flipUD;
+    }
+
+    return push(rMat->matImage);
+}
+
+void RStackAccumulator::reset()
+{
+    QMutexLocker locker(&mutex);
+    mean.release();
+    meanComp.release();
+    m2.release();
+    m2Comp.release();
+    count.release();
+    nFrames = 0;
+}
+
+cv::Mat RStackAccumulator::getMean() const
+{
+    QMutexLocker locker(&mutex);
+    return mean.clone();
+}
+
+cv::Mat RStackAccumulator::getStdDev() const
+{
+    QMutexLocker locker(&mutex);
+    if (nFrames == 0)
+    {
+        return cv::Mat();
+    }
+    /// Single-channel views: scalars would only apply to the first channel otherwise.
+    cv::Mat count1 = count.reshape(1);
+    cv::Mat nMinusOne = cv::max(count1 - 1.0f, 1.0f);
+    cv::Mat variance = cv::max(m2.reshape(1), 0.0f) / nMinusOne;
+    cv::Mat stdDev;
+    cv::sqrt(variance, stdDev);
+    stdDev.setTo(0, (count1 < 2.0f));
+    return stdDev.reshape(mean.channels());
+}
+
+cv::Mat RStackAccumulator::getCount() const
+{
+    QMutexLocker locker(&mutex);
+    return count.clone();
+}
+
+int RStackAccumulator::getNFrames() const
+{
+    QMutexLocker locker(&mutex);
+    return nFrames;
+}
+
+RMat* RStackAccumulator::getMeanRMat() const
+{
+    cv::Mat meanMat = getMean();
+    if (meanMat.empty())
+    {
+        return NULL;
+    }
+
+    QMutexLocker locker(&mutex);
+    RMat *rMatMean = RMat::adopt(meanMat, bayer, instrument, XPOSURE, TEMP);
+    rMatMean->setSOLAR_R(SOLAR_R);
+    rMatMean->flipUD = flipUD;
+    return rMatMean;
+}
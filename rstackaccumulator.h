@@ -0,0 +1,54 @@
+#ifndef RSTACKACCUMULATOR_H
+#define RSTACKACCUMULATOR_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include "rmat.h"
+
+/// Running (online) per-pixel mean and variance of a series of frames, which are pushed
+/// one at a time and need not be kept: e.g. while they are loaded, registered or acquired.
+/// Welford's update, with Kahan-compensated mean and sum of squared deviations, so that
+/// float maps give about the accuracy of double sums over long series.
+/// NaN samples are skipped, hence the per-pixel count map.
+/// push() and the getters lock, so frames can be pushed from one thread and the stack read from another.
+class RStackAccumulator
+{
+public:
+    RStackAccumulator();
+
+    /// Frames of any depth; all must have the size and channels of the first one.
+    bool push(const cv::Mat &frame);
+    bool push(RMat *rMat);
+    void reset();
+
+    /// CV_32F maps with the channels of the frames.
+    cv::Mat getMean() const;
+    /// Sample standard deviation (n - 1), 0 where fewer than 2 samples.
+    cv::Mat getStdDev() const;
+    cv::Mat getCount() const;
+    int getNFrames() const;
+    /// Mean as an RMat with the metadata of the first frame pushed as an RMat.
+    RMat* getMeanRMat() const;
+
+private:
+
+    mutable QMutex mutex;
+    cv::Mat mean, meanComp;
+    cv::Mat m2, m2Comp;
+    cv::Mat count;
+    int nFrames;
+
+    // Metadata of the first RMat
+    bool bayer;
+    instruments instrument;
+    float XPOSURE;
+    float TEMP;
+    float SOLAR_R;
+    bool flipUD;
+};
+
+#endif // RSTACKACCUMULATOR_H
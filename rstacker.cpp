@@ -0,0 +1,501 @@
+#include "rstacker.h"
+
+#include <opencv2/core/hal/intrin.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+using namespace cv;
+
+/// Pixels per block. The samples of a block (nFrames x blockSize floats) stay in L2 during the iterations.
+static const int blockSize = 256;
+
+RMatStackSource::RMatStackSource(const QList<RMat *> &rMatList) : rMatList(rMatList)
+{
+
+}
+
+int RMatStackSource::getNFrames() const
+{
+    return rMatList.size();
+}
+
+int RMatStackSource::getRows() const
+{
+    return rMatList.isEmpty() ? 0 : rMatList.at(0)->matImage.rows;
+}
+
+int RMatStackSource::getCols() const
+{
+    return rMatList.isEmpty() ? 0 : rMatList.at(0)->matImage.cols;
+}
+
+int RMatStackSource::getChannels() const
+{
+    return rMatList.isEmpty() ? 0 : rMatList.at(0)->matImage.channels();
+}
+
+bool RMatStackSource::readRows(int frame, int row0, int nRows, float *dst)
+{
+    const cv::Mat &mat = rMatList.at(frame)->matImage;
+    if (mat.cols != getCols() || mat.channels() != getChannels() || row0 + nRows > mat.rows)
+    {
+        return false;
+    }
+    /// convertTo() writes into dstMat in place, as it has the right size and type already.
+    cv::Mat dstMat(nRows, mat.cols, CV_32FC(mat.channels()), dst);
+    mat.rowRange(row0, row0 + nRows).convertTo(dstMat, CV_32F);
+    return true;
+}
+
+
+/// Per-pixel loops over one frame of a block. Rejected samples are NaN.
+
+/// sum += x, cnt += 1 for the kept samples
+static void accumulateKept(const float *x, float *sum, float *cnt, int n)
+{
+    int i = 0;
+#if CV_SIMD128
+    const v_float32x4 vOne = v_setall_f32(1.0f);
+    for (; i <= n - 4; i += 4)
+    {
+        v_float32x4 v = v_load(x + i);
+        v_float32x4 keep = (v == v);
+        v_store(sum + i, v_load(sum + i) + (v & keep));
+        v_store(cnt + i, v_load(cnt + i) + (vOne & keep));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (x[i] == x[i])
+        {
+            sum[i] += x[i];
+            cnt[i] += 1.0f;
+        }
+    }
+}
+
+/// sum += w * x, wsum += w, cnt += 1 for the kept samples of a frame of weight w
+static void accumulateKeptWeighted(const float *x, float w, float *sum, float *wsum, float *cnt, int n)
+{
+    int i = 0;
+#if CV_SIMD128
+    const v_float32x4 vOne = v_setall_f32(1.0f);
+    const v_float32x4 vW = v_setall_f32(w);
+    for (; i <= n - 4; i += 4)
+    {
+        v_float32x4 v = v_load(x + i);
+        v_float32x4 keep = (v == v);
+        v_store(sum + i, v_load(sum + i) + ((vW * v) & keep));
+        v_store(wsum + i, v_load(wsum + i) + (vW & keep));
+        v_store(cnt + i, v_load(cnt + i) + (vOne & keep));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (x[i] == x[i])
+        {
+            sum[i] += w * x[i];
+            wsum[i] += w;
+            cnt[i] += 1.0f;
+        }
+    }
+}
+
+/// ss += w * (x - mean)^2 for the kept samples of a frame of weight w
+static void accumulateDevWeighted(const float *x, const float *mean, float w, float *ss, int n)
+{
+    int i = 0;
+#if CV_SIMD128
+    const v_float32x4 vW = v_setall_f32(w);
+    for (; i <= n - 4; i += 4)
+    {
+        v_float32x4 v = v_load(x + i);
+        v_float32x4 d = v - v_load(mean + i);
+        v_store(ss + i, v_load(ss + i) + ((vW * d * d) & (v == v)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (x[i] == x[i])
+        {
+            float d = x[i] - mean[i];
+            ss[i] += w * d * d;
+        }
+    }
+}
+
+/// ss += (x - mean)^2 for the kept samples
+static void accumulateDev(const float *x, const float *mean, float *ss, int n)
+{
+    int i = 0;
+#if CV_SIMD128
+    for (; i <= n - 4; i += 4)
+    {
+        v_float32x4 v = v_load(x + i);
+        v_float32x4 d = v - v_load(mean + i);
+        v_store(ss + i, v_load(ss + i) + ((d * d) & (v == v)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (x[i] == x[i])
+        {
+            float d = x[i] - mean[i];
+            ss[i] += d * d;
+        }
+    }
+}
+
+/// Samples outside [lo, hi] become NaN. Returns how many.
+static float rejectOutside(float *x, const float *lo, const float *hi, int n)
+{
+    float nRejected = 0;
+    int i = 0;
+#if CV_SIMD128
+    const v_float32x4 vOne = v_setall_f32(1.0f);
+    const v_float32x4 vNaN = v_setall_f32(std::numeric_limits<float>::quiet_NaN());
+    v_float32x4 vRejected = v_setzero_f32();
+    for (; i <= n - 4; i += 4)
+    {
+        v_float32x4 v = v_load(x + i);
+        v_float32x4 out = (v < v_load(lo + i)) | (v > v_load(hi + i));
+        v_store(x + i, (v & ~out) | (vNaN & out));
+        vRejected += vOne & out;
+    }
+    nRejected = v_reduce_sum(vRejected);
+#endif
+    for (; i < n; i++)
+    {
+        if (x[i] < lo[i] || x[i] > hi[i])
+        {
+            x[i] = std::numeric_limits<float>::quiet_NaN();
+            nRejected += 1.0f;
+        }
+    }
+    return nRejected;
+}
+
+/// x = min(max(x, lo), hi)
+static void clampInside(float *x, const float *lo, const float *hi, int n)
+{
+    int i = 0;
+#if CV_SIMD128
+    for (; i <= n - 4; i += 4)
+    {
+        v_store(x + i, v_min(v_max(v_load(x + i), v_load(lo + i)), v_load(hi + i)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        x[i] = std::min(std::max(x[i], lo[i]), hi[i]);
+    }
+}
+
+
+class ParallelStripRead : public cv::ParallelLoopBody
+{
+public:
+    ParallelStripRead(RStackSource &source, int row0, int nRows, float *samples, size_t stripElements, std::atomic<int> &failures) :
+        source(source), row0(row0), nRows(nRows), samples(samples), stripElements(stripElements), failures(failures)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        for (int f = range.start; f < range.end; f++)
+        {
+            if (!source.readRows(f, row0, nRows, samples + f * stripElements))
+            {
+                failures++;
+            }
+        }
+    }
+
+private:
+    RStackSource &source;
+    int row0;
+    int nRows;
+    float *samples;
+    size_t stripElements;
+    std::atomic<int> &failures;
+};
+
+class ParallelStackBlocks : public cv::ParallelLoopBody
+{
+public:
+    ParallelStackBlocks(const float *samples, int nFrames, size_t stripElements, stackMethods method,
+                        float kappaLow, float kappaHigh, int maxIterations, const float *weights, float *result, ushort *rejections) :
+        samples(samples), nFrames(nFrames), stripElements(stripElements), method(method),
+        kappaLow(kappaLow), kappaHigh(kappaHigh), maxIterations(maxIterations), weights(weights), result(result), rejections(rejections)
+    {
+
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+        std::vector<float> x(nFrames * blockSize);
+        std::vector<float> w;
+        std::vector<float> sum(blockSize), wsum(blockSize), cnt(blockSize), mean(blockSize), ss(blockSize);
+        std::vector<float> lo(blockSize), hi(blockSize), fallback(blockSize);
+
+        for (int b = range.start; b < range.end; b++)
+        {
+            size_t p0 = (size_t) b * blockSize;
+            int n = (int) std::min((size_t) blockSize, stripElements - p0);
+
+            /// Gather the block, so that the iterations run on contiguous, cached samples.
+            for (int f = 0; f < nFrames; f++)
+            {
+                std::copy(samples + f * stripElements + p0, samples + f * stripElements + p0 + n, &x[f * n]);
+            }
+
+            meanAndSigma(x.data(), n, &sum[0], &wsum[0], &cnt[0], &mean[0], &ss[0]);
+            std::copy(mean.begin(), mean.begin() + n, fallback.begin());
+
+            if (method == stackMethods::kappaSigma)
+            {
+                for (int it = 0; it < maxIterations; it++)
+                {
+                    setBounds(n, &cnt[0], &mean[0], &ss[0], kappaLow, kappaHigh, 1.0f, &lo[0], &hi[0]);
+                    float nRejected = 0;
+                    for (int f = 0; f < nFrames; f++)
+                    {
+                        nRejected += rejectOutside(&x[f * n], &lo[0], &hi[0], n);
+                    }
+                    if (nRejected == 0)
+                    {
+                        break;
+                    }
+                    meanAndSigma(x.data(), n, &sum[0], &wsum[0], &cnt[0], &mean[0], &ss[0]);
+                }
+            }
+            else if (method == stackMethods::winsorized)
+            {
+                /// Robust mean and sigma from the winsorized samples, then a single rejection of the originals.
+                w.assign(x.begin(), x.begin() + nFrames * n);
+                std::vector<float> sigmaPrev(n, 0.0f);
+                float sigmaScale = 1.0f;
+                for (int it = 0; it < maxIterations; it++)
+                {
+                    setBounds(n, &cnt[0], &mean[0], &ss[0], 1.5f, 1.5f, sigmaScale, &lo[0], &hi[0]);
+                    for (int f = 0; f < nFrames; f++)
+                    {
+                        clampInside(&w[f * n], &lo[0], &hi[0], n);
+                    }
+                    meanAndSigma(w.data(), n, &sum[0], &wsum[0], &cnt[0], &mean[0], &ss[0]);
+                    sigmaScale = 1.134f;
+
+                    bool converged = true;
+                    for (int i = 0; i < n; i++)
+                    {
+                        float sigma = sigmaScale * ss[i];
+                        converged &= std::abs(sigma - sigmaPrev[i]) <= 5e-4f * sigma;
+                        sigmaPrev[i] = sigma;
+                    }
+                    if (converged)
+                    {
+                        break;
+                    }
+                }
+
+                setBounds(n, &cnt[0], &mean[0], &ss[0], kappaLow, kappaHigh, sigmaScale, &lo[0], &hi[0]);
+                for (int f = 0; f < nFrames; f++)
+                {
+                    rejectOutside(&x[f * n], &lo[0], &hi[0], n);
+                }
+                meanAndSigma(x.data(), n, &sum[0], &wsum[0], &cnt[0], &mean[0], &ss[0]);
+            }
+
+            for (int i = 0; i < n; i++)
+            {
+                result[p0 + i] = (cnt[i] > 0) ? mean[i] : fallback[i];
+                rejections[p0 + i] = cv::saturate_cast<ushort>(nFrames - cnt[i]);
+            }
+        }
+    }
+
+private:
+
+    /// Mean and standard deviation (in ss) of the kept samples of a block, weighted by the frame weights if any.
+    /// cnt is the number of kept samples either way.
+    void meanAndSigma(const float *x, int n, float *sum, float *wsum, float *cnt, float *mean, float *ss) const
+    {
+        std::fill(sum, sum + n, 0.0f);
+        std::fill(wsum, wsum + n, 0.0f);
+        std::fill(cnt, cnt + n, 0.0f);
+        std::fill(ss, ss + n, 0.0f);
+        for (int f = 0; f < nFrames; f++)
+        {
+            if (weights != NULL)
+            {
+                accumulateKeptWeighted(x + f * n, weights[f], sum, wsum, cnt, n);
+            }
+            else
+            {
+                accumulateKept(x + f * n, sum, cnt, n);
+            }
+        }
+        const float *norm = (weights != NULL) ? wsum : cnt;
+        for (int i = 0; i < n; i++)
+        {
+            mean[i] = (norm[i] > 0) ? sum[i] / norm[i] : 0.0f;
+        }
+        for (int f = 0; f < nFrames; f++)
+        {
+            if (weights != NULL)
+            {
+                accumulateDevWeighted(x + f * n, mean, weights[f], ss, n);
+            }
+            else
+            {
+                accumulateDev(x + f * n, mean, ss, n);
+            }
+        }
+        for (int i = 0; i < n; i++)
+        {
+            ss[i] = (norm[i] > 0) ? std::sqrt(ss[i] / norm[i]) : 0.0f;
+        }
+    }
+
+    /// Rejection bounds. Pixels with less than 3 samples left are not clipped any further.
+    static void setBounds(int n, const float *cnt, const float *mean, const float *sigma,
+                          float kLow, float kHigh, float sigmaScale, float *lo, float *hi)
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < n; i++)
+        {
+            bool clip = cnt[i] >= 3.0f;
+            lo[i] = clip ? mean[i] - kLow * sigmaScale * sigma[i] : -inf;
+            hi[i] = clip ? mean[i] + kHigh * sigmaScale * sigma[i] : inf;
+        }
+    }
+
+    const float *samples;
+    int nFrames;
+    size_t stripElements;
+    stackMethods method;
+    float kappaLow;
+    float kappaHigh;
+    int maxIterations;
+    // One per frame, or NULL for equal weights
+    const float *weights;
+    float *result;
+    ushort *rejections;
+};
+
+
+RStacker::RStacker(stackMethods method, float kappaLow, float kappaHigh, int maxIterations) :
+    method(method), kappaLow(kappaLow), kappaHigh(kappaHigh), maxIterations(maxIterations),
+    memoryBudget((size_t) 256 * 1024 * 1024), rejectedFraction(0), stripRows(0)
+{
+
+}
+
+cv::Mat RStacker::stack(RStackSource &source)
+{
+    int nFrames = source.getNFrames();
+    int rows = source.getRows();
+    int cols = source.getCols();
+    int channels = source.getChannels();
+
+    rejectionMap.release();
+    rejectedFraction = 0;
+
+    if (nFrames == 0 || rows == 0 || cols == 0)
+    {
+        return cv::Mat();
+    }
+
+    if (!weights.empty() && (int) weights.size() != nFrames)
+    {
+        std::cout << "RStacker:: " << weights.size() << " weights for " << nFrames << " frames" << std::endl;
+        return cv::Mat();
+    }
+
+    size_t rowElements = (size_t) cols * channels;
+    size_t rowBytes = (size_t) nFrames * rowElements * sizeof(float);
+    stripRows = (int) std::max((size_t) 1, std::min((size_t) rows, memoryBudget / rowBytes));
+
+    cv::Mat result(rows, cols, CV_32FC(channels));
+    rejectionMap.create(rows, cols, CV_16UC(channels));
+    std::vector<float> samples((size_t) nFrames * stripRows * rowElements);
+
+    std::cout << "RStacker:: " << nFrames << " frames in strips of " << stripRows << " rows ("
+              << (samples.size() * sizeof(float)) / (1024*1024) << " MB)" << std::endl;
+
+    for (int row0 = 0; row0 < rows; row0 += stripRows)
+    {
+        int nRows = std::min(stripRows, rows - row0);
+        size_t stripElements = nRows * rowElements;
+
+        std::atomic<int> failures(0);
+        cv::parallel_for_(cv::Range(0, nFrames), ParallelStripRead(source, row0, nRows, samples.data(), stripElements, failures));
+        if (failures > 0)
+        {
+            std::cout << "RStacker:: could not read rows " << row0 << " to " << row0 + nRows << std::endl;
+            rejectionMap.release();
+            return cv::Mat();
+        }
+
+        int nBlocks = (int) ((stripElements + blockSize - 1) / blockSize);
+        cv::parallel_for_(cv::Range(0, nBlocks),
+                          ParallelStackBlocks(samples.data(), nFrames, stripElements, method, kappaLow, kappaHigh, maxIterations,
+                                              weights.empty() ? NULL : weights.data(),
+                                              result.ptr<float>(row0), rejectionMap.ptr<ushort>(row0)));
+    }
+
+    rejectedFraction = cv::sum(rejectionMap.reshape(1))[0] / ((double) nFrames * rows * rowElements);
+    return result;
+}
+
+cv::Mat RStacker::stack(const QList<RMat *> &rMatList)
+{
+    RMatStackSource source(rMatList);
+    return stack(source);
+}
+
+cv::Mat RStacker::getRejectionMap() const
+{
+    return rejectionMap;
+}
+
+double RStacker::getRejectedFraction() const
+{
+    return rejectedFraction;
+}
+
+int RStacker::getStripRows() const
+{
+    return stripRows;
+}
+
+void RStacker::setMethod(stackMethods method)
+{
+    this->method = method;
+}
+
+void RStacker::setKappa(float kappaLow, float kappaHigh)
+{
+    this->kappaLow = kappaLow;
+    this->kappaHigh = kappaHigh;
+}
+
+void RStacker::setMaxIterations(int maxIterations)
+{
+    this->maxIterations = maxIterations;
+}
+
+void RStacker::setMemoryBudget(size_t bytes)
+{
+    this->memoryBudget = bytes;
+}
+
+void RStacker::setWeights(const std::vector<float> &weights)
+{
+    this->weights = weights;
+}
@@ -0,0 +1,98 @@
+#ifndef RSTACKER_H
+#define RSTACKER_H
+
+#include "winsockwrapper.h"
+#include <QtCore>
+
+//opencv
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+#include "rmat.h"
+
+enum class stackMethods {mean, kappaSigma, winsorized};
+/// Per-frame weights: none, inverse noise variance, or squared sharpness over noise
+enum class frameWeights {none, noise, sharpness};
+
+/// Where the stacker reads its frames from, a strip of rows at a time.
+/// The frames themselves need not be in memory, only the strip being stacked.
+class RStackSource
+{
+public:
+    virtual ~RStackSource() {}
+
+    virtual int getNFrames() const = 0;
+    virtual int getRows() const = 0;
+    virtual int getCols() const = 0;
+    virtual int getChannels() const = 0;
+    /// Writes rows [row0, row0 + nRows[ of the frame as float in dst, channels interleaved.
+    /// Called concurrently for different frames.
+    virtual bool readRows(int frame, int row0, int nRows, float *dst) = 0;
+};
+
+/// Frames already loaded as RMats.
+class RMatStackSource : public RStackSource
+{
+public:
+    RMatStackSource(const QList<RMat*> &rMatList);
+
+    int getNFrames() const;
+    int getRows() const;
+    int getCols() const;
+    int getChannels() const;
+    bool readRows(int frame, int row0, int nRows, float *dst);
+
+private:
+    QList<RMat*> rMatList;
+};
+
+/// Pixel-wise combination of a series of frames with outlier rejection:
+/// - mean: plain average;
+/// - kappaSigma: iteratively rejects samples outside [mean - kappaLow*sigma, mean + kappaHigh*sigma]
+///   of the samples kept so far, then averages what is left;
+/// - winsorized: same rejection, but mean and sigma are those of the winsorized samples
+///   (clamped at 1.5 sigma, sigma rescaled by 1.134), which are robust to a larger fraction of outliers.
+/// With frame weights (setWeights), means and sigmas are weighted, whatever the method.
+/// The frames are stacked in strips of rows that fit in the memory budget, so the cube is never
+/// in memory as a whole. Each strip is split into blocks of pixels processed in parallel, and the
+/// per-pixel loops run over contiguous samples with SIMD.
+class RStacker
+{
+public:
+    RStacker(stackMethods method = stackMethods::kappaSigma, float kappaLow = 3.0f, float kappaHigh = 3.0f, int maxIterations = 5);
+
+    /// Returns the stack as CV_32F with the channels of the frames, or an empty mat on failure.
+    cv::Mat stack(RStackSource &source);
+    cv::Mat stack(const QList<RMat*> &rMatList);
+
+    /// Number of rejected samples for each pixel (CV_16U, same channels as the stack).
+    cv::Mat getRejectionMap() const;
+    /// Rejected samples over all samples of the last stack.
+    double getRejectedFraction() const;
+    /// Rows per strip used for the last stack.
+    int getStripRows() const;
+
+    void setMethod(stackMethods method);
+    void setKappa(float kappaLow, float kappaHigh);
+    void setMaxIterations(int maxIterations);
+    /// Memory for the samples of one strip, for all frames. Default: 256 MB.
+    void setMemoryBudget(size_t bytes);
+    /// One positive weight per frame. Empty: equal weights.
+    void setWeights(const std::vector<float> &weights);
+
+private:
+
+    stackMethods method;
+    float kappaLow;
+    float kappaHigh;
+    int maxIterations;
+    size_t memoryBudget;
+    std::vector<float> weights;
+
+    cv::Mat rejectionMap;
+    double rejectedFraction;
+    int stripRows;
+};
+
+#endif // RSTACKER_H